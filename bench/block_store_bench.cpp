@@ -0,0 +1,250 @@
+/*
+ * Benchmarks for the bitmap scans, the allocator, block I/O and images
+ *
+ * Run it through the bench target to get JSON for comparing runs:
+ *     cmake --build build --target bench    (writes build/block_store_bench.json)
+ * or by hand with --benchmark_out=results.json --benchmark_out_format=json,
+ * --benchmark_filter=<regex> picks which ones run.
+ */
+#include <benchmark/benchmark.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "../include/block_store.h"
+#include "../include/bitmap.h"
+
+namespace {
+
+const size_t BITMAP_BITS = 1 << 20;
+
+// A bitmap with its first percent of bits set (ffz has to get past all of them, ffs none)
+bitmap_t *prefix_filled(const size_t percent) {
+    bitmap_t *bitmap = bitmap_create(BITMAP_BITS);
+    bitmap_set_range(bitmap, 0, BITMAP_BITS * percent / 100);
+    return bitmap;
+}
+
+// A bitmap with percent of its bits set at random
+bitmap_t *randomly_filled(const size_t percent) {
+    bitmap_t *bitmap = bitmap_create(BITMAP_BITS);
+    std::mt19937_64 rng(42);
+    for (size_t bit = 0; bit < BITMAP_BITS; ++bit) {
+        if (rng() % 100 < percent) {
+            bitmap_set(bitmap, bit);
+        }
+    }
+    return bitmap;
+}
+
+void bitmap_ffz(benchmark::State &state) {
+    bitmap_t *bitmap = prefix_filled((size_t) state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * (int64_t) (BITMAP_BITS / 8 * state.range(0) / 100));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_ffz)->Arg(0)->Arg(50)->Arg(99)->Arg(100);
+
+void bitmap_ffs(benchmark::State &state) {
+    bitmap_t *bitmap = prefix_filled((size_t) state.range(0));
+    bitmap_invert(bitmap);  // the first percent of bits clear
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bitmap_ffs(bitmap));
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * (int64_t) (BITMAP_BITS / 8 * state.range(0) / 100));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_ffs)->Arg(0)->Arg(50)->Arg(99)->Arg(100);
+
+void bitmap_total_set(benchmark::State &state) {
+    bitmap_t *bitmap = randomly_filled((size_t) state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * (int64_t) bitmap_get_bytes(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_total_set)->Arg(1)->Arg(50)->Arg(99);
+
+void bitmap_iterate(benchmark::State &state) {
+    bitmap_t *bitmap = randomly_filled((size_t) state.range(0));
+    for (auto _ : state) {
+        bitmap_iter_t iter;
+        bitmap_iter_init(&iter, bitmap, 0);
+        size_t visited = 0;
+        for (size_t bit = bitmap_iter_next(&iter); bit != SIZE_MAX; bit = bitmap_iter_next(&iter)) {
+            ++visited;
+        }
+        benchmark::DoNotOptimize(visited);
+    }
+    state.SetItemsProcessed((int64_t) state.iterations() * (int64_t) bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_iterate)->Arg(1)->Arg(50)->Arg(99);
+
+const size_t DEVICE_BLOCK_SIZE = 4096, DEVICE_BLOCKS = 16384;  // 64 MiB
+
+// Allocates blocks until the device is percent full
+void fill_device(block_store_t *const bs, const size_t percent) {
+    const size_t target = block_store_get_capacity(bs) * percent / 100;
+    while (block_store_get_used_blocks(bs) < target && block_store_allocate(bs) != SIZE_MAX) {
+    }
+}
+
+// One allocate and one release, on a device that's range(1) percent full, with range(0) for flags
+void allocate_release(benchmark::State &state) {
+    block_store_t *bs = block_store_create_ex(512, 1 << 20, (unsigned) state.range(0));
+    fill_device(bs, (size_t) state.range(1));
+    for (auto _ : state) {
+        const size_t id = block_store_allocate(bs);
+        block_store_release(bs, id);
+    }
+    state.SetItemsProcessed((int64_t) state.iterations());
+    block_store_destroy(bs);
+}
+BENCHMARK(allocate_release)
+    ->ArgNames({"flags", "full"})
+    ->Args({BS_FLAG_NONE, 0})
+    ->Args({BS_FLAG_NONE, 90})
+    ->Args({BS_FLAG_CONCURRENT, 0})
+    ->Args({BS_FLAG_CONCURRENT, 90})
+    ->Args({BS_FLAG_THREAD_CACHE, 90});
+
+// Every thread allocating and releasing on the same device (range(0) for flags)
+block_store_t *shared_device;
+
+void allocate_release_threads(benchmark::State &state) {
+    if (state.thread_index() == 0) {
+        shared_device = block_store_create_ex(512, 1 << 20, (unsigned) state.range(0));
+        fill_device(shared_device, 50);
+    }
+    for (auto _ : state) {  // every thread waits for the setup before the first iteration
+        const size_t id = block_store_allocate(shared_device);
+        block_store_release(shared_device, id);
+    }
+    state.SetItemsProcessed((int64_t) state.iterations());
+    if (state.thread_index() == 0) {
+        block_store_destroy(shared_device);
+    }
+}
+BENCHMARK(allocate_release_threads)
+    ->ArgName("flags")
+    ->Arg(BS_FLAG_CONCURRENT)
+    ->Arg(BS_FLAG_THREAD_CACHE)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// Block ids to visit, in order (range(0) 0) or shuffled (1)
+std::vector<size_t> block_order(block_store_t *const bs, const bool random) {
+    const size_t meta = DEVICE_BLOCKS - block_store_get_capacity(bs);
+    std::vector<size_t> ids;
+    for (size_t id = meta; id < DEVICE_BLOCKS; ++id) {
+        ids.push_back(id);
+    }
+    if (random) {
+        std::shuffle(ids.begin(), ids.end(), std::mt19937_64(7));
+    }
+    return ids;
+}
+
+void block_read(benchmark::State &state) {
+    block_store_t *bs = block_store_create_ex(DEVICE_BLOCK_SIZE, DEVICE_BLOCKS, (unsigned) state.range(1));
+    const std::vector<size_t> ids = block_order(bs, state.range(0) != 0);
+    std::vector<uint8_t> buffer(DEVICE_BLOCK_SIZE, 0x5A);
+    for (size_t id : ids) {
+        block_store_write(bs, id, buffer.data());
+    }
+    size_t next = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block_store_read(bs, ids[next], buffer.data()));
+        next = next + 1 < ids.size() ? next + 1 : 0;
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * (int64_t) DEVICE_BLOCK_SIZE);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_read)
+    ->ArgNames({"random", "flags"})
+    ->Args({0, BS_FLAG_NONE})
+    ->Args({1, BS_FLAG_NONE})
+    ->Args({1, BS_FLAG_CONCURRENT})
+    ->Args({1, BS_FLAG_CHECKSUM});
+
+void block_write(benchmark::State &state) {
+    block_store_t *bs = block_store_create_ex(DEVICE_BLOCK_SIZE, DEVICE_BLOCKS, (unsigned) state.range(1));
+    const std::vector<size_t> ids = block_order(bs, state.range(0) != 0);
+    std::vector<uint8_t> buffer(DEVICE_BLOCK_SIZE, 0x5A);
+    size_t next = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block_store_write(bs, ids[next], buffer.data()));
+        next = next + 1 < ids.size() ? next + 1 : 0;
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * (int64_t) DEVICE_BLOCK_SIZE);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_write)
+    ->ArgNames({"random", "flags"})
+    ->Args({0, BS_FLAG_NONE})
+    ->Args({1, BS_FLAG_NONE})
+    ->Args({1, BS_FLAG_CONCURRENT})
+    ->Args({1, BS_FLAG_CHECKSUM});
+
+// A device of range(0) blocks of 4 KiB, half of them allocated and holding text-like bytes that compress some
+block_store_t *image_device(const size_t blocks) {
+    block_store_t *bs = block_store_create_ex(DEVICE_BLOCK_SIZE, blocks, BS_FLAG_NONE);
+    std::vector<uint8_t> buffer(DEVICE_BLOCK_SIZE);
+    std::mt19937 rng(3);
+    for (size_t n = 0; n < blocks / 2; ++n) {
+        const size_t id = block_store_allocate(bs);
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            buffer[i] = (uint8_t) ('a' + rng() % 16);
+        }
+        block_store_write(bs, id, buffer.data());
+    }
+    return bs;
+}
+
+const char *const IMAGE_FILE = "block_store_bench.bs";
+
+// range(0) blocks, range(1) for BS_SERIALIZE_OPTIONS
+void serialize(benchmark::State &state) {
+    block_store_t *bs = image_device((size_t) state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block_store_serialize_ex(bs, IMAGE_FILE, (unsigned) state.range(1)));
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * state.range(0) * (int64_t) DEVICE_BLOCK_SIZE);
+    block_store_destroy(bs);
+    std::remove(IMAGE_FILE);
+}
+
+void deserialize(benchmark::State &state) {
+    block_store_t *bs = image_device((size_t) state.range(0));
+    block_store_serialize_ex(bs, IMAGE_FILE, (unsigned) state.range(1));
+    block_store_destroy(bs);
+    for (auto _ : state) {
+        bs = block_store_deserialize_ex(IMAGE_FILE, DEVICE_BLOCK_SIZE, (size_t) state.range(0), BS_FLAG_NONE);
+        benchmark::DoNotOptimize(bs);
+        block_store_destroy(bs);
+    }
+    state.SetBytesProcessed((int64_t) state.iterations() * state.range(0) * (int64_t) DEVICE_BLOCK_SIZE);
+    std::remove(IMAGE_FILE);
+}
+
+// 1, 16 and 64 MiB images, raw, sparse and compressed
+void image_args(benchmark::internal::Benchmark *const bench) {
+    bench->ArgNames({"blocks", "options"});
+    for (int64_t blocks : {256, 4096, 16384}) {
+        for (int64_t options : {BS_SERIALIZE_NONE, BS_SERIALIZE_SPARSE, BS_SERIALIZE_COMPRESS}) {
+            bench->Args({blocks, options});
+        }
+    }
+    bench->Unit(benchmark::kMillisecond);
+}
+BENCHMARK(serialize)->Apply(image_args);
+BENCHMARK(deserialize)->Apply(image_args);
+
+}  // namespace
+
+BENCHMARK_MAIN();
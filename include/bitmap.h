@@ -12,6 +12,14 @@ extern "C" {
 
 typedef struct bitmap bitmap_t;
 
+// Walks the set bits of a bitmap in order, a word at a time (see bitmap_iter_init)
+// Filled in by bitmap_iter_init, the fields are only here so it can live on the stack
+typedef struct {
+    const bitmap_t *bitmap;
+    size_t word;    // Word the pending bits came from
+    uint64_t bits;  // Set bits of that word not handed out yet
+} bitmap_iter_t;
+
 // WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
 // This was originally a high performance C++ library, so the C translation assumes you're using it right.
 
@@ -66,12 +74,113 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first set, starting at the given bit
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \return The first one bit address at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first zero, starting at the given bit
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \return The first zero bit address at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find the first run of consecutive zeros
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \param count Length of the run
+/// \return Address of the first bit of the first such run at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Sets a contiguous range of bits
+///  (out of range requests are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a contiguous range of bits
+///  (out of range requests are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Count the bits set in a contiguous range
+/// \param bitmap The bitmap
+/// \param start The first bit to count
+/// \param count The number of bits to look at
+/// \return The number of bits set in the range, 0 on error
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
 /// \return the total number of bits that are set in the bitmap
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
+///
+/// Intersects a bitmap with another of the same size, in place (dst &= src)
+/// \param dst The bitmap to change
+/// \param src The other bitmap
+/// \return boolean indicating success, false if the sizes differ
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Merges another bitmap of the same size into a bitmap, in place (dst |= src)
+/// \param dst The bitmap to change
+/// \param src The other bitmap
+/// \return boolean indicating success, false if the sizes differ
+///
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Flips the bits of a bitmap that are set in another of the same size, in place (dst ^= src)
+/// \param dst The bitmap to change
+/// \param src The other bitmap
+/// \return boolean indicating success, false if the sizes differ
+///
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Clears the bits of a bitmap that are set in another of the same size, in place (dst &= ~src)
+/// \param dst The bitmap to change
+/// \param src The other bitmap
+/// \return boolean indicating success, false if the sizes differ
+///
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Starts walking the set bits of a bitmap
+///  (the bitmap can't change while the walk is on)
+/// \param iter The iterator to set up
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+///
+void bitmap_iter_init(bitmap_iter_t *const iter, const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Next set bit of the walk
+///  Costs a count trailing zeros per set bit, runs of zero words get skipped without looking at their bits
+/// \param iter The iterator
+/// \return The next one bit address, SIZE_MAX once there are no more
+///
+size_t bitmap_iter_next(bitmap_iter_t *const iter);
+
 ///
 /// For each loop for all set bits
 ///  (Arguments passed to func are saved across calls)
@@ -83,8 +192,7 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 
 ///
 /// Resets bitmap contents to the desired pattern
-/// (pattern not guarenteed accurate for final bits
-/// 		if bit_count is not a multiple of 8)
+///  (bits past the end of the bitmap are left clear, whatever the pattern)
 /// \param bitmap The bitmap
 /// \param pattern The pattern to apply to all bytes
 ///
@@ -133,6 +241,7 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  Any address will do, word aligned memory is just faster. The bitmap only touches the bytes it needs
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
 /// \return New bitmap pointer, NULL on error
@@ -7,6 +7,7 @@ extern "C" {
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // Declaring the struct but not implementing in the header allows us to prevent users
 //  from using the object directly and monkeying with the contents
@@ -14,12 +15,294 @@ extern "C" {
 // This enforces a black box device, but it can be restricting
 typedef struct block_store block_store_t;
 
+///
+/// Options for block_store_create_ex, may be OR'd together
+///
+typedef enum {
+	BS_FLAG_NONE = 0x00,
+	BS_FLAG_CONCURRENT = 0x01, // Safe to share between threads: lock-free allocation, per block range locks for reads and writes (block size must be a multiple of 8)
+	BS_FLAG_THREAD_CACHE = 0x02, // BS_FLAG_CONCURRENT plus per-thread caches of reserved block ids, so allocating threads don't fight over the free map (only release blocks you allocated)
+	BS_FLAG_CHECKSUM = 0x04, // Keep a CRC-32C of every block in a table after the free map (taking more meta blocks), reads fail with EBADMSG on a mismatch (images made with it must be opened with it)
+	BS_FLAG_DEDUP = 0x08, // Store blocks with identical contents once and all-zero blocks not at all (heap devices only: block_store_create_ex, block_store_deserialize_ex)
+	BS_FLAG_STATS = 0x10, // Count and time every operation, in per-thread counters block_store_get_stats adds up (snapshots inherit it)
+	BS_FLAG_HUGEPAGES = 0x20, // Back the arena with 2 MiB pages, reserved hugetlbfs ones if there are any and transparent ones otherwise (heap devices get their arena rounded up to whole pages, mapped ones ask the filesystem)
+	BS_FLAG_NUMA_INTERLEAVE = 0x40, // Spread the arena's pages over every NUMA node in turn (heap devices only, like the next one: the mapped and cached opens fail on either, journaled devices live on the heap and get them)
+	BS_FLAG_NUMA_PARTITION = 0x80, // Give each NUMA node one contiguous range of the blocks, in node order, see block_store_get_block_node (not with BS_FLAG_NUMA_INTERLEAVE)
+} BS_FLAGS;
+
+///
+/// Options for block_store_serialize_ex, may be OR'd together
+///
+typedef enum {
+	BS_SERIALIZE_NONE = 0x00,
+	BS_SERIALIZE_FSYNC = 0x01, // Don't return until the image is on stable storage
+	BS_SERIALIZE_ATOMIC = 0x02, // Write a temporary file and rename it over the target, so a crash leaves the old image intact (implies FSYNC)
+	BS_SERIALIZE_COMPRESS = 0x04, // Write the compressed image format: LZ4 extents behind an index, all-zero ones left out (deserialize reads either format)
+	BS_SERIALIZE_SPARSE = 0x08, // Leave out the blocks the free block map has free, they load as zeros (holes in a raw image, which loads skip over)
+} BS_SERIALIZE_OPTIONS;
+
+///
+/// Where block_store_allocate and block_store_allocate_range look for free blocks, see block_store_set_policy
+///  (BS_FLAG_THREAD_CACHE devices hand single blocks out of their magazines whatever the policy)
+///
+typedef enum {
+	BS_POLICY_FIRST_FIT = 0, // The lowest free blocks, the default: keeps the device packed at the front
+	BS_POLICY_NEXT_FIT = 1, // The first free blocks after where the last allocation ended, wrapping around, so churn moves across the device instead of splitting up the holes at the front
+	BS_POLICY_BEST_FIT = 2, // Ranges go in the shortest free extent that holds them, keeping long extents for long requests (single blocks go first fit)
+} BS_POLICY;
+
+///
+/// Told about every block block_store_defragment moves, once the contents are in place and before the old block is freed
+/// \param context Whatever was passed to block_store_defragment
+/// \param from The block's old id
+/// \param to The block's new id
+/// \return true to go through with the move, false to keep the block where it is
+///
+typedef bool (*block_store_remap_t)(void *const context, const size_t from, const size_t to);
+
+///
+/// One entry of a vectored read or write: which block, and the buffer to copy it to/from
+///  (buffers must hold a whole block)
+///
+typedef struct {
+	size_t block_id;
+	void *buffer;
+} block_store_iovec_t;
+
+///
+/// Options for block_store_aio_setup, may be OR'd together
+///
+typedef enum {
+	BS_AIO_NONE = 0x00,
+	BS_AIO_THREAD_POOL = 0x01, // Skip io_uring and go straight to the worker threads
+	BS_AIO_FIXED_FILE = 0x02, // Register the device's file with the ring instead of looking it up on every request
+} BS_AIO_FLAGS;
+
+///
+/// Asynchronous I/O engine settings, zero everything for the defaults
+///
+typedef struct {
+	unsigned queue_depth; // Most requests in flight at once (default 64)
+	unsigned flags; // BS_AIO_FLAGS
+	unsigned threads; // Worker threads when io_uring isn't used (default 4)
+	void *buffers; // Optional region to register with the ring, requests with a buffer inside it skip per request page pinning
+	size_t buffer_bytes; // Size of that region
+} block_store_aio_options_t;
+
+///
+/// A finished asynchronous request
+///
+typedef struct {
+	uint64_t user_data; // Whatever was passed when it was submitted
+	size_t block_id;
+	size_t bytes; // Bytes transferred, 0 on error
+	int error; // errno of the failure, 0 on success
+} block_store_completion_t;
+
+///
+/// Counters of a cached device's block cache
+///
+typedef struct {
+	uint64_t hits; // Accesses to data blocks that were in memory
+	uint64_t misses; // Accesses that had to load the block (or make room for it)
+	uint64_t evictions; // Blocks pushed out to make room
+	uint64_t writebacks; // Changed blocks written to the file, on eviction or on a sync
+	uint64_t readahead; // Blocks loaded ahead of a sequential reader
+	uint64_t readahead_hits; // Of those, the ones that were then asked for
+	uint64_t readahead_wasted; // and the ones evicted before anything did
+} block_store_cache_stats_t;
+
+///
+/// Counters of a deduplicated device's block storage
+///
+typedef struct {
+	uint64_t zero_blocks; // Data blocks that are all zeros, nothing is stored for them
+	uint64_t stored_blocks; // Distinct contents the rest of the data blocks share between them
+	uint64_t stored_bytes; // Memory taken by stored contents, including room freed for reuse
+} block_store_dedup_stats_t;
+
+///
+/// Operations a BS_FLAG_STATS device counts, indexes into block_store_stats_t's ops
+///
+typedef enum {
+	BS_OP_ALLOCATE, // block_store_allocate and block_store_allocate_range
+	BS_OP_RELEASE, // block_store_release and block_store_release_range, failing on blocks that aren't data blocks
+	BS_OP_REQUEST, // block_store_request
+	BS_OP_READ, // block_store_read and block_store_readv, asynchronous reads included (timed from submit until polled)
+	BS_OP_WRITE, // block_store_write, block_store_write_partial and block_store_writev, asynchronous writes included
+	BS_OP_SERIALIZE, // block_store_serialize and block_store_serialize_ex
+	BS_OP_COUNT
+} BS_OP;
+
+///
+/// Latency histogram geometry: one bucket per nanosecond below BS_STATS_SUB_BUCKETS, then BS_STATS_SUB_BUCKETS
+///  buckets per power of two (each within 12.5% of the latencies it holds) up to 2^41 ns, the last bucket
+///  takes anything slower. block_store_stats_bucket_limit gives a bucket's upper bound
+///
+#define BS_STATS_SUB_BUCKETS 8
+#define BS_STATS_BUCKETS 312
+
+///
+/// Counters of one BS_OP
+///
+typedef struct {
+	uint64_t calls;
+	uint64_t failures; // Calls that returned an error
+	uint64_t bytes; // Bytes read or written, the file's size for serialize
+	uint64_t total_ns; // Time spent in every call together
+	uint64_t max_ns; // The slowest call
+	uint64_t latency[BS_STATS_BUCKETS]; // Calls by how long they took
+} block_store_op_stats_t;
+
+///
+/// Counters of a journaled device's write-ahead journal
+///
+typedef struct {
+	uint64_t appended_bytes; // Bytes of records appended since the journal was opened
+	uint64_t durable_bytes; // How many of those are on stable storage, in the journal or in the image
+	uint64_t syncs; // Journal write-outs, each one fdatasync shared by every commit waiting on it
+	uint64_t checkpoints; // Times the journal was folded into the image and emptied
+} block_store_journal_stats_t;
+
+///
+/// Everything block_store_get_stats reports
+///
+typedef struct {
+	block_store_op_stats_t ops[BS_OP_COUNT]; // Indexed by BS_OP, all zeros without BS_FLAG_STATS
+	size_t free_blocks; // Data blocks free in the fbm (blocks in BS_FLAG_THREAD_CACHE magazines count as used)
+	size_t free_extents; // Runs of free blocks those make up
+	size_t largest_free_extent; // The longest run, the biggest block_store_allocate_range that can succeed
+	bool has_cache; // cache holds the block cache's counters (block_store_open_cached)
+	block_store_cache_stats_t cache;
+	bool has_dedup; // dedup holds the dedup store's counters (BS_FLAG_DEDUP)
+	block_store_dedup_stats_t dedup;
+	bool has_journal; // journal holds the journal's counters (block_store_open_journaled)
+	block_store_journal_stats_t journal;
+} block_store_stats_t;
+
 ///
 /// This creates a new BS device, ready to go
+///  (256 blocks of 256 bytes, block 0 holds the free block map)
 /// \return Pointer to a new block storage device, NULL on error
 ///
 block_store_t *block_store_create();
 
+///
+/// This creates a new BS device with the given geometry
+///  The free block map takes up as many leading blocks as it needs, and they are never user-addressable
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_ex(const size_t block_size, const size_t block_count, const unsigned flags);
+
+///
+/// Opens the device image in the given file by mapping it into memory - blocks are read and written in place
+///  (the file is created if it doesn't exist)
+/// \param filename The device image
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_mmap(const char *const filename);
+
+///
+/// Opens the device image with the given geometry by mapping it into memory
+///  (the file is created if it doesn't exist, an existing one has to match the geometry exactly)
+/// \param filename The device image
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_mmap_ex(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags);
+
+///
+/// Opens the device image with the given geometry, keeping at most cache_bytes of its data blocks in memory
+///  For images bigger than RAM: blocks are loaded as they are used and changed ones written back as they're evicted
+///  (CLOCK-Pro), only the free block map stays resident.
+///  The file is created if it doesn't exist, an existing one has to match the geometry exactly.
+///  block_store_sync (or block_store_flush to the same file) writes everything back, so does block_store_destroy.
+/// \param filename The device image
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param cache_bytes Memory for cached blocks, rounded down to whole blocks (at least one)
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_cached(const char *const filename, const size_t block_size, const size_t block_count, const size_t cache_bytes, const unsigned flags);
+
+///
+/// Reads the counters of a cached device's block cache
+/// \param bs BS device
+/// \param stats Where to put them
+/// \return boolean indicating success, false if the device isn't a cached one
+///
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+///
+/// Reads the counters of a deduplicated device
+/// \param bs BS device
+/// \param stats Where to put them
+/// \return boolean indicating success, false if the device isn't a BS_FLAG_DEDUP one
+///
+bool block_store_get_dedup_stats(const block_store_t *const bs, block_store_dedup_stats_t *const stats);
+
+///
+/// Tells which NUMA node a block of a BS_FLAG_NUMA_PARTITION device was placed on
+///  Each node gets one contiguous range of blocks, so threads pinned to a node can keep to the blocks
+///  local to them (block_store_allocate_range_near from the start of their range, say)
+/// \param bs BS device
+/// \param block_id The block
+/// \return The node's id, -1 on error or if the device's blocks weren't partitioned (no NUMA support)
+///
+int block_store_get_block_node(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Takes a snapshot of the device's counters: per operation counts and latency histograms (BS_FLAG_STATS),
+///  free space fragmentation, and whatever the cache, dedup store and journal keep
+///  Every thread counts its own operations without atomics, this adds them all up. Each counter is exact,
+///  but operations still running on other threads may show up in some of them and not yet in others
+/// \param bs BS device
+/// \param stats Where to put them
+/// \return boolean indicating success
+///
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+///
+/// Upper bound of a latency histogram bucket
+/// \param bucket Index into block_store_op_stats_t's latency
+/// \return The slowest latency the bucket holds in nanoseconds, UINT64_MAX for the last bucket (or past it)
+///
+uint64_t block_store_stats_bucket_limit(const size_t bucket);
+
+///
+/// Estimates a latency percentile from an operation's histogram, never past the slowest call
+/// \param op The operation's counters
+/// \param percentile Between 0 and 100, 99 for p99
+/// \return The latency in nanoseconds that many percent of the calls took at most, 0 without any calls
+///
+uint64_t block_store_stats_percentile(const block_store_op_stats_t *const op, const double percentile);
+
+///
+/// Takes a read-only snapshot of the device as it is right now, sharing its blocks
+///  A block is only copied into the snapshot when the device writes over it, and writers are
+///  only held up while the meta blocks are copied (allocations racing with that may or may not make it in)
+///  Every call that would change the snapshot fails, serializing it is how to get a writable copy.
+///  A snapshot can outlive its device, destroying the device copies whatever they still share into it first
+///  (don't use the snapshot while that happens)
+/// \param bs BS device, not a snapshot itself
+/// \return Pointer to the snapshot, NULL on error
+///
+block_store_t *block_store_snapshot(block_store_t *const bs);
+
+///
+/// Flushes the changes made to a memory mapped or cached device out to its file
+/// \param bs BS device
+/// \param async Only schedule the writeback instead of waiting for it to finish
+/// \return boolean indicating success, false if the device has no backing file
+///
+bool block_store_sync(block_store_t *const bs, const bool async);
+
 ///
 /// Destroys the provided block storage device
 /// This is an idempotent operation, so there is no return value
@@ -49,6 +332,72 @@ bool block_store_request(block_store_t *const bs, const size_t block_id);
 ///
 void block_store_release(block_store_t *const bs, const size_t block_id);
 
+///
+/// Searches for n contiguous free blocks, marks them all as in use, and returns the first block's id
+/// \param bs BS device
+/// \param n The number of blocks wanted
+/// \param first Where to put the id of the first block of the extent
+/// \return boolean indicating success of operation
+///
+bool block_store_allocate_range(block_store_t *const bs, const size_t n, size_t *const first);
+
+///
+/// Frees every block in the given extent (blocks that were already free are left alone)
+/// \param bs BS device
+/// \param first The first block to free
+/// \param n The number of blocks to free
+///
+void block_store_release_range(block_store_t *const bs, const size_t first, const size_t n);
+
+///
+/// Picks how the device looks for free blocks from now on
+/// \param bs BS device
+/// \param policy A BS_POLICY
+/// \return boolean indicating success, false for an unknown policy
+///
+bool block_store_set_policy(block_store_t *const bs, const unsigned policy);
+
+///
+/// Allocates the first free block at or after hint, wrapping around to the start of the device
+///  For keeping related blocks together: allocating near the last block of an object
+/// \param bs BS device
+/// \param hint Where to start looking
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint);
+
+///
+/// Allocates the first n contiguous free blocks at or after hint, wrapping around to the start of the device
+/// \param bs BS device
+/// \param n The number of blocks wanted
+/// \param hint Where to start looking, the blocks right after an extent to grow it in place
+/// \param first Where to put the id of the first block of the extent
+/// \return boolean indicating success of operation
+///
+bool block_store_allocate_range_near(block_store_t *const bs, const size_t n, const size_t hint, size_t *const first);
+
+///
+/// One step of compacting the device: moves up to max_moves allocated blocks into the free blocks before them
+///  Blocks move down in ascending order, so the ones that were contiguous stay contiguous and in order,
+///  and the free space gathers into one extent at the end of the device. Steps pick up where the last one
+///  left off, a few moves at a time keeps the device usable in between (BS_FLAG_CONCURRENT devices can keep
+///  going in other threads: a block being moved stays locked from the copy until it's freed, so reads and
+///  writes of it wait, and then have to go by whatever remap changed. remap runs with the lock held and
+///  mustn't touch the device's blocks itself).
+///  Each block is copied, then remap is told, then the old block is freed. A block remap turns down stays
+///  where it is, and the next steps go on past it. It was copied all the same, so it counts against max_moves.
+///  Not for BS_FLAG_THREAD_CACHE devices, whose magazines hold blocks that look allocated but aren't
+/// \param bs BS device
+/// \param max_moves Most blocks to copy in this step
+/// \param remap Called for every move, to update whatever refers to the block
+/// \param context Passed to remap
+/// \param done Set to whether this step ended a pass that moved nothing, so there's nothing left to do
+///  (everything is packed, bar what remap keeps turning down), may be NULL
+/// \return Blocks copied (moved or turned down), SIZE_MAX on error
+///
+size_t block_store_defragment(block_store_t *const bs, const size_t max_moves, block_store_remap_t remap, void *const context,
+	bool *const done);
+
 ///
 /// Counts the number of blocks marked as in use
 /// \param bs BS device
@@ -70,15 +419,68 @@ size_t block_store_get_free_blocks(const block_store_t *const bs);
 ///
 size_t block_store_get_total_blocks();
 
+///
+/// Returns the total number of user-addressable blocks of the given device
+/// \param bs BS device
+/// \return Total blocks, SIZE_MAX on error
+///
+size_t block_store_get_capacity(const block_store_t *const bs);
+
+///
+/// Returns the size of every block of the given device
+/// \param bs BS device
+/// \return Bytes per block, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs);
+
 ///
 /// Reads data from the specified block and writes it to the designated buffer
 /// \param bs BS device
 /// \param block_id Source block id
 /// \param buffer Data buffer to write to
-/// \return Number of bytes read, 0 on error
+/// \return Number of bytes read, 0 on error (errno is EBADMSG if the block failed its checksum)
 ///
 size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer);
 
+///
+/// Checks every data block against its checksum, BS_FLAG_CHECKSUM devices only
+///  Threads split the device into ranges, each block is only locked while it's checked
+/// \param bs BS device
+/// \param threads Number of threads to check with, 0 for one per CPU
+/// \param bad_blocks Where to put the ids of the blocks that failed, in ascending order, can be NULL
+/// \param max_bad Room in bad_blocks, the rest are only counted
+/// \return Number of blocks that failed their checksum, SIZE_MAX on error
+///
+size_t block_store_scrub(const block_store_t *const bs, const unsigned threads, size_t *const bad_blocks, const size_t max_bad);
+
+///
+/// Borrows a read-only view of the specified block without copying it
+///  The pointer stays valid until the next write to that block
+///  (checksums aren't checked, that's up to block_store_read and block_store_scrub)
+///  (on a cached device only until the next access to any block, pin it to keep it longer)
+/// \param bs BS device
+/// \param block_id Source block id
+/// \return Pointer to the block's bytes, NULL on error
+///
+const void *block_store_peek(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Borrows a read-only view of the specified block until it is unpinned
+///  Every pin must be matched by exactly one block_store_unpin, and the block must not
+///  be written while it is pinned (debug builds assert on both)
+/// \param bs BS device
+/// \param block_id Source block id
+/// \return Pointer to the block's bytes, NULL on error
+///
+const void *block_store_pin(block_store_t *const bs, const size_t block_id);
+
+///
+/// Releases a view handed out by block_store_pin
+/// \param bs BS device
+/// \param block_id The pinned block id
+///
+void block_store_unpin(block_store_t *const bs, const size_t block_id);
+
 ///
 /// Reads data from the specified buffer and writes it to the designated block
 /// \param bs BS device
@@ -88,13 +490,109 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 ///
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+///
+/// Reads data from the specified buffer and writes it to part of the designated block
+///  (the rest of the block is left untouched)
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param offset Byte offset within the block to start writing at
+/// \param len Number of bytes to write, offset + len must not exceed the block size
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write_partial(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer);
+
+///
+/// Reads the data of many blocks at once, each into its own buffer
+///  The whole batch is validated before anything is copied
+/// \param bs BS device
+/// \param iov The blocks to read and where to put each of them
+/// \param n Number of entries in iov
+/// \return Total number of bytes read, 0 on error (errno is EBADMSG if a block failed its checksum)
+///
+size_t block_store_readv(const block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n);
+
+///
+/// Writes the data of many blocks at once, each from its own buffer
+///  The whole batch is validated before anything is copied, and if a block
+///  shows up more than once the last entry for it wins
+/// \param bs BS device
+/// \param iov The blocks to write and where to take each of them from
+/// \param n Number of entries in iov
+/// \return Total number of bytes written, 0 on error
+///
+size_t block_store_writev(block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n);
+
 ///
 /// Imports BS device from the given file - for grads/bonus
+///  (a journal left next to it by block_store_open_journaled gets replayed)
 /// \param filename The file to load
 /// \return Pointer to new BS device, NULL on error
 ///
 block_store_t *block_store_deserialize(const char *const filename);
 
+///
+/// Imports BS device with the given geometry from the given file
+///  Raw images and compressed ones (BS_SERIALIZE_COMPRESS) alike, a compressed image has its extents
+///  checked against their checksums and decompressed in parallel. Holes in a raw one (BS_SERIALIZE_SPARSE) aren't read at all
+///  Loads with a thread per CPU, block_store_deserialize_parallel picks the number
+/// \param filename The file to load
+/// \param block_size Bytes per block the image was written with
+/// \param block_count Total number of blocks the image was written with
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags);
+
+///
+/// Imports BS device with the given geometry from the given file, with the given number of threads
+///  A raw image is split into a range of blocks per thread, each read with pread straight into place and counted
+///  towards the used blocks as it comes in. A compressed image gets its extents handed out to the threads.
+///  With bad_blocks set, a BS_FLAG_CHECKSUM device is then scrubbed by as many threads (after any journal replay,
+///  the image alone may have a block ahead of its checksum). Blocks that fail still load, and fail their reads.
+/// \param filename The file to load
+/// \param block_size Bytes per block the image was written with
+/// \param block_count Total number of blocks the image was written with
+/// \param flags BS_FLAGS to apply
+/// \param threads Number of threads to load with, 0 for one per CPU
+/// \param bad_blocks Where to put the number of data blocks that failed their checksum (0 without BS_FLAG_CHECKSUM), can be NULL
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_parallel(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags,
+	const unsigned threads, size_t *const bad_blocks);
+
+///
+/// Loads the device image in the given file onto the heap and journals every change made to it from then on
+///  Changes go to an append-only journal next to the image (<filename>.journal), block_store_commit makes them
+///  durable for the cost of the records instead of the whole image. A background checkpointer folds the journal
+///  into the image whenever it gets big, and block_store_destroy does a last checkpoint.
+///  A missing image is created; one that was left with a journal (after a crash) gets the journal replayed,
+///  here and in block_store_deserialize alike, and folded into the image so nothing written over it later can
+///  be undone by the same records. Serializing or flushing any device over an image drops the image's journal,
+///  unless it's that device's own (its records replay onto the very state they led to).
+/// \param filename The device image
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_journaled(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags);
+
+///
+/// Makes every change made to a journaled device so far durable, a write to the journal and one fsync
+///  Commits running at the same time share the fsync (group commit)
+/// \param bs BS device opened with block_store_open_journaled
+/// \return boolean indicating success, false after any journal I/O error
+///
+bool block_store_commit(block_store_t *const bs);
+
+///
+/// Folds the journal into the device's image and empties it, without waiting for the checkpointer
+/// \param bs BS device opened with block_store_open_journaled
+/// \return boolean indicating success
+///
+bool block_store_checkpoint(block_store_t *const bs);
+
 ///
 /// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
 /// \param bs BS device
@@ -103,6 +601,72 @@ block_store_t *block_store_deserialize(const char *const filename);
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+///
+/// Writes the entirety of the BS device to file, overwriting it if it exists
+///  Compressed images can only be loaded with block_store_deserialize(_ex), everything else takes raw ones
+///  With BS_SERIALIZE_ATOMIC a failure to sync the directory or close the file after the rename still returns 0,
+///  but the new image has replaced the old one by then (and the old image's journal is gone with it)
+/// \param bs BS device
+/// \param filename The file to write to
+/// \param options BS_SERIALIZE_OPTIONS to apply
+/// \return Number of bytes written (the size of the file), 0 on error
+///
+size_t block_store_serialize_ex(const block_store_t *const bs, const char *const filename, const unsigned options);
+
+///
+/// Writes the blocks changed since the last flush to the given file, which has to hold the image as of then
+///  (the image a device was deserialized or mapped from counts as flushed, a new device has never been flushed)
+///  The file gets the full image instead if it doesn't have the device's size
+///  This updates the file in place, a crash part way through can leave a mix of old and new blocks
+/// \param bs BS device
+/// \param filename The file to update
+/// \return Number of bytes written, SIZE_MAX on error
+///
+size_t block_store_flush(block_store_t *const bs, const char *const filename);
+
+///
+/// Sets up the device's asynchronous I/O engine, io_uring where the kernel has it and worker threads otherwise
+///  (the submit calls do this with the defaults if it wasn't done, it can't be redone with requests in flight)
+///  Memory mapped devices do real file I/O, heap, cached and BS_FLAG_CHECKSUM devices complete every request right away
+/// \param bs BS device
+/// \param options Engine settings, NULL for the defaults
+/// \return boolean indicating success of operation
+///
+bool block_store_aio_setup(block_store_t *const bs, const block_store_aio_options_t *const options);
+
+///
+/// Queues a read of the specified block into the buffer
+///  The buffer must stay valid until the request's completion is polled
+///  Requests go out to the kernel in batches, on the next poll
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \param user_data Handed back with the completion
+/// \return boolean indicating the request was queued, false on error or when queue_depth requests are in flight
+///
+bool block_store_submit_read(block_store_t *const bs, const size_t block_id, void *buffer, const uint64_t user_data);
+
+///
+/// Queues a write of the buffer to the specified block
+///  The buffer must stay valid and unchanged until the request's completion is polled
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \param user_data Handed back with the completion
+/// \return boolean indicating the request was queued, false on error or when queue_depth requests are in flight
+///
+bool block_store_submit_write(block_store_t *const bs, const size_t block_id, const void *buffer, const uint64_t user_data);
+
+///
+/// Sends any queued requests and collects finished ones, in no particular order
+/// \param bs BS device
+/// \param completions Where to put the finished requests
+/// \param max Room in completions
+/// \param min Wait until at least this many are done (capped at the number in flight), 0 to just check
+/// \return Number of completions stored, SIZE_MAX on error
+///
+size_t block_store_poll_completions(block_store_t *const bs, block_store_completion_t *const completions, const size_t max, const size_t min);
+
 
 #ifdef __cplusplus
 }
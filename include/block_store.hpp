@@ -0,0 +1,324 @@
+#ifndef BLOCK_STORE_HPP__
+#define BLOCK_STORE_HPP__
+
+// Header-only C++ face of block_store.h
+// bs::BlockStore<BlockSize, BlockCount> owns a device of a geometry fixed at compile time, so block offsets, image
+// and free map sizes are constants and block ids and buffer sizes are checked inline before anything crosses into the
+// library. bs::BlockStore<> is the same thing with the geometry given at run time.
+// Both are thin: the device is the library's (same flags, same image formats), the wrapper only adds ownership.
+// Errors are reported the way the C API reports them, a device that couldn't be made tests false.
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <type_traits>
+#include <utility>
+
+#include "block_store.h"
+
+namespace bs {
+
+///
+/// Marks a geometry (or a Span length) only known at run time
+///
+constexpr size_t dynamic = SIZE_MAX;
+
+///
+/// A contiguous run of Extent elements, the part of C++20's std::span the wrapper needs
+///  (a fixed Extent costs nothing but the pointer, dynamic carries its length)
+///
+template <typename T, size_t Extent = dynamic>
+class Span {
+   public:
+    explicit Span(T *const data) : data_(data) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(std::array<U, Extent> &array) : data_(array.data()) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<const U *, T *>::value>::type>
+    Span(const std::array<U, Extent> &array) : data_(array.data()) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(U (&array)[Extent]) : data_(array) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(const Span<U, Extent> &other) : data_(other.data()) {}
+
+    T *data() const { return data_; }
+    static constexpr size_t size() { return Extent; }
+    T &operator[](const size_t i) const { return data_[i]; }
+    T *begin() const { return data_; }
+    T *end() const { return data_ + Extent; }
+
+   private:
+    T *data_;
+};
+
+template <typename T>
+class Span<T, dynamic> {
+   public:
+    Span() : data_(nullptr), size_(0) {}
+    Span(T *const data, const size_t size) : data_(data), size_(size) {}
+    template <typename U, size_t N, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(std::array<U, N> &array) : data_(array.data()), size_(N) {}
+    template <typename U, size_t N, typename = typename std::enable_if<std::is_convertible<const U *, T *>::value>::type>
+    Span(const std::array<U, N> &array) : data_(array.data()), size_(N) {}
+    template <typename U, size_t N, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(U (&array)[N]) : data_(array), size_(N) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(std::vector<U> &vector) : data_(vector.data()), size_(vector.size()) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<const U *, T *>::value>::type>
+    Span(const std::vector<U> &vector) : data_(vector.data()), size_(vector.size()) {}
+    template <typename U, size_t N, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    Span(const Span<U, N> &other) : data_(other.data()), size_(other.size()) {}
+
+    T *data() const { return data_; }
+    size_t size() const { return size_; }
+    T &operator[](const size_t i) const { return data_[i]; }
+    T *begin() const { return data_; }
+    T *end() const { return data_ + size_; }
+
+   private:
+    T *data_;
+    size_t size_;
+};
+
+namespace detail {
+
+// Blocks needed for a number of bytes
+constexpr size_t blocks_for(const size_t bytes, const size_t block_size) {
+    return bytes / block_size + (bytes % block_size ? 1 : 0);
+}
+
+// The device's geometry, as constants or as members
+template <size_t BlockSize, size_t BlockCount>
+class Geometry {
+    static_assert(BlockSize != dynamic && BlockCount != dynamic, "either both sizes are dynamic or neither is");
+    static_assert(BlockSize > 0 && BlockCount > 0, "a device needs blocks, and they need bytes");
+    static_assert(BlockSize <= SIZE_MAX / BlockCount, "the device doesn't fit in memory");
+    static_assert(blocks_for((BlockCount + 7) / 8, BlockSize) < BlockCount, "the free block map takes up every block");
+
+   public:
+    Geometry(size_t, size_t) {}
+    static constexpr size_t block_size() { return BlockSize; }
+    static constexpr size_t block_count() { return BlockCount; }
+    static constexpr size_t bytes() { return BlockSize * BlockCount; }
+    static constexpr size_t offset(const size_t block_id) { return block_id * BlockSize; }
+    static constexpr size_t fbm_bytes() { return (BlockCount + 7) / 8; }
+    static constexpr bool contains(const size_t block_id) { return block_id < BlockCount; }
+};
+
+template <>
+class Geometry<dynamic, dynamic> {
+   public:
+    Geometry(const size_t block_size, const size_t block_count) : block_size_(block_size), block_count_(block_count) {}
+    size_t block_size() const { return block_size_; }
+    size_t block_count() const { return block_count_; }
+    size_t bytes() const { return block_size_ * block_count_; }
+    size_t offset(const size_t block_id) const { return block_id * block_size_; }
+    size_t fbm_bytes() const { return (block_count_ + 7) / 8; }
+    bool contains(const size_t block_id) const { return block_id < block_count_; }
+
+   private:
+    size_t block_size_, block_count_;
+};
+
+}  // namespace detail
+
+///
+/// Owns a block store device, destroying it when it goes
+///  BlockSize and BlockCount fix the geometry at compile time, leave them out for one given at run time
+///  Move-only, a moved-from object holds no device
+///
+template <size_t BlockSize = dynamic, size_t BlockCount = dynamic>
+class BlockStore : private detail::Geometry<BlockSize, BlockCount> {
+    typedef detail::Geometry<BlockSize, BlockCount> geometry_t;
+
+   public:
+    typedef Span<uint8_t, BlockSize> Block;             // A whole block's worth of buffer
+    typedef Span<const uint8_t, BlockSize> ConstBlock;  // and a read-only one
+
+    ///
+    /// The geometry: bytes per block, number of blocks, bytes on the device (the size of a raw image),
+    ///  where a block starts (in the device and in a raw image of it), bytes of the free block map
+    ///  (the start of block 0, more meta blocks follow it with BS_FLAG_CHECKSUM) and whether a block id is on the device
+    ///  All constant expressions for a compile-time geometry
+    ///
+    using geometry_t::block_size;
+    using geometry_t::block_count;
+    using geometry_t::bytes;
+    using geometry_t::offset;
+    using geometry_t::fbm_bytes;
+    using geometry_t::contains;
+
+    ///
+    /// Creates a device of the compile-time geometry
+    /// \param flags BS_FLAGS, OR'd together
+    ///
+    template <size_t S = BlockSize, typename = typename std::enable_if<S != dynamic>::type>
+    explicit BlockStore(const unsigned flags = BS_FLAG_NONE)
+        : geometry_t(BlockSize, BlockCount), bs_(block_store_create_ex(BlockSize, BlockCount, flags)) {}
+
+    ///
+    /// Creates a device of the given geometry
+    /// \param size Bytes per block
+    /// \param count Number of blocks
+    /// \param flags BS_FLAGS, OR'd together
+    ///
+    template <size_t S = BlockSize, typename = typename std::enable_if<S == dynamic>::type>
+    BlockStore(const size_t size, const size_t count, const unsigned flags = BS_FLAG_NONE)
+        : geometry_t(size, count), bs_(block_store_create_ex(size, count, flags)) {}
+
+    ///
+    /// Loads an image written by serialize (or block_store_serialize_ex), of the compile-time geometry
+    /// \param filename The image
+    /// \param flags BS_FLAGS the image was made with
+    /// \return The device, false on error
+    ///
+    template <size_t S = BlockSize, typename = typename std::enable_if<S != dynamic>::type>
+    static BlockStore deserialize(const char *const filename, const unsigned flags = BS_FLAG_NONE) {
+        return BlockStore(block_store_deserialize_ex(filename, BlockSize, BlockCount, flags), BlockSize, BlockCount);
+    }
+
+    ///
+    /// Loads an image of the given geometry written by serialize (or block_store_serialize_ex)
+    /// \param filename The image
+    /// \param size Bytes per block
+    /// \param count Number of blocks
+    /// \param flags BS_FLAGS the image was made with
+    /// \return The device, false on error
+    ///
+    template <size_t S = BlockSize, typename = typename std::enable_if<S == dynamic>::type>
+    static BlockStore deserialize(const char *const filename, const size_t size, const size_t count,
+                                  const unsigned flags = BS_FLAG_NONE) {
+        return BlockStore(block_store_deserialize_ex(filename, size, count, flags), size, count);
+    }
+
+    BlockStore(const BlockStore &) = delete;
+    BlockStore &operator=(const BlockStore &) = delete;
+
+    BlockStore(BlockStore &&other) : geometry_t(other), bs_(other.bs_) { other.bs_ = nullptr; }
+
+    BlockStore &operator=(BlockStore &&other) {
+        if (this != &other) {
+            block_store_destroy(bs_);
+            static_cast<geometry_t &>(*this) = other;
+            bs_                              = other.bs_;
+            other.bs_                        = nullptr;
+        }
+        return *this;
+    }
+
+    ~BlockStore() { block_store_destroy(bs_); }
+
+    ///
+    /// Tells whether there's a device behind this
+    ///
+    explicit operator bool() const { return bs_ != nullptr; }
+
+    ///
+    /// The device, for anything the wrapper doesn't cover (it still owns it)
+    ///
+    block_store_t *get() const { return bs_; }
+
+    ///
+    /// Gives up ownership of the device without destroying it
+    /// \return The device, the caller destroys it
+    ///
+    block_store_t *detach() {
+        block_store_t *const bs = bs_;
+        bs_                     = nullptr;
+        return bs;
+    }
+
+    size_t allocate() { return block_store_allocate(bs_); }
+    bool request(const size_t block_id) { return contains(block_id) && block_store_request(bs_, block_id); }
+    void release(const size_t block_id) {
+        if (contains(block_id)) {
+            block_store_release(bs_, block_id);
+        }
+    }
+    bool allocate_range(const size_t n, size_t *const first) { return block_store_allocate_range(bs_, n, first); }
+    void release_range(const size_t first, const size_t n) { block_store_release_range(bs_, first, n); }
+    size_t allocate_near(const size_t hint) { return block_store_allocate_near(bs_, hint); }
+    bool allocate_range_near(const size_t n, const size_t hint, size_t *const first) {
+        return block_store_allocate_range_near(bs_, n, hint, first);
+    }
+    bool set_policy(const BS_POLICY policy) { return block_store_set_policy(bs_, policy); }
+    size_t defragment(const size_t max_moves, block_store_remap_t remap, void *const context, bool *const done = nullptr) {
+        return block_store_defragment(bs_, max_moves, remap, context, done);
+    }
+
+    size_t used_blocks() const { return block_store_get_used_blocks(bs_); }
+    size_t free_blocks() const { return block_store_get_free_blocks(bs_); }
+    size_t capacity() const { return block_store_get_capacity(bs_); }
+    int block_node(const size_t block_id) const { return block_store_get_block_node(bs_, block_id); }
+
+    ///
+    /// Copies a block out
+    /// \param block_id Source block id
+    /// \param buffer Where to put it, a whole block
+    /// \return boolean indicating success
+    ///
+    bool read(const size_t block_id, const Block buffer) const {
+        return contains(block_id) && buffer.size() >= block_size() && block_store_read(bs_, block_id, buffer.data()) == block_size();
+    }
+
+    ///
+    /// Copies a block in
+    /// \param block_id Destination block id
+    /// \param buffer The block's new contents, a whole block
+    /// \return boolean indicating success
+    ///
+    bool write(const size_t block_id, const ConstBlock buffer) {
+        return contains(block_id) && buffer.size() >= block_size() && block_store_write(bs_, block_id, buffer.data()) == block_size();
+    }
+
+    ///
+    /// Copies bytes into part of a block, the rest of it stays as it is
+    /// \param block_id Destination block id
+    /// \param at Byte offset within the block
+    /// \param data The bytes, at + data.size() has to stay in the block
+    /// \return boolean indicating success
+    ///
+    bool write(const size_t block_id, const size_t at, const Span<const uint8_t> data) {
+        return contains(block_id) && at <= block_size() && data.size() <= block_size() - at
+               && block_store_write_partial(bs_, block_id, at, data.size(), data.data()) == data.size();
+    }
+
+    ///
+    /// Borrows a read-only view of a block without copying it, see block_store_peek for how long it lasts
+    /// \param block_id Source block id
+    /// \return The view, its data() is NULL on error
+    ///
+    ConstBlock view(const size_t block_id) const {
+        return make_block(contains(block_id) ? static_cast<const uint8_t *>(block_store_peek(bs_, block_id)) : nullptr);
+    }
+
+    ///
+    /// Writes the device's image, see block_store_serialize_ex
+    /// \param filename Where to write it
+    /// \param options BS_SERIALIZE_OPTIONS, OR'd together
+    /// \return Number of bytes written, 0 on error
+    ///
+    size_t serialize(const char *const filename, const unsigned options = BS_SERIALIZE_NONE) const {
+        return block_store_serialize_ex(bs_, filename, options);
+    }
+
+   private:
+    // Takes a device the library made with this geometry
+    BlockStore(block_store_t *const bs, const size_t size, const size_t count) : geometry_t(size, count), bs_(bs) {}
+
+    // A view of a block's bytes (or of nothing, for NULL)
+    template <size_t S = BlockSize>
+    typename std::enable_if<S != dynamic, ConstBlock>::type make_block(const uint8_t *const data) const {
+        return ConstBlock(data);
+    }
+    template <size_t S = BlockSize>
+    typename std::enable_if<S == dynamic, ConstBlock>::type make_block(const uint8_t *const data) const {
+        return ConstBlock(data, data ? block_size() : 0);
+    }
+
+    block_store_t *bs_;
+};
+
+}  // namespace bs
+
+#endif
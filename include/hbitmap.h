@@ -0,0 +1,114 @@
+#ifndef HBITMAP_H__
+#define HBITMAP_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "bitmap.h"
+
+// Hierarchical bitmap: a regular bitmap_t plus summary levels on top of it
+// Each summary bit stands for one 64-bit word of the level below and is set when that word is full,
+// so finding a zero only has to look at one word per level instead of walking the whole bitmap.
+// The base bitmap is borrowed, not owned. Go through the hbitmap for every change to it,
+// or call hbitmap_rebuild after changing it directly.
+typedef struct hbitmap hbitmap_t;
+
+// Same deal as bitmap.h, bits outside the bitmap and NULL pointers are on you
+
+///
+/// Creates the summary levels for the given bitmap, based on its current contents
+/// \param base The bitmap to index (must outlive the hbitmap)
+/// \return New hbitmap pointer, NULL on error
+///
+hbitmap_t *hbitmap_create(bitmap_t *const base);
+
+///
+/// Recomputes every summary level from the base bitmap
+/// \param hbitmap The hbitmap
+///
+void hbitmap_rebuild(hbitmap_t *const hbitmap);
+
+///
+/// Sets requested bit in the base bitmap and updates the summaries
+/// \param hbitmap The hbitmap
+/// \param bit The bit to set
+///
+void hbitmap_set(hbitmap_t *const hbitmap, const size_t bit);
+
+///
+/// Clears requested bit in the base bitmap and updates the summaries
+/// \param hbitmap The hbitmap
+/// \param bit The bit to clear
+///
+void hbitmap_reset(hbitmap_t *const hbitmap, const size_t bit);
+
+///
+/// Sets a contiguous range of bits in the base bitmap and updates the summaries
+///  (out of range requests are ignored)
+/// \param hbitmap The hbitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void hbitmap_set_range(hbitmap_t *const hbitmap, const size_t start, const size_t count);
+
+///
+/// Clears a contiguous range of bits in the base bitmap and updates the summaries
+///  (out of range requests are ignored)
+/// \param hbitmap The hbitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void hbitmap_reset_range(hbitmap_t *const hbitmap, const size_t start, const size_t count);
+
+///
+/// Returns bit in the base bitmap
+/// \param hbitmap The hbitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+bool hbitmap_test(const hbitmap_t *const hbitmap, const size_t bit);
+
+///
+/// Find first zero
+/// \param hbitmap The hbitmap
+/// \return The first zero bit address, SIZE_MAX on error/not found
+///
+size_t hbitmap_ffz(const hbitmap_t *const hbitmap);
+
+///
+/// Find first zero, starting at the given bit
+/// \param hbitmap The hbitmap
+/// \param start The first bit to consider
+/// \return The first zero bit address at or after start, SIZE_MAX on error/not found
+///
+size_t hbitmap_ffz_from(const hbitmap_t *const hbitmap, const size_t start);
+
+///
+/// Find the first run of consecutive zeros
+/// \param hbitmap The hbitmap
+/// \param start The first bit to consider
+/// \param count Length of the run
+/// \return Address of the first bit of the first such run at or after start, SIZE_MAX on error/not found
+///
+size_t hbitmap_ffz_run(const hbitmap_t *const hbitmap, const size_t start, const size_t count);
+
+///
+/// Gets the bitmap this hbitmap indexes
+/// \param hbitmap The hbitmap
+/// \return The base bitmap
+///
+bitmap_t *hbitmap_get_base(const hbitmap_t *const hbitmap);
+
+///
+/// Destructs and destroys the hbitmap (the base bitmap is left alone)
+/// \param hbitmap The hbitmap
+///
+void hbitmap_destroy(hbitmap_t *hbitmap);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
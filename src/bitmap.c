@@ -1,15 +1,35 @@
 #include "bitmap.h"
+#include "hbitmap.h"
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BITMAP_X86 1
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BITMAP_NEON 1
+#endif
+
+// Storage we allocate ourselves starts on a cache line and covers whole cache lines
+#define BITMAP_ALIGNMENT 64
+
 // Just the one for now. Indicates we're an overlay and should not free
 // (also, make sure that ALL is as wide as ll of the flags)
 typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
 
+// Bit n is bit n % 64 of words[n / 64]. Words are kept little endian, so byte n / 8 holds bit n
+// and the storage can be exported, imported and overlaid as plain bytes on any machine.
+// Our own storage is padded out to whole words and every bit past bit_count stays zero.
+// An overlay is the caller's memory, it only has byte_count bytes, so its last word may be cut short,
+// and it may not be word aligned at all, in which case none of its words count as whole ones.
 struct bitmap {
     unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
-    uint8_t *data;
+    uint64_t *words;         // NULL for an unaligned overlay, which has no word we could point at
+    uint8_t *bytes;          // The same storage byte by byte, all there is of an unaligned overlay
     size_t bit_count, byte_count;
+    size_t word_count;   // Words holding bits, the last one may be partly used
+    size_t whole_words;  // Aligned words backed by a full 8 bytes (all of them unless it's a short or unaligned overlay)
 };
 
 
@@ -19,21 +39,12 @@ struct bitmap {
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
 // lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
+// Single bits go through their byte, which is the same on either endianness and never reaches past an overlay
 static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
 
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
 // Inverted mask
 static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
 
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
 // Total bits set in the given byte in a handy lookup table
 // Macros, man...
 // http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
@@ -44,94 +55,519 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 #undef B6
 #undef B4
 #undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-    unsigned int v; // count the number of bits set in v
-    unsigned int c; // c accumulates the total bits set in v
-
-    for (c = 0; v; v >>= 1)
-    {
-      c += v & 1;
-    }
-*/
 
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Between a stored word and the value whose bit n % 64 is bit n, a no-op on little endian machines
+static inline uint64_t word_order(const uint64_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+// Bytes of storage behind a word past whole_words, 8 unless it's the short last word of an overlay
+static inline size_t word_bytes(const bitmap_t *const bitmap, const size_t word) {
+    const size_t left = bitmap->byte_count - (word << 3);
+    return left < sizeof(uint64_t) ? left : sizeof(uint64_t);
+}
+
+// Word level access for the scanning routines
+// Words past whole_words are copied byte-wise, so they may sit anywhere, and a short last word
+// only takes the bytes that actually exist, the rest reads as zero.
+static inline uint64_t bitmap_word(const bitmap_t *const bitmap, const size_t word) {
+    if (word < bitmap->whole_words) {
+        return word_order(bitmap->words[word]);
+    }
+    uint64_t result = 0;
+    memcpy(&result, bitmap->bytes + (word << 3), word_bytes(bitmap, word));
+    return word_order(result);
+}
+
+// Counterpart of bitmap_word, the last word of a short overlay only gets the bytes that exist
+static inline void bitmap_put_word(bitmap_t *const bitmap, const size_t word, const uint64_t value) {
+    const uint64_t stored = word_order(value);
+    if (word < bitmap->whole_words) {
+        bitmap->words[word] = stored;
+    } else {
+        memcpy(bitmap->bytes + (word << 3), &stored, word_bytes(bitmap, word));
+    }
+}
+
+// Clears the bits past bit_count, the ones whole-bitmap operations can set in the last word
+static inline void bitmap_clear_tail(bitmap_t *const bitmap) {
+    if (bitmap->bit_count & 63) {
+        const size_t last = bitmap->word_count - 1;
+        bitmap_put_word(bitmap, last, bitmap_word(bitmap, last) & (~UINT64_C(0) >> (64 - (bitmap->bit_count & 63))));
+    }
+}
+
+// Skips whole words that are entirely `fill` (0x00 when hunting set bits, 0xFF when hunting zeros)
+// Returns the index of the first word in [word, word_end) that isn't, or word_end
+// word_end may only cover whole words
+static size_t skip_words_portable(const uint64_t *const words, size_t word, const size_t word_end, const uint8_t fill) {
+    const uint64_t pattern = fill ? ~UINT64_C(0) : 0;
+    for (; word < word_end; ++word) {
+        if (words[word] != pattern) {
+            break;
+        }
+    }
+    return word;
+}
+
+#if BITMAP_X86
+// SSE2 is part of x86-64, so this one is always safe there. Two words per compare.
+// Overlays are only word aligned, so the loads stay unaligned ones (no slower when they happen to be aligned)
+__attribute__((target("sse2"))) static size_t skip_words_sse2(const uint64_t *const words, size_t word, const size_t word_end,
+                                                              const uint8_t fill) {
+    const __m128i pattern = _mm_set1_epi8((char) fill);
+    for (; word + 2 <= word_end; word += 2) {
+        const __m128i block = _mm_loadu_si128((const __m128i *) (words + word));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)) != 0xFFFF) {
+            break;
+        }
+    }
+    return skip_words_portable(words, word, word_end, fill);
+}
+
+// Four words per compare.
+__attribute__((target("avx2"))) static size_t skip_words_avx2(const uint64_t *const words, size_t word, const size_t word_end,
+                                                              const uint8_t fill) {
+    const __m256i pattern = _mm256_set1_epi8((char) fill);
+    for (; word + 4 <= word_end; word += 4) {
+        const __m256i block = _mm256_loadu_si256((const __m256i *) (words + word));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, pattern)) != -1) {
+            break;
+        }
+    }
+    return skip_words_portable(words, word, word_end, fill);
+}
+#endif
+
+#if BITMAP_NEON
+// NEON is mandatory on AArch64, two words per compare.
+static size_t skip_words_neon(const uint64_t *const words, size_t word, const size_t word_end, const uint8_t fill) {
+    const uint8x16_t pattern = vdupq_n_u8(fill);
+    for (; word + 2 <= word_end; word += 2) {
+        if (vminvq_u8(vceqq_u8(vld1q_u8((const uint8_t *) (words + word)), pattern)) != 0xFF) {
+            break;
+        }
+    }
+    return skip_words_portable(words, word, word_end, fill);
+}
+#endif
+
+// Counts the bits set in the first word_count words, which have to be whole ones
+// The lookup table is the fallback for CPUs without a population count instruction
+static size_t count_words_portable(const uint64_t *const words, const size_t word_count) {
+    const uint8_t *const data = (const uint8_t *) words;
+    size_t total              = 0;
+    for (size_t idx = 0; idx < (word_count << 3); ++idx) {
+        total += bit_totals[data[idx]];
+    }
+    return total;
+}
+
+#if BITMAP_X86
+// One POPCNT per word instead of eight table lookups
+__attribute__((target("popcnt"))) static size_t count_words_popcnt(const uint64_t *const words, const size_t word_count) {
+    size_t total = 0;
+    for (size_t word = 0; word < word_count; ++word) {
+        total += (size_t) __builtin_popcountll(words[word]);
+    }
+    return total;
+}
+
+// VPOPCNTQ counts eight words at once, the leftovers go through POPCNT
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt"))) static size_t count_words_avx512(const uint64_t *const words,
+                                                                                           const size_t word_count) {
+    __m512i totals = _mm512_setzero_si512();
+    size_t word    = 0;
+    for (; word + 8 <= word_count; word += 8) {
+        totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(_mm512_loadu_si512((const void *) (words + word))));
+    }
+    size_t total = (size_t) _mm512_reduce_add_epi64(totals);
+    for (; word < word_count; ++word) {
+        total += (size_t) __builtin_popcountll(words[word]);
+    }
+    return total;
+}
+#endif
+
+#if BITMAP_NEON
+// CNT gives per byte totals, which get folded into one sum per pair of words
+static size_t count_words_neon(const uint64_t *const words, const size_t word_count) {
+    size_t total = 0;
+    size_t word  = 0;
+    for (; word + 2 <= word_count; word += 2) {
+        total += vaddvq_u8(vcntq_u8(vld1q_u8((const uint8_t *) (words + word))));
+    }
+    return total + count_words_portable(words + word, word_count - word);
+}
+#endif
+
+// The binary operations between two bitmaps
+typedef enum { OP_AND, OP_OR, OP_XOR, OP_ANDNOT } BITMAP_OP;
+
+static inline uint64_t combine(const uint64_t a, const uint64_t b, const BITMAP_OP op) {
+    switch (op) {
+        case OP_AND:
+            return a & b;
+        case OP_OR:
+            return a | b;
+        case OP_XOR:
+            return a ^ b;
+        default:
+            return a & ~b;
+    }
+}
+
+// dst = dst op src over the first word_count words of both, which have to be whole ones
+// The op is the same for every word, so the switch gets hoisted out of the loop
+static void combine_words_portable(uint64_t *const dst, const uint64_t *const src, const size_t word_count, const BITMAP_OP op) {
+    for (size_t word = 0; word < word_count; ++word) {
+        dst[word] = combine(dst[word], src[word], op);
+    }
+}
+
+#if BITMAP_X86
+// Four words per instruction, the leftovers go through the portable loop
+__attribute__((target("avx2"))) static void combine_words_avx2(uint64_t *const dst, const uint64_t *const src, const size_t word_count,
+                                                               const BITMAP_OP op) {
+    size_t word = 0;
+    for (; word + 4 <= word_count; word += 4) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *) (dst + word));
+        const __m256i b = _mm256_loadu_si256((const __m256i *) (src + word));
+        __m256i result;
+        switch (op) {
+            case OP_AND:
+                result = _mm256_and_si256(a, b);
+                break;
+            case OP_OR:
+                result = _mm256_or_si256(a, b);
+                break;
+            case OP_XOR:
+                result = _mm256_xor_si256(a, b);
+                break;
+            default:
+                result = _mm256_andnot_si256(b, a);  // The first operand is the one that gets inverted
+                break;
+        }
+        _mm256_storeu_si256((__m256i *) (dst + word), result);
+    }
+    combine_words_portable(dst + word, src + word, word_count - word, op);
+}
+#endif
+
+#if BITMAP_NEON
+// Two words per instruction
+static void combine_words_neon(uint64_t *const dst, const uint64_t *const src, const size_t word_count, const BITMAP_OP op) {
+    size_t word = 0;
+    for (; word + 2 <= word_count; word += 2) {
+        const uint64x2_t a = vld1q_u64(dst + word);
+        const uint64x2_t b = vld1q_u64(src + word);
+        uint64x2_t result;
+        switch (op) {
+            case OP_AND:
+                result = vandq_u64(a, b);
+                break;
+            case OP_OR:
+                result = vorrq_u64(a, b);
+                break;
+            case OP_XOR:
+                result = veorq_u64(a, b);
+                break;
+            default:
+                result = vbicq_u64(a, b);
+                break;
+        }
+        vst1q_u64(dst + word, result);
+    }
+    combine_words_portable(dst + word, src + word, word_count - word, op);
+}
+#endif
+
+// Kernels are picked once at load time based on what the CPU actually supports
+static size_t (*skip_words)(const uint64_t *const, size_t, const size_t, const uint8_t) = skip_words_portable;
+static size_t (*count_words)(const uint64_t *const, const size_t)                       = count_words_portable;
+static void (*combine_words)(uint64_t *const, const uint64_t *const, const size_t, const BITMAP_OP) = combine_words_portable;
+
+#if defined(__GNUC__)
+__attribute__((constructor)) static void bitmap_select_kernels(void) {
+#if BITMAP_X86
+    __builtin_cpu_init();  // required before __builtin_cpu_supports when running this early
+    if (__builtin_cpu_supports("avx2")) {
+        skip_words    = skip_words_avx2;
+        combine_words = combine_words_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        skip_words = skip_words_sse2;
+    }
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        count_words = count_words_avx512;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        count_words = count_words_popcnt;
+    }
+#elif BITMAP_NEON
+    skip_words    = skip_words_neon;
+    count_words   = count_words_neon;
+    combine_words = combine_words_neon;
+#endif
+}
+#endif
+
+// Shared implementation of ffs/ffz over [start, end). invert is 0 to look for ones, all ones to look for zeros
+// Bits past end may hold anything, but they can only ever turn up after every bit in range
+// has been ruled out, so a final range check is all they need
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t start, const size_t end, const uint64_t invert) {
+    const size_t word_count = (end + 63) >> 6;
+    const size_t full_words = bitmap->whole_words < word_count ? bitmap->whole_words : word_count;
+    size_t word             = start >> 6;
+    uint64_t bits           = (bitmap_word(bitmap, word) ^ invert) & (~UINT64_C(0) << (start & 63));
+    while (!bits) {
+        if (++word < full_words) {
+            word = skip_words(bitmap->words, word, full_words, invert ? 0xFF : 0x00);
+        }
+        if (word >= word_count) {
+            return SIZE_MAX;
+        }
+        bits = bitmap_word(bitmap, word) ^ invert;
+    }
+    const size_t result = (word << 6) + (size_t) __builtin_ctzll(bits);
+    return (result < end ? result : SIZE_MAX);
+}
+
+// Sets (value true) or clears the bits of mask in a word
+static inline void bitmap_apply(bitmap_t *const bitmap, const size_t word, const uint64_t bits, const bool value) {
+    const uint64_t current = bitmap_word(bitmap, word);
+    bitmap_put_word(bitmap, word, value ? (current | bits) : (current & ~bits));
+}
+
+// Sets (value true) or clears every bit in [start, start + count), caller checks the range
+// Whole words in the middle are one memset (which vectorizes), only the two ends need masking
+// and whatever an overlay has past its whole words goes a word at a time
+static void bitmap_fill(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value) {
+    const size_t first  = start >> 6;
+    const size_t last   = (start + count - 1) >> 6;
+    uint64_t head       = ~UINT64_C(0) << (start & 63);
+    const uint64_t tail = ~UINT64_C(0) >> (63 - ((start + count - 1) & 63));
+    if (first == last) {
+        head &= tail;
+    }
+    bitmap_apply(bitmap, first, head, value);
+    if (first != last) {
+        const uint64_t pattern = value ? ~UINT64_C(0) : 0;  // the same either way round
+        size_t word            = first + 1;
+        const size_t whole     = bitmap->whole_words < last ? bitmap->whole_words : last;
+        if (word < whole) {
+            memset(bitmap->words + word, value ? 0xFF : 0x00, (whole - word) << 3);
+            word = whole;
+        }
+        for (; word < last; ++word) {
+            bitmap_put_word(bitmap, word, pattern);
+        }
+        bitmap_apply(bitmap, last, tail, value);
+    }
+}
+
+// Bits set in [start, end), the whole words get handed to the popcount kernel
+static size_t bitmap_count(const bitmap_t *const bitmap, const size_t start, const size_t end) {
+    size_t first = start >> 6;
+    const size_t last = (end - 1) >> 6;
+    const uint64_t head = ~UINT64_C(0) << (start & 63);
+    const uint64_t tail = ~UINT64_C(0) >> (63 - ((end - 1) & 63));
+    if (first == last) {
+        return (size_t) __builtin_popcountll(bitmap_word(bitmap, first) & head & tail);
+    }
+    size_t total = (size_t) __builtin_popcountll(bitmap_word(bitmap, first) & head);
+    ++first;
+    const size_t whole = bitmap->whole_words < last ? bitmap->whole_words : last;
+    if (first < whole) {
+        total += count_words(bitmap->words + first, whole - first);
+        first = whole;
+    }
+    for (; first < last; ++first) {
+        total += (size_t) __builtin_popcountll(bitmap_word(bitmap, first));
+    }
+    return total + (size_t) __builtin_popcountll(bitmap_word(bitmap, last) & tail);
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    bitmap->bytes[bit >> 3] |= mask[bit & 0x07];
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    bitmap->bytes[bit >> 3] &= invert_mask[bit & 0x07];
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    return bitmap->bytes[bit >> 3] & mask[bit & 0x07];
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    bitmap->bytes[bit >> 3] ^= mask[bit & 0x07];
 }
 
 void bitmap_invert(bitmap_t *const bitmap) {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) {
-        bitmap->data[byte] = ~bitmap->data[byte];
+    for (size_t word = 0; word < bitmap->whole_words; ++word) {
+        bitmap->words[word] = ~bitmap->words[word];
+    }
+    for (size_t word = bitmap->whole_words; word < bitmap->word_count; ++word) {
+        bitmap_put_word(bitmap, word, ~bitmap_word(bitmap, word));
     }
+    bitmap_clear_tail(bitmap);
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
-    if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+    return bitmap_ffs_from(bitmap, 0);
+}
+
+size_t bitmap_ffz(const bitmap_t *const bitmap) {
+    return bitmap_ffz_from(bitmap, 0);
+}
+
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start) {
+    if (bitmap && start < bitmap->bit_count) {
+        return bitmap_scan(bitmap, start, bitmap->bit_count, 0);
     }
     return SIZE_MAX;
 }
 
-size_t bitmap_ffz(const bitmap_t *const bitmap) {
-    if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) {
+    if (bitmap && start < bitmap->bit_count) {
+        return bitmap_scan(bitmap, start, bitmap->bit_count, ~UINT64_C(0));
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count && start < bitmap->bit_count) {
+        size_t pos = start;
+        while (count <= bitmap->bit_count - pos) {
+            // Next zero, then the first set bit in the count bits after it (if any) is where to resume
+            const size_t zero = bitmap_scan(bitmap, pos, bitmap->bit_count, ~UINT64_C(0));
+            if (zero == SIZE_MAX || count > bitmap->bit_count - zero) {
+                break;
+            }
+            const size_t blocker = bitmap_scan(bitmap, zero, zero + count, 0);
+            if (blocker == SIZE_MAX) {
+                return zero;
+            }
+            pos = blocker + 1;
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) {
+        bitmap_fill(bitmap, start, count, true);
+    }
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) {
+        bitmap_fill(bitmap, start, count, false);
+    }
+}
+
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) {
+        return bitmap_count(bitmap, start, start + count);
+    }
+    return 0;
+}
+
 size_t bitmap_total_set(const bitmap_t *const bitmap) {
-    size_t total = 0;
     if (bitmap) {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) {
-            total += bit_totals[bitmap->data[idx]];
+        return bitmap_count(bitmap, 0, bitmap->bit_count);  // An overlay's bits past the end needn't be clear
+    }
+    return 0;
+}
+
+// Shared implementation of the binary operations
+// Whole words go to the kernel, an overlay's short or unaligned words are done here
+static bool bitmap_combine(bitmap_t *const dst, const bitmap_t *const src, const BITMAP_OP op) {
+    if (dst && src && dst->bit_count == src->bit_count) {
+        const size_t whole = dst->whole_words < src->whole_words ? dst->whole_words : src->whole_words;
+        if (whole) {
+            combine_words(dst->words, src->words, whole, op);
         }
-        if (bitmap->leftover_bits) {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+        for (size_t word = whole; word < dst->word_count; ++word) {
+            bitmap_put_word(dst, word, combine(bitmap_word(dst, word), bitmap_word(src, word), op));
         }
+        bitmap_clear_tail(dst);  // src may be an overlay with junk past the end
+        return true;
     }
-    return total;
+    return false;
+}
+
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_AND);
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_OR);
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_XOR);
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_ANDNOT);
+}
+
+void bitmap_iter_init(bitmap_iter_t *const iter, const bitmap_t *const bitmap, const size_t start) {
+    iter->bitmap = bitmap;
+    iter->word   = start >> 6;
+    iter->bits   = 0;
+    if (bitmap && start < bitmap->bit_count) {
+        iter->bits = bitmap_word(bitmap, iter->word) & (~UINT64_C(0) << (start & 63));
+    }
+}
+
+size_t bitmap_iter_next(bitmap_iter_t *const iter) {
+    const bitmap_t *const bitmap = iter->bitmap;
+    if (!bitmap) {
+        return SIZE_MAX;
+    }
+    while (!iter->bits) {
+        if (iter->word >= bitmap->word_count) {
+            return SIZE_MAX;
+        }
+        if (++iter->word < bitmap->whole_words) {
+            iter->word = skip_words(bitmap->words, iter->word, bitmap->whole_words, 0x00);
+        }
+        if (iter->word >= bitmap->word_count) {
+            return SIZE_MAX;
+        }
+        iter->bits = bitmap_word(bitmap, iter->word);
+    }
+    const size_t bit = (iter->word << 6) + (size_t) __builtin_ctzll(iter->bits);
+    iter->bits &= iter->bits - 1;  // Clears the lowest set bit
+    if (bit >= bitmap->bit_count) {
+        iter->bits = 0;  // Past the end (junk in an overlay), and so is everything after it
+        iter->word = bitmap->word_count;
+        return SIZE_MAX;
+    }
+    return bit;
 }
 
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
     if (bitmap && func) {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) {
-            if (bitmap_test(bitmap, idx)) {
-                func(idx, arg);
-            }
+        bitmap_iter_t iter;
+        bitmap_iter_init(&iter, bitmap, 0);
+        for (size_t idx = bitmap_iter_next(&iter); idx != SIZE_MAX; idx = bitmap_iter_next(&iter)) {
+            func(idx, arg);
         }
     }
 }
 
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) {
-    memset(bitmap->data, pattern, bitmap->byte_count);
+    memset(bitmap->bytes, pattern, bitmap->byte_count);
+    bitmap_clear_tail(bitmap);
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) {
@@ -147,14 +583,15 @@ bitmap_t *bitmap_create(const size_t n_bits) {
 }
 
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) {
-    return bitmap->data;
+    return bitmap->bytes;
 }
 
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) {
     if (bitmap_data) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, NONE);
         if (bitmap) {
-            memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            memcpy(bitmap->bytes, bitmap_data, bitmap->byte_count);
+            bitmap_clear_tail(bitmap);
             return bitmap;
         }
     }
@@ -165,7 +602,12 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
     if (bitmap_data) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) {
-            bitmap->data = (uint8_t *) bitmap_data;
+            // Only byte_count bytes are ours to touch, and unaligned memory gets every word copied byte-wise
+            // (without ever forming a uint64_t pointer to it)
+            const bool aligned  = (uintptr_t) bitmap_data % sizeof(uint64_t) == 0;
+            bitmap->bytes       = (uint8_t *) bitmap_data;
+            bitmap->words       = aligned ? (uint64_t *) bitmap_data : NULL;
+            bitmap->whole_words = aligned ? bitmap->byte_count >> 3 : 0;
             return bitmap;
         }
     }
@@ -176,12 +618,221 @@ void bitmap_destroy(bitmap_t *bitmap) {
     if (bitmap) {
         if (!FLAG_CHECK(bitmap, OVERLAY)) {
             // don't free memory that isn't ours!
-            free(bitmap->data);
+            free(bitmap->words);
         }
         free(bitmap);
     }
 }
 
+//
+///
+// HIERARCHICAL BITMAP
+///
+//
+
+// 64^11 > 2^64, so this covers any bitmap we can address
+#define HBITMAP_MAX_LEVELS 11
+
+struct hbitmap {
+    bitmap_t *base;                              // Not ours, don't free it
+    size_t levels;                               // Summary levels above the base, the top one is a single word
+    uint64_t *storage;                           // Every summary level back to back
+    uint64_t *summary[HBITMAP_MAX_LEVELS];       // summary[k] has one bit per word of level k (level 0 is the base)
+    size_t bits[HBITMAP_MAX_LEVELS + 1];         // Bits in level k, bits[0] being the base bitmap
+};
+
+// Word of the given level, with everything past the end of that level reading as set
+// (summary levels keep their tail bits set, the base has to be patched up on the fly)
+static inline uint64_t hbitmap_word(const hbitmap_t *const hbitmap, const size_t level, const size_t word) {
+    if (level) {
+        return hbitmap->summary[level - 1][word];
+    }
+    uint64_t value        = bitmap_word(hbitmap->base, word);
+    const size_t leftover = hbitmap->bits[0] & 63;
+    if (leftover && word == (hbitmap->bits[0] >> 6)) {
+        value |= ~UINT64_C(0) << leftover;
+    }
+    return value;
+}
+
+// First zero at or after pos on the given level, SIZE_MAX if there isn't one
+// If the word pos is in has nothing, the level above says which word does, so each level costs one probe
+static size_t hbitmap_find(const hbitmap_t *const hbitmap, const size_t level, const size_t pos) {
+    if (pos >= hbitmap->bits[level]) {
+        return SIZE_MAX;
+    }
+    size_t word   = pos >> 6;
+    uint64_t bits = ~hbitmap_word(hbitmap, level, word) & (~UINT64_C(0) << (pos & 63));
+    if (!bits) {
+        if (level == hbitmap->levels) {
+            return SIZE_MAX;  // top level is a single word, nowhere else to look
+        }
+        word = hbitmap_find(hbitmap, level + 1, word + 1);
+        if (word == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        bits = ~hbitmap_word(hbitmap, level, word);  // summary says it isn't full, so this is non-zero
+    }
+    return (word << 6) + (size_t) __builtin_ctzll(bits);
+}
+
+hbitmap_t *hbitmap_create(bitmap_t *const base) {
+    if (base) {
+        hbitmap_t *hbitmap = (hbitmap_t *) calloc(1, sizeof(hbitmap_t));
+        if (hbitmap) {
+            hbitmap->base    = base;
+            hbitmap->bits[0] = base->bit_count;
+            size_t total     = 0;
+            while (hbitmap->bits[hbitmap->levels] > 64) {
+                const size_t words                  = (hbitmap->bits[hbitmap->levels] + 63) >> 6;
+                hbitmap->bits[++hbitmap->levels]    = words;
+                total += (words + 63) >> 6;
+            }
+            if (total) {
+                hbitmap->storage = (uint64_t *) malloc(total * sizeof(uint64_t));
+                if (!hbitmap->storage) {
+                    free(hbitmap);
+                    return NULL;
+                }
+            }
+            uint64_t *next = hbitmap->storage;
+            for (size_t level = 0; level < hbitmap->levels; ++level) {
+                hbitmap->summary[level] = next;
+                next += (hbitmap->bits[level + 1] + 63) >> 6;
+            }
+            hbitmap_rebuild(hbitmap);
+            return hbitmap;
+        }
+    }
+    return NULL;
+}
+
+void hbitmap_rebuild(hbitmap_t *const hbitmap) {
+    if (hbitmap) {
+        // Bottom up, each level only depends on the one below it
+        for (size_t level = 0; level < hbitmap->levels; ++level) {
+            const size_t children = hbitmap->bits[level + 1];
+            const size_t words    = (children + 63) >> 6;
+            for (size_t word = 0; word < words; ++word) {
+                uint64_t value = 0;
+                for (size_t bit = 0; bit < 64; ++bit) {
+                    const size_t child = (word << 6) + bit;
+                    if (child >= children || hbitmap_word(hbitmap, level, child) == ~UINT64_C(0)) {
+                        value |= UINT64_C(1) << bit;
+                    }
+                }
+                hbitmap->summary[level][word] = value;
+            }
+        }
+    }
+}
+
+void hbitmap_set(hbitmap_t *const hbitmap, const size_t bit) {
+    bitmap_set(hbitmap->base, bit);
+    // Keep going up for as long as we're the ones that filled the word
+    size_t pos = bit;
+    for (size_t level = 0; level < hbitmap->levels; ++level) {
+        const size_t word = pos >> 6;
+        if (hbitmap_word(hbitmap, level, word) != ~UINT64_C(0)) {
+            break;
+        }
+        hbitmap->summary[level][word >> 6] |= UINT64_C(1) << (word & 63);
+        pos = word;
+    }
+}
+
+void hbitmap_reset(hbitmap_t *const hbitmap, const size_t bit) {
+    bitmap_reset(hbitmap->base, bit);
+    // Keep going up for as long as the word we touched used to be full
+    size_t pos = bit;
+    for (size_t level = 0; level < hbitmap->levels; ++level) {
+        const size_t word   = pos >> 6;
+        uint64_t *const sum = &hbitmap->summary[level][word >> 6];
+        const bool was_full = (*sum == ~UINT64_C(0));
+        *sum &= ~(UINT64_C(1) << (word & 63));
+        if (!was_full) {
+            break;
+        }
+        pos = word;
+    }
+}
+
+// Brings the summaries in line with the base for bits [first, last], one level at a time
+static void hbitmap_refresh(hbitmap_t *const hbitmap, size_t first, size_t last) {
+    for (size_t level = 0; level < hbitmap->levels; ++level) {
+        first >>= 6;
+        last >>= 6;
+        for (size_t word = first; word <= last; ++word) {
+            const uint64_t bit = UINT64_C(1) << (word & 63);
+            if (hbitmap_word(hbitmap, level, word) == ~UINT64_C(0)) {
+                hbitmap->summary[level][word >> 6] |= bit;
+            } else {
+                hbitmap->summary[level][word >> 6] &= ~bit;
+            }
+        }
+    }
+}
+
+void hbitmap_set_range(hbitmap_t *const hbitmap, const size_t start, const size_t count) {
+    if (hbitmap && count && start < hbitmap->bits[0] && count <= hbitmap->bits[0] - start) {
+        bitmap_fill(hbitmap->base, start, count, true);
+        hbitmap_refresh(hbitmap, start, start + count - 1);
+    }
+}
+
+void hbitmap_reset_range(hbitmap_t *const hbitmap, const size_t start, const size_t count) {
+    if (hbitmap && count && start < hbitmap->bits[0] && count <= hbitmap->bits[0] - start) {
+        bitmap_fill(hbitmap->base, start, count, false);
+        hbitmap_refresh(hbitmap, start, start + count - 1);
+    }
+}
+
+bool hbitmap_test(const hbitmap_t *const hbitmap, const size_t bit) {
+    return bitmap_test(hbitmap->base, bit);
+}
+
+size_t hbitmap_ffz(const hbitmap_t *const hbitmap) {
+    return hbitmap_ffz_from(hbitmap, 0);
+}
+
+size_t hbitmap_ffz_from(const hbitmap_t *const hbitmap, const size_t start) {
+    if (hbitmap) {
+        return hbitmap_find(hbitmap, 0, start);
+    }
+    return SIZE_MAX;
+}
+
+size_t hbitmap_ffz_run(const hbitmap_t *const hbitmap, const size_t start, const size_t count) {
+    if (hbitmap && count) {
+        const size_t bits = hbitmap->bits[0];
+        size_t pos        = start;
+        while (pos < bits && count <= bits - pos) {
+            // Same idea as bitmap_ffz_run, but the summaries get us past full stretches for free
+            const size_t zero = hbitmap_find(hbitmap, 0, pos);
+            if (zero == SIZE_MAX || count > bits - zero) {
+                break;
+            }
+            const size_t blocker = bitmap_scan(hbitmap->base, zero, zero + count, 0);
+            if (blocker == SIZE_MAX) {
+                return zero;
+            }
+            pos = blocker + 1;
+        }
+    }
+    return SIZE_MAX;
+}
+
+bitmap_t *hbitmap_get_base(const hbitmap_t *const hbitmap) {
+    return hbitmap->base;
+}
+
+void hbitmap_destroy(hbitmap_t *hbitmap) {
+    if (hbitmap) {
+        free(hbitmap->storage);
+        free(hbitmap);
+    }
+}
+
 //
 ///
 // HERE BE DRAGONS
@@ -197,6 +848,8 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
             bitmap->byte_count    = n_bits >> 3;
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+            bitmap->word_count  = (n_bits + 63) >> 6;
+            bitmap->whole_words = bitmap->word_count;
 
             // FLAG HANDLING HERE
 
@@ -206,11 +859,16 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
 
             if (FLAG_CHECK(bitmap, OVERLAY)) {
                 // don't mess with data, caller will set it
-                bitmap->data = NULL;
+                bitmap->words = NULL;
+                bitmap->bytes = NULL;
                 return bitmap;
             } else {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
-                if (bitmap->data) {
+                // aligned_alloc wants a multiple of the alignment, the padding past the last word is never touched
+                const size_t storage = ((bitmap->word_count << 3) + BITMAP_ALIGNMENT - 1) & ~(size_t) (BITMAP_ALIGNMENT - 1);
+                bitmap->words        = (uint64_t *) aligned_alloc(BITMAP_ALIGNMENT, storage);
+                if (bitmap->words) {
+                    bitmap->bytes = (uint8_t *) bitmap->words;
+                    memset(bitmap->words, 0, storage);
                     return bitmap;
                 }
             }
@@ -0,0 +1,593 @@
+#define _POSIX_C_SOURCE 200809L // pread/pwrite under -std=c11
+#define _DEFAULT_SOURCE // preadv/pwritev
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+#include<unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "block_store_internal.h"
+#include "block_cache.h"
+
+#define NIL UINT32_MAX
+
+// Blocks moved per preadv/pwritev, well under any IOV_MAX
+#define CACHE_BATCH 64
+
+typedef enum { ENTRY_FREE, ENTRY_HOT, ENTRY_COLD, ENTRY_TEST } ENTRY_STATE;
+
+// One block the cache knows about, resident (hot or cold) or remembered (test)
+typedef struct {
+	size_t block_id;
+	uint32_t prev, next; // Position in the clock
+	uint32_t frame; // NIL for test entries, next free entry for free ones
+	uint8_t state; // ENTRY_STATE
+	bool referenced;
+	bool prefetched; // Loaded by block_cache_prefetch and not asked for since
+} cache_entry_t;
+
+struct block_cache{
+	pthread_mutex_t lock;
+	int fd;
+	size_t block_size;
+	size_t frames; // Resident blocks at most, CLOCK-Pro's m
+	uint8_t *data; // frames * block_size
+	uint32_t *pins; // Outstanding pins per frame
+	size_t pinned_frames;
+	bitmap_t *dirty; // Frames changed since they were loaded or written back
+	uint32_t *free_frames;
+	size_t free_frame_count;
+	cache_entry_t *entries; // 2 * frames + 1, every resident block plus as many test entries
+	uint32_t free_entry; // Free entries chained through frame
+	// Index, open addressing with linear probing from block id to entry
+	uint32_t *slots; // NIL when empty
+	size_t slot_mask;
+	unsigned slot_shift;
+	// CLOCK-Pro state
+	uint32_t hand_hot, hand_cold, hand_test;
+	size_t count_hot, count_cold, count_test;
+	size_t target_cold; // Adaptive share of the frames for cold blocks
+	int failed; // errno of a write-back that failed during eviction, 0 normally
+	block_store_cache_stats_t stats;
+};
+
+//
+///
+// INDEX
+///
+//
+
+// Fibonacci hashing, ids of neighbouring blocks end up far apart
+static inline size_t index_home(const block_cache_t *const cache, const size_t block_id){
+	return (size_t)(((uint64_t)block_id * UINT64_C(0x9E3779B97F4A7C15)) >> (*cache).slot_shift);
+}
+
+static size_t index_slot(const block_cache_t *const cache, const size_t block_id){
+	size_t slot = index_home(cache, block_id);
+	while((*cache).slots[slot] != NIL && (*cache).entries[(*cache).slots[slot]].block_id != block_id){
+		slot = (slot + 1) & (*cache).slot_mask;
+	}
+	return slot;
+}
+
+static inline uint32_t index_find(const block_cache_t *const cache, const size_t block_id){
+	return (*cache).slots[index_slot(cache, block_id)];
+}
+
+static inline void index_insert(block_cache_t *const cache, const uint32_t entry){
+	(*cache).slots[index_slot(cache, (*cache).entries[entry].block_id)] = entry;
+}
+
+// Backward shift deletion, so lookups never have to step over tombstones
+static void index_remove(block_cache_t *const cache, const size_t block_id){
+	size_t hole = index_slot(cache, block_id);
+	if((*cache).slots[hole] == NIL){
+		return;
+	}
+	for(size_t slot = (hole + 1) & (*cache).slot_mask; (*cache).slots[slot] != NIL; slot = (slot + 1) & (*cache).slot_mask){
+		const size_t home = index_home(cache, (*cache).entries[(*cache).slots[slot]].block_id);
+		// Move it back unless its home lies cyclically in (hole, slot]
+		const bool stays = hole <= slot ? (home > hole && home <= slot) : (home > hole || home <= slot);
+		if(!stays){
+			(*cache).slots[hole] = (*cache).slots[slot];
+			hole = slot;
+		}
+	}
+	(*cache).slots[hole] = NIL;
+}
+
+//
+///
+// CLOCK
+///
+//
+
+// New entries go in just behind HAND_hot, the head of the list in the paper's terms
+static void clock_insert(block_cache_t *const cache, const uint32_t entry){
+	cache_entry_t *const e = &(*cache).entries[entry];
+	if((*cache).hand_hot == NIL){
+		(*e).prev = (*e).next = entry;
+		(*cache).hand_hot = (*cache).hand_cold = (*cache).hand_test = entry;
+		return;
+	}
+	const uint32_t next = (*cache).hand_hot, prev = (*cache).entries[next].prev;
+	(*e).prev = prev;
+	(*e).next = next;
+	(*cache).entries[prev].next = entry;
+	(*cache).entries[next].prev = entry;
+}
+
+static void clock_remove(block_cache_t *const cache, const uint32_t entry){
+	cache_entry_t *const e = &(*cache).entries[entry];
+	const uint32_t next = (*e).next == entry ? NIL : (*e).next;
+	(*cache).hand_hot = (*cache).hand_hot == entry ? next : (*cache).hand_hot;
+	(*cache).hand_cold = (*cache).hand_cold == entry ? next : (*cache).hand_cold;
+	(*cache).hand_test = (*cache).hand_test == entry ? next : (*cache).hand_test;
+	(*cache).entries[(*e).prev].next = (*e).next;
+	(*cache).entries[(*e).next].prev = (*e).prev;
+}
+
+static inline uint8_t *frame_data(const block_cache_t *const cache, const uint32_t frame){
+	return (*cache).data + (size_t)frame * (*cache).block_size;
+}
+
+static bool frame_writeback(block_cache_t *const cache, const uint32_t frame, const size_t block_id){
+	if(!bitmap_test((*cache).dirty, frame)){
+		return true;
+	}
+	if(!block_store_pwrite_all((*cache).fd, frame_data(cache, frame), (*cache).block_size, (off_t)(block_id * (*cache).block_size))){
+		return false;
+	}
+	bitmap_reset((*cache).dirty, frame);
+	++(*cache).stats.writebacks;
+	return true;
+}
+
+// Drops an entry entirely, whatever state it's in
+static void entry_forget(block_cache_t *const cache, const uint32_t entry){
+	cache_entry_t *const e = &(*cache).entries[entry];
+	clock_remove(cache, entry);
+	index_remove(cache, (*e).block_id);
+	(*e).state = ENTRY_FREE;
+	(*e).frame = (*cache).free_entry;
+	(*cache).free_entry = entry;
+}
+
+static void run_hand_test(block_cache_t *const cache);
+static void run_hand_hot(block_cache_t *const cache);
+
+// Looks for a cold block to evict, promoting the ones that were used since the hand last came by
+static void run_hand_cold(block_cache_t *const cache){
+	const uint32_t entry = (*cache).hand_cold;
+	cache_entry_t *const e = &(*cache).entries[entry];
+	if((*e).state == ENTRY_COLD){
+		// Pinned blocks can't go, they count as just used until they're unpinned
+		if((*e).referenced || (*cache).pins[(*e).frame] > 0 || !frame_writeback(cache, (*e).frame, (*e).block_id)){
+			if(!(*e).referenced && (*cache).pins[(*e).frame] == 0){
+				(*cache).failed = errno ? errno : EIO;
+			}
+			(*e).state = ENTRY_HOT;
+			(*e).referenced = false;
+			--(*cache).count_cold;
+			++(*cache).count_hot;
+		} else {
+			// Out of memory, but remembered for a test period in case it comes back soon
+			(*cache).free_frames[(*cache).free_frame_count++] = (*e).frame;
+			(*cache).stats.readahead_wasted += (*e).prefetched;
+			(*e).prefetched = false;
+			(*e).frame = NIL;
+			(*e).state = ENTRY_TEST;
+			--(*cache).count_cold;
+			++(*cache).count_test;
+			++(*cache).stats.evictions;
+			while((*cache).count_test > (*cache).frames){
+				run_hand_test(cache);
+			}
+		}
+	}
+	(*cache).hand_cold = (*cache).entries[(*cache).hand_cold].next;
+	while((*cache).count_hot > (*cache).frames - (*cache).target_cold){
+		run_hand_hot(cache);
+	}
+}
+
+// Turns hot blocks that weren't used for a whole round cold again
+static void run_hand_hot(block_cache_t *const cache){
+	if((*cache).hand_hot == (*cache).hand_test){
+		run_hand_test(cache);
+	}
+	cache_entry_t *const e = &(*cache).entries[(*cache).hand_hot];
+	if((*e).state == ENTRY_HOT){
+		if((*e).referenced){
+			(*e).referenced = false;
+		} else {
+			(*e).state = ENTRY_COLD;
+			--(*cache).count_hot;
+			++(*cache).count_cold;
+		}
+	}
+	(*cache).hand_hot = (*cache).entries[(*cache).hand_hot].next;
+}
+
+// Ends test periods, each one that ran out without the block coming back shrinks the cold share
+static void run_hand_test(block_cache_t *const cache){
+	if((*cache).hand_test == (*cache).hand_cold){
+		run_hand_cold(cache);
+	}
+	const uint32_t entry = (*cache).hand_test;
+	const uint32_t next = (*cache).entries[entry].next;
+	if((*cache).entries[entry].state == ENTRY_TEST){
+		entry_forget(cache, entry);
+		--(*cache).count_test;
+		if((*cache).target_cold > 1){
+			--(*cache).target_cold;
+		}
+	}
+	(*cache).hand_test = (*cache).count_hot + (*cache).count_cold + (*cache).count_test ? next : NIL;
+}
+
+// Makes sure there's a free frame, false if an eviction had to write back a block and couldn't
+static bool cache_make_room(block_cache_t *const cache){
+	(*cache).failed = 0;
+	while((*cache).count_hot + (*cache).count_cold >= (*cache).frames){
+		run_hand_cold(cache);
+		if((*cache).failed){
+			errno = (*cache).failed;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Puts a block into a frame that was just taken off the free list, hot if it had a test entry and cold otherwise
+static uint32_t cache_install(block_cache_t *const cache, uint32_t entry, const size_t block_id, const uint32_t frame){
+	const bool was_test = entry != NIL;
+	if(!was_test){
+		entry = (*cache).free_entry;
+		(*cache).free_entry = (*cache).entries[entry].frame;
+		(*cache).entries[entry].block_id = block_id;
+		index_insert(cache, entry);
+	}
+	cache_entry_t *const e = &(*cache).entries[entry];
+	bitmap_reset((*cache).dirty, frame);
+	(*e).frame = frame;
+	(*e).state = was_test ? ENTRY_HOT : ENTRY_COLD;
+	(*e).referenced = false;
+	(*e).prefetched = false;
+	clock_insert(cache, entry);
+	++*(was_test ? &(*cache).count_hot : &(*cache).count_cold);
+	return entry;
+}
+
+// Moves consecutive blocks between their frames and the file with one preadv/pwritev (count <= CACHE_BATCH)
+//  Whatever a short transfer leaves over goes block by block
+static bool cache_transfer(block_cache_t *const cache, const uint32_t *const frames, const size_t count, const size_t first_block, const bool write){
+	const size_t block_size = (*cache).block_size;
+	const off_t offset = (off_t)(first_block * block_size);
+	struct iovec iov[CACHE_BATCH];
+	for(size_t i = 0; i < count; ++i){
+		iov[i].iov_base = frame_data(cache, frames[i]);
+		iov[i].iov_len = block_size;
+	}
+	ssize_t moved;
+	do {
+		moved = write ? pwritev((*cache).fd, iov, (int)count, offset) : preadv((*cache).fd, iov, (int)count, offset);
+	} while(moved < 0 && errno == EINTR);
+	if(moved < 0){
+		return false;
+	}
+	bool ok = true;
+	for(size_t i = 0; ok && i < count; ++i){
+		const size_t before = i * block_size, done = (size_t)moved > before ? (size_t)moved - before : 0;
+		if(done < block_size){
+			uint8_t *const data = frame_data(cache, frames[i]) + done;
+			const off_t at = offset + (off_t)(before + done);
+			ok = write ? block_store_pwrite_all((*cache).fd, data, block_size - done, at) : block_store_pread_all((*cache).fd, data, block_size - done, at);
+		}
+	}
+	return ok;
+}
+
+// Finds a block's frame, loading it (or just making room for it, if fill is false) on a miss
+//  Returns NIL when the block isn't resident and populate is false, or on error
+static uint32_t cache_lookup(block_cache_t *const cache, const size_t block_id, const bool populate, const bool fill){
+	uint32_t entry = index_find(cache, block_id);
+	if(entry != NIL && (*cache).entries[entry].state != ENTRY_TEST){
+		cache_entry_t *const e = &(*cache).entries[entry];
+		// The access a prefetch ran ahead of is the block's first one, it only counts as a reuse after that
+		(*e).referenced = (*e).referenced || !(*e).prefetched;
+		(*cache).stats.readahead_hits += (*e).prefetched;
+		(*e).prefetched = false;
+		++(*cache).stats.hits;
+		return (*e).frame;
+	}
+	if(!populate){
+		return NIL; // Reads past the cache don't count, they'd drown out the real traffic
+	}
+	++(*cache).stats.misses;
+	if((*cache).pinned_frames == (*cache).frames){
+		errno = EBUSY;
+		return NIL;
+	}
+	const bool was_test = entry != NIL;
+	if(was_test){
+		// Back within its test period: it deserved to stay, so it comes in hot and cold blocks get more room
+		if((*cache).target_cold < (*cache).frames){
+			++(*cache).target_cold;
+		}
+		clock_remove(cache, entry); // Off the clock while room is made, so the hands leave it alone
+		--(*cache).count_test;
+	}
+	if(!cache_make_room(cache)){
+		if(was_test){
+			clock_insert(cache, entry);
+			++(*cache).count_test;
+		}
+		return NIL;
+	}
+	const uint32_t frame = (*cache).free_frames[--(*cache).free_frame_count];
+	if(fill && !block_store_pread_all((*cache).fd, frame_data(cache, frame), (*cache).block_size, (off_t)(block_id * (*cache).block_size))){
+		(*cache).free_frames[(*cache).free_frame_count++] = frame;
+		if(was_test){
+			clock_insert(cache, entry);
+			++(*cache).count_test;
+		}
+		return NIL;
+	}
+	cache_install(cache, was_test ? entry : NIL, block_id, frame);
+	return frame;
+}
+
+// Creates a cache over the blocks of the given file
+// \param fd File holding the image, block n at offset n * block_size (borrowed, not closed)
+// \param block_size Bytes per block
+// \param frames Number of blocks to keep in memory at most
+// \return New cache, NULL on error
+//
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t frames){
+	if(fd < 0 || block_size == 0 || frames == 0 || frames >= NIL / 4 || block_size > SIZE_MAX / frames){
+		return NULL;
+	}
+	block_cache_t *const cache = calloc(1, sizeof(block_cache_t));
+	if(cache == NULL){
+		return NULL;
+	}
+	pthread_mutex_init(&(*cache).lock, NULL);
+	(*cache).fd = fd;
+	(*cache).block_size = block_size;
+	(*cache).frames = frames;
+	(*cache).target_cold = frames;
+	(*cache).hand_hot = (*cache).hand_cold = (*cache).hand_test = NIL;
+	const size_t entry_count = 2 * frames + 1;
+	size_t slot_count = 1;
+	(*cache).slot_shift = 64;
+	while(slot_count < 2 * entry_count){ // Load factor stays under a half
+		slot_count <<= 1;
+		--(*cache).slot_shift;
+	}
+	(*cache).slot_mask = slot_count - 1;
+	(*cache).data = malloc(frames * block_size);
+	(*cache).pins = calloc(frames, sizeof(uint32_t));
+	(*cache).dirty = bitmap_create(frames);
+	(*cache).free_frames = malloc(frames * sizeof(uint32_t));
+	(*cache).entries = calloc(entry_count, sizeof(cache_entry_t));
+	(*cache).slots = malloc(slot_count * sizeof(uint32_t));
+	if((*cache).data == NULL || (*cache).pins == NULL || (*cache).dirty == NULL || (*cache).free_frames == NULL
+		|| (*cache).entries == NULL || (*cache).slots == NULL){
+		block_cache_destroy(cache);
+		return NULL;
+	}
+	memset((*cache).slots, 0xFF, slot_count * sizeof(uint32_t)); // NIL
+	for(size_t i = 0; i < frames; ++i){
+		(*cache).free_frames[(*cache).free_frame_count++] = (uint32_t)(frames - 1 - i);
+	}
+	for(size_t i = 0; i < entry_count; ++i){
+		(*cache).entries[i].frame = i + 1 < entry_count ? (uint32_t)(i + 1) : NIL;
+	}
+	(*cache).free_entry = 0;
+	return cache;
+}
+
+// Copies a block out, loading it into the cache if it isn't there
+// \param cache The cache
+// \param block_id The block
+// \param buffer Where to put the block's bytes
+// \param populate Whether a miss should make room for the block or just read it past the cache
+// \return boolean indicating success, false on I/O errors or when every frame is pinned
+//
+bool block_cache_read(block_cache_t *const cache, const size_t block_id, void *const buffer, const bool populate){
+	pthread_mutex_lock(&(*cache).lock);
+	const uint32_t frame = cache_lookup(cache, block_id, populate, true);
+	bool ok = frame != NIL;
+	if(ok){
+		memcpy(buffer, frame_data(cache, frame), (*cache).block_size);
+	} else if(!populate){
+		ok = block_store_pread_all((*cache).fd, buffer, (*cache).block_size, (off_t)(block_id * (*cache).block_size));
+	}
+	pthread_mutex_unlock(&(*cache).lock);
+	return ok;
+}
+
+// Writes part (or all) of a block into the cache, it goes to the file once it's evicted or written back
+// \param cache The cache
+// \param block_id The block
+// \param offset Byte offset within the block
+// \param len Number of bytes to write
+// \param buffer The bytes to write
+// \return boolean indicating success, false on I/O errors or when every frame is pinned
+//
+bool block_cache_write(block_cache_t *const cache, const size_t block_id, const size_t offset, const size_t len, const void *const buffer){
+	pthread_mutex_lock(&(*cache).lock);
+	// A whole block overwrite doesn't need the old contents
+	const uint32_t frame = cache_lookup(cache, block_id, true, offset != 0 || len != (*cache).block_size);
+	if(frame != NIL){
+		memcpy(frame_data(cache, frame) + offset, buffer, len);
+		bitmap_set((*cache).dirty, frame);
+	}
+	pthread_mutex_unlock(&(*cache).lock);
+	return frame != NIL;
+}
+
+// Loads a block and keeps it in memory until it's unpinned
+// \param cache The cache
+// \param block_id The block
+// \return The block's bytes in the cache, NULL on error
+//
+const void *block_cache_pin(block_cache_t *const cache, const size_t block_id){
+	pthread_mutex_lock(&(*cache).lock);
+	const uint32_t frame = cache_lookup(cache, block_id, true, true);
+	const void *data = NULL;
+	if(frame != NIL){
+		if((*cache).pins[frame]++ == 0){
+			++(*cache).pinned_frames;
+		}
+		data = frame_data(cache, frame);
+	}
+	pthread_mutex_unlock(&(*cache).lock);
+	return data;
+}
+
+// Allows a block given out by block_cache_pin to be evicted again
+// \param cache The cache
+// \param block_id The pinned block
+//
+void block_cache_unpin(block_cache_t *const cache, const size_t block_id){
+	pthread_mutex_lock(&(*cache).lock);
+	const uint32_t entry = index_find(cache, block_id);
+	if(entry != NIL && (*cache).entries[entry].state != ENTRY_TEST){
+		const uint32_t frame = (*cache).entries[entry].frame;
+		if((*cache).pins[frame] > 0 && --(*cache).pins[frame] == 0){
+			--(*cache).pinned_frames;
+		}
+	}
+	pthread_mutex_unlock(&(*cache).lock);
+}
+
+// Loads the blocks in [first, first + count) that aren't in the cache yet, each run of them with a single read
+//  They come in cold, and count as read-ahead until something asks for them
+// \param cache The cache
+// \param first First block to load
+// \param count Number of blocks, at most half the cache's frames are used
+// \return Number of blocks loaded
+//
+size_t block_cache_prefetch(block_cache_t *const cache, const size_t first, const size_t count){
+	pthread_mutex_lock(&(*cache).lock);
+	const size_t end = first + (count > (*cache).frames / 2 ? (*cache).frames / 2 : count); // Any more and it would push out its own blocks
+	size_t loaded = 0;
+	bool ok = true;
+	for(size_t block = first; ok && block < end;){
+		uint32_t frames[CACHE_BATCH], entries[CACHE_BATCH];
+		size_t run = 0;
+		// Blocks of the run stay pinned until it's read, so making room for one can't evict another
+		while(run < CACHE_BATCH && block + run < end && index_find(cache, block + run) == NIL){
+			if((*cache).pinned_frames == (*cache).frames || !cache_make_room(cache)){
+				ok = false;
+				break;
+			}
+			frames[run] = (*cache).free_frames[--(*cache).free_frame_count];
+			entries[run] = cache_install(cache, NIL, block + run, frames[run]);
+			(*cache).entries[entries[run]].prefetched = true;
+			if((*cache).pins[frames[run]]++ == 0){
+				++(*cache).pinned_frames;
+			}
+			++run;
+		}
+		const bool read = run > 0 && cache_transfer(cache, frames, run, block, false);
+		for(size_t i = 0; i < run; ++i){
+			if(--(*cache).pins[frames[i]] == 0){
+				--(*cache).pinned_frames;
+			}
+			if(!read){ // Drop them without a trace, they never held anything
+				--*((*cache).entries[entries[i]].state == ENTRY_HOT ? &(*cache).count_hot : &(*cache).count_cold);
+				entry_forget(cache, entries[i]);
+				(*cache).free_frames[(*cache).free_frame_count++] = frames[i];
+			}
+		}
+		loaded += read ? run : 0;
+		ok = ok && (run == 0 || read);
+		block += run > 0 ? run : 1; // Skips over blocks that are cached already
+	}
+	(*cache).stats.readahead += loaded;
+	pthread_mutex_unlock(&(*cache).lock);
+	return loaded;
+}
+
+// A changed frame and the block it holds, so write-back can go in block order
+typedef struct {
+	size_t block_id;
+	uint32_t frame;
+} cache_dirty_t;
+
+static int dirty_compare(const void *a, const void *b){
+	const cache_dirty_t *const lhs = a, *const rhs = b;
+	return (*lhs).block_id < (*rhs).block_id ? -1 : ((*lhs).block_id > (*rhs).block_id);
+}
+
+// Writes every changed block in the cache to the file, they stay cached
+//  Neighbouring blocks go out together, one pwritev per run
+// \param cache The cache
+// \return boolean indicating success of operation
+//
+bool block_cache_writeback(block_cache_t *const cache){
+	pthread_mutex_lock(&(*cache).lock);
+	cache_dirty_t *const dirty = malloc((*cache).frames * sizeof(cache_dirty_t));
+	bool ok = dirty != NULL;
+	size_t count = 0;
+	uint32_t entry = (*cache).hand_hot;
+	for(size_t i = 0, n = (*cache).count_hot + (*cache).count_cold + (*cache).count_test; ok && i < n; ++i){
+		const cache_entry_t *const e = &(*cache).entries[entry];
+		if((*e).state != ENTRY_TEST && bitmap_test((*cache).dirty, (*e).frame)){
+			dirty[count].block_id = (*e).block_id;
+			dirty[count++].frame = (*e).frame;
+		}
+		entry = (*e).next;
+	}
+	if(ok){
+		qsort(dirty, count, sizeof(cache_dirty_t), dirty_compare);
+	}
+	for(size_t i = 0; ok && i < count;){
+		uint32_t frames[CACHE_BATCH];
+		size_t run = 0;
+		do {
+			frames[run] = dirty[i + run].frame;
+			++run;
+		} while(run < CACHE_BATCH && i + run < count && dirty[i + run].block_id == dirty[i].block_id + run);
+		ok = cache_transfer(cache, frames, run, dirty[i].block_id, true);
+		for(size_t j = 0; ok && j < run; ++j){
+			bitmap_reset((*cache).dirty, frames[j]);
+		}
+		(*cache).stats.writebacks += ok ? run : 0;
+		i += run;
+	}
+	free(dirty);
+	pthread_mutex_unlock(&(*cache).lock);
+	return ok;
+}
+
+// Reads the cache's counters
+// \param cache The cache
+// \param stats Where to put them
+//
+void block_cache_stats(block_cache_t *const cache, block_store_cache_stats_t *const stats){
+	pthread_mutex_lock(&(*cache).lock);
+	*stats = (*cache).stats;
+	pthread_mutex_unlock(&(*cache).lock);
+}
+
+// Frees the cache, changed blocks that weren't written back are lost
+// \param cache The cache
+//
+void block_cache_destroy(block_cache_t *const cache){
+	if(cache == NULL){
+		return;
+	}
+	pthread_mutex_destroy(&(*cache).lock);
+	free((*cache).data);
+	free((*cache).pins);
+	bitmap_destroy((*cache).dirty);
+	free((*cache).free_frames);
+	free((*cache).entries);
+	free((*cache).slots);
+	free(cache);
+}
@@ -0,0 +1,95 @@
+#ifndef BLOCK_CACHE_H__
+#define BLOCK_CACHE_H__
+
+// Bounded write-back cache of the blocks of a device image file, for devices that don't fit in memory
+// Eviction is CLOCK-Pro: resident blocks are hot or cold, cold blocks that get evicted are remembered
+// for a while (non-resident test entries) and come back hot if they're asked for again in that window,
+// so a scan through the device can't push out the working set.
+// Every call takes the cache's own lock, it's safe to share between threads.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../include/block_store.h"
+
+typedef struct block_cache block_cache_t;
+
+///
+/// Creates a cache over the blocks of the given file
+/// \param fd File holding the image, block n at offset n * block_size (borrowed, not closed)
+/// \param block_size Bytes per block
+/// \param frames Number of blocks to keep in memory at most
+/// \return New cache, NULL on error
+///
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t frames);
+
+///
+/// Copies a block out, loading it into the cache if it isn't there
+/// \param cache The cache
+/// \param block_id The block
+/// \param buffer Where to put the block's bytes
+/// \param populate Whether a miss should make room for the block or just read it past the cache
+/// \return boolean indicating success, false on I/O errors or when every frame is pinned
+///
+bool block_cache_read(block_cache_t *const cache, const size_t block_id, void *const buffer, const bool populate);
+
+///
+/// Writes part (or all) of a block into the cache, it goes to the file once it's evicted or written back
+///  (partial writes of a missing block read the rest of it in first)
+/// \param cache The cache
+/// \param block_id The block
+/// \param offset Byte offset within the block
+/// \param len Number of bytes to write
+/// \param buffer The bytes to write
+/// \return boolean indicating success, false on I/O errors or when every frame is pinned
+///
+bool block_cache_write(block_cache_t *const cache, const size_t block_id, const size_t offset, const size_t len, const void *const buffer);
+
+///
+/// Loads a block and keeps it in memory until it's unpinned
+/// \param cache The cache
+/// \param block_id The block
+/// \return The block's bytes in the cache, NULL on error
+///
+const void *block_cache_pin(block_cache_t *const cache, const size_t block_id);
+
+///
+/// Allows a block given out by block_cache_pin to be evicted again
+/// \param cache The cache
+/// \param block_id The pinned block
+///
+void block_cache_unpin(block_cache_t *const cache, const size_t block_id);
+
+///
+/// Loads the blocks in [first, first + count) that aren't in the cache yet, each run of them with a single read
+///  They come in cold, and count as read-ahead until something asks for them
+/// \param cache The cache
+/// \param first First block to load
+/// \param count Number of blocks, at most half the cache's frames are used
+/// \return Number of blocks loaded
+///
+size_t block_cache_prefetch(block_cache_t *const cache, const size_t first, const size_t count);
+
+///
+/// Writes every changed block in the cache to the file, they stay cached
+///  Neighbouring blocks go out together, one pwritev per run
+/// \param cache The cache
+/// \return boolean indicating success of operation
+///
+bool block_cache_writeback(block_cache_t *const cache);
+
+///
+/// Reads the cache's counters
+/// \param cache The cache
+/// \param stats Where to put them
+///
+void block_cache_stats(block_cache_t *const cache, block_store_cache_stats_t *const stats);
+
+///
+/// Frees the cache, changed blocks that weren't written back are lost
+/// \param cache The cache
+///
+void block_cache_destroy(block_cache_t *const cache);
+
+#endif
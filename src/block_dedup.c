@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+#include<string.h>
+#include<pthread.h>
+
+#include "block_dedup.h"
+
+#define DEDUP_NONE SIZE_MAX // No slot: what zero blocks point at, and the end of every chain
+#define DEDUP_SLAB_SLOTS 64 // Contents are allocated this many blocks at a time
+#define DEDUP_MIN_BUCKETS 64
+
+// One stored block's worth of contents
+typedef struct {
+	uint64_t hash;
+	size_t refs; // Blocks pointing here, 0 while the slot is free
+	size_t next; // Next slot in the same hash bucket, or on the free list
+} dedup_slot_t;
+
+struct block_dedup{
+	pthread_mutex_t lock;
+	size_t block_size;
+	size_t block_count;
+	size_t *map; // Slot each block points at, DEDUP_NONE for the zero blocks
+	uint8_t **slabs; // The contents, DEDUP_SLAB_SLOTS slots per slab, slot n at slabs[n / DEDUP_SLAB_SLOTS]
+	dedup_slot_t *slots;
+	size_t slot_count; // Slots that exist (used or free), all slabs up to this one are allocated
+	size_t slot_capacity; // Room in slots (always a multiple of DEDUP_SLAB_SLOTS)
+	size_t free_slots; // Head of the free list
+	size_t *buckets; // Hash table, heads of chains of slots with the same low hash bits
+	size_t bucket_count; // Power of two, grown to stay ahead of the stored count
+	size_t stored; // Slots in use
+	size_t zero_blocks; // Blocks pointing at nothing
+	uint8_t *zeros; // What zero blocks read as
+	uint8_t *scratch; // Partial writes put the new contents together here
+};
+
+//
+///
+// HASHING
+///
+//
+
+// XXH64, a fast non-cryptographic hash. Collisions only cost a memcmp, contents are always compared before sharing.
+#define XXH_PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME3 UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME5 UINT64_C(0x27D4EB2F165667C5)
+
+static inline uint64_t xxh_rotl(const uint64_t x, const int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *const p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, const uint64_t input){
+	acc += input * XXH_PRIME2;
+	return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, const uint64_t v){
+	acc ^= xxh_round(0, v);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static uint64_t dedup_hash(const uint8_t *p, const size_t len){
+	const uint8_t *const end = p + len;
+	uint64_t h;
+	if(len >= 32){
+		uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0, v4 = 0 - XXH_PRIME1;
+		for(; p + 32 <= end; p += 32){ // Four independent lanes, so they pipeline
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+		}
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+	} else {
+		h = XXH_PRIME5;
+	}
+	h += len;
+	for(; p + 8 <= end; p += 8){
+		h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if(p + 4 <= end){
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		h = xxh_rotl(h ^ (v * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for(; p < end; ++p){
+		h = xxh_rotl(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+	}
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	return h ^ (h >> 32);
+}
+
+// A block of zeros, checked a word at a time
+static bool dedup_all_zero(const uint8_t *p, size_t len){
+	for(; len >= 8; p += 8, len -= 8){
+		if(xxh_read64(p) != 0){
+			return false;
+		}
+	}
+	for(; len > 0; ++p, --len){
+		if(*p != 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+//
+///
+// SLOTS
+///
+//
+
+static inline uint8_t *slot_data(const block_dedup_t *const dedup, const size_t slot){
+	return (*dedup).slabs[slot / DEDUP_SLAB_SLOTS] + (slot % DEDUP_SLAB_SLOTS) * (*dedup).block_size;
+}
+
+// Doubles the hash table once it holds as many slots as it has buckets (lock held)
+static void dedup_grow_buckets(block_dedup_t *const dedup){
+	const size_t count = (*dedup).bucket_count * 2;
+	size_t *const buckets = malloc(count * sizeof(size_t));
+	if(buckets == NULL){
+		return; // Chains just get longer
+	}
+	for(size_t i = 0; i < count; ++i){
+		buckets[i] = DEDUP_NONE;
+	}
+	for(size_t slot = 0; slot < (*dedup).slot_count; ++slot){
+		if((*dedup).slots[slot].refs > 0){
+			const size_t bucket = (size_t)(*dedup).slots[slot].hash & (count - 1);
+			(*dedup).slots[slot].next = buckets[bucket];
+			buckets[bucket] = slot;
+		}
+	}
+	free((*dedup).buckets);
+	(*dedup).buckets = buckets;
+	(*dedup).bucket_count = count;
+}
+
+// Gets a free slot, making more if there aren't any (lock held), DEDUP_NONE without memory for it
+static size_t dedup_new_slot(block_dedup_t *const dedup){
+	if((*dedup).free_slots != DEDUP_NONE){
+		const size_t slot = (*dedup).free_slots;
+		(*dedup).free_slots = (*dedup).slots[slot].next;
+		return slot;
+	}
+	if((*dedup).slot_count == (*dedup).slot_capacity){
+		const size_t capacity = (*dedup).slot_capacity ? (*dedup).slot_capacity * 2 : DEDUP_SLAB_SLOTS;
+		dedup_slot_t *const slots = realloc((*dedup).slots, capacity * sizeof(dedup_slot_t));
+		if(slots == NULL){
+			return DEDUP_NONE;
+		}
+		(*dedup).slots = slots;
+		uint8_t **const slabs = realloc((*dedup).slabs, capacity / DEDUP_SLAB_SLOTS * sizeof(uint8_t *));
+		if(slabs == NULL){
+			return DEDUP_NONE; // The bigger slots array is kept, it's just not used yet
+		}
+		(*dedup).slabs = slabs;
+		(*dedup).slot_capacity = capacity;
+	}
+	if((*dedup).slot_count % DEDUP_SLAB_SLOTS == 0){
+		uint8_t *const slab = malloc(DEDUP_SLAB_SLOTS * (*dedup).block_size);
+		if(slab == NULL){
+			return DEDUP_NONE;
+		}
+		(*dedup).slabs[(*dedup).slot_count / DEDUP_SLAB_SLOTS] = slab;
+	}
+	return (*dedup).slot_count++;
+}
+
+// Takes a reference on the slot holding these contents, storing them in a new one if no slot has them yet (lock held)
+static size_t dedup_acquire(block_dedup_t *const dedup, const uint8_t *const contents, const uint64_t hash){
+	const size_t bucket = (size_t)hash & ((*dedup).bucket_count - 1);
+	for(size_t slot = (*dedup).buckets[bucket]; slot != DEDUP_NONE; slot = (*dedup).slots[slot].next){
+		if((*dedup).slots[slot].hash == hash && memcmp(slot_data(dedup, slot), contents, (*dedup).block_size) == 0){
+			++(*dedup).slots[slot].refs;
+			return slot;
+		}
+	}
+	const size_t slot = dedup_new_slot(dedup);
+	if(slot == DEDUP_NONE){
+		return DEDUP_NONE;
+	}
+	memcpy(slot_data(dedup, slot), contents, (*dedup).block_size);
+	(*dedup).slots[slot] = (dedup_slot_t){hash, 1, (*dedup).buckets[bucket]};
+	(*dedup).buckets[bucket] = slot;
+	if(++(*dedup).stored > (*dedup).bucket_count){
+		dedup_grow_buckets(dedup);
+	}
+	return slot;
+}
+
+// Drops a reference, freeing the slot when it was the last one (lock held)
+static void dedup_release(block_dedup_t *const dedup, const size_t slot){
+	if(slot == DEDUP_NONE || --(*dedup).slots[slot].refs > 0){
+		return;
+	}
+	size_t *link = &(*dedup).buckets[(size_t)(*dedup).slots[slot].hash & ((*dedup).bucket_count - 1)];
+	while(*link != slot){
+		link = &(*dedup).slots[*link].next;
+	}
+	*link = (*dedup).slots[slot].next;
+	(*dedup).slots[slot].next = (*dedup).free_slots;
+	(*dedup).free_slots = slot;
+	--(*dedup).stored;
+}
+
+//
+///
+// API
+///
+//
+
+// Creates a store where every block starts out all zeros
+block_dedup_t *block_dedup_create(const size_t block_size, const size_t block_count){
+	block_dedup_t *const dedup = calloc(1, sizeof(block_dedup_t));
+	if(dedup == NULL){
+		return NULL;
+	}
+	pthread_mutex_init(&(*dedup).lock, NULL);
+	(*dedup).block_size = block_size;
+	(*dedup).block_count = block_count;
+	(*dedup).free_slots = DEDUP_NONE;
+	(*dedup).bucket_count = DEDUP_MIN_BUCKETS;
+	(*dedup).zero_blocks = block_count;
+	(*dedup).map = malloc(block_count * sizeof(size_t));
+	(*dedup).buckets = malloc(DEDUP_MIN_BUCKETS * sizeof(size_t));
+	(*dedup).zeros = calloc(1, block_size);
+	(*dedup).scratch = malloc(block_size);
+	if((*dedup).map == NULL || (*dedup).buckets == NULL || (*dedup).zeros == NULL || (*dedup).scratch == NULL){
+		block_dedup_destroy(dedup);
+		return NULL;
+	}
+	for(size_t i = 0; i < block_count; ++i){
+		(*dedup).map[i] = DEDUP_NONE;
+	}
+	for(size_t i = 0; i < DEDUP_MIN_BUCKETS; ++i){
+		(*dedup).buckets[i] = DEDUP_NONE;
+	}
+	return dedup;
+}
+
+// Replaces part (or all) of a block's contents, letting go of whatever it pointed at before
+bool block_dedup_write(block_dedup_t *const dedup, const size_t block_id, const size_t offset, const size_t len, const void *const data){
+	const size_t block_size = (*dedup).block_size;
+	const bool whole = offset == 0 && len == block_size;
+	bool zero = whole && dedup_all_zero(data, block_size);
+	uint64_t hash = whole && !zero ? dedup_hash(data, block_size) : 0; // Whole blocks get hashed before taking the lock
+	pthread_mutex_lock(&(*dedup).lock);
+	const size_t old = (*dedup).map[block_id];
+	const uint8_t *contents = data;
+	if(!whole){
+		memcpy((*dedup).scratch, old == DEDUP_NONE ? (*dedup).zeros : slot_data(dedup, old), block_size);
+		memcpy((*dedup).scratch + offset, data, len);
+		contents = (*dedup).scratch;
+		zero = dedup_all_zero(contents, block_size);
+		hash = zero ? 0 : dedup_hash(contents, block_size);
+	}
+	size_t slot = DEDUP_NONE;
+	if(!zero){
+		slot = dedup_acquire(dedup, contents, hash); // Before the old one goes, they might well be the same
+		if(slot == DEDUP_NONE){
+			pthread_mutex_unlock(&(*dedup).lock);
+			return false;
+		}
+	}
+	dedup_release(dedup, old);
+	(*dedup).map[block_id] = slot;
+	if(old == DEDUP_NONE && slot != DEDUP_NONE){
+		--(*dedup).zero_blocks;
+	} else if(old != DEDUP_NONE && slot == DEDUP_NONE){
+		++(*dedup).zero_blocks;
+	}
+	pthread_mutex_unlock(&(*dedup).lock);
+	return true;
+}
+
+// Finds a block's contents, they stay put until the block is written again
+//  (slabs never move, only the array pointing at them does)
+const void *block_dedup_data(block_dedup_t *const dedup, const size_t block_id){
+	pthread_mutex_lock(&(*dedup).lock);
+	const size_t slot = (*dedup).map[block_id];
+	const void *const data = slot == DEDUP_NONE ? (*dedup).zeros : slot_data(dedup, slot);
+	pthread_mutex_unlock(&(*dedup).lock);
+	return data;
+}
+
+// Tells whether a block is all zeros, and so has no storage behind it
+bool block_dedup_is_zero(block_dedup_t *const dedup, const size_t block_id){
+	pthread_mutex_lock(&(*dedup).lock);
+	const bool zero = (*dedup).map[block_id] == DEDUP_NONE;
+	pthread_mutex_unlock(&(*dedup).lock);
+	return zero;
+}
+
+// Reads the store's counters
+void block_dedup_stats(block_dedup_t *const dedup, block_store_dedup_stats_t *const stats){
+	pthread_mutex_lock(&(*dedup).lock);
+	(*stats).zero_blocks = (*dedup).zero_blocks;
+	(*stats).stored_blocks = (*dedup).stored;
+	(*stats).stored_bytes = (uint64_t)(*dedup).slot_count * (*dedup).block_size;
+	pthread_mutex_unlock(&(*dedup).lock);
+}
+
+// Frees the store and every block's contents
+void block_dedup_destroy(block_dedup_t *const dedup){
+	if(dedup == NULL){
+		return;
+	}
+	for(size_t i = 0; i < (*dedup).slot_count; i += DEDUP_SLAB_SLOTS){
+		free((*dedup).slabs[i / DEDUP_SLAB_SLOTS]);
+	}
+	free((*dedup).slabs);
+	free((*dedup).slots);
+	free((*dedup).buckets);
+	free((*dedup).map);
+	free((*dedup).zeros);
+	free((*dedup).scratch);
+	pthread_mutex_destroy(&(*dedup).lock);
+	free(dedup);
+}
@@ -0,0 +1,66 @@
+#ifndef BLOCK_DEDUP_H__
+#define BLOCK_DEDUP_H__
+
+// Content-addressed storage for the data blocks of a BS_FLAG_DEDUP device
+// Every block points at a stored copy of its contents, blocks with identical contents point at the same copy
+// (found by a 64-bit hash, confirmed byte for byte) and share it until one of them is written again.
+// All-zero blocks point at nothing, they take no storage at all.
+// Every call takes the store's own lock, callers still hold the block's lock around anything touching it.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../include/block_store.h"
+
+typedef struct block_dedup block_dedup_t;
+
+///
+/// Creates a store where every block starts out all zeros
+/// \param block_size Bytes per block
+/// \param block_count Number of blocks
+/// \return New store, NULL on error
+///
+block_dedup_t *block_dedup_create(const size_t block_size, const size_t block_count);
+
+///
+/// Replaces part (or all) of a block's contents, letting go of whatever it pointed at before
+/// \param dedup The store
+/// \param block_id The block
+/// \param offset Byte offset within the block
+/// \param len Number of bytes to write
+/// \param data The bytes to write
+/// \return boolean indicating success, false if there was no memory for new contents
+///
+bool block_dedup_write(block_dedup_t *const dedup, const size_t block_id, const size_t offset, const size_t len, const void *const data);
+
+///
+/// Finds a block's contents, they stay put until the block is written again
+/// \param dedup The store
+/// \param block_id The block
+/// \return The block's bytes (a shared all-zero block for zero blocks)
+///
+const void *block_dedup_data(block_dedup_t *const dedup, const size_t block_id);
+
+///
+/// Tells whether a block is all zeros, and so has no storage behind it
+/// \param dedup The store
+/// \param block_id The block
+/// \return boolean indicating it is
+///
+bool block_dedup_is_zero(block_dedup_t *const dedup, const size_t block_id);
+
+///
+/// Reads the store's counters
+/// \param dedup The store
+/// \param stats Where to put them
+///
+void block_dedup_stats(block_dedup_t *const dedup, block_store_dedup_stats_t *const stats);
+
+///
+/// Frees the store and every block's contents
+/// \param dedup The store
+///
+void block_dedup_destroy(block_dedup_t *const dedup);
+
+#endif
@@ -1,176 +1,1996 @@
+#define _POSIX_C_SOURCE 200809L // ftruncate, msync and friends under -std=c11
+#define _GNU_SOURCE // SEEK_DATA and SEEK_HOLE
 #include<string.h>
+#include<assert.h>
 #include<stdio.h>
 #include<stdint.h>
+#include<stdatomic.h>
 #include<errno.h>
 #include<fcntl.h>
 #include<unistd.h>
 /* Not technically required, but needed on some UNIX distributions */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 		
-#include "../include/bitmap.h"
-#include "../include/block_store.h"
+#include "block_store_internal.h"
 
-typedef struct block_store{
-	bitmap_t *bmp[256]; // array of bitmap_t pointers
-} block_store_t;
+// Geometry of the classic device, what block_store_create() and block_store_deserialize() use
+#define BLOCK_SIZE_BYTES 256
+#define BLOCK_COUNT 256
+#define ARENA_ALIGNMENT 4096 // page aligned, which also keeps every block on its own cache lines
+
+// Every flag block_store_create_ex understands, anything else is rejected
+#define BS_FLAGS_KNOWN (BS_FLAG_CONCURRENT | BS_FLAG_THREAD_CACHE | BS_FLAG_CHECKSUM | BS_FLAG_DEDUP | BS_FLAG_STATS \
+	| BS_FLAG_HUGEPAGES | BS_FLAG_NUMA_INTERLEAVE | BS_FLAG_NUMA_PARTITION)
+// Flags that need the arena on the heap, the mapped and cached opens turn them down instead of ignoring them
+#define BS_FLAGS_HEAP_ONLY (BS_FLAG_DEDUP | BS_FLAG_NUMA_INTERLEAVE | BS_FLAG_NUMA_PARTITION)
+
+// BS_FLAG_THREAD_CACHE magazines hold up to MAGAZINE_SIZE reserved ids and refill MAGAZINE_BATCH at a time
+//  (one fbm word, so a refill is a single claim on a word nobody else is using)
+#define MAGAZINE_SIZE 128
+#define MAGAZINE_BATCH 64
+
+// Vectored calls up to this size sort on the stack, bigger ones allocate
+#define IOV_STACK_ENTRIES 64
+
+// Cached devices write images out through a buffer of this many blocks
+#define STAGING_BLOCKS 64
+
+// Sequential read-ahead on devices with a file behind them starts out READAHEAD_MIN blocks ahead,
+//  and never goes more than READAHEAD_MAX_BYTES ahead
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX_BYTES (512 * 1024)
+
+// block_store_scrub never runs more threads than this
+#define SCRUB_MAX_THREADS 64
+
+// Raw images load with at most LOAD_MAX_THREADS threads, each reading up to LOAD_CHUNK_BYTES at a time
+#define LOAD_MAX_THREADS 64
+#define LOAD_CHUNK_BYTES (1u << 20)
+
+
+
+// Marks the meta blocks holding fbm bits [first, first + count) as changed
+//  Concurrent devices skip this, flush always writes their meta blocks instead
+static inline void block_store_dirty_fbm(block_store_t *const bs, const size_t first, const size_t count){
+	if((*bs).stripes != NULL){
+		return;
+	}
+	const size_t bits_per_block = (*bs).block_size * 8;
+	const size_t first_meta = first / bits_per_block, last_meta = (first + count - 1) / bits_per_block;
+	bitmap_set_range((*bs).dirty, first_meta, last_meta - first_meta + 1);
+}
+
+//
+///
+// BS_FLAG_CONCURRENT SUPPORT
+///
+//
+
+// The lock-free allocator works on the fbm directly as 64-bit words, bit n of the device being bit n % 64 of word n / 64
+//  Storage order is bytes though, so on big endian hosts the words get swapped to line up with that
+static inline uint64_t fbm_order(const uint64_t value){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap64(value);
+#else
+	return value;
+#endif
+}
+static inline uint64_t *fbm_word(const block_store_t *const bs, const size_t word){
+	return (uint64_t *)(*bs).arena + word; // The arena is page aligned and concurrent block sizes are multiples of 8
+}
+static inline uint64_t fbm_load(const block_store_t *const bs, const size_t word){
+	uint64_t value = fbm_order(__atomic_load_n(fbm_word(bs, word), __ATOMIC_ACQUIRE));
+	const size_t leftover = (*bs).block_count & 63;
+	if(leftover && word == (*bs).block_count >> 6){
+		value |= ~UINT64_C(0) << leftover; // Bits past the last block are never available
+	}
+	return value;
+}
+
+// Sets the bits of mask (device order) in the given word, fails without changing anything if any already was
+static inline bool fbm_claim(const block_store_t *const bs, const size_t word, const uint64_t mask){
+	uint64_t *const target = fbm_word(bs, word);
+	uint64_t expected = __atomic_load_n(target, __ATOMIC_RELAXED);
+	do {
+		if(fbm_order(expected) & mask){
+			return false;
+		}
+	} while(!__atomic_compare_exchange_n(target, &expected, expected | fbm_order(mask), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return true;
+}
+
+// Moves the allocation hint back to the given word if it's past it
+static inline void fbm_lower_hint(block_store_t *const bs, const size_t word){
+	size_t hint = __atomic_load_n(&(*bs).free_hint, __ATOMIC_SEQ_CST);
+	while(word < hint && !__atomic_compare_exchange_n(&(*bs).free_hint, &hint, word, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+	}
+}
+
+// Clears the bits of mask (device order) in the given word, returns how many of them were set
+static inline size_t fbm_unclaim(block_store_t *const bs, const size_t word, const uint64_t mask){
+	const uint64_t old = fbm_order(__atomic_fetch_and(fbm_word(bs, word), ~fbm_order(mask), __ATOMIC_ACQ_REL));
+	const size_t released = (size_t)__builtin_popcountll(old & mask);
+	if(released){
+		__atomic_sub_fetch(&(*bs).used_blocks, released, __ATOMIC_SEQ_CST);
+		fbm_lower_hint(bs, word); // So the next allocation finds this space
+	}
+	return released;
+}
+
+// Lowest free block, claimed with an atomic fetch-or so two threads can never walk away with the same one
+static size_t fbm_allocate_concurrent(block_store_t *const bs){
+	const size_t words = ((*bs).block_count + 63) >> 6;
+	for(size_t word = __atomic_load_n(&(*bs).free_hint, __ATOMIC_RELAXED); word < words; ++word){
+		uint64_t value = fbm_load(bs, word);
+		while(~value){
+			const uint64_t bit = ~value & (value + 1); // lowest clear bit
+			const uint64_t old = fbm_order(__atomic_fetch_or(fbm_word(bs, word), fbm_order(bit), __ATOMIC_ACQ_REL));
+			if(!(old & bit)){
+				__atomic_add_fetch(&(*bs).used_blocks, 1, __ATOMIC_SEQ_CST);
+				return (word << 6) + (size_t)__builtin_ctzll(bit);
+			}
+			value = old | fbm_load(bs, word); // Someone beat us to it, try the next one in this word
+		}
+		// Full word, later allocations can start past it
+		size_t hint = word;
+		if(__atomic_compare_exchange_n(&(*bs).free_hint, &hint, word + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) && ~fbm_load(bs, word)){
+			fbm_lower_hint(bs, word); // A release got in between the scan and the bump and its hint update was overwritten
+		}
+	}
+	return SIZE_MAX;
+}
+
+// Claims blocks [first, first + n) word by word, rolling back if another thread got to any of them first
+static bool fbm_claim_range_concurrent(block_store_t *const bs, const size_t first, const size_t n){
+	const size_t last = first + n - 1;
+	for(size_t word = first >> 6; word <= last >> 6; ++word){
+		const uint64_t head = word == (first >> 6) ? ~UINT64_C(0) << (first & 63) : ~UINT64_C(0);
+		const uint64_t tail = word == (last >> 6) ? ~UINT64_C(0) >> (63 - (last & 63)) : ~UINT64_C(0);
+		if(!fbm_claim(bs, word, head & tail)){
+			// Undo what we already took, without touching the used counter we haven't bumped yet
+			for(size_t undo = first >> 6; undo < word; ++undo){
+				const uint64_t undo_head = undo == (first >> 6) ? ~UINT64_C(0) << (first & 63) : ~UINT64_C(0);
+				__atomic_fetch_and(fbm_word(bs, undo), ~fbm_order(undo_head), __ATOMIC_ACQ_REL);
+			}
+			return false;
+		}
+	}
+	__atomic_add_fetch(&(*bs).used_blocks, n, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+// First fit for n contiguous blocks, racing other threads for them
+static size_t fbm_allocate_range_concurrent(block_store_t *const bs, const size_t n){
+	const size_t words = ((*bs).block_count + 63) >> 6;
+	for(;;){
+		size_t run_start = 0, run_length = 0, found = SIZE_MAX;
+		for(size_t word = __atomic_load_n(&(*bs).free_hint, __ATOMIC_RELAXED); word < words && found == SIZE_MAX; ++word){
+			const uint64_t value = fbm_load(bs, word);
+			if(value == 0 && run_length + 64 < n){ // Whole word free and it doesn't finish the run
+				run_start = run_length ? run_start : word << 6;
+				run_length += 64;
+				continue;
+			}
+			for(size_t bit = 0; bit < 64; ++bit){
+				if(value & (UINT64_C(1) << bit)){
+					run_length = 0;
+				} else {
+					run_start = run_length ? run_start : (word << 6) + bit;
+					if(++run_length == n){
+						found = run_start;
+						break;
+					}
+				}
+			}
+		}
+		if(found == SIZE_MAX){
+			return SIZE_MAX;
+		}
+		if(fbm_claim_range_concurrent(bs, found, n)){
+			return found;
+		}
+		// Lost the race for part of it, look again with the new state of the map
+	}
+}
+
+//
+///
+// BS_FLAG_THREAD_CACHE SUPPORT
+///
+//
+
+// A thread's stash of block ids, already claimed in the fbm, handed out and taken back without touching it
+struct magazine{
+	block_store_t *bs;
+	pthread_mutex_t lock; // Only ever contended when the device runs dry and empties everyone's magazine
+	size_t count;
+	size_t ids[MAGAZINE_SIZE]; // Popped from the end, refills go in descending so they come out ascending
+	magazine_t *prev, *next; // The device's list
+};
+
+// Whether a block is sitting in some magazine
+//  A block's byte is only ever stored to by whoever holds the block, so plain loads and stores do, no locked RMW
+static inline bool magazine_marked(const block_store_t *const bs, const size_t block_id){
+	return __atomic_load_n(&(*bs).cached_ids[block_id], __ATOMIC_ACQUIRE) != 0;
+}
+
+// Notes that a block went into a magazine
+static inline void magazine_mark(block_store_t *const bs, const size_t block_id){
+	__atomic_store_n(&(*bs).cached_ids[block_id], 1, __ATOMIC_RELEASE);
+}
+
+// Notes that a block left its magazine, before it's handed out or goes back to the fbm
+static inline void magazine_unmark(block_store_t *const bs, const size_t block_id){
+	__atomic_store_n(&(*bs).cached_ids[block_id], 0, __ATOMIC_RELEASE);
+}
+
+// Gives the first count ids at the end of the magazine back to the fbm (magazine lock held)
+static void magazine_drain(magazine_t *const magazine, const size_t count){
+	block_store_t *const bs = (*magazine).bs;
+	for(size_t i = 0; i < count; ++i){
+		const size_t id = (*magazine).ids[--(*magazine).count];
+		magazine_unmark(bs, id); // Unmarked first, a thread that allocates it from the fbm right away can release it again
+		fbm_unclaim(bs, id >> 6, UINT64_C(1) << (id & 63));
+	}
+}
+
+// Empties every magazine of the device, for when the fbm alone can't satisfy a request
+static void magazine_drain_all(block_store_t *const bs){
+	pthread_mutex_lock(&(*bs).magazines_lock);
+	for(magazine_t *magazine = (*bs).magazines; magazine != NULL; magazine = (*magazine).next){
+		pthread_mutex_lock(&(*magazine).lock);
+		magazine_drain(magazine, (*magazine).count);
+		pthread_mutex_unlock(&(*magazine).lock);
+	}
+	pthread_mutex_unlock(&(*bs).magazines_lock);
+}
+
+// Takes a magazine off the device's list and hands its blocks back (device list lock held)
+static void magazine_retire(magazine_t *const magazine){
+	block_store_t *const bs = (*magazine).bs;
+	if((*magazine).prev != NULL){
+		(*(*magazine).prev).next = (*magazine).next;
+	} else {
+		(*bs).magazines = (*magazine).next;
+	}
+	if((*magazine).next != NULL){
+		(*(*magazine).next).prev = (*magazine).prev;
+	}
+	magazine_drain(magazine, (*magazine).count);
+	pthread_mutex_destroy(&(*magazine).lock);
+	free(magazine);
+}
+
+// Thread exit hook, whatever the thread still had cached goes back to the device
+static void magazine_thread_exit(void *const value){
+	magazine_t *const magazine = value;
+	block_store_t *const bs = (*magazine).bs;
+	pthread_mutex_lock(&(*bs).magazines_lock);
+	magazine_retire(magazine);
+	pthread_mutex_unlock(&(*bs).magazines_lock);
+}
+
+// The calling thread's magazine, created on first use, NULL if that fails (callers go to the fbm directly)
+static magazine_t *magazine_get(block_store_t *const bs){
+	magazine_t *magazine = pthread_getspecific((*bs).magazine_key);
+	if(magazine != NULL){
+		return magazine;
+	}
+	magazine = calloc(1, sizeof(magazine_t));
+	if(magazine == NULL){
+		return NULL;
+	}
+	(*magazine).bs = bs;
+	pthread_mutex_init(&(*magazine).lock, NULL);
+	if(pthread_setspecific((*bs).magazine_key, magazine) != 0){
+		pthread_mutex_destroy(&(*magazine).lock);
+		free(magazine);
+		return NULL;
+	}
+	pthread_mutex_lock(&(*bs).magazines_lock);
+	(*magazine).next = (*bs).magazines;
+	if((*bs).magazines != NULL){
+		(*(*bs).magazines).prev = magazine;
+	}
+	(*bs).magazines = magazine;
+	pthread_mutex_unlock(&(*bs).magazines_lock);
+	return magazine;
+}
+
+// Allocation through the calling thread's magazine, refilled a batch at a time from the fbm
+static size_t magazine_allocate(block_store_t *const bs){
+	magazine_t *const magazine = magazine_get(bs);
+	size_t id = SIZE_MAX;
+	if(magazine != NULL){
+		pthread_mutex_lock(&(*magazine).lock);
+		if((*magazine).count == 0){
+			// Take the biggest free extent we can get, down to a pair, single blocks aren't worth caching
+			for(size_t batch = MAGAZINE_BATCH; batch > 1; batch /= 2){
+				const size_t first = fbm_allocate_range_concurrent(bs, batch);
+				if(first != SIZE_MAX){
+					for(size_t i = batch; i-- > 0;){
+						magazine_mark(bs, first + i);
+						(*magazine).ids[(*magazine).count++] = first + i;
+					}
+					break;
+				}
+			}
+		}
+		if((*magazine).count > 0){
+			id = (*magazine).ids[--(*magazine).count];
+			magazine_unmark(bs, id);
+		}
+		pthread_mutex_unlock(&(*magazine).lock);
+	}
+	if(id == SIZE_MAX){
+		id = fbm_allocate_concurrent(bs);
+	}
+	if(id == SIZE_MAX){
+		magazine_drain_all(bs); // Whatever is left is hiding in other threads' magazines
+		id = fbm_allocate_concurrent(bs);
+	}
+	return id;
+}
+
+// Release into the calling thread's magazine, half of it goes back to the fbm when it fills up
+static void magazine_release(block_store_t *const bs, const size_t block_id){
+	if(!(fbm_load(bs, block_id >> 6) & (UINT64_C(1) << (block_id & 63)))){
+		return; // Not allocated
+	}
+	if(magazine_marked(bs, block_id)){
+		return; // Released already and cached since, a second copy would get handed out twice
+	}
+	magazine_t *const magazine = magazine_get(bs);
+	if(magazine == NULL){
+		fbm_unclaim(bs, block_id >> 6, UINT64_C(1) << (block_id & 63));
+		return;
+	}
+	pthread_mutex_lock(&(*magazine).lock);
+	if((*magazine).count == MAGAZINE_SIZE){
+		magazine_drain(magazine, MAGAZINE_SIZE / 2);
+	}
+	magazine_mark(bs, block_id);
+	(*magazine).ids[(*magazine).count++] = block_id;
+	pthread_mutex_unlock(&(*magazine).lock);
+}
+
+// Rebuilds the fbm summaries, block_store_reload_fbm without the used block count
+static void block_store_rebuild_fbm_index(block_store_t *const bs){
+	if((*bs).stripes != NULL){
+		__atomic_store_n(&(*bs).free_hint, 0, __ATOMIC_RELAXED); // Concurrent devices allocate from the fbm itself
+	} else {
+		hbitmap_rebuild((*bs).fbm_index);
+	}
+}
+
+// Recomputes the used block counter and the fbm summaries after the fbm was changed behind our back
+//  (a write to a meta block)
+void block_store_reload_fbm(block_store_t *const bs){
+	size_t meta_set = 0;
+	for(size_t i = 0; i < (*bs).meta_blocks; ++i){
+		meta_set += bitmap_test((*bs).fbm, i) ? 1 : 0;
+	}
+	__atomic_store_n(&(*bs).used_blocks, bitmap_total_set((*bs).fbm) - meta_set, __ATOMIC_RELAXED);
+	block_store_rebuild_fbm_index(bs);
+}
 
 /// This creates a new BS device, ready to go
 /// \return Pointer to a new block storage device, NULL on error
 block_store_t *block_store_create(){
-	block_store_t *bs = malloc(sizeof(block_store_t));
+	return block_store_create_ex(BLOCK_SIZE_BYTES, BLOCK_COUNT, BS_FLAG_NONE);
+}
+
+// The fbm needs one bit per block, and gets as many whole blocks as that takes
+static inline size_t fbm_blocks(const size_t block_size, const size_t block_count){
+	const size_t fbm_bytes = block_count / 8 + (block_count % 8 ? 1 : 0);
+	return fbm_bytes / block_size + (fbm_bytes % block_size ? 1 : 0);
+}
+
+// Validates the geometry and builds everything but the arena and the fbm on top of it
+//  The result is safe to hand to block_store_destroy at any point
+static block_store_t *block_store_prepare(const size_t block_size, const size_t block_count, const unsigned flags){
+	if(block_size == 0 || block_count == 0 || (flags & ~BS_FLAGS_KNOWN) || block_count > SIZE_MAX / sizeof(uint32_t)){
+		return NULL;
+	}
+	// BS_FLAG_CHECKSUM puts the checksum table in whole blocks of its own right after the fbm
+	const size_t table_bytes = (flags & BS_FLAG_CHECKSUM) ? block_count * sizeof(uint32_t) : 0;
+	const size_t meta_blocks = fbm_blocks(block_size, block_count) + table_bytes / block_size + (table_bytes % block_size ? 1 : 0);
+	if(meta_blocks >= block_count){ // No room left for any user data
+		return NULL;
+	}
+	if(block_size > (SIZE_MAX - ARENA_ALIGNMENT) / block_count){
+		return NULL;
+	}
+	if((flags & (BS_FLAG_CONCURRENT | BS_FLAG_THREAD_CACHE)) && block_size % 8){ // The allocator needs the fbm to be made of whole 64-bit words
+		return NULL;
+	}
+	if((flags & BS_FLAG_NUMA_INTERLEAVE) && (flags & BS_FLAG_NUMA_PARTITION)){ // One placement or the other
+		return NULL;
+	}
+	block_store_t *bs = calloc(1, sizeof(block_store_t));
+	if(bs == NULL){
+		return NULL;
+	}
+	(*bs).block_size = block_size;
+	(*bs).block_count = block_count;
+	(*bs).meta_blocks = meta_blocks;
+	(*bs).flags = flags;
+	(*bs).fd = -1;
+	pthread_mutex_init(&(*bs).aio_lock, NULL);
+	pthread_mutex_init(&(*bs).snapshots_lock, NULL);
+	pthread_mutex_init(&(*bs).readahead_lock, NULL);
+	(*bs).readahead_next = SIZE_MAX; // So the very first read doesn't look sequential
+	(*bs).readahead_max = READAHEAD_MAX_BYTES / block_size > READAHEAD_MIN ? READAHEAD_MAX_BYTES / block_size : READAHEAD_MIN;
+	(*bs).readahead_window = READAHEAD_MIN;
+	(*bs).dirty = bitmap_create(block_count); // Starts clean, create_ex marks everything since it's never been flushed
+	if((*bs).dirty == NULL){
+		block_store_destroy(bs);
+		return NULL;
+	}
+#ifndef NDEBUG
+	(*bs).pins = calloc(block_count, sizeof(uint32_t));
+	if((*bs).pins == NULL){
+		block_store_destroy(bs);
+		return NULL;
+	}
+#endif
+	if(flags & (BS_FLAG_CONCURRENT | BS_FLAG_THREAD_CACHE)){
+		(*bs).stripes = malloc(STRIPE_COUNT * sizeof(pthread_rwlock_t));
+		if((*bs).stripes == NULL){
+			block_store_destroy(bs);
+			return NULL;
+		}
+		for(size_t i = 0; i < STRIPE_COUNT; ++i){
+			pthread_rwlock_init(&(*bs).stripes[i], NULL);
+		}
+	}
+	if(flags & BS_FLAG_THREAD_CACHE){
+		(*bs).cached_ids = calloc(block_count, sizeof(uint8_t));
+		if((*bs).cached_ids == NULL || pthread_key_create(&(*bs).magazine_key, magazine_thread_exit) != 0){
+			block_store_destroy(bs);
+			return NULL;
+		}
+		pthread_mutex_init(&(*bs).magazines_lock, NULL);
+		(*bs).has_magazines = true;
+	}
+	if((flags & BS_FLAG_STATS) && !block_store_stats_setup(bs)){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+// Puts the fbm and its index (and the checksum table) on top of the arena, marking the meta blocks in use
+//  and checksumming the all-zero data blocks if the device is brand new
+static bool block_store_attach_fbm(block_store_t *const bs, const bool fresh){
+	(*bs).fbm = bitmap_overlay((*bs).block_count, block_store_block(bs, 0)); // The Free Block Map is stored in the device itself
+	if((*bs).fbm == NULL){
+		return false;
+	}
+	if((*bs).flags & BS_FLAG_CHECKSUM){
+		(*bs).checksums = block_store_block(bs, fbm_blocks((*bs).block_size, (*bs).block_count));
+	}
+	if(fresh){
+		for(size_t i = 0; i < (*bs).meta_blocks; ++i){
+			bitmap_set((*bs).fbm, i); // The blocks holding the Free Block Map are always in use (always set)
+		}
+		if((*bs).checksums != NULL){
+			void *const zeros = calloc(1, (*bs).block_size);
+			if(zeros == NULL){
+				return false;
+			}
+			const uint32_t crc = crc32c(zeros, (*bs).block_size);
+			free(zeros);
+			for(size_t i = 0; i < (*bs).block_count; ++i){
+				memcpy((*bs).checksums + i * sizeof(crc), &crc, sizeof(crc));
+			}
+		}
+	}
+	(*bs).fbm_index = hbitmap_create((*bs).fbm);
+	if((*bs).fbm_index == NULL){
+		return false;
+	}
+	block_store_reload_fbm(bs);
+	return true;
+}
+
+/// This creates a new BS device with the given geometry
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to a new block storage device, NULL on error
+//
+block_store_t *block_store_create_ex(const size_t block_size, const size_t block_count, const unsigned flags){
+	block_store_t *bs = block_store_prepare(block_size, block_count, flags);
+	if(bs == NULL){
+		return NULL;
+	}
+	// aligned_alloc wants a multiple of the alignment, a deduplicated device keeps only its meta blocks in the arena
+	const size_t arena_blocks = (flags & BS_FLAG_DEDUP) ? (*bs).meta_blocks : block_count;
+	if(flags & (BS_FLAG_HUGEPAGES | BS_FLAG_NUMA_INTERLEAVE | BS_FLAG_NUMA_PARTITION)){
+		if(!block_store_arena_map(bs, block_size * arena_blocks)){ // Zeroed already, and left untouched until placed
+			block_store_destroy(bs);
+			return NULL;
+		}
+	} else {
+		(*bs).arena_bytes = (block_size * arena_blocks + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+		(*bs).arena = aligned_alloc(ARENA_ALIGNMENT, (*bs).arena_bytes); // One allocation holds the data of every block
+		if((*bs).arena == NULL){
+			block_store_destroy(bs);
+			return NULL;
+		}
+		memset((*bs).arena, 0, (*bs).arena_bytes);
+	}
+	if((flags & BS_FLAG_DEDUP) && ((*bs).dedup = block_dedup_create(block_size, block_count)) == NULL){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	if(!block_store_attach_fbm(bs, true)){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bitmap_format((*bs).dirty, 0xFF); // Nothing has ever been flushed, so all of it is news to any file
+	return bs;
+}
+
+/// Opens the device image in the given file by mapping it into memory - blocks are read and written in place
+///  (the file is created if it doesn't exist)
+/// \param filename The device image
+/// \return Pointer to the BS device, NULL on error
+//
+block_store_t *block_store_open_mmap(const char *const filename){
+	return block_store_open_mmap_ex(filename, BLOCK_SIZE_BYTES, BLOCK_COUNT, BS_FLAG_NONE);
+}
+
+/// Opens the device image with the given geometry by mapping it into memory
+///  (the file is created if it doesn't exist, an existing one has to match the geometry exactly)
+/// \param filename The device image
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to the BS device, NULL on error
+//
+block_store_t *block_store_open_mmap_ex(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags){
+	if(filename == NULL || (flags & BS_FLAGS_HEAP_ONLY)){ // The file is the storage, there's no sharing it out or placing it
+		return NULL;
+	}
+	block_store_t *bs = block_store_prepare(block_size, block_count, flags);
+	if(bs == NULL){
+		return NULL;
+	}
+	const size_t image_bytes = block_size * block_count;
+	(*bs).fd = open(filename, O_RDWR | O_CREAT, 0666);
+	struct stat st;
+	if((*bs).fd < 0 || fstat((*bs).fd, &st) != 0){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	const bool fresh = (st.st_size == 0);
+	if((fresh && ftruncate((*bs).fd, (off_t)image_bytes) != 0) || (!fresh && (uintmax_t)st.st_size != image_bytes)){
+		block_store_destroy(bs); // Couldn't grow a new file, or an existing one has some other geometry
+		return NULL;
+	}
+	// Nothing is read here, pages come in as blocks get touched
+	void *map = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, (*bs).fd, 0);
+	if(map == MAP_FAILED){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	(*bs).arena = map;
+	(*bs).arena_bytes = image_bytes;
+	if(flags & BS_FLAG_HUGEPAGES){
+		madvise(map, image_bytes, MADV_HUGEPAGE); // Only some filesystems can, the rest carry on with small pages
+	}
+	if(!block_store_attach_fbm(bs, fresh)){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+/// Opens the device image with the given geometry, keeping at most cache_bytes of its data blocks in memory
+/// \param filename The device image
+/// \param block_size Bytes per block
+/// \param block_count Total number of blocks, including the ones the free block map lives in
+/// \param cache_bytes Memory for cached blocks, rounded down to whole blocks (at least one)
+/// \param flags BS_FLAGS to apply
+/// \return Pointer to the BS device, NULL on error
+//
+block_store_t *block_store_open_cached(const char *const filename, const size_t block_size, const size_t block_count, const size_t cache_bytes, const unsigned flags){
+	if(filename == NULL || (flags & BS_FLAGS_HEAP_ONLY)){
+		return NULL;
+	}
+	block_store_t *bs = block_store_prepare(block_size, block_count, flags);
+	if(bs == NULL){
+		return NULL;
+	}
+	const size_t image_bytes = block_size * block_count;
+	(*bs).fd = open(filename, O_RDWR | O_CREAT, 0666);
+	struct stat st;
+	if((*bs).fd < 0 || fstat((*bs).fd, &st) != 0){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	const bool fresh = (st.st_size == 0);
+	if((fresh && ftruncate((*bs).fd, (off_t)image_bytes) != 0) || (!fresh && (uintmax_t)st.st_size != image_bytes)){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	// First, so from here on destroy knows the arena isn't a mapping
+	size_t frames = cache_bytes / block_size; // No point in more frames than there are data blocks
+	frames = frames == 0 ? 1 : (frames > block_count - (*bs).meta_blocks ? block_count - (*bs).meta_blocks : frames);
+	(*bs).cache = block_cache_create((*bs).fd, block_size, frames);
+	if((*bs).cache == NULL){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	// A quarter of the cache at most, the window and the half of it being read have to fit with room to spare
+	(*bs).readahead_max = frames / 4 < (*bs).readahead_max ? (frames / 4 ? frames / 4 : 1) : (*bs).readahead_max;
+	(*bs).readahead_window = (*bs).readahead_window < (*bs).readahead_max ? (*bs).readahead_window : (*bs).readahead_max;
+	// Only the meta blocks stay in memory, the fbm is overlaid on them the same as on any other device
+	const size_t meta_bytes = (*bs).meta_blocks * block_size;
+	(*bs).arena_bytes = (meta_bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	(*bs).arena = aligned_alloc(ARENA_ALIGNMENT, (*bs).arena_bytes);
+	if((*bs).arena == NULL){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	memset((*bs).arena, 0, (*bs).arena_bytes);
+	if(!fresh && !block_store_pread_all((*bs).fd, (*bs).arena, meta_bytes, 0)){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	if(!block_store_attach_fbm(bs, fresh)){
+		block_store_destroy(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+/// Reads the counters of a cached device's block cache
+/// \param bs BS device
+/// \param stats Where to put them
+/// \return boolean indicating success, false if the device isn't a cached one
+//
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats){
+	if(bs == NULL || stats == NULL || (*bs).cache == NULL){
+		return false;
+	}
+	block_cache_stats((*bs).cache, stats);
+	return true;
+}
+
+/// Reads the counters of a deduplicated device
+/// \param bs BS device
+/// \param stats Where to put them
+/// \return boolean indicating success, false if the device isn't a BS_FLAG_DEDUP one
+//
+bool block_store_get_dedup_stats(const block_store_t *const bs, block_store_dedup_stats_t *const stats){
+	if(bs == NULL || stats == NULL || (*bs).dedup == NULL){
+		return false;
+	}
+	block_dedup_stats((*bs).dedup, stats);
+	(*stats).zero_blocks -= (*bs).meta_blocks; // The store has them too, they just never get written there
+	return true;
+}
+
+/// Takes a read-only snapshot of the device as it is right now, sharing its blocks
+///  A block is only copied into the snapshot when the device writes over it, and writers are
+///  only held up while the meta blocks are copied (allocations racing with that may or may not make it in)
+/// \param bs BS device, not a snapshot itself
+/// \return Pointer to the snapshot, NULL on error
+//
+block_store_t *block_store_snapshot(block_store_t *const bs){
+	if(bs == NULL || block_store_read_only(bs)){
+		return NULL;
+	}
+	block_store_t *const snapshot = block_store_prepare((*bs).block_size, (*bs).block_count, (*bs).flags & (BS_FLAG_CHECKSUM | BS_FLAG_STATS));
+	if(snapshot == NULL){
+		return NULL;
+	}
+	// Room for every block, though only the meta blocks and what gets copied later ever take memory
+	//  (an allocation this big comes straight from the kernel, pages nobody touches stay unbacked)
+	(*snapshot).arena_bytes = ((*bs).block_size * (*bs).block_count + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	(*snapshot).arena = aligned_alloc(ARENA_ALIGNMENT, (*snapshot).arena_bytes);
+	(*snapshot).shared = bitmap_create((*bs).block_count);
+	if((*snapshot).arena == NULL || (*snapshot).shared == NULL){
+		block_store_destroy(snapshot);
+		return NULL;
+	}
+	bitmap_set_range((*snapshot).shared, (*bs).meta_blocks, (*bs).block_count - (*bs).meta_blocks);
+	if((*bs).has_magazines){
+		magazine_drain_all(bs); // Reserved blocks are free as far as the snapshot is concerned
+	}
+	pthread_mutex_lock(&(*bs).snapshots_lock);
+	block_store_lock_all(bs); // Writers wait until the snapshot has its meta blocks and is on the list
+	memcpy((*snapshot).arena, (*bs).arena, (*bs).meta_blocks * (*bs).block_size);
+	block_store_snapshot_attach(snapshot, bs);
+	block_store_unlock_all(bs);
+	pthread_mutex_unlock(&(*bs).snapshots_lock);
+	if(!block_store_attach_fbm(snapshot, false)){
+		block_store_destroy(snapshot);
+		return NULL;
+	}
+	bitmap_format((*snapshot).dirty, 0xFF); // Never been flushed anywhere
+	return snapshot;
+}
+
+// Writes a cached device's changed blocks and its whole fbm to its file
+static bool block_store_write_back(const block_store_t *const bs){
+	return block_cache_writeback((*bs).cache) && block_store_pwrite_all((*bs).fd, (*bs).arena, (*bs).meta_blocks * (*bs).block_size, 0);
+}
+
+/// Flushes the changes made to a memory mapped or cached device out to its file
+/// \param bs BS device
+/// \param async Only schedule the writeback instead of waiting for it to finish
+/// \return boolean indicating success, false if the device has no backing file
+//
+bool block_store_sync(block_store_t *const bs, const bool async){
+	if(bs == NULL || (*bs).fd < 0){
+		return false;
+	}
+	if((*bs).has_magazines){
+		magazine_drain_all(bs); // So the file doesn't have cached blocks marked in use
+	}
+	if((*bs).cache != NULL){
+		// Plain writes, so async only gets out of waiting for the disk
+		return block_store_write_back(bs) && (async || fsync((*bs).fd) == 0);
+	}
+	return msync((*bs).arena, (*bs).arena_bytes, async ? MS_ASYNC : MS_SYNC) == 0;
+}
+
+/// Destroys the provided block storage device
+/// This is an idempotent operation, so there is no return value
+/// \param bs BS device
+//
+void block_store_destroy(block_store_t *const bs){
 	if(bs == NULL){
+		return;
+	}
+#ifndef NDEBUG
+	for(size_t i = 0; (*bs).pins != NULL && i < (*bs).block_count; ++i){
+		assert((*bs).pins[i] == 0 && "block_store_destroy with blocks still pinned");
+	}
+	free((*bs).pins);
+#endif
+	block_store_aio_release(bs); // Outstanding requests still point into the device
+	block_store_journal_release(bs); // After that, so what they wrote gets checkpointed too
+	block_store_snapshot_release(bs); // While the blocks snapshots share are still here
+	pthread_mutex_destroy(&(*bs).aio_lock);
+	pthread_mutex_destroy(&(*bs).snapshots_lock);
+	pthread_mutex_destroy(&(*bs).readahead_lock);
+	if((*bs).has_magazines){
+		// Threads still holding a magazine lose it here, deleting the key means their exit hook won't run
+		pthread_key_delete((*bs).magazine_key);
+		while((*bs).magazines != NULL){
+			magazine_retire((*bs).magazines); // Back into the fbm, which matters for a mapped device
+		}
+		pthread_mutex_destroy(&(*bs).magazines_lock);
+	}
+	free((*bs).cached_ids);
+	block_store_stats_release(bs); // Same deal as the magazines, threads that still have counters lose them
+	if((*bs).cache != NULL && (*bs).fbm != NULL){
+		block_store_write_back(bs); // Nothing to report a failure to, the file keeps whatever made it out
+	}
+	if((*bs).stripes != NULL){
+		for(size_t i = 0; i < STRIPE_COUNT; ++i){
+			pthread_rwlock_destroy(&(*bs).stripes[i]);
+		}
+		free((*bs).stripes);
+	}
+	hbitmap_destroy((*bs).fbm_index);
+	bitmap_destroy((*bs).fbm); // Overlay, so this leaves the arena alone
+	bitmap_destroy((*bs).dirty);
+	if((*bs).cache != NULL || (*bs).fd < 0){
+		block_cache_destroy((*bs).cache);
+		block_dedup_destroy((*bs).dedup);
+		if((*bs).arena_mapped){
+			block_store_arena_unmap(bs);
+		} else {
+			free((*bs).arena); // Heap either way, a cached or deduplicated device only allocates its meta blocks
+		}
+		if((*bs).fd >= 0){
+			close((*bs).fd);
+		}
+	} else {
+		if((*bs).arena != NULL){
+			munmap((*bs).arena, (*bs).arena_bytes); // The page cache still has everything, no need to msync first
+		}
+		close((*bs).fd);
+	}
+	free(bs);
+}
+
+//
+///
+// ALLOCATION POLICIES
+///
+//
+
+// First bit at or after from that's set (or clear) in a concurrent device's fbm, SIZE_MAX if there isn't one
+//  Bits past the last block read as set
+static size_t fbm_scan_concurrent(const block_store_t *const bs, const size_t from, const bool set){
+	const size_t words = ((*bs).block_count + 63) >> 6;
+	for(size_t word = from >> 6; word < words; ++word){
+		uint64_t value = set ? fbm_load(bs, word) : ~fbm_load(bs, word);
+		if(word == from >> 6){
+			value &= ~UINT64_C(0) << (from & 63);
+		}
+		if(value){
+			return (word << 6) + (size_t)__builtin_ctzll(value);
+		}
+	}
+	return SIZE_MAX;
+}
+
+// The first run of free blocks at or after from, SIZE_MAX if there isn't one (length gets how long it is)
+static size_t fbm_next_run(const block_store_t *const bs, const size_t from, size_t *const length){
+	if(from >= (*bs).block_count){
+		return SIZE_MAX;
+	}
+	size_t start, end;
+	if((*bs).stripes != NULL){
+		start = fbm_scan_concurrent(bs, from, false);
+		end = start == SIZE_MAX ? SIZE_MAX : fbm_scan_concurrent(bs, start, true);
+	} else {
+		start = hbitmap_ffz_from((*bs).fbm_index, from);
+		end = start == SIZE_MAX ? SIZE_MAX : bitmap_ffs_from((*bs).fbm, start);
+	}
+	if(start == SIZE_MAX || start >= (*bs).block_count){
+		return SIZE_MAX;
+	}
+	*length = (end == SIZE_MAX || end > (*bs).block_count ? (*bs).block_count : end) - start;
+	return start;
+}
+
+// Where n free blocks in a row are: the first run long enough at or after from (wrapping around to the first
+//  data block), or with best the shortest one that fits. SIZE_MAX if no run is long enough
+//  Best fit has to look at every free extent, first fit stops at the first one that will do
+static size_t fbm_place(const block_store_t *const bs, const size_t n, const size_t from, const bool best){
+	const size_t origin = from < (*bs).meta_blocks || from >= (*bs).block_count ? (*bs).meta_blocks : from;
+	size_t choice = SIZE_MAX, choice_length = SIZE_MAX, stop = SIZE_MAX, length = 0;
+	bool wrapped = origin == (*bs).meta_blocks; // Starting at the front, one pass covers everything
+	for(size_t at = origin;;){
+		const size_t start = fbm_next_run(bs, at, &length);
+		if(start == SIZE_MAX && !wrapped){
+			wrapped = true;
+			stop = origin; // Everything from there on has been looked at
+			at = (*bs).meta_blocks;
+			continue;
+		}
+		if(start == SIZE_MAX || start >= stop){
+			break;
+		}
+		if(length >= n && length < choice_length){
+			choice = start;
+			choice_length = length;
+			if(!best || length == n){
+				break;
+			}
+		}
+		at = start + length;
+	}
+	return choice;
+}
+
+// Claims n blocks in a row where fbm_place puts them, without journaling it, SIZE_MAX if there's no room
+static size_t fbm_allocate_placed(block_store_t *const bs, const size_t n, const size_t from, const bool best){
+	if(n == 0 || n > (*bs).block_count){
+		return SIZE_MAX;
+	}
+	for(;;){
+		const size_t first = fbm_place(bs, n, from, best);
+		if(first == SIZE_MAX){
+			return SIZE_MAX;
+		}
+		if((*bs).stripes == NULL){
+			hbitmap_set_range((*bs).fbm_index, first, n);
+			block_store_dirty_fbm(bs, first, n);
+			(*bs).used_blocks += n;
+			return first;
+		}
+		if(fbm_claim_range_concurrent(bs, first, n)){
+			return first;
+		}
+		// Lost the race for part of it, look again with the new state of the map
+	}
+}
+
+// fbm_allocate_placed from the next fit cursor, which moves on past whatever gets allocated
+static size_t fbm_allocate_next_fit(block_store_t *const bs, const size_t n){
+	const size_t first = fbm_allocate_placed(bs, n, __atomic_load_n(&(*bs).next_fit, __ATOMIC_RELAXED), false);
+	if(first != SIZE_MAX){
+		__atomic_store_n(&(*bs).next_fit, first + n, __ATOMIC_RELAXED); // Racing threads can move it back a little, it's only where searches start
+	}
+	return first;
+}
+
+// Searches for a free block, marks it as in use, and returns the block's id, without journaling it
+static size_t fbm_allocate(block_store_t *const bs){
+	if(bs == NULL){
+		return SIZE_MAX;
+	}
+	if((*bs).has_magazines){
+		return magazine_allocate(bs);
+	}
+	if(__atomic_load_n(&(*bs).policy, __ATOMIC_RELAXED) == BS_POLICY_NEXT_FIT){
+		return fbm_allocate_next_fit(bs, 1);
+	}
+	if((*bs).stripes != NULL){
+		return fbm_allocate_concurrent(bs);
+	}
+	size_t i = hbitmap_ffz((*bs).fbm_index); // One word probe per summary level, however full the device is
+	if(i == SIZE_MAX || i >= (*bs).block_count) {
+		return SIZE_MAX;
+	}
+	hbitmap_set((*bs).fbm_index, i);
+	block_store_dirty_fbm(bs, i, 1);
+	++(*bs).used_blocks;
+	return i;		
+}
+
+/// Searches for a free block, marks it as in use, and returns the block's id
+// \param bs BS device
+// \return Allocated block's id, SIZE_MAX on error
+//
+size_t block_store_allocate(block_store_t *const bs){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t block_id = block_store_read_only(bs) ? SIZE_MAX : fbm_allocate(bs);
+	if(block_id != SIZE_MAX && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, true, block_id, 1);
+	}
+	block_store_stats_end(bs, BS_OP_ALLOCATE, started, block_id != SIZE_MAX, 0);
+	return block_id;
+}
+
+// Attempts to allocate the requested block id, without journaling it
+static bool fbm_request(block_store_t *const bs, const size_t block_id){
+	if(bs != NULL && (*bs).stripes != NULL){
+		if(block_id < (*bs).meta_blocks || block_id >= (*bs).block_count){
+			return false;
+		}
+		if(fbm_claim_range_concurrent(bs, block_id, 1)){
+			return true;
+		}
+		if(!(*bs).has_magazines){
+			return false;
+		}
+		magazine_drain_all(bs); // It might only be sitting in a magazine
+		return fbm_claim_range_concurrent(bs, block_id, 1);
+	}
+	if(bs != NULL && block_id >= (*bs).meta_blocks && block_id < (*bs).block_count && !bitmap_test((*bs).fbm, block_id)){
+	   	hbitmap_set((*bs).fbm_index, block_id);
+		block_store_dirty_fbm(bs, block_id, 1);
+		++(*bs).used_blocks;
+		return true;
+	}
+	return false;
+}
+
+// Attempts to allocate the requested block id
+// \param bs the block store object
+// \block_id the requested block identifier
+// \return boolean indicating succes of operation
+//
+bool block_store_request(block_store_t *const bs, const size_t block_id){
+	const uint64_t started = block_store_stats_start(bs);
+	const bool claimed = !block_store_read_only(bs) && fbm_request(bs, block_id);
+	if(claimed && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, true, block_id, 1);
+	}
+	block_store_stats_end(bs, BS_OP_REQUEST, started, claimed, 0);
+	return claimed;
+}
+
+// Frees the specified block, without journaling it
+static void fbm_release(block_store_t *const bs, const size_t block_id){
+	if(bs != NULL && (*bs).stripes != NULL){
+		if(block_id >= (*bs).meta_blocks && block_id < (*bs).block_count){
+			if((*bs).has_magazines){
+				magazine_release(bs, block_id);
+			} else {
+				fbm_unclaim(bs, block_id >> 6, UINT64_C(1) << (block_id & 63));
+			}
+		}
+		return;
+	}
+	if(bs != NULL && block_id >= (*bs).meta_blocks && block_id < (*bs).block_count && bitmap_test((*bs).fbm, block_id)){
+		hbitmap_reset((*bs).fbm_index, block_id);
+		block_store_dirty_fbm(bs, block_id, 1);
+		--(*bs).used_blocks;
+	}
+	return;	
+}
+
+// Frees the specified block
+// \param bs BS device
+// \param block_id The block to free
+//
+void block_store_release(block_store_t *const bs, const size_t block_id){
+	if(bs == NULL){
+		return;
+	}
+	const uint64_t started = block_store_stats_start(bs);
+	const bool valid = !block_store_read_only(bs) && block_id >= (*bs).meta_blocks && block_id < (*bs).block_count;
+	// Journaled before the bit clears, so a thread allocating the block right after can't get its record in first
+	if(valid && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, false, block_id, 1); // Free already or not, replaying it is harmless
+	}
+	if(valid){
+		fbm_release(bs, block_id);
+	}
+	block_store_stats_end(bs, BS_OP_RELEASE, started, valid, 0);
+}
+
+// Searches for n contiguous free blocks and marks them in use, without journaling it
+static bool fbm_allocate_range(block_store_t *const bs, const size_t n, size_t *const first){
+	if(bs == NULL || first == NULL || n == 0){
+		return false;
+	}
+	const unsigned policy = __atomic_load_n(&(*bs).policy, __ATOMIC_RELAXED);
+	if(policy != BS_POLICY_FIRST_FIT){
+		*first = policy == BS_POLICY_NEXT_FIT ? fbm_allocate_next_fit(bs, n) : fbm_allocate_placed(bs, n, (*bs).meta_blocks, true);
+		return *first != SIZE_MAX;
+	}
+	if((*bs).stripes != NULL){
+		*first = n <= (*bs).block_count ? fbm_allocate_range_concurrent(bs, n) : SIZE_MAX;
+		return *first != SIZE_MAX;
+	}
+	size_t i = hbitmap_ffz_run((*bs).fbm_index, (*bs).meta_blocks, n);
+	if(i == SIZE_MAX){
+		return false;
+	}
+	hbitmap_set_range((*bs).fbm_index, i, n);
+	block_store_dirty_fbm(bs, i, n);
+	(*bs).used_blocks += n;
+	*first = i;
+	return true;
+}
+
+// Searches for n contiguous free blocks, marks them all as in use, and returns the first block's id
+// \param bs BS device
+// \param n The number of blocks wanted
+// \param first Where to put the id of the first block of the extent
+// \return boolean indicating success of operation
+//
+bool block_store_allocate_range(block_store_t *const bs, const size_t n, size_t *const first){
+	const uint64_t started = block_store_stats_start(bs);
+	const bool claimed = !block_store_read_only(bs) && fbm_allocate_range(bs, n, first);
+	if(claimed && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, true, *first, n);
+	}
+	block_store_stats_end(bs, BS_OP_ALLOCATE, started, claimed, 0);
+	return claimed;
+}
+
+// Frees every block in the given extent, without journaling it
+static void fbm_release_range(block_store_t *const bs, const size_t first, const size_t n){
+	if(bs != NULL && n > 0 && first >= (*bs).meta_blocks && first < (*bs).block_count && n <= (*bs).block_count - first){
+		if((*bs).stripes != NULL){
+			const size_t last = first + n - 1;
+			for(size_t word = first >> 6; word <= last >> 6; ++word){
+				const uint64_t head = word == (first >> 6) ? ~UINT64_C(0) << (first & 63) : ~UINT64_C(0);
+				const uint64_t tail = word == (last >> 6) ? ~UINT64_C(0) >> (63 - (last & 63)) : ~UINT64_C(0);
+				fbm_unclaim(bs, word, head & tail);
+			}
+			return;
+		}
+		(*bs).used_blocks -= bitmap_count_range((*bs).fbm, first, n);
+		hbitmap_reset_range((*bs).fbm_index, first, n);
+		block_store_dirty_fbm(bs, first, n);
+	}
+}
+
+// Frees every block in the given extent (blocks that were already free are left alone)
+// \param bs BS device
+// \param first The first block to free
+// \param n The number of blocks to free
+//
+void block_store_release_range(block_store_t *const bs, const size_t first, const size_t n){
+	if(bs == NULL){
+		return;
+	}
+	const uint64_t started = block_store_stats_start(bs);
+	const bool valid = !block_store_read_only(bs) && n > 0 && first >= (*bs).meta_blocks && first < (*bs).block_count && n <= (*bs).block_count - first;
+	if(valid && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, false, first, n); // Before the bits clear, same as block_store_release
+	}
+	if(valid){
+		fbm_release_range(bs, first, n);
+	}
+	block_store_stats_end(bs, BS_OP_RELEASE, started, valid, 0);
+}
+
+// Picks how the device looks for free blocks from now on
+// \param bs BS device
+// \param policy A BS_POLICY
+// \return boolean indicating success, false for an unknown policy
+//
+bool block_store_set_policy(block_store_t *const bs, const unsigned policy){
+	if(bs == NULL || policy > BS_POLICY_BEST_FIT){
+		return false;
+	}
+	__atomic_store_n(&(*bs).policy, policy, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Allocates the first free block at or after hint, wrapping around to the start of the device
+// \param bs BS device
+// \param hint Where to start looking
+// \return Allocated block's id, SIZE_MAX on error
+//
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint){
+	const uint64_t started = block_store_stats_start(bs);
+	const bool writable = bs != NULL && !block_store_read_only(bs);
+	size_t block_id = writable ? fbm_allocate_placed(bs, 1, hint, false) : SIZE_MAX;
+	if(block_id == SIZE_MAX && writable && (*bs).has_magazines){
+		magazine_drain_all(bs); // What's left might be sitting in magazines
+		block_id = fbm_allocate_placed(bs, 1, hint, false);
+	}
+	if(block_id != SIZE_MAX && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, true, block_id, 1);
+	}
+	block_store_stats_end(bs, BS_OP_ALLOCATE, started, block_id != SIZE_MAX, 0);
+	return block_id;
+}
+
+// Allocates the first n contiguous free blocks at or after hint, wrapping around to the start of the device
+// \param bs BS device
+// \param n The number of blocks wanted
+// \param hint Where to start looking
+// \param first Where to put the id of the first block of the extent
+// \return boolean indicating success of operation
+//
+bool block_store_allocate_range_near(block_store_t *const bs, const size_t n, const size_t hint, size_t *const first){
+	const uint64_t started = block_store_stats_start(bs);
+	const bool claimed = bs != NULL && first != NULL && !block_store_read_only(bs) && (*first = fbm_allocate_placed(bs, n, hint, false)) != SIZE_MAX;
+	if(claimed && (*bs).journal != NULL){
+		block_store_journal_fbm(bs, true, *first, n);
+	}
+	block_store_stats_end(bs, BS_OP_ALLOCATE, started, claimed, 0);
+	return claimed;
+}
+
+// Counts the number of blocks marked as in use
+// \param bs BS device
+// \return Total blocks in use, SIZE_MAX on error
+//
+size_t block_store_get_used_blocks(const block_store_t *const bs){
+	if(bs == NULL){
+		return SIZE_MAX;
+	}
+	// Kept up to date by allocate/request/release, no need to walk the fbm
+	//  Magazine blocks are set there but nobody's using them, each magazine counts its own so the fast path
+	//  stays off shared counters. A block only joins a magazine after the used count took it and leaves
+	//  before the count drops, so summing first keeps the sum below the count unless blocks move mid-walk
+	size_t cached = 0;
+	if((*bs).has_magazines){
+		block_store_t *const mutable_bs = (block_store_t *)bs; // Just the locks
+		pthread_mutex_lock(&(*mutable_bs).magazines_lock);
+		for(magazine_t *magazine = (*bs).magazines; magazine != NULL; magazine = (*magazine).next){
+			pthread_mutex_lock(&(*magazine).lock);
+			cached += (*magazine).count;
+			pthread_mutex_unlock(&(*magazine).lock);
+		}
+		pthread_mutex_unlock(&(*mutable_bs).magazines_lock);
+	}
+	const size_t used = __atomic_load_n(&(*bs).used_blocks, __ATOMIC_SEQ_CST);
+	return used > cached ? used - cached : 0;
+}
+
+// Counts the number of blocks marked free for use
+// \param bs BS device
+// \return Total blocks free, SIZE_MAX on error
+//
+size_t block_store_get_free_blocks(const block_store_t *const bs){
+	size_t ub = block_store_get_used_blocks(bs);
+	if(ub == SIZE_MAX){
+		return SIZE_MAX;
+	}	
+	return ((*bs).block_count - (*bs).meta_blocks) - ub;
+}
+
+// Returns the total number of user-addressable blocks
+//  (since this is constant, you don't even need the bs object)
+// \return Total blocks
+//
+size_t block_store_get_total_blocks(){
+	return BLOCK_COUNT - 1;
+}
+
+// Returns the total number of user-addressable blocks of the given device
+// \param bs BS device
+// \return Total blocks, SIZE_MAX on error
+//
+size_t block_store_get_capacity(const block_store_t *const bs){
+	if(bs == NULL){
+		return SIZE_MAX;
+	}
+	return (*bs).block_count - (*bs).meta_blocks;
+}
+
+// Returns the size of every block of the given device
+// \param bs BS device
+// \return Bytes per block, 0 on error
+//
+size_t block_store_get_block_size(const block_store_t *const bs){
+	if(bs == NULL){
+		return 0;
+	}
+	return (*bs).block_size;
+}
+
+// Copies bytes into a block and marks it dirty, the block_store_copy_out counterpart
+//  (snapshots still sharing the block get what it held first)
+static inline bool block_store_copy_in(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *const buffer){
+	if((*bs).snapshots != NULL && !block_store_snapshot_preserve(bs, block_id)){
+		return false;
+	}
+	if((*bs).cache != NULL && block_id >= (*bs).meta_blocks){
+		if(!block_cache_write((*bs).cache, block_id, offset, len, buffer)){
+			return false;
+		}
+	} else if((*bs).dedup != NULL && block_id >= (*bs).meta_blocks){
+		if(!block_dedup_write((*bs).dedup, block_id, offset, len, buffer)){
+			return false;
+		}
+	} else {
+		memcpy(block_store_block(bs, block_id) + offset, buffer, len); // Overwrite the block in place, no allocation
+	}
+	bitmap_set((*bs).dirty, block_id); // The stripe lock covers this block's whole dirty byte
+	return true;
+}
+
+// Brings a block's checksum up to date after a write, data being everything the block holds now
+//  (callers hold the block's lock, the journal gets the new checksum right after the write)
+static void block_store_update_checksum(block_store_t *const bs, const size_t block_id, const void *const data){
+	if((*bs).checksums == NULL || block_id < (*bs).meta_blocks){
+		return;
+	}
+	const uint32_t crc = crc32c(data, (*bs).block_size);
+	block_store_set_checksum(bs, block_id, crc);
+	if((*bs).journal != NULL){
+		block_store_journal_checksum(bs, block_id, crc);
+	}
+}
+
+// block_store_update_checksum for a write that only changed part of the block, rereads the rest of it
+static bool block_store_rechecksum(block_store_t *const bs, const size_t block_id){
+	if((*bs).checksums == NULL || block_id < (*bs).meta_blocks){
+		return true;
+	}
+	if((*bs).dedup != NULL){
+		block_store_update_checksum(bs, block_id, block_dedup_data((*bs).dedup, block_id));
+		return true;
+	}
+	if((*bs).cache == NULL){
+		block_store_update_checksum(bs, block_id, block_store_block(bs, block_id));
+		return true;
+	}
+	const void *const data = block_cache_pin((*bs).cache, block_id); // Just written, so it's in the cache
+	if(data == NULL){
+		return false;
+	}
+	block_store_update_checksum(bs, block_id, data);
+	block_cache_unpin((*bs).cache, block_id);
+	return true;
+}
+
+// Gets blocks [first, first + count) of a mapped or cached device on their way into memory
+static void block_store_prefetch(const block_store_t *const bs, size_t first, const size_t count){
+	const size_t end = first + count;
+	if((*bs).cache != NULL){
+		first = first < (*bs).meta_blocks ? (*bs).meta_blocks : first; // Those are in the arena for good
+		if(first < end){
+			block_cache_prefetch((*bs).cache, first, end - first);
+		}
+		return;
+	}
+	// The kernel wants whole pages, the mapping starts on one
+	const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	const uintptr_t from = (uintptr_t)block_store_block(bs, first) & ~(page - 1), to = (uintptr_t)block_store_block(bs, end);
+	posix_madvise((void *)from, to - from, POSIX_MADV_WILLNEED);
+}
+
+// Keeps prefetching ahead of a reader going through the blocks in order, on devices with a file behind them
+//  The window doubles each time the reader gets halfway into what was prefetched for it, and halves when it
+//  goes elsewhere before using it up (or a cached device had to evict read-ahead nobody asked for)
+static void block_store_readahead(block_store_t *const bs, const size_t block_id){
+	if(pthread_mutex_trylock(&(*bs).readahead_lock) != 0){
+		return; // Someone else's read is at it, not worth holding this one up for
+	}
+	const size_t max_window = (*bs).readahead_max, min_window = READAHEAD_MIN < max_window ? READAHEAD_MIN : max_window;
+	size_t window = (*bs).readahead_window;
+	if(block_id != (*bs).readahead_next){
+		if((*bs).readahead_end > (*bs).readahead_next){ // Part of the window went unread
+			window = window / 2 > min_window ? window / 2 : min_window;
+		}
+		(*bs).readahead_end = (*bs).readahead_mark = 0;
+	} else if(block_id >= (*bs).readahead_mark){
+		bool wasted = false;
+		if((*bs).cache != NULL){
+			block_store_cache_stats_t stats;
+			block_cache_stats((*bs).cache, &stats);
+			wasted = stats.readahead_wasted != (*bs).readahead_wasted;
+			(*bs).readahead_wasted = stats.readahead_wasted;
+		}
+		if((*bs).readahead_end != 0){ // The reader made it into the last window
+			window = wasted ? (window / 2 > min_window ? window / 2 : min_window) : (window * 2 < max_window ? window * 2 : max_window);
+		}
+		const size_t from = (*bs).readahead_end > block_id + 1 ? (*bs).readahead_end : block_id + 1;
+		const size_t to = (*bs).block_count - block_id - 1 > window ? block_id + 1 + window : (*bs).block_count;
+		if(from < to){
+			block_store_prefetch(bs, from, to - from);
+		}
+		(*bs).readahead_end = to;
+		(*bs).readahead_mark = to - window / 2;
+	}
+	(*bs).readahead_window = window;
+	(*bs).readahead_next = block_id + 1;
+	pthread_mutex_unlock(&(*bs).readahead_lock);
+}
+
+// block_store_read, untimed
+static size_t device_read(const block_store_t *const bs, const size_t block_id, void *buffer){
+	if(bs == NULL || buffer == NULL || block_id >= (*bs).block_count){
+		return 0;
+	}
+	block_store_lock_read(bs, block_id);
+	bool ok = block_store_copy_out(bs, block_id, buffer); // Copy the data from the specified block to the buffer
+	const bool intact = !ok || block_store_verify(bs, block_id, buffer);
+	block_store_unlock(bs, block_id);
+	if(!intact){
+		errno = EBADMSG;
+		ok = false;
+	}
+	if(ok && (*bs).fd >= 0){
+		block_store_readahead((block_store_t *)bs, block_id); // Only the bookkeeping changes, not the device
+	}
+	
+	return ok ? (*bs).block_size : 0;
+}
+
+// Reads data from the specified block and writes it to the designated buffer
+// \param bs BS device
+// \param block_id Source block id
+// \param buffer Data buffer to write to
+// \return Number of bytes read, 0 on error (errno is EBADMSG if the block failed its checksum)
+//
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t bytes = device_read(bs, block_id, buffer);
+	block_store_stats_end(bs, BS_OP_READ, started, bytes != 0, bytes);
+	return bytes;
+}
+
+// One thread's share of a scrub, blocks [first, end)
+typedef struct {
+	const block_store_t *bs;
+	size_t first, end;
+	size_t *bad; // The first max_bad failures in the range
+	size_t max_bad;
+	size_t found; // Every failure in the range
+	bool failed; // Couldn't read a block
+} scrub_range_t;
+
+static void *scrub_range(void *const arg){
+	scrub_range_t *const range = arg;
+	const block_store_t *const bs = (*range).bs;
+	const bool staged = block_store_staged(bs);
+	uint8_t *const buffer = staged ? malloc((*bs).block_size) : NULL;
+	if(staged && buffer == NULL){
+		(*range).failed = true;
+		return NULL;
+	}
+	for(size_t i = (*range).first; i < (*range).end; ++i){
+		block_store_lock_read(bs, i);
+		const void *data = block_store_block(bs, i);
+		bool ok = true;
+		if(staged){
+			ok = block_store_copy_out_direct(bs, i, buffer);
+			data = buffer;
+		}
+		const bool intact = !ok || block_store_verify(bs, i, data);
+		block_store_unlock(bs, i);
+		if(!ok){
+			(*range).failed = true;
+			break;
+		}
+		if(!intact){
+			if((*range).found < (*range).max_bad){
+				(*range).bad[(*range).found] = i;
+			}
+			++(*range).found;
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+// Checks every data block against its checksum, BS_FLAG_CHECKSUM devices only
+//  Threads split the device into ranges, each block is only locked while it's checked
+// \param bs BS device
+// \param threads Number of threads to check with, 0 for one per CPU
+// \param bad_blocks Where to put the ids of the blocks that failed, in ascending order, can be NULL
+// \param max_bad Room in bad_blocks, the rest are only counted
+// \return Number of blocks that failed their checksum, SIZE_MAX on error
+//
+size_t block_store_scrub(const block_store_t *const bs, const unsigned threads, size_t *const bad_blocks, const size_t max_bad){
+	if(bs == NULL || (*bs).checksums == NULL){
+		return SIZE_MAX;
+	}
+	const size_t blocks = (*bs).block_count - (*bs).meta_blocks;
+	size_t count = threads;
+	if(count == 0){
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? (size_t)cpus : 1;
+	}
+	count = count > SCRUB_MAX_THREADS ? SCRUB_MAX_THREADS : count;
+	count = count > blocks ? blocks : count;
+	const size_t keep = bad_blocks != NULL ? max_bad : 0;
+	scrub_range_t ranges[SCRUB_MAX_THREADS];
+	pthread_t workers[SCRUB_MAX_THREADS];
+	bool started[SCRUB_MAX_THREADS];
+	bool ok = true;
+	for(size_t t = 0; t < count; ++t){
+		const size_t share = blocks / count, extra = blocks % count; // The first extra ranges get a block more
+		const size_t first = (*bs).meta_blocks + share * t + (t < extra ? t : extra), end = first + share + (t < extra);
+		const size_t room = keep < end - first ? keep : end - first;
+		ranges[t] = (scrub_range_t){bs, first, end, room > 0 ? malloc(room * sizeof(size_t)) : NULL, room, 0, false};
+		ok = ok && (room == 0 || ranges[t].bad != NULL);
+	}
+	for(size_t t = 0; ok && t < count; ++t){
+		started[t] = t + 1 < count && pthread_create(&workers[t], NULL, scrub_range, &ranges[t]) == 0;
+		if(!started[t]){
+			scrub_range(&ranges[t]); // The last range (or one that couldn't get a thread) runs here
+		}
+	}
+	size_t found = 0, kept = 0;
+	for(size_t t = 0; t < count; ++t){
+		if(ok && started[t]){
+			pthread_join(workers[t], NULL);
+		}
+	}
+	for(size_t t = 0; t < count; ++t){ // Ranges are in order, so their failures are too
+		ok = ok && !ranges[t].failed;
+		for(size_t i = 0; ok && i < ranges[t].found && i < ranges[t].max_bad && kept < keep; ++i){
+			bad_blocks[kept++] = ranges[t].bad[i];
+		}
+		found += ranges[t].found;
+		free(ranges[t].bad);
+	}
+	return ok ? found : SIZE_MAX;
+}
+
+// Borrows a read-only view of the specified block without copying it
+//  The pointer stays valid until the next write to that block
+//  (checksums aren't checked, that's up to block_store_read and block_store_scrub)
+//  (on a cached device only until the next access to any block, pin it to keep it longer)
+//  (no block lock is held, concurrent devices need the caller to keep writers away)
+// \param bs BS device
+// \param block_id Source block id
+// \return Pointer to the block's bytes, NULL on error
+//
+const void *block_store_peek(const block_store_t *const bs, const size_t block_id){
+	if(bs == NULL || block_id >= (*bs).block_count){
+		return NULL;
+	}
+	if((*bs).cache != NULL && block_id >= (*bs).meta_blocks){
+		const void *const data = block_cache_pin((*bs).cache, block_id); // Loaded, and then free to go again
+		if(data != NULL){
+			block_cache_unpin((*bs).cache, block_id);
+		}
+		return data;
+	}
+	if((*bs).dedup != NULL && block_id >= (*bs).meta_blocks){
+		return block_dedup_data((*bs).dedup, block_id); // Stored contents never change, a write points the block elsewhere
+	}
+	if((*bs).shared != NULL && !block_store_snapshot_own((block_store_t *)bs, block_id)){
+		return NULL; // Its origin's copy would change the next time the origin wrote it
+	}
+	return block_store_block(bs, block_id);
+}
+
+// Borrows a read-only view of the specified block until it is unpinned
+// \param bs BS device
+// \param block_id Source block id
+// \return Pointer to the block's bytes, NULL on error
+//
+const void *block_store_pin(block_store_t *const bs, const size_t block_id){
+	if(bs == NULL || block_id >= (*bs).block_count){
 		return NULL;
 	}
-	int i=0;
-	for(; i<256; ++i){
-		if(!((*bs).bmp[i] = bitmap_create(2048))){ // Create a bitmap for every block to represent their data
+	const void *data = block_store_block(bs, block_id);
+	if((*bs).cache != NULL && block_id >= (*bs).meta_blocks){
+		data = block_cache_pin((*bs).cache, block_id); // Stays in its frame until unpinned
+		if(data == NULL){
 			return NULL;
 		}
 	}
-	bitmap_set((*bs).bmp[0], 0); // The first block is used as Free Block Map, and always in use (always set)
-	if(bs == NULL){
+	if((*bs).dedup != NULL && block_id >= (*bs).meta_blocks){
+		data = block_dedup_data((*bs).dedup, block_id);
+	}
+	if((*bs).shared != NULL && !block_store_snapshot_own(bs, block_id)){
 		return NULL;
 	}
-	return bs;
+#ifndef NDEBUG
+	__atomic_add_fetch(&(*bs).pins[block_id], 1, __ATOMIC_RELAXED);
+#endif
+	return data;
 }
 
-/// Destroys the provided block storage device
-/// This is an idempotent operation, so there is no return value
-/// \param bs BS device
+// Releases a view handed out by block_store_pin
+// \param bs BS device
+// \param block_id The pinned block id
 //
-void block_store_destroy(block_store_t *const bs){
-	if(bs == NULL){
+void block_store_unpin(block_store_t *const bs, const size_t block_id){
+	if(bs == NULL || block_id >= (*bs).block_count){
 		return;
 	}
-	int i=0;
-	for(; i<256; ++i){
-		if((*bs).bmp[i] != NULL ){
-			bitmap_destroy((*bs).bmp[i]);
-			(*bs).bmp[i] = NULL;
-		}
-	}	
-	free(bs);
+#ifndef NDEBUG
+	assert(__atomic_load_n(&(*bs).pins[block_id], __ATOMIC_RELAXED) > 0 && "block_store_unpin without a matching block_store_pin");
+	__atomic_sub_fetch(&(*bs).pins[block_id], 1, __ATOMIC_RELAXED);
+#endif
+	if((*bs).cache != NULL && block_id >= (*bs).meta_blocks){
+		block_cache_unpin((*bs).cache, block_id);
+	}
 }
-/// Searches for a free block, marks it as in use, and returns the block's id
-// \param bs BS device
-// \return Allocated block's id, SIZE_MAX on error
-//
-size_t block_store_allocate(block_store_t *const bs){
-	if(bs == NULL){
-		return SIZE_MAX;
+
+// block_store_write, untimed
+static size_t device_write(block_store_t *const bs, const size_t block_id, const void *buffer){
+	if(bs == NULL || buffer == NULL || block_id >= (*bs).block_count || block_store_read_only(bs)){
+		return 0;
 	}
-	size_t i = bitmap_ffz((*bs).bmp[0]);
-	if(i == SIZE_MAX || i >= 256) {
-		return SIZE_MAX;
+	assert((*bs).pins[block_id] == 0 && "block_store_write to a pinned block");
+	block_store_lock_write(bs, block_id);
+	const bool ok = block_store_copy_in(bs, block_id, 0, (*bs).block_size, buffer);
+	if(ok && (*bs).journal != NULL){
+		block_store_journal_write(bs, block_id, 0, (*bs).block_size, buffer);
 	}
-	bitmap_set((*bs).bmp[0], i);
-	return i;		
+	if(ok){
+		block_store_update_checksum(bs, block_id, buffer);
+	}
+	block_store_unlock(bs, block_id);
+	if(block_id < (*bs).meta_blocks){
+		block_store_reload_fbm(bs); // Whoever wrote a meta block just replaced (part of) the fbm
+	}
+	return ok ? (*bs).block_size : 0;
 }
 
-// Attempts to allocate the requested block id
-// \param bs the block store object
-// \block_id the requested block identifier
-// \return boolean indicating succes of operation
-//
-bool block_store_request(block_store_t *const bs, const size_t block_id){
-	if(bs != NULL && block_id > 0 && block_id < 256 && !bitmap_test((*bs).bmp[0], block_id)){
-	   	bitmap_set((*bs).bmp[0],block_id);
-		return true;
+// Reads data from the specified buffer and writes it to the designated block
+// \param bs BS device
+// \param block_id Destination block id
+// \param buffer Data buffer to read from
+// \return Number of bytes written, 0 on error
+///
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t bytes = device_write(bs, block_id, buffer);
+	block_store_stats_end(bs, BS_OP_WRITE, started, bytes != 0, bytes);
+	return bytes;
+}
+
+// block_store_write_partial, untimed
+static size_t device_write_partial(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer){
+	if(bs == NULL || buffer == NULL || block_id >= (*bs).block_count || len == 0 || offset >= (*bs).block_size || len > (*bs).block_size - offset || block_store_read_only(bs)){
+		return 0;
 	}
-	return false;
+	assert((*bs).pins[block_id] == 0 && "block_store_write_partial to a pinned block");
+	block_store_lock_write(bs, block_id);
+	bool ok = block_store_copy_in(bs, block_id, offset, len, buffer);
+	if(ok && (*bs).journal != NULL){
+		block_store_journal_write(bs, block_id, offset, len, buffer);
+	}
+	ok = ok && block_store_rechecksum(bs, block_id);
+	block_store_unlock(bs, block_id);
+	if(block_id < (*bs).meta_blocks){
+		block_store_reload_fbm(bs);
+	}
+	return ok ? len : 0;
 }
 
-// Frees the specified block
+// Reads data from the specified buffer and writes it to part of the designated block
+//  (the rest of the block is left untouched)
 // \param bs BS device
-// \param block_id The block to free
+// \param block_id Destination block id
+// \param offset Byte offset within the block to start writing at
+// \param len Number of bytes to write, offset + len must not exceed the block size
+// \param buffer Data buffer to read from
+// \return Number of bytes written, 0 on error
 //
-void block_store_release(block_store_t *const bs, const size_t block_id){
-	if(bs != NULL && block_id > 0 && block_id < 256 && bitmap_test((*bs).bmp[0], block_id)){
-		bitmap_reset((*bs).bmp[0], block_id);
+size_t block_store_write_partial(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t bytes = device_write_partial(bs, block_id, offset, len, buffer);
+	block_store_stats_end(bs, BS_OP_WRITE, started, bytes != 0, bytes);
+	return bytes;
+}
+
+// Visiting order for a vectored call, the entry's block id is copied in so sorting doesn't chase pointers
+typedef struct {
+	size_t block_id;
+	size_t index; // Position in the caller's array
+} iov_order_t;
+
+// qsort helper for the vectored calls, orders by block id and keeps the caller's order for duplicates
+static int iov_compare(const void *a, const void *b){
+	const iov_order_t *const lhs = a, *const rhs = b;
+	if((*lhs).block_id != (*rhs).block_id){
+		return (*lhs).block_id < (*rhs).block_id ? -1 : 1;
 	}
-	return;	
+	return (*lhs).index < (*rhs).index ? -1 : ((*lhs).index > (*rhs).index);
 }
 
-// Counts the number of blocks marked as in use
+// Checks every entry of a vectored request up front and works out the order to visit them in
+//  order has to hold n entries. Returns false if anything in the batch is bad.
+static bool block_store_prepare_iov(const block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n, iov_order_t *const order){
+	bool sorted = true;
+	for(size_t i = 0; i < n; ++i){
+		if(iov[i].buffer == NULL || iov[i].block_id >= (*bs).block_count){
+			return false;
+		}
+		sorted = sorted && (i == 0 || iov[i - 1].block_id <= iov[i].block_id);
+		order[i].block_id = iov[i].block_id;
+		order[i].index = i;
+	}
+	if(!sorted){
+		qsort(order, n, sizeof(iov_order_t), iov_compare);
+	}
+	return true;
+}
+
+// block_store_readv, untimed
+static size_t device_readv(const block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n){
+	if(bs == NULL || iov == NULL || n == 0){
+		return 0;
+	}
+	iov_order_t stack_order[IOV_STACK_ENTRIES];
+	iov_order_t *order = n <= IOV_STACK_ENTRIES ? stack_order : malloc(n * sizeof(iov_order_t));
+	if(order == NULL){
+		return 0;
+	}
+	size_t size = 0;
+	if(block_store_prepare_iov(bs, iov, n, order)){
+		bool ok = true;
+		for(size_t i = 0; ok && i < n; ++i){ // Ascending block ids, so this walks the arena front to back
+			const block_store_iovec_t *const entry = &iov[order[i].index];
+			block_store_lock_read(bs, entry->block_id);
+			ok = block_store_copy_out(bs, entry->block_id, entry->buffer);
+			const bool intact = !ok || block_store_verify(bs, entry->block_id, entry->buffer);
+			block_store_unlock(bs, entry->block_id);
+			if(!intact){
+				errno = EBADMSG;
+				ok = false;
+			}
+		}
+		size = ok ? n * (*bs).block_size : 0;
+	}
+	if(order != stack_order){
+		free(order);
+	}
+	return size;
+}
+
+// Reads the data of many blocks at once, each into its own buffer
+//  The whole batch is validated before anything is copied
 // \param bs BS device
-// \return Total blocks in use, SIZE_MAX on error
+// \param iov The blocks to read and where to put each of them
+// \param n Number of entries in iov
+// \return Total number of bytes read, 0 on error (errno is EBADMSG if a block failed its checksum)
 //
-size_t block_store_get_used_blocks(const block_store_t *const bs){
-	if(bs == NULL){
-		return SIZE_MAX;
+size_t block_store_readv(const block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t bytes = device_readv(bs, iov, n);
+	block_store_stats_end(bs, BS_OP_READ, started, bytes != 0, bytes);
+	return bytes;
+}
+
+// block_store_writev, untimed
+static size_t device_writev(block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n){
+	if(bs == NULL || iov == NULL || n == 0 || block_store_read_only(bs)){
+		return 0;
+	}
+	iov_order_t stack_order[IOV_STACK_ENTRIES];
+	iov_order_t *order = n <= IOV_STACK_ENTRIES ? stack_order : malloc(n * sizeof(iov_order_t));
+	if(order == NULL){
+		return 0;
 	}
-	size_t ub = 0, i = 1;
-	for(; i<256; ++i){
-		if(bitmap_test((*bs).bmp[0], i)){
-			ub++;
+	size_t size = 0;
+	if(block_store_prepare_iov(bs, iov, n, order)){
+		bool touched_fbm = false, ok = true;
+		for(size_t i = 0; ok && i < n; ++i){ // A cached device can fail part way, the blocks before stay written
+			const block_store_iovec_t *const entry = &iov[order[i].index];
+			assert((*bs).pins[entry->block_id] == 0 && "block_store_writev to a pinned block");
+			block_store_lock_write(bs, entry->block_id);
+			ok = block_store_copy_in(bs, entry->block_id, 0, (*bs).block_size, entry->buffer);
+			if(ok && (*bs).journal != NULL){
+				block_store_journal_write(bs, entry->block_id, 0, (*bs).block_size, entry->buffer);
+			}
+			if(ok){
+				block_store_update_checksum(bs, entry->block_id, entry->buffer);
+			}
+			block_store_unlock(bs, entry->block_id);
+			touched_fbm = touched_fbm || entry->block_id < (*bs).meta_blocks;
 		}
+		if(touched_fbm){
+			block_store_reload_fbm(bs); // Once for the whole batch
+		}
+		size = ok ? n * (*bs).block_size : 0;
 	}
-	if(ub >= 256){
-		return SIZE_MAX;
+	if(order != stack_order){
+		free(order);
 	}
-	return ub;
+	return size;
 }
 
-// Counts the number of blocks marked free for use
+// Writes the data of many blocks at once, each from its own buffer
+//  The whole batch is validated before anything is copied, and if a block
+//  shows up more than once the last entry for it wins
 // \param bs BS device
-// \return Total blocks free, SIZE_MAX on error
+// \param iov The blocks to write and where to take each of them from
+// \param n Number of entries in iov
+// \return Total number of bytes written, 0 on error
 //
-size_t block_store_get_free_blocks(const block_store_t *const bs){
-	size_t ub = block_store_get_used_blocks(bs);
-	if(ub == SIZE_MAX){
-		return SIZE_MAX;
-	}	
-	return 255 - ub;
+size_t block_store_writev(block_store_t *const bs, const block_store_iovec_t *const iov, const size_t n){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t bytes = device_writev(bs, iov, n);
+	block_store_stats_end(bs, BS_OP_WRITE, started, bytes != 0, bytes);
+	return bytes;
 }
 
-// Returns the total number of user-addressable blocks
-//  (since this is constant, you don't even need the bs object)
-// \return Total blocks
 //
-size_t block_store_get_total_blocks(){
-	return 255;
+///
+// DEFRAGMENTATION
+///
+//
+
+// Write locks the two blocks of a move in stripe order, the same order block_store_lock_all goes in, and a shared stripe once
+static void defrag_lock(const block_store_t *const bs, const size_t from, const size_t to){
+	if((*bs).stripes != NULL){
+		pthread_rwlock_t *const a = block_store_stripe(bs, from), *const b = block_store_stripe(bs, to);
+		pthread_rwlock_wrlock(a < b ? a : b);
+		if(a != b){
+			pthread_rwlock_wrlock(a < b ? b : a);
+		}
+	}
+}
+static void defrag_unlock(const block_store_t *const bs, const size_t from, const size_t to){
+	if((*bs).stripes != NULL){
+		pthread_rwlock_t *const a = block_store_stripe(bs, from), *const b = block_store_stripe(bs, to);
+		pthread_rwlock_unlock(a);
+		if(a != b){
+			pthread_rwlock_unlock(b);
+		}
+	}
 }
 
-// Reads data from the specified block and writes it to the designated buffer
+// Copies a block into the one it's moving to, the caller holds both their locks
+//  Same steps as device_read and device_write, without taking the locks again
+static bool defrag_copy(block_store_t *const bs, const size_t from, const size_t to, uint8_t *const buffer){
+	if(!block_store_copy_out(bs, from, buffer)){
+		return false;
+	}
+	if(!block_store_verify(bs, from, buffer)){
+		errno = EBADMSG;
+		return false;
+	}
+	if(!block_store_copy_in(bs, to, 0, (*bs).block_size, buffer)){
+		return false;
+	}
+	if((*bs).journal != NULL){
+		block_store_journal_write(bs, to, 0, (*bs).block_size, buffer);
+	}
+	block_store_update_checksum(bs, to, buffer);
+	return true;
+}
+
+/// One step of compacting the device: moves up to max_moves allocated blocks into the free blocks before them
+///  Every move fills the lowest free block with the first allocated block after it, which slides everything
+///  down in order. Steps go on from where the last one stopped, and start over once a pass is done.
+///  Both blocks stay write locked from the copy until the old one is freed, so a write can't slip in between
+///  A move remap turns down still costs a copy, so it counts against max_moves all the same
 // \param bs BS device
-// \param block_id Source block id
-// \param buffer Data buffer to write to
-// \return Number of bytes read, 0 on error
+// \param max_moves Most blocks to copy in this step
+// \param remap Called for every move, to update whatever refers to the block
+// \param context Passed to remap
+// \param done Set to whether this step ended a pass that moved nothing, may be NULL
+// \return Blocks copied (moved or turned down), SIZE_MAX on error
 //
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer){
-	if(bs == NULL || buffer == NULL){
-		return 0;
+size_t block_store_defragment(block_store_t *const bs, const size_t max_moves, block_store_remap_t remap, void *const context,
+	bool *const done){
+	if(done != NULL){
+		*done = false;
 	}
-	memcpy(buffer,(const void *)bitmap_export((*bs).bmp[block_id]), 256); // Copy the data from the specified block to the buffer
-	
-	return 256;
+	if(bs == NULL || remap == NULL || block_store_read_only(bs) || (*bs).has_magazines){
+		return SIZE_MAX;
+	}
+	uint8_t *const buffer = malloc((*bs).block_size);
+	if(buffer == NULL){
+		return SIZE_MAX;
+	}
+	size_t tried = 0, length = 0;
+	bool ok = true;
+	while(ok && tried < max_moves){
+		const size_t cursor = (*bs).defrag_cursor < (*bs).meta_blocks ? (*bs).meta_blocks : (*bs).defrag_cursor;
+		const size_t hole = fbm_next_run(bs, cursor, &length);
+		const size_t from = hole == SIZE_MAX ? SIZE_MAX : hole + length; // Allocated, or past the end
+		if(from >= (*bs).block_count){
+			(*bs).defrag_cursor = (*bs).meta_blocks; // Nothing after the last free extent, the next pass starts over
+			if(done != NULL){
+				*done = (*bs).defrag_moved == 0; // Whatever this pass copied got turned down, nothing left remap will let go
+			}
+			(*bs).defrag_moved = 0;
+			break;
+		}
+		if(!fbm_request(bs, hole)){
+			continue; // Another thread took it first
+		}
+		if((*bs).journal != NULL){
+			block_store_journal_fbm(bs, true, hole, 1);
+		}
+		defrag_lock(bs, from, hole);
+		ok = defrag_copy(bs, from, hole, buffer);
+		const bool keep = !ok || !remap(context, from, hole);
+		const size_t freed = keep ? hole : from;
+		if((*bs).journal != NULL){
+			block_store_journal_fbm(bs, false, freed, 1);
+		}
+		fbm_release(bs, freed);
+		defrag_unlock(bs, from, hole);
+		// A block turned down stays put, this pass goes on with the free blocks after it
+		(*bs).defrag_cursor = keep ? from + 1 : hole + 1;
+		(*bs).defrag_moved += !keep;
+		++tried;
+	}
+	free(buffer);
+	return ok ? tried : SIZE_MAX;
 }
 
-// Reads data from the specified buffer and writes it to the designated block
-// \param bs BS device
-// \param block_id Destination block id
-// \param buffer Data buffer to read from
-// \return Number of bytes written, 0 on error
-///
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer){
-	if(bs == NULL || buffer == NULL || block_id >= 256){
-		return 0;
+// Moves a raw image loader at block *i past the holes in the file, false if there's no data left
+//  *data_end gets where the data found runs out, -1 if the filesystem can't tell (then everything gets read)
+static bool block_store_skip_hole(const int fd, const size_t block_size, size_t *const i, off_t *const data_end){
+	*data_end = -1;
+#ifdef SEEK_DATA
+	const off_t data = lseek(fd, (off_t)(*i * block_size), SEEK_DATA); // Only asks, pread doesn't care where the offset is
+	if(data < 0){
+		return errno != ENXIO; // ENXIO: no data past this point
 	}
- 	bitmap_destroy((*bs).bmp[block_id]); // destroy the old bitmap at block_id
-	(*bs).bmp[block_id] = NULL;
-	(*bs).bmp[block_id] = bitmap_import(2048, buffer); // re-create one bitmap for the block at block_id using the buffer content as data
-	if((*bs).bmp[block_id] == NULL){
-		return 0;
+	*i = (size_t)data / block_size; // Holes come in whole pages, a block can still start in one
+	*data_end = lseek(fd, data, SEEK_HOLE);
+#endif
+	return true;
+}
+
+// One loader thread's share of a raw image: blocks [first, end), read a chunk at a time
+typedef struct {
+	block_store_t *bs;
+	int fd;
+	size_t first;
+	size_t end;
+	size_t used; // Blocks the fbm has in use in the range
+	bool failed;
+} load_range_t;
+
+static void *load_range(void *const arg){
+	load_range_t *const range = arg;
+	block_store_t *const bs = (*range).bs;
+	const size_t block_size = (*bs).block_size;
+	const size_t chunk_blocks = LOAD_CHUNK_BYTES / block_size ? LOAD_CHUNK_BYTES / block_size : 1;
+	// A deduplicated device takes its data blocks through a buffer, the store decides where they go
+	uint8_t *const staging = (*bs).dedup != NULL ? malloc(chunk_blocks * block_size) : NULL;
+	if((*bs).dedup != NULL && staging == NULL){
+		(*range).failed = true;
+		return NULL;
+	}
+	off_t data_end = 0; // Where the data being read runs into a hole, holes stay the zeros a new device starts with
+	for(size_t i = (*range).first; !(*range).failed && i < (*range).end;){
+		if(data_end >= 0 && (off_t)(i * block_size) >= data_end && !block_store_skip_hole((*range).fd, block_size, &i, &data_end)){
+			break; // Nothing but holes from here on
+		}
+		if(i >= (*range).end){
+			break;
+		}
+		size_t count = (*range).end - i < chunk_blocks ? (*range).end - i : chunk_blocks;
+		if(data_end >= 0){ // No further than the hole
+			const size_t data_blocks = ((size_t)data_end - i * block_size + block_size - 1) / block_size;
+			count = data_blocks < count ? data_blocks : count;
+		}
+		uint8_t *const target = staging != NULL ? staging : block_store_block(bs, i);
+		if(staging != NULL){
+			memset(staging, 0, count * block_size); // Whatever the file doesn't have reads as zeros
+		}
+		if(!block_store_pread_all((*range).fd, target, count * block_size, (off_t)(i * block_size))){ // A short image is a broken one
+			(*range).failed = true;
+			break;
+		}
+		for(size_t b = 0; staging != NULL && !(*range).failed && b < count; ++b){
+			(*range).failed = !block_dedup_write((*bs).dedup, i + b, 0, block_size, staging + b * block_size);
+		}
+		i += count;
+	}
+	free(staging);
+	(*range).used = bitmap_count_range((*bs).fbm, (*range).first, (*range).end - (*range).first); // The fbm is in already
+	return NULL;
+}
+
+// Loads a raw image into a freshly created device: the meta blocks first, then the data blocks split into
+//  a range per thread. The used block count comes from the ranges too, false on error
+static bool block_store_load_raw(block_store_t *const bs, const int fd, const unsigned threads){
+	const size_t meta_bytes = (*bs).meta_blocks * (*bs).block_size;
+	if(!block_store_pread_all(fd, block_store_block(bs, 0), meta_bytes, 0)){
+		return false;
+	}
+	const size_t blocks = (*bs).block_count - (*bs).meta_blocks;
+	size_t count = threads;
+	if(count == 0){
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? (size_t)cpus : 1;
+	}
+	count = count > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : count;
+	count = count > blocks ? blocks : count;
+	load_range_t ranges[LOAD_MAX_THREADS];
+	pthread_t workers[LOAD_MAX_THREADS];
+	bool started[LOAD_MAX_THREADS];
+	for(size_t t = 0; t < count; ++t){
+		const size_t share = blocks / count, extra = blocks % count; // The first extra ranges get a block more
+		const size_t first = (*bs).meta_blocks + share * t + (t < extra ? t : extra);
+		ranges[t] = (load_range_t){bs, fd, first, first + share + (t < extra), 0, false};
+	}
+	for(size_t t = 0; t < count; ++t){
+		started[t] = t + 1 < count && pthread_create(&workers[t], NULL, load_range, &ranges[t]) == 0;
+		if(!started[t]){
+			load_range(&ranges[t]); // The last range (or one that couldn't get a thread) runs here
+		}
+	}
+	bool ok = true;
+	size_t used = 0;
+	for(size_t t = 0; t < count; ++t){
+		if(started[t]){
+			pthread_join(workers[t], NULL);
+		}
+		ok = ok && !ranges[t].failed;
+		used += ranges[t].used;
 	}
-	return 256;
+	__atomic_store_n(&(*bs).used_blocks, used, __ATOMIC_RELAXED);
+	block_store_rebuild_fbm_index(bs);
+	return ok;
 }
 
 // Imports BS device from the given file - for grads/bonus
+//  (a journal left next to it by block_store_open_journaled gets replayed)
 // \param filename The file to load
 // \return Pointer to new BS device, NULL on error
 //
 block_store_t *block_store_deserialize(const char *const filename){
+	return block_store_deserialize_ex(filename, BLOCK_SIZE_BYTES, BLOCK_COUNT, BS_FLAG_NONE);
+}
+
+// Imports BS device with the given geometry from the given file
+//  Raw images and compressed ones (BS_SERIALIZE_COMPRESS) alike, a compressed image has its extents
+//  checked against their checksums and decompressed in parallel. Holes in a raw one (BS_SERIALIZE_SPARSE) aren't read at all
+//  Loads with a thread per CPU, block_store_deserialize_parallel picks the number
+// \param filename The file to load
+// \param block_size Bytes per block the image was written with
+// \param block_count Total number of blocks the image was written with
+// \param flags BS_FLAGS to apply
+// \return Pointer to new BS device, NULL on error
+//
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags){
+	return block_store_deserialize_parallel(filename, block_size, block_count, flags, 0, NULL);
+}
+
+// Imports BS device with the given geometry from the given file, with the given number of threads
+// \param filename The file to load
+// \param block_size Bytes per block the image was written with
+// \param block_count Total number of blocks the image was written with
+// \param flags BS_FLAGS to apply
+// \param threads Number of threads to load with, 0 for one per CPU
+// \param bad_blocks Where to put the number of data blocks that failed their checksum (0 without BS_FLAG_CHECKSUM), can be NULL
+// \return Pointer to new BS device, NULL on error
+//
+block_store_t *block_store_deserialize_parallel(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags,
+	const unsigned threads, size_t *const bad_blocks){
 	if(filename == NULL){
 		return NULL;
 	}
@@ -178,25 +1998,191 @@ block_store_t *block_store_deserialize(const char *const filename){
 	if(fd < 0){
 		return NULL;
 	}
-	block_store_t * bs = block_store_create(); // Create a new BS device for storing the data given from the file
+	block_store_t * bs = block_store_create_ex(block_size, block_count, flags); // Create a new BS device for storing the data given from the file
 	if(bs == NULL){
+		close(fd);
+		return NULL;
+	}
+	bool ok;
+	if(block_store_image_compressed(fd)){
+		ok = block_store_image_read(bs, fd, threads);
+		block_store_reload_fbm(bs); // The fbm came in with the meta blocks
+	} else {
+		ok = block_store_load_raw(bs, fd, threads); // Reloads the fbm on the way
+	}
+	bitmap_format((*bs).dirty, 0x00); // and the file now matches the device
+	ok = ok && block_store_journal_replay(bs, filename); // unless there's a journal with changes that never made it in
+	if(close(fd) != 0 || !ok){ // This happens if reading or closing the file fails
+		block_store_destroy(bs);
 		return NULL;
 	}
-	size_t i=0;
-	for(; i<256; ++i){
- 		uint8_t buffer[256]; // Temporary buffer for transferring data from the file to the BS device
-		/* Read the data from the file to the temp buffer  */
-		if(read(fd, buffer, 256) < 0){ 
-			block_store_destroy(bs); // This happens if read() fails
+	if(bad_blocks != NULL){ // Once the journal is in, the image alone may have a block ahead of its checksum
+		*bad_blocks = (*bs).checksums != NULL ? block_store_scrub(bs, threads, NULL, 0) : 0;
+		if(*bad_blocks == SIZE_MAX){
+			block_store_destroy(bs);
 			return NULL;
 		}
-		/* Read the data from the buffer to every block */
-		if(block_store_write(bs, i, buffer) != 256){ // This happens if block_store_read() fails 
-			block_store_destroy(bs);
+	}
+	return bs;
+}
+
+// pwrite that keeps going until everything is out (or it really fails)
+bool block_store_pwrite_all(const int fd, const uint8_t *data, size_t len, off_t offset){
+	while(len > 0){
+		const ssize_t written = pwrite(fd, data, len, offset);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		len -= (size_t)written;
+		offset += written;
+	}
+	return true;
+}
+
+// pread counterpart, a file that ends early is as good as a failed read
+bool block_store_pread_all(const int fd, uint8_t *data, size_t len, off_t offset){
+	while(len > 0){
+		const ssize_t got = pread(fd, data, len, offset);
+		if(got < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		if(got == 0){
+			errno = EIO;
+			return false;
+		}
+		data += got;
+		len -= (size_t)got;
+		offset += got;
+	}
+	return true;
+}
+
+// Writes blocks [first, end) to the same place in an image file
+//  The data blocks of a cached device (read past its cache), a deduplicated one or a snapshot are staged through a small buffer
+//  With holes set the file is already zeroed, and a deduplicated device's zero blocks are left out of it,
+//  along with the data blocks missing from used (NULL for all of them)
+static bool block_store_write_run(const block_store_t *const bs, const int fd, size_t first, const size_t end, const bool holes, const bitmap_t *const used){
+	const size_t block_size = (*bs).block_size;
+	if(used != NULL && end > (*bs).meta_blocks){
+		// The meta blocks, then every run of used blocks on its own
+		bool ok = first >= (*bs).meta_blocks || block_store_write_run(bs, fd, first, (*bs).meta_blocks, holes, NULL);
+		first = first < (*bs).meta_blocks ? (*bs).meta_blocks : first;
+		while(ok && first < end && (first = bitmap_ffs_from(used, first)) < end){
+			size_t run_end = bitmap_ffz_from(used, first);
+			run_end = run_end > end ? end : run_end; // SIZE_MAX when the run goes to the last block
+			ok = block_store_write_run(bs, fd, first, run_end, holes, NULL);
+			first = run_end;
+		}
+		return ok;
+	}
+	if(!block_store_staged(bs) || end <= (*bs).meta_blocks){
+		return block_store_pwrite_all(fd, block_store_block(bs, first), (end - first) * block_size, (off_t)(first * block_size));
+	}
+	if(first < (*bs).meta_blocks){
+		if(!block_store_pwrite_all(fd, block_store_block(bs, first), ((*bs).meta_blocks - first) * block_size, (off_t)(first * block_size))){
+			return false;
+		}
+		first = (*bs).meta_blocks;
+	}
+	uint8_t *const staging = malloc(STAGING_BLOCKS * block_size);
+	bool ok = staging != NULL;
+	const bool skip_zeros = holes && (*bs).dedup != NULL;
+	while(ok && first < end){
+		if(skip_zeros && block_dedup_is_zero((*bs).dedup, first)){
+			++first;
+			continue;
+		}
+		size_t count = 0; // Up to the next zero block the file can do without
+		for(; ok && count < STAGING_BLOCKS && first + count < end && !(skip_zeros && block_dedup_is_zero((*bs).dedup, first + count)); ++count){
+			ok = block_store_copy_out_direct(bs, first + count, staging + count * block_size);
+		}
+		ok = ok && block_store_pwrite_all(fd, staging, count * block_size, (off_t)(first * block_size));
+		first += count;
+	}
+	free(staging);
+	return ok;
+}
+
+// The meta blocks of a sparse image: the device's own, except that the blocks left out have the checksum of
+//  the zeros they'll load as. NULL without memory for them
+static uint8_t *block_store_sparse_meta(const block_store_t *const bs, const bitmap_t *const used){
+	const size_t block_size = (*bs).block_size, meta_bytes = (*bs).meta_blocks * block_size;
+	uint8_t *const meta = malloc(meta_bytes);
+	void *const zeros = (*bs).checksums != NULL ? calloc(1, block_size) : NULL;
+	if(meta == NULL || ((*bs).checksums != NULL && zeros == NULL)){
+		free(meta);
+		return NULL;
+	}
+	memcpy(meta, (*bs).arena, meta_bytes);
+	if((*bs).checksums != NULL){
+		const uint32_t crc = crc32c(zeros, block_size);
+		uint8_t *const table = meta + ((*bs).checksums - (*bs).arena);
+		for(size_t i = bitmap_ffz_from(used, (*bs).meta_blocks); i != SIZE_MAX; i = bitmap_ffz_from(used, i + 1)){
+			memcpy(table + i * sizeof(crc), &crc, sizeof(crc));
+		}
+		free(zeros);
+	}
+	return meta;
+}
+
+// Flushes a file, and for a freshly renamed one the directory entry pointing at it too
+static bool fsync_path(const int fd, const char *const filename){
+	if(fsync(fd) != 0){
+		return false;
+	}
+	if(filename == NULL){
+		return true;
+	}
+	char dir[4096];
+	const char *slash = strrchr(filename, '/');
+	const size_t dir_len = slash == NULL ? 1 : (size_t)(slash - filename) + (slash == filename ? 1 : 0);
+	if(dir_len >= sizeof(dir)){
+		return false;
+	}
+	memcpy(dir, slash == NULL ? "." : filename, dir_len);
+	dir[dir_len] = '\0';
+	const int dir_fd = open(dir, O_RDONLY);
+	if(dir_fd < 0){
+		return false;
+	}
+	const bool synced = (fsync(dir_fd) == 0);
+	close(dir_fd);
+	return synced;
+}
+
+// Loads the device image in the given file onto the heap and journals every change made to it from then on
+// \param filename The device image
+// \param block_size Bytes per block
+// \param block_count Total number of blocks, including the ones the free block map lives in
+// \param flags BS_FLAGS to apply
+// \return Pointer to the BS device, NULL on error
+//
+block_store_t *block_store_open_journaled(const char *const filename, const size_t block_size, const size_t block_count, const unsigned flags){
+	if(filename == NULL){
+		return NULL;
+	}
+	if(access(filename, F_OK) != 0){
+		if(errno != ENOENT){
+			return NULL;
+		}
+		// A brand new device, the image has to exist before there's anything to fold into it
+		block_store_t *const fresh = block_store_create_ex(block_size, block_count, flags);
+		const bool written = fresh != NULL && block_store_serialize_ex(fresh, filename, BS_SERIALIZE_ATOMIC) != 0;
+		block_store_destroy(fresh);
+		if(!written){
 			return NULL;
 		}
 	}
-	if(close(fd) != 0){ // This happens if closing the file fails
+	block_store_t *const bs = block_store_deserialize_ex(filename, block_size, block_count, flags); // Replays the journal
+	struct stat st; // An image of some other geometry would get records folded into all the wrong places
+	if(bs != NULL && (stat(filename, &st) != 0 || (uintmax_t)st.st_size != block_size * block_count || !block_store_journal_attach(bs, filename))){
 		block_store_destroy(bs);
 		return NULL;
 	}
@@ -209,31 +2195,153 @@ block_store_t *block_store_deserialize(const char *const filename){
 // \return Number of bytes written, 0 on error
 //
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename){
-	if(bs == NULL || filename == NULL){
+	return block_store_serialize_ex(bs, filename, BS_SERIALIZE_NONE);
+}
+
+// block_store_serialize_ex, untimed
+static size_t device_serialize(const block_store_t *const bs, const char *const filename, const unsigned options){
+	if(bs == NULL || filename == NULL || (options & ~(unsigned)(BS_SERIALIZE_FSYNC | BS_SERIALIZE_ATOMIC | BS_SERIALIZE_COMPRESS | BS_SERIALIZE_SPARSE))){
 		return 0;
 	}
-	int fd = open(filename, O_TRUNC | O_CREAT, 0666); // Create a new file, or, if it exists already, clear all its data
+	size_t size = (*bs).block_size * (*bs).block_count;
+	int fd;
+	char temp_name[4096];
+	if(options & BS_SERIALIZE_ATOMIC){
+		// Build the whole image next to the real one, then swap it in, readers see the old image or the new one
+		// (open instead of mkstemp so the file gets the usual umask treatment, the counter keeps threads apart)
+		static atomic_uint temp_counter;
+		do {
+			if((size_t)snprintf(temp_name, sizeof(temp_name), "%s.tmp.%ld.%u", filename, (long)getpid(), atomic_fetch_add(&temp_counter, 1)) >= sizeof(temp_name)){
+				return 0;
+			}
+			fd = open(temp_name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		} while(fd < 0 && errno == EEXIST);
+	} else {
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666); // Create a new file, or, if it exists already, clear all its data
+	}
 	if(fd < 0){
 		return 0;
 	}
-	if(close(fd) != 0){
-		return 0;
-	}	
- 	fd = open(filename, O_WRONLY | O_APPEND); // Open the file for writing/appending
-	if(fd < 0){
+	if((*bs).has_magazines){
+		magazine_drain_all((block_store_t *)bs); // Cached blocks are free as far as the image is concerned
+	}
+	// The arena already has every block in order, so the image goes out in one go (unless the device is cached)
+	//  A deduplicated device sizes the file first, its zero blocks are holes
+	block_store_lock_all(bs);
+	// A sparse image goes by a copy of the fbm taken here, the blocks free in it stay holes in the file
+	//  (as do a deduplicated device's zero blocks, sparse or not)
+	bitmap_t *const used = (options & BS_SERIALIZE_SPARSE) ? bitmap_import((*bs).block_count, bitmap_export((*bs).fbm)) : NULL;
+	uint8_t *const meta = used != NULL ? block_store_sparse_meta(bs, used) : NULL;
+	bool ok = !(options & BS_SERIALIZE_SPARSE) || (used != NULL && meta != NULL);
+	if(options & BS_SERIALIZE_COMPRESS){
+		ok = ok && block_store_image_write(bs, fd, used, meta, &size);
+	} else {
+		const bool holes = used != NULL || (*bs).dedup != NULL;
+		ok = ok && (!holes || ftruncate(fd, (off_t)size) == 0) && block_store_write_run(bs, fd, 0, (*bs).block_count, holes, used)
+			&& (meta == NULL || block_store_pwrite_all(fd, meta, (*bs).meta_blocks * (*bs).block_size, 0));
+	}
+	block_store_unlock_all(bs);
+	free(meta);
+	bitmap_destroy(used);
+	if(ok && (options & (BS_SERIALIZE_FSYNC | BS_SERIALIZE_ATOMIC))){
+		ok = fsync_path(fd, NULL);
+	}
+	bool renamed = false;
+	if(ok && (options & BS_SERIALIZE_ATOMIC)){
+		renamed = rename(temp_name, filename) == 0;
+		ok = renamed && fsync_path(fd, filename);
+	}
+	if((options & BS_SERIALIZE_ATOMIC) && !renamed){
+		unlink(temp_name); // However far it got, a failed image doesn't stay behind
+	}
+	if(renamed || (ok && !(options & BS_SERIALIZE_ATOMIC))){
+		// The new image is in place, even if what follows fails, and a journal left next to the old one
+		// would undo it on the next load
+		block_store_journal_retire(bs, filename);
+	}
+	if(close(fd) != 0 || !ok){
 		return 0;
 	}
-	int i=0;
+	return size; // Total size should be block_size * block_count, 2^8 (bytes) * 2^8 (blocks) for the classic device
+}
+
+// Writes the entirety of the BS device to file, overwriting it if it exists
+// \param bs BS device
+// \param filename The file to write to
+// \param options BS_SERIALIZE_OPTIONS to apply
+// \return Number of bytes written (the size of the file), 0 on error
+//
+size_t block_store_serialize_ex(const block_store_t *const bs, const char *const filename, const unsigned options){
+	const uint64_t started = block_store_stats_start(bs);
+	const size_t bytes = device_serialize(bs, filename, options);
+	block_store_stats_end(bs, BS_OP_SERIALIZE, started, bytes != 0, bytes);
+	return bytes;
+}
+
+// Writes the blocks changed since the last flush to the given file, which has to hold the image as of then
+//  The file gets the full image instead if it doesn't have the device's size
+// \param bs BS device
+// \param filename The file to update
+// \return Number of bytes written, SIZE_MAX on error
+//
+size_t block_store_flush(block_store_t *const bs, const char *const filename){
+	if(bs == NULL || filename == NULL){
+		return SIZE_MAX;
+	}
+	const size_t image_bytes = (*bs).block_size * (*bs).block_count;
+	const int fd = open(filename, O_WRONLY | O_CREAT, 0666);
+	struct stat st, backing;
+	if(fd < 0 || fstat(fd, &st) != 0){
+		if(fd >= 0){
+			close(fd);
+		}
+		return SIZE_MAX;
+	}
+	if((*bs).has_magazines){
+		magazine_drain_all(bs);
+	}
+	// Writers are held off until the dirty bits are settled, or their changes could be cleared unwritten
+	block_store_lock_all(bs);
+	if((*bs).fd >= 0 && fstat((*bs).fd, &backing) == 0 && backing.st_dev == st.st_dev && backing.st_ino == st.st_ino){
+		// Our own mapping, the kernel already has every change and just needs to write it back
+		close(fd);
+		const bool synced = block_store_sync(bs, false);
+		if(synced){
+			bitmap_format((*bs).dirty, 0x00);
+		}
+		block_store_unlock_all(bs);
+		return synced ? 0 : SIZE_MAX;
+	}
+	if((uintmax_t)st.st_size != image_bytes){
+		if(ftruncate(fd, (off_t)image_bytes) != 0){
+			block_store_unlock_all(bs);
+			close(fd);
+			return SIZE_MAX;
+		}
+		bitmap_format((*bs).dirty, 0xFF); // Not our image (or no image at all yet), it needs everything
+	}
+	if((*bs).stripes != NULL){
+		bitmap_set_range((*bs).dirty, 0, (*bs).meta_blocks); // The lock-free allocator doesn't track which fbm blocks it changed
+	}
+	// A run of dirty blocks is contiguous in the arena and in the file, so each run is one write
 	size_t size = 0;
-	for(; i<256; ++i){			
-		if(write(fd, bitmap_export((*bs).bmp[i]), 256) < 0){ // Write just the data of every bitmap-formatted block to the file
-			return 0;
-		} else {
-			size += 256;
-		}		
+	bool ok = true;
+	size_t first = bitmap_ffs((*bs).dirty);
+	while(ok && first != SIZE_MAX){
+		size_t end = bitmap_ffz_from((*bs).dirty, first);
+		if(end == SIZE_MAX){
+			end = (*bs).block_count;
+		}
+		ok = block_store_write_run(bs, fd, first, end, false, NULL);
+		size += (end - first) * (*bs).block_size;
+		first = end < (*bs).block_count ? bitmap_ffs_from((*bs).dirty, end) : SIZE_MAX;
 	}
-	if(close(fd) != 0){
-		return 0;
+	ok = ok && fsync_path(fd, NULL);
+	ok = (close(fd) == 0) && ok;
+	if(ok){
+		bitmap_format((*bs).dirty, 0x00); // On failure the dirty bits are kept, so the next flush tries again
+		block_store_journal_retire(bs, filename);
 	}
-	return size; // Total size should be 2^8 (bytes) * 2^8 (blocks)
+	block_store_unlock_all(bs);
+	return ok ? size : SIZE_MAX;
 }
@@ -0,0 +1,574 @@
+#define _DEFAULT_SOURCE // syscall() under -std=c11
+#include<string.h>
+#include<assert.h>
+#include<errno.h>
+#include<unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "block_store_internal.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define BS_AIO_URING 1
+#endif
+#endif
+
+#define AIO_DEFAULT_DEPTH 64
+#define AIO_DEFAULT_THREADS 4
+
+// One request from submit until its completion is polled, the slot index is what travels through the queues
+typedef struct {
+	uint64_t user_data;
+	size_t block_id;
+	uint8_t *buffer;
+	bool write;
+	bool settled; // Side effects on the device already taken care of (heap devices do the copy at submit)
+	size_t bytes;
+	int error;
+	uint64_t started; // For BS_FLAG_STATS, which counts a request from submit until it's polled
+} aio_request_t;
+
+struct block_store_aio{
+	block_store_t *bs;
+	unsigned depth;
+	aio_request_t *requests; // depth slots
+	unsigned *free_slots, free_count; // Stack of unused slots
+	unsigned in_flight; // Slots handed out and not polled yet
+	unsigned *done, done_head, done_count; // Finished slots not polled yet (worker threads and heap devices)
+	// Worker thread fallback, requests wait in queue for one of the threads
+	pthread_t *threads;
+	unsigned thread_count;
+	pthread_cond_t work_ready, work_done;
+	unsigned *queue, queue_head, queue_count;
+	bool stopping;
+#ifdef BS_AIO_URING
+	int ring_fd; // -1 when the ring isn't used
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_bytes, cq_ring_bytes;
+	struct io_uring_sqe *sqes;
+	size_t sqes_bytes;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned unsubmitted; // In the SQ ring but not handed to the kernel yet
+	bool fixed_file;
+	const uint8_t *buffers; // Registered region, NULL if there isn't one
+	size_t buffer_bytes;
+#endif
+};
+
+//
+///
+// IO_URING
+///
+//
+
+#ifdef BS_AIO_URING
+// No liburing, the three syscalls and the ring layout are all we need
+static int uring_setup(const unsigned entries, struct io_uring_params *const params){
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+static int uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags){
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+static int uring_register(const int fd, const unsigned opcode, const void *const arg, const unsigned count){
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void uring_teardown(block_store_aio_t *const aio){
+	if((*aio).sqes != NULL){
+		munmap((*aio).sqes, (*aio).sqes_bytes);
+	}
+	if((*aio).cq_ring != NULL && (*aio).cq_ring != (*aio).sq_ring){
+		munmap((*aio).cq_ring, (*aio).cq_ring_bytes);
+	}
+	if((*aio).sq_ring != NULL){
+		munmap((*aio).sq_ring, (*aio).sq_ring_bytes);
+	}
+	if((*aio).ring_fd >= 0){
+		close((*aio).ring_fd); // Unregisters the file and the buffers too
+	}
+	(*aio).ring_fd = -1;
+}
+
+// Builds the ring, false if the kernel won't give us one we can use (callers go to the worker threads instead)
+static bool uring_init(block_store_aio_t *const aio, const block_store_aio_options_t *const options){
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	(*aio).ring_fd = uring_setup((*aio).depth, &params);
+	if((*aio).ring_fd < 0){
+		return false;
+	}
+	// IORING_OP_READ/WRITE came with the same kernel as RW_CUR_POS, anything older isn't worth supporting
+	if(!(params.features & IORING_FEAT_RW_CUR_POS) || params.sq_entries < (*aio).depth){
+		uring_teardown(aio);
+		return false;
+	}
+	(*aio).sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	(*aio).cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single_mmap && (*aio).cq_ring_bytes > (*aio).sq_ring_bytes){
+		(*aio).sq_ring_bytes = (*aio).cq_ring_bytes;
+	}
+	void *ring = mmap(NULL, (*aio).sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, (*aio).ring_fd, IORING_OFF_SQ_RING);
+	if(ring == MAP_FAILED){
+		uring_teardown(aio);
+		return false;
+	}
+	(*aio).sq_ring = ring;
+	if(single_mmap){
+		(*aio).cq_ring = ring;
+	} else {
+		ring = mmap(NULL, (*aio).cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, (*aio).ring_fd, IORING_OFF_CQ_RING);
+		if(ring == MAP_FAILED){
+			uring_teardown(aio);
+			return false;
+		}
+		(*aio).cq_ring = ring;
+	}
+	(*aio).sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring = mmap(NULL, (*aio).sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, (*aio).ring_fd, IORING_OFF_SQES);
+	if(ring == MAP_FAILED){
+		uring_teardown(aio);
+		return false;
+	}
+	(*aio).sqes = ring;
+	uint8_t *const sq = (*aio).sq_ring, *const cq = (*aio).cq_ring;
+	(*aio).sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	(*aio).sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	(*aio).sq_array = (unsigned *)(sq + params.sq_off.array);
+	(*aio).cq_head = (unsigned *)(cq + params.cq_off.head);
+	(*aio).cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	(*aio).cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	(*aio).cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	// The CQ ring is at least as big as the SQ ring and we never have more than depth in flight, so it can't overflow
+
+	// Asked for explicitly, so failing to register either of these fails the setup rather than quietly doing without
+	if((*options).flags & BS_AIO_FIXED_FILE){
+		if(uring_register((*aio).ring_fd, IORING_REGISTER_FILES, &(*(*aio).bs).fd, 1) != 0){
+			return false;
+		}
+		(*aio).fixed_file = true;
+	}
+	if((*options).buffers != NULL && (*options).buffer_bytes > 0){
+		const struct iovec region = {(*options).buffers, (*options).buffer_bytes};
+		if(uring_register((*aio).ring_fd, IORING_REGISTER_BUFFERS, &region, 1) != 0){
+			return false;
+		}
+		(*aio).buffers = (*options).buffers;
+		(*aio).buffer_bytes = (*options).buffer_bytes;
+	}
+	return true;
+}
+
+// Fills in the next SQE for the request in the given slot (the kernel only sees it once the tail moves, on enter)
+static void uring_queue(block_store_aio_t *const aio, const unsigned slot){
+	const block_store_t *const bs = (*aio).bs;
+	const aio_request_t *const request = &(*aio).requests[slot];
+	const unsigned tail = *(*aio).sq_tail; // Only we write the tail
+	const unsigned index = tail & *(*aio).sq_mask;
+	struct io_uring_sqe *const sqe = &(*aio).sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	const bool fixed_buffer = (*aio).buffers != NULL && (*aio).buffer_bytes >= (*bs).block_size && (*request).buffer >= (*aio).buffers
+		&& (size_t)((*request).buffer - (*aio).buffers) <= (*aio).buffer_bytes - (*bs).block_size;
+	if(fixed_buffer){
+		(*sqe).opcode = (*request).write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		(*sqe).buf_index = 0;
+	} else {
+		(*sqe).opcode = (*request).write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	(*sqe).fd = (*aio).fixed_file ? 0 : (*bs).fd;
+	(*sqe).flags = (*aio).fixed_file ? IOSQE_FIXED_FILE : 0;
+	(*sqe).off = (uint64_t)(*request).block_id * (*bs).block_size;
+	(*sqe).addr = (uint64_t)(uintptr_t)(*request).buffer;
+	(*sqe).len = (unsigned)(*bs).block_size;
+	(*sqe).user_data = slot;
+	(*aio).sq_array[index] = index;
+	__atomic_store_n((*aio).sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++(*aio).unsubmitted;
+}
+
+// Hands queued SQEs to the kernel and waits for wait completions to be in the CQ ring
+static bool uring_kick(block_store_aio_t *const aio, const unsigned wait){
+	while((*aio).unsubmitted > 0 || wait > 0){
+		const int ret = uring_enter((*aio).ring_fd, (*aio).unsubmitted, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if(ret < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		(*aio).unsubmitted -= (unsigned)ret;
+		if(wait > 0 || (*aio).unsubmitted == 0){
+			break; // The kernel submits everything before waiting, anything left over goes with the next call
+		}
+	}
+	return true;
+}
+
+// Moves finished requests out of the CQ ring onto the done list
+static void uring_reap(block_store_aio_t *const aio){
+	unsigned head = *(*aio).cq_head; // Only we move the head
+	const unsigned tail = __atomic_load_n((*aio).cq_tail, __ATOMIC_ACQUIRE);
+	for(; head != tail; ++head){
+		const struct io_uring_cqe *const cqe = &(*aio).cqes[head & *(*aio).cq_mask];
+		const unsigned slot = (unsigned)(*cqe).user_data;
+		aio_request_t *const request = &(*aio).requests[slot];
+		if((*cqe).res < 0){
+			(*request).error = -(*cqe).res;
+		} else if((size_t)(*cqe).res != (*(*aio).bs).block_size){
+			(*request).error = EIO; // The image is exactly the device's size, a short transfer means something is wrong
+		} else {
+			(*request).bytes = (size_t)(*cqe).res;
+		}
+		(*aio).done[((*aio).done_head + (*aio).done_count++) % (*aio).depth] = slot;
+	}
+	__atomic_store_n((*aio).cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+//
+///
+// WORKER THREADS
+///
+//
+
+static void aio_transfer(block_store_aio_t *const aio, aio_request_t *const request){
+	const block_store_t *const bs = (*aio).bs;
+	const off_t offset = (off_t)((*request).block_id * (*bs).block_size);
+	const bool ok = (*request).write ? block_store_pwrite_all((*bs).fd, (*request).buffer, (*bs).block_size, offset)
+		: block_store_pread_all((*bs).fd, (*request).buffer, (*bs).block_size, offset);
+	if(ok){
+		(*request).bytes = (*bs).block_size;
+	} else {
+		(*request).error = errno;
+	}
+}
+
+static void *aio_worker(void *const arg){
+	block_store_aio_t *const aio = arg;
+	pthread_mutex_t *const lock = &(*(*aio).bs).aio_lock;
+	pthread_mutex_lock(lock);
+	for(;;){
+		while(!(*aio).stopping && (*aio).queue_count == 0){
+			pthread_cond_wait(&(*aio).work_ready, lock);
+		}
+		if((*aio).queue_count == 0){
+			break; // Stopping, and nothing left to do
+		}
+		const unsigned slot = (*aio).queue[(*aio).queue_head];
+		(*aio).queue_head = ((*aio).queue_head + 1) % (*aio).depth;
+		--(*aio).queue_count;
+		pthread_mutex_unlock(lock);
+		aio_transfer(aio, &(*aio).requests[slot]);
+		pthread_mutex_lock(lock);
+		(*aio).done[((*aio).done_head + (*aio).done_count++) % (*aio).depth] = slot;
+		pthread_cond_broadcast(&(*aio).work_done);
+	}
+	pthread_mutex_unlock(lock);
+	return NULL;
+}
+
+//
+///
+// ENGINE
+///
+//
+
+static bool aio_uses_ring(const block_store_aio_t *const aio){
+#ifdef BS_AIO_URING
+	return (*aio).ring_fd >= 0;
+#else
+	(void)aio;
+	return false;
+#endif
+}
+
+// Tells the engine's owner (the device) about a finished request, the same way block_store_read or block_store_write would
+static void aio_settle(block_store_aio_t *const aio, aio_request_t *const request){
+	block_store_t *const bs = (*aio).bs;
+	if((*request).settled){
+		return; // Went through the regular calls, which counted it too
+	}
+	block_store_stats_end(bs, (*request).write ? BS_OP_WRITE : BS_OP_READ, (*request).started, (*request).error == 0, (*request).bytes);
+	if((*request).error || !(*request).write){
+		return;
+	}
+	block_store_lock_write(bs, (*request).block_id);
+	bitmap_set((*bs).dirty, (*request).block_id);
+	block_store_unlock(bs, (*request).block_id);
+	if((*request).block_id < (*bs).meta_blocks){
+		block_store_reload_fbm(bs); // Same as a synchronous write, the mapping already shows the new fbm
+	}
+}
+
+// Waits (engine lock held) until wait requests are on the done list, then hands out up to max of them
+static size_t aio_collect(block_store_aio_t *const aio, block_store_completion_t *const completions, const size_t max, unsigned wait){
+	if(wait > (*aio).in_flight){
+		wait = (*aio).in_flight;
+	}
+	if(wait > max){
+		wait = (unsigned)max;
+	}
+	if(aio_uses_ring(aio)){
+#ifdef BS_AIO_URING
+		uring_reap(aio);
+		do {
+			const unsigned missing = wait > (*aio).done_count ? wait - (*aio).done_count : 0;
+			if(!uring_kick(aio, missing)){ // Sends whatever was queued even if there's nothing to wait for
+				return SIZE_MAX;
+			}
+			uring_reap(aio);
+		} while((*aio).done_count < wait);
+#endif
+	} else {
+		while((*aio).done_count < wait){
+			pthread_cond_wait(&(*aio).work_done, &(*(*aio).bs).aio_lock); // Heap devices never get here, their requests are done already
+		}
+	}
+	size_t n = 0;
+	for(; n < max && (*aio).done_count > 0; ++n){
+		const unsigned slot = (*aio).done[(*aio).done_head];
+		(*aio).done_head = ((*aio).done_head + 1) % (*aio).depth;
+		--(*aio).done_count;
+		aio_request_t *const request = &(*aio).requests[slot];
+		aio_settle(aio, request);
+		if(completions != NULL){
+			completions[n].user_data = (*request).user_data;
+			completions[n].block_id = (*request).block_id;
+			completions[n].bytes = (*request).bytes;
+			completions[n].error = (*request).error;
+		}
+		(*aio).free_slots[(*aio).free_count++] = slot;
+		--(*aio).in_flight;
+	}
+	return n;
+}
+
+// Waits out everything in flight and frees the engine (engine lock held)
+static void aio_teardown(block_store_aio_t *const aio){
+	while((*aio).in_flight > 0){
+		if(aio_collect(aio, NULL, (*aio).in_flight, (*aio).in_flight) == SIZE_MAX){
+			break; // The ring is broken, nothing we can do but let close() cancel what's left
+		}
+	}
+	if((*aio).threads != NULL){
+		(*aio).stopping = true;
+		pthread_cond_broadcast(&(*aio).work_ready);
+		pthread_mutex_unlock(&(*(*aio).bs).aio_lock);
+		for(unsigned i = 0; i < (*aio).thread_count; ++i){
+			pthread_join((*aio).threads[i], NULL);
+		}
+		pthread_mutex_lock(&(*(*aio).bs).aio_lock);
+		free((*aio).threads);
+	}
+#ifdef BS_AIO_URING
+	uring_teardown(aio);
+#endif
+	pthread_cond_destroy(&(*aio).work_ready);
+	pthread_cond_destroy(&(*aio).work_done);
+	free((*aio).requests);
+	free((*aio).free_slots);
+	free((*aio).done);
+	free((*aio).queue);
+	free(aio);
+}
+
+// Whether the device's requests go through the regular calls at submit instead of out to the file
+//  Heap devices have no file, a cached device's file has to go through the cache too (or the two would
+//  disagree), and a checksummed block has to get its data and its checksum together: a write landing in the
+//  mapping ahead of its checksum would fail reads of it in between, and a read could race a write
+static bool aio_synchronous(const block_store_t *const bs){
+	return (*bs).fd < 0 || (*bs).cache != NULL || (*bs).checksums != NULL;
+}
+
+// Builds a new engine (engine lock held), NULL on error
+static block_store_aio_t *aio_create(block_store_t *const bs, const block_store_aio_options_t *const options){
+	block_store_aio_t *const aio = calloc(1, sizeof(block_store_aio_t));
+	if(aio == NULL){
+		return NULL;
+	}
+	(*aio).bs = bs;
+	(*aio).depth = (*options).queue_depth ? (*options).queue_depth : AIO_DEFAULT_DEPTH;
+	pthread_cond_init(&(*aio).work_ready, NULL);
+	pthread_cond_init(&(*aio).work_done, NULL);
+#ifdef BS_AIO_URING
+	(*aio).ring_fd = -1;
+#endif
+	(*aio).requests = calloc((*aio).depth, sizeof(aio_request_t));
+	(*aio).free_slots = calloc((*aio).depth, sizeof(unsigned));
+	(*aio).done = calloc((*aio).depth, sizeof(unsigned));
+	if((*aio).requests == NULL || (*aio).free_slots == NULL || (*aio).done == NULL){
+		aio_teardown(aio);
+		return NULL;
+	}
+	for(unsigned i = (*aio).depth; i-- > 0;){
+		(*aio).free_slots[(*aio).free_count++] = i;
+	}
+	if(aio_synchronous(bs)){
+		return aio; // Every request is done the moment it's submitted
+	}
+#ifdef BS_AIO_URING
+	if(!((*options).flags & BS_AIO_THREAD_POOL)){
+		if(uring_init(aio, options)){
+			return aio;
+		}
+		if((*aio).ring_fd >= 0){ // Got a ring but couldn't register what was asked for
+			aio_teardown(aio);
+			return NULL;
+		}
+	}
+#endif
+	(*aio).thread_count = (*options).threads ? (*options).threads : AIO_DEFAULT_THREADS;
+	(*aio).queue = calloc((*aio).depth, sizeof(unsigned));
+	(*aio).threads = calloc((*aio).thread_count, sizeof(pthread_t));
+	if((*aio).queue == NULL || (*aio).threads == NULL){
+		aio_teardown(aio);
+		return NULL;
+	}
+	for(unsigned i = 0; i < (*aio).thread_count; ++i){
+		if(pthread_create(&(*aio).threads[i], NULL, aio_worker, aio) != 0){
+			(*aio).thread_count = i; // Let teardown join the ones we did start
+			aio_teardown(aio);
+			return NULL;
+		}
+	}
+	return aio;
+}
+
+// Sets up the engine with the default options if nobody did (engine lock held)
+static block_store_aio_t *aio_get(block_store_t *const bs){
+	if((*bs).aio == NULL){
+		const block_store_aio_options_t defaults = {0, BS_AIO_NONE, 0, NULL, 0};
+		(*bs).aio = aio_create(bs, &defaults);
+	}
+	return (*bs).aio;
+}
+
+// Hands a block to the device's snapshots before a write goes out to the file behind the mapping
+static bool aio_preserve(block_store_t *const bs, const size_t block_id){
+	block_store_lock_write(bs, block_id);
+	const bool ok = block_store_snapshot_preserve(bs, block_id);
+	block_store_unlock(bs, block_id);
+	return ok;
+}
+
+// Common half of the submit calls
+static bool aio_submit(block_store_t *const bs, const size_t block_id, uint8_t *const buffer, const bool write, const uint64_t user_data){
+	if(bs == NULL || buffer == NULL || block_id >= (*bs).block_count || (write && block_store_read_only(bs))){
+		return false;
+	}
+	assert((!write || (*bs).pins[block_id] == 0) && "block_store_submit_write to a pinned block");
+	pthread_mutex_lock(&(*bs).aio_lock);
+	block_store_aio_t *const aio = aio_get(bs);
+	if(aio == NULL || (*aio).free_count == 0){
+		pthread_mutex_unlock(&(*bs).aio_lock);
+		return false;
+	}
+	const unsigned slot = (*aio).free_slots[--(*aio).free_count];
+	++(*aio).in_flight;
+	aio_request_t *const request = &(*aio).requests[slot];
+	memset(request, 0, sizeof(*request));
+	(*request).user_data = user_data;
+	(*request).block_id = block_id;
+	(*request).buffer = buffer;
+	(*request).write = write;
+	(*request).started = block_store_stats_start(bs);
+	if(aio_synchronous(bs)){
+		// Nothing to wait for, the regular calls do the copy and the bookkeeping
+		(*request).bytes = write ? block_store_write(bs, block_id, buffer) : block_store_read(bs, block_id, buffer);
+		(*request).error = (*request).bytes ? 0 : (errno ? errno : EIO);
+		(*request).settled = true;
+		(*aio).done[((*aio).done_head + (*aio).done_count++) % (*aio).depth] = slot;
+	} else if(write && (*bs).snapshots != NULL && !aio_preserve(bs, block_id)){
+		(*request).error = errno ? errno : EIO;
+		(*aio).done[((*aio).done_head + (*aio).done_count++) % (*aio).depth] = slot;
+	} else if(aio_uses_ring(aio)){
+#ifdef BS_AIO_URING
+		uring_queue(aio, slot);
+#endif
+	} else {
+		(*aio).queue[((*aio).queue_head + (*aio).queue_count++) % (*aio).depth] = slot;
+		pthread_cond_signal(&(*aio).work_ready);
+	}
+	pthread_mutex_unlock(&(*bs).aio_lock);
+	return true;
+}
+
+// Sets up the device's asynchronous I/O engine, io_uring where the kernel has it and worker threads otherwise
+// \param bs BS device
+// \param options Engine settings, NULL for the defaults
+// \return boolean indicating success of operation
+//
+bool block_store_aio_setup(block_store_t *const bs, const block_store_aio_options_t *const options){
+	if(bs == NULL || (options != NULL && ((*options).flags & ~(unsigned)(BS_AIO_THREAD_POOL | BS_AIO_FIXED_FILE)))){
+		return false;
+	}
+	const block_store_aio_options_t defaults = {0, BS_AIO_NONE, 0, NULL, 0};
+	pthread_mutex_lock(&(*bs).aio_lock);
+	if((*bs).aio != NULL && (*(*bs).aio).in_flight > 0){
+		pthread_mutex_unlock(&(*bs).aio_lock);
+		return false;
+	}
+	if((*bs).aio != NULL){
+		aio_teardown((*bs).aio);
+	}
+	(*bs).aio = aio_create(bs, options != NULL ? options : &defaults);
+	const bool ok = (*bs).aio != NULL;
+	pthread_mutex_unlock(&(*bs).aio_lock);
+	return ok;
+}
+
+// Queues a read of the specified block into the buffer
+// \param bs BS device
+// \param block_id Source block id
+// \param buffer Data buffer to write to
+// \param user_data Handed back with the completion
+// \return boolean indicating the request was queued, false on error or when queue_depth requests are in flight
+//
+bool block_store_submit_read(block_store_t *const bs, const size_t block_id, void *buffer, const uint64_t user_data){
+	return aio_submit(bs, block_id, buffer, false, user_data);
+}
+
+// Queues a write of the buffer to the specified block
+// \param bs BS device
+// \param block_id Destination block id
+// \param buffer Data buffer to read from
+// \param user_data Handed back with the completion
+// \return boolean indicating the request was queued, false on error or when queue_depth requests are in flight
+//
+bool block_store_submit_write(block_store_t *const bs, const size_t block_id, const void *buffer, const uint64_t user_data){
+	return aio_submit(bs, block_id, (uint8_t *)buffer, true, user_data); // Only ever read from, the request just doesn't know that
+}
+
+// Sends any queued requests and collects finished ones, in no particular order
+// \param bs BS device
+// \param completions Where to put the finished requests
+// \param max Room in completions
+// \param min Wait until at least this many are done (capped at the number in flight), 0 to just check
+// \return Number of completions stored, SIZE_MAX on error
+//
+size_t block_store_poll_completions(block_store_t *const bs, block_store_completion_t *const completions, const size_t max, const size_t min){
+	if(bs == NULL || (completions == NULL && max > 0)){
+		return SIZE_MAX;
+	}
+	pthread_mutex_lock(&(*bs).aio_lock);
+	size_t n = 0;
+	if((*bs).aio != NULL){
+		n = aio_collect((*bs).aio, completions, max, min > UINT32_MAX ? UINT32_MAX : (unsigned)min);
+	}
+	pthread_mutex_unlock(&(*bs).aio_lock);
+	return n;
+}
+
+// Finishes whatever is in flight and shuts the engine down, for block_store_destroy
+void block_store_aio_release(block_store_t *const bs){
+	pthread_mutex_lock(&(*bs).aio_lock);
+	if((*bs).aio != NULL){
+		aio_teardown((*bs).aio);
+		(*bs).aio = NULL;
+	}
+	pthread_mutex_unlock(&(*bs).aio_lock);
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE // MAP_HUGETLB, MADV_HUGEPAGE and syscall
+#include<string.h>
+#include<stdio.h>
+#include<errno.h>
+#include<unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "block_store_internal.h"
+
+// Placement of a heap device's arena for BS_FLAG_HUGEPAGES and the BS_FLAG_NUMA_* flags: the arena gets an
+//  anonymous mapping of its own, so its pages can be given a size and a node before anything touches them.
+//  All of it is best effort, a system without hugepages or NUMA just gets an ordinary arena.
+#define HUGEPAGE_BYTES (2u << 20)
+#define NUMA_MAX_NODES 1024 // Bits in the node masks handed to mbind
+
+#define NODEMASK_WORDS (NUMA_MAX_NODES / (8 * sizeof(unsigned long)))
+
+// mbind without libnuma, the C library doesn't wrap it
+static long arena_mbind(void *const start, const size_t len, const int mode, const unsigned long *const nodes){
+#ifdef SYS_mbind
+	return syscall(SYS_mbind, start, len, mode, nodes, (unsigned long)NUMA_MAX_NODES + 1, 0UL); // The kernel drops the last bit
+#else
+	(void)start; (void)len; (void)mode; (void)nodes;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+// Fills nodes with the ids of the online NUMA nodes, in order, returns how many there are (0 if the kernel doesn't say)
+static size_t online_nodes(int *const nodes, const size_t max){
+	FILE *const online = fopen("/sys/devices/system/node/online", "r"); // Ranges like "0-1,3"
+	if(online == NULL){
+		return 0;
+	}
+	size_t count = 0;
+	int first, last;
+	while(fscanf(online, "%d", &first) == 1){
+		last = first;
+		int separator = fgetc(online);
+		if(separator == '-'){
+			if(fscanf(online, "%d", &last) != 1){
+				break;
+			}
+			separator = fgetc(online);
+		}
+		for(int node = first; node <= last && node >= 0 && node < NUMA_MAX_NODES && count < max; ++node){
+			nodes[count++] = node;
+		}
+		if(separator != ','){
+			break;
+		}
+	}
+	fclose(online);
+	return count;
+}
+
+// An anonymous mapping of bytes starting on a huge page boundary, so transparent hugepages can back all of it
+static void *map_aligned(const size_t bytes){
+	uint8_t *const map = mmap(NULL, bytes + HUGEPAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED){
+		return NULL;
+	}
+	uint8_t *const start = (uint8_t *)(((uintptr_t)map + HUGEPAGE_BYTES - 1) & ~(uintptr_t)(HUGEPAGE_BYTES - 1));
+	if(start > map){
+		munmap(map, (size_t)(start - map));
+	}
+	munmap(start + bytes, (size_t)(map + HUGEPAGE_BYTES - start)); // What's left of the slack past the end
+	return start;
+}
+
+// Puts the arena's pages on NUMA nodes, before any of them exist: interleaved page by page, or cut into
+//  one range per node (whole pages of the granule size, the last range takes what's left)
+static void place_on_nodes(block_store_t *const bs, const size_t granule){
+	int nodes[NUMA_MAX_NODES];
+	const size_t count = online_nodes(nodes, NUMA_MAX_NODES);
+	if(count == 0){
+		return;
+	}
+	unsigned long mask[NODEMASK_WORDS];
+	if((*bs).flags & BS_FLAG_NUMA_INTERLEAVE){
+		memset(mask, 0, sizeof(mask));
+		for(size_t i = 0; i < count; ++i){
+			mask[nodes[i] / (8 * sizeof(unsigned long))] |= 1UL << (nodes[i] % (8 * sizeof(unsigned long)));
+		}
+		arena_mbind((*bs).arena, (*bs).arena_bytes, MPOL_INTERLEAVE, mask); // Pages go wherever the kernel likes otherwise
+		return;
+	}
+	const size_t share = (((*bs).arena_bytes + count - 1) / count + granule - 1) & ~(granule - 1);
+	int *const bound = malloc(count * sizeof(int));
+	if(bound == NULL){
+		return;
+	}
+	size_t ranges = 0;
+	for(size_t at = 0; at < (*bs).arena_bytes; at += share, ++ranges){
+		const size_t len = (*bs).arena_bytes - at < share ? (*bs).arena_bytes - at : share;
+		memset(mask, 0, sizeof(mask));
+		mask[nodes[ranges] / (8 * sizeof(unsigned long))] = 1UL << (nodes[ranges] % (8 * sizeof(unsigned long)));
+		// Preferred rather than bound, a node that runs out of memory spills over instead of taking the process down
+		if(arena_mbind((*bs).arena + at, len, MPOL_PREFERRED, mask) != 0){
+			free(bound);
+			return; // No partition to report, the pages still work wherever they end up
+		}
+		bound[ranges] = nodes[ranges];
+	}
+	(*bs).numa_nodes = bound;
+	(*bs).numa_bytes = share;
+}
+
+// Maps a heap device's arena of the given size for BS_FLAG_HUGEPAGES and the BS_FLAG_NUMA_* flags
+//  The mapping comes zeroed and nothing in it is touched, so pages only ever get made where they were placed
+bool block_store_arena_map(block_store_t *const bs, const size_t bytes){
+	const bool huge = (*bs).flags & BS_FLAG_HUGEPAGES;
+	const long page = sysconf(_SC_PAGESIZE);
+	const size_t granule = huge ? HUGEPAGE_BYTES : (page > 0 ? (size_t)page : 4096);
+	if(bytes > SIZE_MAX - 2 * HUGEPAGE_BYTES){
+		return false;
+	}
+	(*bs).arena_bytes = (bytes + granule - 1) & ~(granule - 1);
+	void *map = MAP_FAILED;
+	if(huge){
+		// Reserved hugetlbfs pages if the system set any aside, transparent hugepages if not
+		map = mmap(NULL, (*bs).arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(map == MAP_FAILED && (map = map_aligned((*bs).arena_bytes)) != NULL){
+			madvise(map, (*bs).arena_bytes, MADV_HUGEPAGE);
+		}
+	} else {
+		map = mmap(NULL, (*bs).arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if(map == MAP_FAILED || map == NULL){
+		return false;
+	}
+	(*bs).arena = map;
+	(*bs).arena_mapped = true;
+	if((*bs).flags & (BS_FLAG_NUMA_INTERLEAVE | BS_FLAG_NUMA_PARTITION)){
+		place_on_nodes(bs, granule);
+	}
+	return true;
+}
+
+// Undoes block_store_arena_map, for block_store_destroy
+void block_store_arena_unmap(block_store_t *const bs){
+	munmap((*bs).arena, (*bs).arena_bytes);
+	free((*bs).numa_nodes);
+	(*bs).numa_nodes = NULL;
+}
+
+/// Tells which NUMA node a block of a BS_FLAG_NUMA_PARTITION device was placed on
+///  Each node gets one contiguous range of blocks, in order of node id
+/// \param bs BS device
+/// \param block_id The block
+/// \return The node's id, -1 on error or if the device's blocks weren't partitioned
+//
+int block_store_get_block_node(const block_store_t *const bs, const size_t block_id){
+	if(bs == NULL || (*bs).numa_nodes == NULL || block_id >= (*bs).block_count || block_id * (*bs).block_size >= (*bs).arena_bytes){
+		return -1;
+	}
+	return (*bs).numa_nodes[block_id * (*bs).block_size / (*bs).numa_bytes];
+}
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L // pread/pwrite under -std=c11
+#include<string.h>
+#include<stdatomic.h>
+#include<errno.h>
+#include<unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "block_store_internal.h"
+#include "lz4.h"
+
+// The compressed image format: a header, an index with an entry per extent, then the extents
+//  An extent is a run of up to IMAGE_EXTENT_BYTES worth of blocks compressed on its own, so any of them can be
+//  read back without the others, and loading decompresses them in parallel.
+//  An all-zero extent takes no room at all, one that doesn't compress is stored as it is.
+//  Everything is little endian, like the rest of the on-disk formats.
+#define IMAGE_MAGIC UINT64_C(0x474D4953422E) // ".BSIMG", little endian (a raw image starts with an odd byte)
+#define IMAGE_VERSION 1
+#define IMAGE_EXTENT_BYTES (64u << 10)
+#define IMAGE_MAX_THREADS 64
+
+typedef enum { EXTENT_ZERO = 0, EXTENT_RAW = 1, EXTENT_LZ4 = 2 } EXTENT_TYPE;
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t crc; // CRC-32C of this header, with this field zero
+	uint64_t block_size;
+	uint64_t block_count;
+	uint64_t extent_blocks; // Blocks per extent, the last one may have fewer
+	uint64_t extent_count;
+	uint32_t index_crc; // CRC-32C of the index
+	uint32_t reserved;
+} image_header_t;
+
+typedef struct {
+	uint64_t offset; // Where the extent's bytes start in the file
+	uint64_t length; // Stored bytes, 0 for EXTENT_ZERO
+	uint32_t type; // EXTENT_TYPE
+	uint32_t crc; // CRC-32C of the stored bytes
+} image_extent_t;
+
+static uint32_t header_crc(image_header_t header){
+	header.crc = 0;
+	return crc32c(&header, sizeof(header));
+}
+
+static bool all_zero(const uint8_t *p, size_t len){
+	for(; len >= 8; p += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		if(word != 0){
+			return false;
+		}
+	}
+	for(; len > 0; ++p, --len){
+		if(*p != 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+// Tells whether a file holds a compressed image (a raw one never starts like one, its first fbm bit is always set)
+bool block_store_image_compressed(const int fd){
+	uint64_t magic;
+	return pread(fd, &magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && magic == IMAGE_MAGIC;
+}
+
+//
+///
+// WRITING
+///
+//
+
+// Writes the device's image in the compressed format (every block locked by the caller), false on error
+//  Data blocks missing from used (NULL for none) go in as zeros, and the meta blocks come from meta (NULL for the
+//  device's own). bytes gets the size of the file
+bool block_store_image_write(const block_store_t *const bs, const int fd, const bitmap_t *const used, const uint8_t *const meta, size_t *const bytes){
+	const size_t block_size = (*bs).block_size;
+	const size_t extent_blocks = block_size < IMAGE_EXTENT_BYTES ? IMAGE_EXTENT_BYTES / block_size : 1;
+	const size_t extent_count = ((*bs).block_count + extent_blocks - 1) / extent_blocks;
+	const size_t raw_capacity = extent_blocks * block_size, packed_capacity = lz4_bound(raw_capacity);
+	image_extent_t *const index = calloc(extent_count, sizeof(image_extent_t));
+	uint8_t *const raw = malloc(raw_capacity), *const packed = malloc(packed_capacity);
+	bool ok = index != NULL && raw != NULL && packed != NULL;
+	off_t at = (off_t)(sizeof(image_header_t) + extent_count * sizeof(image_extent_t));
+	for(size_t e = 0; ok && e < extent_count; ++e){
+		const size_t first = e * extent_blocks;
+		const size_t count = (*bs).block_count - first < extent_blocks ? (*bs).block_count - first : extent_blocks;
+		const size_t raw_bytes = count * block_size;
+		for(size_t i = 0; ok && i < count; ++i){
+			if(meta != NULL && first + i < (*bs).meta_blocks){
+				memcpy(raw + i * block_size, meta + (first + i) * block_size, block_size);
+			} else if(used != NULL && first + i >= (*bs).meta_blocks && !bitmap_test(used, first + i)){
+				memset(raw + i * block_size, 0, block_size);
+			} else {
+				ok = block_store_copy_out_direct(bs, first + i, raw + i * block_size);
+			}
+		}
+		if(!ok || all_zero(raw, raw_bytes)){
+			continue; // Zeroed by calloc, EXTENT_ZERO with nothing stored
+		}
+		size_t length = lz4_compress(raw, raw_bytes, packed, packed_capacity);
+		const uint8_t *stored = packed;
+		uint32_t type = EXTENT_LZ4;
+		if(length == 0 || length >= raw_bytes){
+			length = raw_bytes;
+			stored = raw;
+			type = EXTENT_RAW;
+		}
+		index[e] = (image_extent_t){(uint64_t)at, length, type, crc32c(stored, length)};
+		ok = block_store_pwrite_all(fd, stored, length, at);
+		at += (off_t)length;
+	}
+	if(ok){
+		// Last, so a file cut short on the way out doesn't look like an image
+		image_header_t header = {IMAGE_MAGIC, IMAGE_VERSION, 0, block_size, (*bs).block_count, extent_blocks, extent_count,
+			crc32c(index, extent_count * sizeof(image_extent_t)), 0};
+		header.crc = header_crc(header);
+		ok = block_store_pwrite_all(fd, (const uint8_t *)index, extent_count * sizeof(image_extent_t), sizeof(header))
+			&& block_store_pwrite_all(fd, (const uint8_t *)&header, sizeof(header), 0);
+	}
+	free(packed);
+	free(raw);
+	free(index);
+	*bytes = (size_t)at;
+	return ok;
+}
+
+//
+///
+// READING
+///
+//
+
+typedef struct {
+	block_store_t *bs;
+	int fd;
+	const image_extent_t *index;
+	size_t extent_blocks;
+	size_t extent_count;
+	atomic_size_t next; // Next extent nobody has taken yet
+	atomic_bool failed;
+} image_load_t;
+
+// Puts one extent's blocks into the device
+//  Straight into the arena where they live there, a deduplicated device gets them through the staging buffer
+static bool load_extent(image_load_t *const load, const size_t e, uint8_t *const packed, uint8_t *const staging){
+	block_store_t *const bs = (*load).bs;
+	const image_extent_t extent = (*load).index[e];
+	const size_t first = e * (*load).extent_blocks;
+	const size_t count = (*bs).block_count - first < (*load).extent_blocks ? (*bs).block_count - first : (*load).extent_blocks;
+	const size_t raw_bytes = count * (*bs).block_size;
+	if(extent.type == EXTENT_ZERO){
+		return true; // A new device is all zeros already
+	}
+	uint8_t *const target = (*bs).dedup != NULL ? staging : block_store_block(bs, first);
+	uint8_t *const stored = extent.type == EXTENT_RAW ? target : packed;
+	if(!block_store_pread_all((*load).fd, stored, extent.length, (off_t)extent.offset) || crc32c(stored, extent.length) != extent.crc
+		|| (extent.type == EXTENT_LZ4 && !lz4_decompress(packed, extent.length, target, raw_bytes))){
+		return false;
+	}
+	if((*bs).dedup != NULL){
+		for(size_t i = 0; i < count; ++i){
+			const uint8_t *const block = staging + i * (*bs).block_size;
+			if(first + i < (*bs).meta_blocks){
+				memcpy(block_store_block(bs, first + i), block, (*bs).block_size);
+			} else if(!block_dedup_write((*bs).dedup, first + i, 0, (*bs).block_size, block)){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void *load_extents(void *const arg){
+	image_load_t *const load = arg;
+	const block_store_t *const bs = (*load).bs;
+	const size_t raw_capacity = (*load).extent_blocks * (*bs).block_size;
+	uint8_t *const packed = malloc(raw_capacity), *const staging = (*bs).dedup != NULL ? malloc(raw_capacity) : NULL;
+	if(packed == NULL || ((*bs).dedup != NULL && staging == NULL)){
+		atomic_store(&(*load).failed, true);
+	}
+	while(!atomic_load(&(*load).failed)){
+		const size_t e = atomic_fetch_add(&(*load).next, 1);
+		if(e >= (*load).extent_count){
+			break;
+		}
+		if(!load_extent(load, e, packed, staging)){
+			atomic_store(&(*load).failed, true);
+		}
+	}
+	free(staging);
+	free(packed);
+	return NULL;
+}
+
+// Checks an index against the file it came from, every extent has to be where it could be and the size it has to be
+static bool index_valid(const block_store_t *const bs, const image_header_t *const header, const image_extent_t *const index, const off_t file_size){
+	const uint64_t data_start = sizeof(*header) + (*header).extent_count * sizeof(image_extent_t);
+	for(size_t e = 0; e < (*header).extent_count; ++e){
+		const size_t first = e * (*header).extent_blocks;
+		const size_t count = (*bs).block_count - first < (*header).extent_blocks ? (*bs).block_count - first : (*header).extent_blocks;
+		const uint64_t raw_bytes = (uint64_t)count * (*bs).block_size;
+		const image_extent_t extent = index[e];
+		if(extent.type == EXTENT_ZERO){
+			continue;
+		}
+		if((extent.type != EXTENT_RAW && extent.type != EXTENT_LZ4) || extent.offset < data_start
+			|| extent.offset > (uint64_t)file_size || extent.length > (uint64_t)file_size - extent.offset
+			|| (extent.type == EXTENT_RAW && extent.length != raw_bytes) || (extent.type == EXTENT_LZ4 && extent.length >= raw_bytes)){
+			return false;
+		}
+	}
+	return true;
+}
+
+// Loads a compressed image into a freshly created device of the same geometry (all zeros, nobody else using it)
+//  Extents are decompressed by up to threads threads (0 for one per CPU), false on error or a corrupt image
+bool block_store_image_read(block_store_t *const bs, const int fd, const unsigned threads){
+	image_header_t header;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !block_store_pread_all(fd, (uint8_t *)&header, sizeof(header), 0)){
+		return false;
+	}
+	const size_t block_size = (*bs).block_size;
+	const size_t extent_blocks = block_size < IMAGE_EXTENT_BYTES ? IMAGE_EXTENT_BYTES / block_size : 1;
+	if(header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION || header.crc != header_crc(header)
+		|| header.block_size != block_size || header.block_count != (*bs).block_count || header.extent_blocks != extent_blocks
+		|| header.extent_count != ((*bs).block_count + extent_blocks - 1) / extent_blocks){
+		errno = EINVAL; // Not an image of this geometry
+		return false;
+	}
+	const size_t index_bytes = header.extent_count * sizeof(image_extent_t);
+	image_extent_t *const index = malloc(index_bytes);
+	bool ok = index != NULL && block_store_pread_all(fd, (uint8_t *)index, index_bytes, sizeof(header))
+		&& crc32c(index, index_bytes) == header.index_crc && index_valid(bs, &header, index, st.st_size);
+	if(ok){
+		image_load_t load = {bs, fd, index, extent_blocks, header.extent_count, 0, false};
+		size_t count = threads;
+		if(count == 0){
+			const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			count = cpus > 0 ? (size_t)cpus : 1;
+		}
+		count = count > IMAGE_MAX_THREADS ? IMAGE_MAX_THREADS : count;
+		count = count > header.extent_count ? header.extent_count : count;
+		pthread_t workers[IMAGE_MAX_THREADS];
+		size_t started = 0;
+		while(started + 1 < count && pthread_create(&workers[started], NULL, load_extents, &load) == 0){
+			++started;
+		}
+		load_extents(&load); // This thread takes extents too, alone if no others could start
+		for(size_t t = 0; t < started; ++t){
+			pthread_join(workers[t], NULL);
+		}
+		ok = !atomic_load(&load.failed);
+	}
+	free(index);
+	return ok;
+}
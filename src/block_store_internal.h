@@ -0,0 +1,253 @@
+#ifndef BLOCK_STORE_INTERNAL_H__
+#define BLOCK_STORE_INTERNAL_H__
+
+// Pieces of the block store shared between its translation units, not part of the API
+
+#include<stdint.h>
+#include<stdbool.h>
+#include<string.h>
+#include<pthread.h>
+#include <sys/types.h>
+
+#include "../include/bitmap.h"
+#include "../include/hbitmap.h"
+#include "../include/block_store.h"
+#include "block_cache.h"
+#include "block_dedup.h"
+#include "crc32c.h"
+
+// BS_FLAG_CONCURRENT block locks. Stripes cover runs of 64 blocks, so one word of the dirty bitmap
+//  only ever belongs to one stripe, and consecutive runs land on different stripes
+#define STRIPE_COUNT 64
+#define STRIPE_SHIFT 6
+
+typedef struct magazine magazine_t;
+typedef struct block_store_aio block_store_aio_t;
+typedef struct block_store_journal block_store_journal_t;
+typedef struct block_store_counters block_store_counters_t;
+
+typedef struct block_store{
+	uint8_t *arena; // every block's payload back to back, block n lives at arena + n * block_size
+	size_t arena_bytes; // Size of the allocation (or mapping) behind arena
+	bool arena_mapped; // A heap arena that's an anonymous mapping of its own (BS_FLAG_HUGEPAGES, BS_FLAG_NUMA_*)
+	int *numa_nodes; // BS_FLAG_NUMA_PARTITION only, the node each numa_bytes of the arena went to, in order
+	size_t numa_bytes;
+	int fd; // Backing file of a memory mapped or cached device, -1 for one that lives on the heap
+	bitmap_t *fbm; // Free Block Map, one bit per block, overlaid on the first meta_blocks blocks of the arena
+	hbitmap_t *fbm_index; // Summary levels over the fbm, every fbm change goes through this
+	bitmap_t *dirty; // Blocks changed since the last block_store_flush, one bit per block (fbm changes dirty the meta blocks)
+	size_t block_size; // Bytes per block
+	size_t block_count; // Blocks in the device, including the ones holding the fbm
+	size_t meta_blocks; // Leading blocks taken up by the fbm (and the checksum table), always marked in use
+	size_t used_blocks; // Running count of set bits in the fbm, not counting the meta blocks
+	unsigned flags; // BS_FLAGS given at creation
+	pthread_rwlock_t *stripes; // BS_FLAG_CONCURRENT only, STRIPE_COUNT reader/writer locks guarding block contents
+	size_t free_hint; // BS_FLAG_CONCURRENT only, no fbm word before this one has a free bit
+	unsigned policy; // BS_POLICY the allocator follows
+	size_t next_fit; // BS_POLICY_NEXT_FIT, where the next search starts (right after the last allocation)
+	size_t defrag_cursor; // Where the next block_store_defragment step starts looking for free blocks to fill
+	size_t defrag_moved; // Blocks the current block_store_defragment pass has moved, a pass without any is the last
+	bool has_magazines; // BS_FLAG_THREAD_CACHE only, the rest of these are set up
+	pthread_key_t magazine_key; // Each thread's magazine for this device
+	pthread_mutex_t magazines_lock; // Guards the list below, taken before any magazine's own lock
+	magazine_t *magazines; // Every live magazine, so an exhausted device can take their blocks back
+	uint8_t *cached_ids; // One byte per block, set while it sits in some magazine (so a second release can be told apart)
+	block_cache_t *cache; // block_store_open_cached only, holds the data blocks, the arena just has the meta blocks
+	pthread_mutex_t readahead_lock; // Guards the sequential read detection below, only ever tried, never waited on
+	size_t readahead_next; // Block a sequential reader would ask for next
+	size_t readahead_window; // Blocks to prefetch at a time, adapts to how much of it gets used
+	size_t readahead_max; // Largest the window gets, a cached device keeps it well inside its cache
+	size_t readahead_mark; // Reading this block (or past it) sets off the next prefetch
+	size_t readahead_end; // End of what's been prefetched for the current reader, 0 without one
+	uint64_t readahead_wasted; // Cached devices only, the cache's wasted read-ahead count as of the last prefetch
+	pthread_mutex_t aio_lock; // Guards aio, and the whole engine while setting it up, submitting, and polling
+	block_store_aio_t *aio; // Asynchronous I/O engine, NULL until the first submit or block_store_aio_setup
+	block_store_journal_t *journal; // block_store_open_journaled only, every change gets a record in it
+	uint8_t *checksums; // BS_FLAG_CHECKSUM only, one CRC-32C per block in the meta blocks right after the fbm
+	bitmap_t *shared; // block_store_snapshot only, data blocks still shared with origin (it hasn't written them since)
+	block_store_t *origin; // block_store_snapshot only, the device the snapshot was taken of, NULL once that's gone
+	block_store_t *next_snapshot; // Next snapshot of the same origin
+	block_store_t *snapshots; // Snapshots of this device still around, only changed with every stripe locked
+	pthread_mutex_t snapshots_lock; // Keeps snapshots from joining or leaving the list above at the same time
+	block_dedup_t *dedup; // BS_FLAG_DEDUP only, holds the data blocks, the arena just has the meta blocks
+	block_store_counters_t *counters; // BS_FLAG_STATS only, every thread's operation counters
+#ifndef NDEBUG
+	uint32_t *pins; // Outstanding block_store_pin calls per block, only tracked to catch misuse
+#endif
+} block_store_t;
+
+// Address of a block's payload inside the arena (no bounds checking, callers do that)
+static inline uint8_t *block_store_block(const block_store_t *const bs, const size_t block_id){
+	return (*bs).arena + block_id * (*bs).block_size;
+}
+
+// BS_FLAG_CHECKSUM table entries, read and written under the block's lock
+static inline uint32_t block_store_checksum(const block_store_t *const bs, const size_t block_id){
+	uint32_t crc;
+	memcpy(&crc, (*bs).checksums + block_id * sizeof(crc), sizeof(crc));
+	return crc;
+}
+static inline void block_store_set_checksum(block_store_t *const bs, const size_t block_id, const uint32_t crc){
+	memcpy((*bs).checksums + block_id * sizeof(crc), &crc, sizeof(crc));
+	if((*bs).stripes == NULL){ // Like the fbm, flush writes every meta block of a concurrent device anyway
+		bitmap_set((*bs).dirty, (size_t)((*bs).checksums - (*bs).arena + block_id * sizeof(crc)) / (*bs).block_size);
+	}
+}
+// Whether a block's bytes still match its checksum, always true without BS_FLAG_CHECKSUM and for the meta blocks
+static inline bool block_store_verify(const block_store_t *const bs, const size_t block_id, const void *const data){
+	return (*bs).checksums == NULL || block_id < (*bs).meta_blocks || crc32c(data, (*bs).block_size) == block_store_checksum(bs, block_id);
+}
+
+// Block content locks, no-ops for devices that aren't concurrent
+static inline pthread_rwlock_t *block_store_stripe(const block_store_t *const bs, const size_t block_id){
+	return &(*bs).stripes[(block_id >> STRIPE_SHIFT) & (STRIPE_COUNT - 1)];
+}
+static inline void block_store_lock_read(const block_store_t *const bs, const size_t block_id){
+	if((*bs).stripes != NULL){
+		pthread_rwlock_rdlock(block_store_stripe(bs, block_id));
+	}
+}
+static inline void block_store_lock_write(const block_store_t *const bs, const size_t block_id){
+	if((*bs).stripes != NULL){
+		pthread_rwlock_wrlock(block_store_stripe(bs, block_id));
+	}
+}
+static inline void block_store_unlock(const block_store_t *const bs, const size_t block_id){
+	if((*bs).stripes != NULL){
+		pthread_rwlock_unlock(block_store_stripe(bs, block_id));
+	}
+}
+
+// Read locks every stripe (in order, so two of these can't deadlock), for whole-device operations
+static inline void block_store_lock_all(const block_store_t *const bs){
+	if((*bs).stripes != NULL){
+		for(size_t i = 0; i < STRIPE_COUNT; ++i){
+			pthread_rwlock_rdlock(&(*bs).stripes[i]);
+		}
+	}
+}
+static inline void block_store_unlock_all(const block_store_t *const bs){
+	if((*bs).stripes != NULL){
+		for(size_t i = STRIPE_COUNT; i-- > 0;){
+			pthread_rwlock_unlock(&(*bs).stripes[i]);
+		}
+	}
+}
+
+// Snapshots (block_store_snapshot.c) share the data blocks of the device they were taken of until it writes them
+//  Snapshots are read-only, every call that would change one fails
+static inline bool block_store_read_only(const block_store_t *const bs){
+	return bs != NULL && (*bs).shared != NULL;
+}
+//  Copies a data block out of a snapshot, from its origin if the block is still shared
+bool block_store_snapshot_copy_out(const block_store_t *const snapshot, const size_t block_id, void *const buffer);
+//  Hands the block's current contents to every snapshot still sharing it, before the device writes over it
+//   (called with the block's write lock held)
+bool block_store_snapshot_preserve(block_store_t *const bs, const size_t block_id);
+//  Gives a snapshot a copy of its own of a block, so a pointer into it can't change under the caller
+bool block_store_snapshot_own(block_store_t *const snapshot, const size_t block_id);
+//  Adds a new snapshot (meta blocks copied, every data block shared) to its origin's list
+void block_store_snapshot_attach(block_store_t *const snapshot, block_store_t *const origin);
+//  For block_store_destroy: a snapshot leaves its origin's list, a device hands every snapshot of it
+//   whatever it still shares with them first
+void block_store_snapshot_release(block_store_t *const bs);
+
+// Copies a block out, through the block cache for the data blocks of a cached device, from the dedup store for
+//  those of a deduplicated one, and from the device a snapshot was taken of for the blocks they still share
+//  (callers check the arguments and hold the block's lock)
+static inline bool block_store_copy_out(const block_store_t *const bs, const size_t block_id, void *const buffer){
+	if((*bs).cache != NULL && block_id >= (*bs).meta_blocks){
+		return block_cache_read((*bs).cache, block_id, buffer, true);
+	}
+	if((*bs).dedup != NULL && block_id >= (*bs).meta_blocks){
+		memcpy(buffer, block_dedup_data((*bs).dedup, block_id), (*bs).block_size);
+		return true;
+	}
+	if((*bs).shared != NULL && block_id >= (*bs).meta_blocks){
+		return block_store_snapshot_copy_out(bs, block_id, buffer);
+	}
+	memcpy(buffer, block_store_block(bs, block_id), (*bs).block_size);
+	return true;
+}
+
+// block_store_copy_out for whole-device passes (images, scrubs), which read past a cached device's cache
+//  so they don't push out its working set
+static inline bool block_store_copy_out_direct(const block_store_t *const bs, const size_t block_id, void *const buffer){
+	if((*bs).cache != NULL && block_id >= (*bs).meta_blocks){
+		return block_cache_read((*bs).cache, block_id, buffer, false);
+	}
+	return block_store_copy_out(bs, block_id, buffer);
+}
+
+// A device whose data blocks aren't all in its arena, readers copy them out instead of pointing into it
+static inline bool block_store_staged(const block_store_t *const bs){
+	return (*bs).cache != NULL || (*bs).dedup != NULL || (*bs).shared != NULL;
+}
+
+// Recomputes the used block counter and the fbm summaries after the fbm was changed behind our back
+//  (a write to a meta block)
+void block_store_reload_fbm(block_store_t *const bs);
+
+// pwrite/pread that keep going until everything is through (or it really fails), false on error
+//  A read hitting the end of the file early counts as an error, with errno set to EIO
+bool block_store_pwrite_all(const int fd, const uint8_t *data, size_t len, off_t offset);
+bool block_store_pread_all(const int fd, uint8_t *data, size_t len, off_t offset);
+
+// Compressed images (block_store_image.c): a header, an index, and extents of blocks compressed one by one
+//  Tells whether a file holds a compressed image (a raw one never starts like one, its first fbm bit is always set)
+bool block_store_image_compressed(const int fd);
+//  Writes the device's image in the compressed format (every block locked by the caller), false on error
+//   Data blocks missing from used (NULL for none) go in as zeros, and the meta blocks come from meta (NULL for the
+//   device's own). bytes gets the size of the file
+bool block_store_image_write(const block_store_t *const bs, const int fd, const bitmap_t *const used, const uint8_t *const meta, size_t *const bytes);
+//  Loads a compressed image into a freshly created device of the same geometry (all zeros, nobody else using it)
+//   Extents are decompressed by up to threads threads (0 for one per CPU), false on error or a corrupt image
+bool block_store_image_read(block_store_t *const bs, const int fd, const unsigned threads);
+
+// Heap arenas placed for BS_FLAG_HUGEPAGES and the BS_FLAG_NUMA_* flags (block_store_arena.c)
+//  Maps an arena of at least bytes, zeroed and with none of its pages made yet, false on error
+bool block_store_arena_map(block_store_t *const bs, const size_t bytes);
+//  Unmaps it, for block_store_destroy
+void block_store_arena_unmap(block_store_t *const bs);
+
+// Waits for every outstanding asynchronous request and shuts the engine down, for block_store_destroy
+void block_store_aio_release(block_store_t *const bs);
+
+// Write-ahead journal (block_store_journal.c), the image's journal lives next to it in <image>.journal
+//  Replays it onto a device just loaded from the image and retires it, no journal counts as success
+bool block_store_journal_replay(block_store_t *const bs, const char *const image);
+//  Drops the journal of an image the device was just serialized or flushed over, unless it's the device's own
+void block_store_journal_retire(const block_store_t *const bs, const char *const image);
+//  Starts journaling the device's changes, folding whatever the journal held into the image first
+bool block_store_journal_attach(block_store_t *const bs, const char *const image);
+//  Records a write, called with the block's lock held so the journal sees writes in the order they happened
+void block_store_journal_write(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *const data);
+//  Records a block's new checksum (BS_FLAG_CHECKSUM), along with the write that changed it
+void block_store_journal_checksum(block_store_t *const bs, const size_t block_id, const uint32_t crc);
+//  Records blocks [first, first + count) getting allocated or released
+void block_store_journal_fbm(block_store_t *const bs, const bool allocated, const size_t first, const size_t count);
+//  Checkpoints one last time and closes the journal, for block_store_destroy
+void block_store_journal_release(block_store_t *const bs);
+//  Reads the journal's counters, false if the device isn't journaled
+bool block_store_journal_stats(const block_store_t *const bs, block_store_journal_stats_t *const stats);
+
+// BS_FLAG_STATS operation counters (block_store_stats.c), kept per thread and added up by block_store_get_stats
+//  Sets them up for block_store_prepare, false if they couldn't be
+bool block_store_stats_setup(block_store_t *const bs);
+//  Frees every thread's counters, for block_store_destroy
+void block_store_stats_release(block_store_t *const bs);
+//  The monotonic clock in nanoseconds
+uint64_t block_store_stats_now(void);
+//  Counts a finished operation in the calling thread's counters
+void block_store_stats_record(const block_store_t *const bs, const BS_OP op, const uint64_t started, const bool ok, const size_t bytes);
+//  Public entry points bracket their work with these, which cost a branch on devices without BS_FLAG_STATS
+static inline uint64_t block_store_stats_start(const block_store_t *const bs){
+	return bs != NULL && (*bs).counters != NULL ? block_store_stats_now() : 0;
+}
+static inline void block_store_stats_end(const block_store_t *const bs, const BS_OP op, const uint64_t started, const bool ok, const size_t bytes){
+	if(bs != NULL && (*bs).counters != NULL){
+		block_store_stats_record(bs, op, started, ok, bytes);
+	}
+}
+
+#endif
@@ -0,0 +1,554 @@
+#define _POSIX_C_SOURCE 200809L // pread/pwrite and fdatasync under -std=c11
+#include<string.h>
+#include<stdio.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "block_store_internal.h"
+
+#define JOURNAL_MAGIC UINT64_C(0x4C4E524A53422E) // ".BSJRNL", little endian
+#define JOURNAL_VERSION 2 // 2 added CHECKSUM records, a version 1 journal still replays
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_CHECKPOINT_BYTES (8u << 20) // Journal size that wakes the checkpointer
+#define JOURNAL_SPILL_BYTES (1u << 20) // Records buffered past this go to the file without waiting for a commit
+
+typedef enum { RECORD_WRITE = 1, RECORD_ALLOCATE = 2, RECORD_RELEASE = 3, RECORD_CHECKSUM = 4 } RECORD_TYPE;
+
+// Start of the journal file, rewritten with the next generation at each checkpoint
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t crc; // CRC-32C of this header, with this field zero
+	uint64_t block_size;
+	uint64_t block_count;
+	uint64_t generation; // Only records carrying it count, anything else is left over from before the last checkpoint
+} journal_header_t;
+
+// One change to the device, a WRITE's bytes follow it (padded to 8)
+typedef struct {
+	uint32_t crc; // CRC-32C of the rest of the record, payload and padding included
+	uint32_t type; // RECORD_TYPE
+	uint64_t generation;
+	uint64_t block_id; // First block
+	uint64_t offset; // WRITE: byte offset within the block, CHECKSUM: the block's new checksum
+	uint64_t length; // WRITE: payload bytes, ALLOCATE and RELEASE: number of blocks, CHECKSUM: 1
+} journal_record_t;
+
+struct block_store_journal{
+	block_store_t *bs;
+	pthread_mutex_t lock;
+	pthread_cond_t settled; // A write-out (commit or checkpoint) finished
+	pthread_cond_t wake; // For the checkpointer, the journal grew past JOURNAL_CHECKPOINT_BYTES or it has to stop
+	int fd; // The journal
+	int image_fd; // The image records get folded into
+	uint64_t generation;
+	uint8_t *buffer, *spare; // Records that aren't in the file yet, and the buffer a write-out took with it
+	size_t buffered, capacity, spare_capacity;
+	off_t file_end; // Where the next write-out goes
+	uint64_t appended; // Bytes of records appended since the journal was opened
+	uint64_t durable; // How many of those are safely on disk, in the journal or in the image
+	uint64_t syncs, checkpoints; // Group commits written out and checkpoints done, for block_store_get_stats
+	bool busy; // Somebody is writing the journal out or checkpointing, everyone else buffers or waits
+	int error; // errno of the first failure, every commit fails after one
+	pthread_t checkpointer;
+	bool has_checkpointer, stopping;
+};
+
+//
+///
+// RECORDS
+///
+//
+
+static inline size_t record_bytes(const size_t payload){
+	return sizeof(journal_record_t) + ((payload + 7) & ~(size_t)7);
+}
+
+static uint32_t header_crc(journal_header_t header){
+	header.crc = 0;
+	return crc32c(&header, sizeof(header));
+}
+
+// Walks the records in data, handing each intact one of the given generation to apply
+//  Stops at the first torn, stale, or nonsensical record (how a journal cut off by a crash ends)
+//  Returns false if apply did
+static bool journal_parse(const block_store_t *const bs, const uint8_t *data, size_t len, const uint64_t generation,
+	bool (*apply)(void *, const journal_record_t *, const uint8_t *), void *const context){
+	while(len >= sizeof(journal_record_t)){
+		journal_record_t record;
+		memcpy(&record, data, sizeof(record));
+		const bool write = record.type == RECORD_WRITE, checksum = record.type == RECORD_CHECKSUM;
+		if(record.generation != generation || record.block_id >= (*bs).block_count || record.length == 0
+			|| (write && (record.offset >= (*bs).block_size || record.length > (*bs).block_size - record.offset))
+			|| (checksum && ((*bs).checksums == NULL || record.block_id < (*bs).meta_blocks || record.offset > UINT32_MAX || record.length != 1))
+			|| (!write && !checksum && record.type != RECORD_ALLOCATE && record.type != RECORD_RELEASE)
+			|| (!write && record.length > (*bs).block_count - record.block_id)){
+			return true;
+		}
+		const size_t size = record_bytes(write ? record.length : 0);
+		if(size > len || crc32c(data + sizeof(uint32_t), size - sizeof(uint32_t)) != record.crc){
+			return true;
+		}
+		if(!apply(context, &record, data + sizeof(record))){
+			return false;
+		}
+		data += size;
+		len -= size;
+	}
+	return true;
+}
+
+// Puts a record into the buffer, spilling it to the file once it gets big
+static void journal_append(block_store_journal_t *const journal, const uint32_t type, const size_t block_id, const size_t offset, const size_t length, const void *const payload){
+	const size_t payload_bytes = type == RECORD_WRITE ? length : 0, size = record_bytes(payload_bytes);
+	pthread_mutex_lock(&(*journal).lock);
+	if((*journal).buffered + size > (*journal).capacity){
+		size_t capacity = (*journal).capacity ? (*journal).capacity : 4096;
+		while(capacity < (*journal).buffered + size){
+			capacity *= 2;
+		}
+		uint8_t *const buffer = realloc((*journal).buffer, capacity);
+		if(buffer == NULL){
+			(*journal).error = (*journal).error ? (*journal).error : ENOMEM; // The change can't be made durable anymore
+			pthread_mutex_unlock(&(*journal).lock);
+			return;
+		}
+		(*journal).buffer = buffer;
+		(*journal).capacity = capacity;
+	}
+	uint8_t *const at = (*journal).buffer + (*journal).buffered;
+	const journal_record_t record = {0, type, (*journal).generation, block_id, offset, length};
+	memcpy(at, &record, sizeof(record));
+	if(payload_bytes > 0){
+		memcpy(at + sizeof(record), payload, payload_bytes);
+	}
+	memset(at + sizeof(record) + payload_bytes, 0, size - sizeof(record) - payload_bytes);
+	const uint32_t crc = crc32c(at + sizeof(uint32_t), size - sizeof(uint32_t));
+	memcpy(at, &crc, sizeof(crc));
+	(*journal).buffered += size;
+	(*journal).appended += size;
+	if((*journal).buffered >= JOURNAL_SPILL_BYTES && !(*journal).busy && (*journal).error == 0){
+		// Written but not synced, the next commit only has the rest to write
+		if(block_store_pwrite_all((*journal).fd, (*journal).buffer, (*journal).buffered, (*journal).file_end)){
+			(*journal).file_end += (off_t)(*journal).buffered;
+			(*journal).buffered = 0;
+		} else {
+			(*journal).error = errno ? errno : EIO;
+		}
+		if((*journal).file_end >= (off_t)JOURNAL_CHECKPOINT_BYTES){
+			pthread_cond_signal(&(*journal).wake);
+		}
+	}
+	pthread_mutex_unlock(&(*journal).lock);
+}
+
+// Records a write to (part of) a block, called with the block's lock held so the journal has writes in the order they happened
+void block_store_journal_write(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *const data){
+	journal_append((*bs).journal, RECORD_WRITE, block_id, offset, len, data);
+}
+
+// Records a block's new checksum, right after the write that changed it
+void block_store_journal_checksum(block_store_t *const bs, const size_t block_id, const uint32_t crc){
+	journal_append((*bs).journal, RECORD_CHECKSUM, block_id, crc, 1, NULL);
+}
+
+// Records blocks [first, first + count) getting allocated or released
+void block_store_journal_fbm(block_store_t *const bs, const bool allocated, const size_t first, const size_t count){
+	journal_append((*bs).journal, allocated ? RECORD_ALLOCATE : RECORD_RELEASE, first, 0, count, NULL);
+}
+
+//
+///
+// RECOVERY
+///
+//
+
+// Applies a record to the device itself
+static bool apply_to_device(void *const context, const journal_record_t *const record, const uint8_t *const payload){
+	block_store_t *const bs = context;
+	if((*record).type == RECORD_WRITE){
+		if((*bs).dedup != NULL && (*record).block_id >= (*bs).meta_blocks){
+			if(!block_dedup_write((*bs).dedup, (*record).block_id, (*record).offset, (*record).length, payload)){
+				return false;
+			}
+		} else {
+			memcpy(block_store_block(bs, (*record).block_id) + (*record).offset, payload, (*record).length);
+		}
+		bitmap_set((*bs).dirty, (*record).block_id);
+		return true;
+	}
+	if((*record).type == RECORD_CHECKSUM){
+		block_store_set_checksum(bs, (*record).block_id, (uint32_t)(*record).offset);
+		return true;
+	}
+	if((*record).type == RECORD_ALLOCATE){
+		bitmap_set_range((*bs).fbm, (*record).block_id, (*record).length);
+	} else {
+		bitmap_reset_range((*bs).fbm, (*record).block_id, (*record).length);
+	}
+	bitmap_set_range((*bs).dirty, 0, (*bs).meta_blocks);
+	return true;
+}
+
+// Reads the journal's header, false if it isn't a journal for a device of this geometry
+static bool journal_read_header(const block_store_t *const bs, const int fd, journal_header_t *const header){
+	return block_store_pread_all(fd, (uint8_t *)header, sizeof(*header), 0) && (*header).magic == JOURNAL_MAGIC
+		&& (*header).version >= 1 && (*header).version <= JOURNAL_VERSION && (*header).crc == header_crc(*header)
+		&& (*header).block_size == (*bs).block_size && (*header).block_count == (*bs).block_count;
+}
+
+// Reads bytes [from, to) of a file into a new buffer, NULL on error
+static uint8_t *read_range(const int fd, const off_t from, const off_t to){
+	uint8_t *const data = malloc(to > from ? (size_t)(to - from) : 1);
+	if(data != NULL && to > from && !block_store_pread_all(fd, data, (size_t)(to - from), from)){
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static bool journal_path(const char *const image, char *const path, const size_t size){
+	return (size_t)snprintf(path, size, "%s" JOURNAL_SUFFIX, image) < size;
+}
+
+static block_store_journal_t *journal_open(block_store_t *const bs, const char *const image);
+static void journal_free(block_store_journal_t *const journal);
+
+// Whether the image is a raw one of the device's size, the only kind a journal is ever kept next to
+static bool journal_image(const block_store_t *const bs, const char *const image){
+	struct stat st;
+	return stat(image, &st) == 0 && (uintmax_t)st.st_size == (*bs).block_size * (*bs).block_count;
+}
+
+// Replays the journal next to the image onto a device that was just loaded from it
+//  No journal, or an empty one, is nothing to replay. One that belongs to some other geometry is an error.
+//  Once replayed, the records are folded into the image and retired (a new generation disowns them), or whatever
+//  gets written over the image later would be undone by them on the next load. An image this process can't
+//  write to keeps its journal, nothing here can write over it either.
+bool block_store_journal_replay(block_store_t *const bs, const char *const image){
+	char path[4096];
+	if(!journal_path(image, path, sizeof(path))){
+		return false;
+	}
+	const int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return errno == ENOENT;
+	}
+	struct stat st;
+	journal_header_t header;
+	bool ok = fstat(fd, &st) == 0;
+	if(ok && st.st_size > 0 && journal_image(bs, image)){ // Next to anything else it's left over from an image long gone
+		uint8_t *data = NULL;
+		ok = journal_read_header(bs, fd, &header) && (data = read_range(fd, sizeof(header), st.st_size)) != NULL
+			&& journal_parse(bs, data, (size_t)st.st_size - sizeof(header), header.generation, apply_to_device, bs);
+		free(data);
+		block_store_reload_fbm(bs);
+	}
+	close(fd);
+	if(ok && st.st_size > (off_t)sizeof(header) && journal_image(bs, image) && access(image, W_OK) == 0){
+		block_store_journal_t *const recovered = journal_open(bs, image);
+		ok = recovered != NULL;
+		if(recovered != NULL){
+			journal_free(recovered);
+		}
+	}
+	return ok;
+}
+
+// Drops the journal next to an image that was just written over in full, its records are older than the image now
+//  Unless it's the device's own journal, which is replayed onto the very state it led to
+void block_store_journal_retire(const block_store_t *const bs, const char *const image){
+	char path[4096];
+	struct stat own, st;
+	if((*bs).journal != NULL && fstat((*(*bs).journal).image_fd, &own) == 0 && stat(image, &st) == 0
+		&& own.st_dev == st.st_dev && own.st_ino == st.st_ino){
+		return;
+	}
+	if(journal_path(image, path, sizeof(path))){
+		unlink(path); // Most images don't have one
+	}
+}
+
+//
+///
+// CHECKPOINTS
+///
+//
+
+// Folding into the image: block data goes straight to the file, the meta blocks are collected in memory
+typedef struct {
+	const block_store_t *bs;
+	int fd;
+	uint8_t *meta; // The image's meta blocks
+	bitmap_t *fbm; // Overlaid on meta
+} fold_t;
+
+static bool apply_to_image(void *const context, const journal_record_t *const record, const uint8_t *const payload){
+	fold_t *const fold = context;
+	const block_store_t *const bs = (*fold).bs;
+	if((*record).type == RECORD_WRITE){
+		if((*record).block_id < (*bs).meta_blocks){
+			memcpy((*fold).meta + (*record).block_id * (*bs).block_size + (*record).offset, payload, (*record).length);
+			return true;
+		}
+		return block_store_pwrite_all((*fold).fd, payload, (*record).length, (off_t)((*record).block_id * (*bs).block_size + (*record).offset));
+	}
+	if((*record).type == RECORD_CHECKSUM){ // The table is in the meta blocks, at the same place as in the device's arena
+		const uint32_t crc = (uint32_t)(*record).offset;
+		memcpy((*fold).meta + ((*bs).checksums - (*bs).arena) + (*record).block_id * sizeof(crc), &crc, sizeof(crc));
+		return true;
+	}
+	if((*record).type == RECORD_ALLOCATE){
+		bitmap_set_range((*fold).fbm, (*record).block_id, (*record).length);
+	} else {
+		bitmap_reset_range((*fold).fbm, (*record).block_id, (*record).length);
+	}
+	return true;
+}
+
+// Folds the records in bytes [from, to) of the journal into the image
+static bool journal_fold(block_store_journal_t *const journal, fold_t *const fold, const off_t from, const off_t to){
+	uint8_t *const data = read_range((*journal).fd, from, to);
+	const bool ok = data != NULL && journal_parse((*journal).bs, data, (size_t)(to - from), (*journal).generation, apply_to_image, fold);
+	free(data);
+	return ok;
+}
+
+static bool journal_write_header(block_store_journal_t *const journal){
+	journal_header_t header = {JOURNAL_MAGIC, JOURNAL_VERSION, 0, (*(*journal).bs).block_size, (*(*journal).bs).block_count, (*journal).generation};
+	header.crc = header_crc(header);
+	return block_store_pwrite_all((*journal).fd, (const uint8_t *)&header, sizeof(header), 0);
+}
+
+// Folds every record into the image and starts the journal over
+//  What's in the file already is folded while writers keep appending, only the rest holds them up
+static bool journal_checkpoint(block_store_journal_t *const journal){
+	const block_store_t *const bs = (*journal).bs;
+	pthread_mutex_lock(&(*journal).lock);
+	while((*journal).busy){
+		pthread_cond_wait(&(*journal).settled, &(*journal).lock);
+	}
+	if((*journal).error != 0){
+		pthread_mutex_unlock(&(*journal).lock);
+		return false;
+	}
+	(*journal).busy = true;
+	const off_t written = (*journal).file_end;
+	pthread_mutex_unlock(&(*journal).lock);
+
+	const size_t meta_bytes = (*bs).meta_blocks * (*bs).block_size;
+	fold_t fold = {bs, (*journal).image_fd, malloc(meta_bytes), NULL};
+	bool ok = fold.meta != NULL && block_store_pread_all(fold.fd, fold.meta, meta_bytes, 0)
+		&& (fold.fbm = bitmap_overlay((*bs).block_count, fold.meta)) != NULL
+		&& journal_fold(journal, &fold, sizeof(journal_header_t), written);
+
+	pthread_mutex_lock(&(*journal).lock);
+	if(ok && (*journal).buffered > 0){
+		ok = block_store_pwrite_all((*journal).fd, (*journal).buffer, (*journal).buffered, (*journal).file_end);
+		(*journal).file_end += (off_t)(*journal).buffered;
+		(*journal).buffered = 0;
+	}
+	ok = ok && journal_fold(journal, &fold, written, (*journal).file_end)
+		&& block_store_pwrite_all(fold.fd, fold.meta, meta_bytes, 0) && fsync(fold.fd) == 0;
+	if(ok){
+		// The image has everything now, a new generation disowns every record in the file
+		++(*journal).generation;
+		ok = journal_write_header(journal) && ftruncate((*journal).fd, sizeof(journal_header_t)) == 0 && fdatasync((*journal).fd) == 0;
+		(*journal).file_end = sizeof(journal_header_t);
+		(*journal).durable = (*journal).appended;
+		++(*journal).checkpoints;
+	}
+	if(!ok){
+		(*journal).error = errno ? errno : EIO;
+	}
+	(*journal).busy = false;
+	pthread_cond_broadcast(&(*journal).settled);
+	pthread_mutex_unlock(&(*journal).lock);
+	bitmap_destroy(fold.fbm);
+	free(fold.meta);
+	return ok;
+}
+
+// Background checkpointer, folds the journal into the image whenever it gets big
+static void *journal_checkpointer(void *const arg){
+	block_store_journal_t *const journal = arg;
+	pthread_mutex_lock(&(*journal).lock);
+	while(!(*journal).stopping){
+		if((*journal).file_end < (off_t)JOURNAL_CHECKPOINT_BYTES || (*journal).error != 0){
+			pthread_cond_wait(&(*journal).wake, &(*journal).lock);
+			continue;
+		}
+		pthread_mutex_unlock(&(*journal).lock);
+		journal_checkpoint(journal);
+		pthread_mutex_lock(&(*journal).lock);
+	}
+	pthread_mutex_unlock(&(*journal).lock);
+	return NULL;
+}
+
+static void journal_free(block_store_journal_t *const journal){
+	if((*journal).has_checkpointer){
+		pthread_mutex_lock(&(*journal).lock);
+		(*journal).stopping = true;
+		pthread_cond_signal(&(*journal).wake);
+		pthread_mutex_unlock(&(*journal).lock);
+		pthread_join((*journal).checkpointer, NULL);
+	}
+	if((*journal).fd >= 0){
+		close((*journal).fd);
+	}
+	if((*journal).image_fd >= 0){
+		close((*journal).image_fd);
+	}
+	pthread_cond_destroy(&(*journal).wake);
+	pthread_cond_destroy(&(*journal).settled);
+	pthread_mutex_destroy(&(*journal).lock);
+	free((*journal).buffer);
+	free((*journal).spare);
+	free(journal);
+}
+
+// Opens (or creates) the journal next to the image the device was loaded from, and folds whatever it holds into
+//  the image, NULL on error. The records were replayed already
+static block_store_journal_t *journal_open(block_store_t *const bs, const char *const image){
+	char path[4096];
+	if(!journal_path(image, path, sizeof(path))){
+		return NULL;
+	}
+	block_store_journal_t *const journal = calloc(1, sizeof(block_store_journal_t));
+	if(journal == NULL){
+		return NULL;
+	}
+	pthread_mutex_init(&(*journal).lock, NULL);
+	pthread_cond_init(&(*journal).settled, NULL);
+	pthread_cond_init(&(*journal).wake, NULL);
+	(*journal).bs = bs;
+	(*journal).image_fd = open(image, O_RDWR);
+	(*journal).fd = open(path, O_RDWR | O_CREAT, 0666);
+	struct stat st;
+	journal_header_t header;
+	if((*journal).image_fd < 0 || (*journal).fd < 0 || fstat((*journal).fd, &st) != 0){
+		journal_free(journal);
+		return NULL;
+	}
+	if(st.st_size > 0 && journal_read_header(bs, (*journal).fd, &header)){
+		(*journal).generation = header.generation;
+		(*journal).file_end = st.st_size;
+	} else if(!(st.st_size == 0 && journal_write_header(journal))){
+		journal_free(journal); // Not a journal of ours, better not write over it
+		return NULL;
+	} else {
+		(*journal).file_end = sizeof(journal_header_t);
+	}
+	if(!journal_checkpoint(journal)){
+		journal_free(journal);
+		return NULL;
+	}
+	return journal;
+}
+
+// Starts journaling the device's changes next to the image it was loaded from (which has to exist)
+//  Whatever the journal held was replayed already, it's folded into the image right away
+bool block_store_journal_attach(block_store_t *const bs, const char *const image){
+	block_store_journal_t *const journal = journal_open(bs, image);
+	if(journal == NULL){
+		return false;
+	}
+	(*journal).has_checkpointer = pthread_create(&(*journal).checkpointer, NULL, journal_checkpointer, journal) == 0;
+	if(!(*journal).has_checkpointer){
+		journal_free(journal);
+		return false;
+	}
+	(*bs).journal = journal;
+	return true;
+}
+
+// Checkpoints one last time and closes the journal, for block_store_destroy
+void block_store_journal_release(block_store_t *const bs){
+	if((*bs).journal != NULL){
+		journal_checkpoint((*bs).journal); // Nothing to report a failure to, the journal keeps whatever made it out
+		journal_free((*bs).journal);
+		(*bs).journal = NULL;
+	}
+}
+
+// Reads the journal's counters, false if the device isn't journaled
+bool block_store_journal_stats(const block_store_t *const bs, block_store_journal_stats_t *const stats){
+	block_store_journal_t *const journal = (*bs).journal;
+	if(journal == NULL){
+		return false;
+	}
+	pthread_mutex_lock(&(*journal).lock);
+	*stats = (block_store_journal_stats_t){(*journal).appended, (*journal).durable, (*journal).syncs, (*journal).checkpoints};
+	pthread_mutex_unlock(&(*journal).lock);
+	return true;
+}
+
+//
+///
+// API
+///
+//
+
+/// Makes every change made to a journaled device so far durable, a write to the journal and one fsync
+///  Commits running at the same time share the fsync (group commit)
+/// \param bs BS device opened with block_store_open_journaled
+/// \return boolean indicating success, false after any journal I/O error
+//
+bool block_store_commit(block_store_t *const bs){
+	if(bs == NULL || (*bs).journal == NULL){
+		return false;
+	}
+	block_store_journal_t *const journal = (*bs).journal;
+	pthread_mutex_lock(&(*journal).lock);
+	const uint64_t target = (*journal).appended;
+	while((*journal).error == 0 && (*journal).durable < target){
+		if((*journal).busy){
+			pthread_cond_wait(&(*journal).settled, &(*journal).lock); // Might take care of our records, or be a checkpoint
+			continue;
+		}
+		// Lead this group: take the buffer, whoever appends in the meantime waits for the next one
+		(*journal).busy = true;
+		uint8_t *const records = (*journal).buffer;
+		const size_t len = (*journal).buffered, capacity = (*journal).capacity;
+		(*journal).buffer = (*journal).spare;
+		(*journal).capacity = (*journal).spare_capacity;
+		(*journal).buffered = 0;
+		const uint64_t end = (*journal).appended;
+		const off_t at = (*journal).file_end;
+		(*journal).file_end += (off_t)len;
+		pthread_mutex_unlock(&(*journal).lock);
+		const bool ok = block_store_pwrite_all((*journal).fd, records, len, at) && fdatasync((*journal).fd) == 0;
+		pthread_mutex_lock(&(*journal).lock);
+		(*journal).spare = records;
+		(*journal).spare_capacity = capacity;
+		if(ok){
+			(*journal).durable = end;
+			++(*journal).syncs;
+		} else {
+			(*journal).error = errno ? errno : EIO;
+		}
+		(*journal).busy = false;
+		pthread_cond_broadcast(&(*journal).settled);
+		if((*journal).file_end >= (off_t)JOURNAL_CHECKPOINT_BYTES){
+			pthread_cond_signal(&(*journal).wake);
+		}
+	}
+	const bool ok = (*journal).error == 0;
+	pthread_mutex_unlock(&(*journal).lock);
+	return ok;
+}
+
+/// Folds the journal into the device's image and empties it, without waiting for the checkpointer
+/// \param bs BS device opened with block_store_open_journaled
+/// \return boolean indicating success
+//
+bool block_store_checkpoint(block_store_t *const bs){
+	if(bs == NULL || (*bs).journal == NULL){
+		return false;
+	}
+	return journal_checkpoint((*bs).journal);
+}
@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L // rwlocks under -std=c11
+#include<string.h>
+
+#include "block_store_internal.h"
+
+// A snapshot is a device of its own with the origin's geometry. Its meta blocks (fbm and checksums) are copied
+//  when it's taken, its data blocks start out shared: its shared bit for the block is set and reads go to the origin.
+//  The first time the origin writes a shared block, the old contents go into the snapshot's arena and the bit is cleared.
+// The shared bits of a block are only touched under the origin's lock for that block, the same way its dirty bit is.
+
+// Copies a data block out of a snapshot, from its origin if the block is still shared
+bool block_store_snapshot_copy_out(const block_store_t *const snapshot, const size_t block_id, void *const buffer){
+	block_store_t *const origin = (*snapshot).origin;
+	if(origin != NULL){
+		block_store_lock_read(origin, block_id);
+		if(bitmap_test((*snapshot).shared, block_id)){
+			const bool ok = block_store_copy_out(origin, block_id, buffer);
+			block_store_unlock(origin, block_id);
+			return ok;
+		}
+		block_store_unlock(origin, block_id);
+	}
+	memcpy(buffer, block_store_block(snapshot, block_id), (*snapshot).block_size); // Ours for good once the bit is clear
+	return true;
+}
+
+// Hands the block's current contents to every snapshot still sharing it, before the device writes over it
+//  (called with the block's write lock held)
+bool block_store_snapshot_preserve(block_store_t *const bs, const size_t block_id){
+	for(block_store_t *snapshot = (*bs).snapshots; snapshot != NULL; snapshot = (*snapshot).next_snapshot){
+		if(bitmap_test((*snapshot).shared, block_id)){
+			if(!block_store_copy_out(bs, block_id, block_store_block(snapshot, block_id))){
+				return false;
+			}
+			bitmap_reset((*snapshot).shared, block_id);
+		}
+	}
+	return true;
+}
+
+// Gives a snapshot a copy of its own of a block, so a pointer into it can't change under the caller
+bool block_store_snapshot_own(block_store_t *const snapshot, const size_t block_id){
+	block_store_t *const origin = (*snapshot).origin;
+	if(origin == NULL || block_id < (*snapshot).meta_blocks){
+		return true;
+	}
+	block_store_lock_write(origin, block_id); // Same as a write would, the bit can't change under us
+	bool ok = true;
+	if(bitmap_test((*snapshot).shared, block_id)){
+		ok = block_store_copy_out(origin, block_id, block_store_block(snapshot, block_id));
+		if(ok){
+			bitmap_reset((*snapshot).shared, block_id);
+		}
+	}
+	block_store_unlock(origin, block_id);
+	return ok;
+}
+
+// Adds a new snapshot (meta blocks copied, every data block shared) to its origin's list
+void block_store_snapshot_attach(block_store_t *const snapshot, block_store_t *const origin){
+	(*snapshot).origin = origin;
+	(*snapshot).next_snapshot = (*origin).snapshots;
+	(*origin).snapshots = snapshot;
+}
+
+// Copies everything a snapshot still shares with its origin into it and cuts it loose (origin's list lock held)
+static void snapshot_detach(block_store_t *const snapshot){
+	block_store_t *const origin = (*snapshot).origin;
+	block_store_lock_all(origin);
+	for(size_t i = bitmap_ffs((*snapshot).shared); i != SIZE_MAX; i = i + 1 < (*snapshot).block_count ? bitmap_ffs_from((*snapshot).shared, i + 1) : SIZE_MAX){
+		if(block_store_copy_out(origin, i, block_store_block(snapshot, i))){
+			bitmap_reset((*snapshot).shared, i);
+		}
+		// A block that can't be read leaves the snapshot with whatever its arena has there, nowhere to report it
+	}
+	(*origin).snapshots = (*snapshot).next_snapshot;
+	(*snapshot).origin = NULL;
+	(*snapshot).next_snapshot = NULL;
+	block_store_unlock_all(origin);
+}
+
+// For block_store_destroy: a snapshot leaves its origin's list, a device hands every snapshot of it
+//  whatever it still shares with them first
+void block_store_snapshot_release(block_store_t *const bs){
+	block_store_t *const origin = (*bs).origin;
+	if(origin != NULL){
+		pthread_mutex_lock(&(*origin).snapshots_lock);
+		block_store_lock_all(origin); // Writers walk the list with their block locked
+		block_store_t **link = &(*origin).snapshots;
+		while(*link != bs){
+			link = &(**link).next_snapshot;
+		}
+		*link = (*bs).next_snapshot;
+		block_store_unlock_all(origin);
+		pthread_mutex_unlock(&(*origin).snapshots_lock);
+		(*bs).origin = NULL;
+	}
+	pthread_mutex_lock(&(*bs).snapshots_lock);
+	while((*bs).snapshots != NULL){
+		snapshot_detach((*bs).snapshots);
+	}
+	pthread_mutex_unlock(&(*bs).snapshots_lock);
+	bitmap_destroy((*bs).shared);
+	(*bs).shared = NULL;
+}
@@ -0,0 +1,280 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime under -std=c11
+#include<string.h>
+#include<time.h>
+
+#include "block_store_internal.h"
+
+// BS_FLAG_STATS counters: every thread gets a shard of its own the first time it finishes an operation on the
+//  device, and it's the only one to ever write to it. Updates are a relaxed load and store (no locked
+//  instruction, no cache line shared with another thread), readers add every shard up with relaxed loads of
+//  their own. A thread's shard is folded into the device's totals when the thread exits.
+
+typedef struct stats_shard stats_shard_t;
+struct stats_shard{
+	block_store_op_stats_t ops[BS_OP_COUNT];
+	block_store_counters_t *counters; // The device's, to find the list from the thread exit destructor
+	stats_shard_t *prev, *next;
+};
+
+struct block_store_counters{
+	pthread_key_t key; // Each thread's shard for this device
+	pthread_mutex_t lock; // Guards the list below and the totals
+	stats_shard_t *shards; // Shards of threads still around
+	block_store_op_stats_t retired[BS_OP_COUNT]; // What threads that have exited counted
+};
+
+// Adds to a counter only the calling thread writes to
+static inline void counter_add(uint64_t *const counter, const uint64_t value){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Histogram bucket of a latency: the power of two it falls in picks a group of BS_STATS_SUB_BUCKETS,
+//  the next three bits the bucket inside it
+static inline size_t latency_bucket(const uint64_t ns){
+	if(ns < BS_STATS_SUB_BUCKETS){
+		return (size_t)ns;
+	}
+	const unsigned octave = 63 - (unsigned)__builtin_clzll(ns); // 3 and up
+	if(octave > 40){
+		return BS_STATS_BUCKETS - 1;
+	}
+	return (size_t)(octave - 2) * BS_STATS_SUB_BUCKETS + (size_t)((ns >> (octave - 3)) & (BS_STATS_SUB_BUCKETS - 1));
+}
+
+// Adds one set of counters to another, reading from with relaxed loads (its owner may be updating it)
+static void merge_ops(block_store_op_stats_t *const into, const block_store_op_stats_t *const from){
+	for(size_t op = 0; op < BS_OP_COUNT; ++op){
+		into[op].calls += __atomic_load_n(&from[op].calls, __ATOMIC_RELAXED);
+		into[op].failures += __atomic_load_n(&from[op].failures, __ATOMIC_RELAXED);
+		into[op].bytes += __atomic_load_n(&from[op].bytes, __ATOMIC_RELAXED);
+		into[op].total_ns += __atomic_load_n(&from[op].total_ns, __ATOMIC_RELAXED);
+		const uint64_t max_ns = __atomic_load_n(&from[op].max_ns, __ATOMIC_RELAXED);
+		into[op].max_ns = max_ns > into[op].max_ns ? max_ns : into[op].max_ns;
+		for(size_t b = 0; b < BS_STATS_BUCKETS; ++b){
+			into[op].latency[b] += __atomic_load_n(&from[op].latency[b], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Thread exit destructor, the thread's counts go into the device's totals
+static void shard_thread_exit(void *const arg){
+	stats_shard_t *const shard = arg;
+	block_store_counters_t *const counters = (*shard).counters;
+	pthread_mutex_lock(&(*counters).lock);
+	merge_ops((*counters).retired, (*shard).ops);
+	if((*shard).prev != NULL){
+		(*(*shard).prev).next = (*shard).next;
+	} else {
+		(*counters).shards = (*shard).next;
+	}
+	if((*shard).next != NULL){
+		(*(*shard).next).prev = (*shard).prev;
+	}
+	pthread_mutex_unlock(&(*counters).lock);
+	free(shard);
+}
+
+// The calling thread's shard, made on first use, NULL if there's no memory for one
+static stats_shard_t *shard_get(block_store_counters_t *const counters){
+	stats_shard_t *shard = pthread_getspecific((*counters).key);
+	if(shard != NULL){
+		return shard;
+	}
+	shard = calloc(1, sizeof(stats_shard_t));
+	if(shard == NULL){
+		return NULL;
+	}
+	(*shard).counters = counters;
+	if(pthread_setspecific((*counters).key, shard) != 0){
+		free(shard);
+		return NULL;
+	}
+	pthread_mutex_lock(&(*counters).lock);
+	(*shard).next = (*counters).shards;
+	if((*shard).next != NULL){
+		(*(*shard).next).prev = shard;
+	}
+	(*counters).shards = shard;
+	pthread_mutex_unlock(&(*counters).lock);
+	return shard;
+}
+
+// Sets up the counters for block_store_prepare, false if they couldn't be
+bool block_store_stats_setup(block_store_t *const bs){
+	block_store_counters_t *const counters = calloc(1, sizeof(block_store_counters_t));
+	if(counters == NULL){
+		return false;
+	}
+	if(pthread_key_create(&(*counters).key, shard_thread_exit) != 0){
+		free(counters);
+		return false;
+	}
+	pthread_mutex_init(&(*counters).lock, NULL);
+	(*bs).counters = counters;
+	return true;
+}
+
+// Frees every thread's counters, for block_store_destroy
+//  Deleting the key first means no thread exiting from here on runs the destructor on a shard freed below
+void block_store_stats_release(block_store_t *const bs){
+	block_store_counters_t *const counters = (*bs).counters;
+	if(counters == NULL){
+		return;
+	}
+	pthread_key_delete((*counters).key);
+	pthread_mutex_lock(&(*counters).lock);
+	while((*counters).shards != NULL){
+		stats_shard_t *const shard = (*counters).shards;
+		(*counters).shards = (*shard).next;
+		free(shard);
+	}
+	pthread_mutex_unlock(&(*counters).lock);
+	pthread_mutex_destroy(&(*counters).lock);
+	free(counters);
+	(*bs).counters = NULL;
+}
+
+// The monotonic clock in nanoseconds
+uint64_t block_store_stats_now(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+// Counts a finished operation in the calling thread's counters
+//  A thread that can't get memory for a shard doesn't get its operations counted
+void block_store_stats_record(const block_store_t *const bs, const BS_OP op, const uint64_t started, const bool ok, const size_t bytes){
+	stats_shard_t *const shard = shard_get((*bs).counters);
+	if(shard == NULL){
+		return;
+	}
+	const uint64_t ns = block_store_stats_now() - started;
+	block_store_op_stats_t *const counts = &(*shard).ops[op];
+	counter_add(&(*counts).calls, 1);
+	if(!ok){
+		counter_add(&(*counts).failures, 1);
+	}
+	counter_add(&(*counts).bytes, bytes);
+	counter_add(&(*counts).total_ns, ns);
+	if(ns > (*counts).max_ns){
+		__atomic_store_n(&(*counts).max_ns, ns, __ATOMIC_RELAXED);
+	}
+	counter_add(&(*counts).latency[latency_bucket(ns)], 1);
+}
+
+// Walks the fbm's runs of free data blocks
+//  Concurrent devices change theirs a word at a time with atomics, so the walk goes over a copy taken the same way
+static bool free_space(const block_store_t *const bs, block_store_stats_t *const stats){
+	const bitmap_t *fbm = (*bs).fbm;
+	bitmap_t *copy = NULL;
+	if((*bs).stripes != NULL){
+		// The fbm is whole words there, and overlays keep the bytes as they are
+		const size_t words = ((*bs).block_count + 63) / 64;
+		uint64_t *const snapshot = malloc(words * sizeof(uint64_t));
+		const uint64_t *const live = (const uint64_t *)(*bs).arena;
+		if(snapshot == NULL){
+			return false;
+		}
+		for(size_t w = 0; w < words; ++w){
+			snapshot[w] = __atomic_load_n(&live[w], __ATOMIC_RELAXED);
+		}
+		copy = bitmap_import((*bs).block_count, snapshot);
+		free(snapshot);
+		if(copy == NULL){
+			return false;
+		}
+		fbm = copy;
+	}
+	for(size_t first = bitmap_ffz_from(fbm, (*bs).meta_blocks); first != SIZE_MAX;){
+		const size_t used = bitmap_ffs_from(fbm, first);
+		const size_t end = used == SIZE_MAX ? (*bs).block_count : used;
+		(*stats).free_blocks += end - first;
+		++(*stats).free_extents;
+		if(end - first > (*stats).largest_free_extent){
+			(*stats).largest_free_extent = end - first;
+		}
+		first = end < (*bs).block_count ? bitmap_ffz_from(fbm, end) : SIZE_MAX;
+	}
+	bitmap_destroy(copy);
+	return true;
+}
+
+//
+///
+// API
+///
+//
+
+/// Takes a snapshot of the device's counters: per operation counts and latency histograms (BS_FLAG_STATS),
+///  free space fragmentation, and whatever the cache, dedup store and journal keep
+/// \param bs BS device
+/// \param stats Where to put them
+/// \return boolean indicating success
+//
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats){
+	if(bs == NULL || stats == NULL){
+		return false;
+	}
+	memset(stats, 0, sizeof(*stats));
+	block_store_counters_t *const counters = (*bs).counters;
+	if(counters != NULL){
+		pthread_mutex_lock(&(*counters).lock);
+		merge_ops((*stats).ops, (*counters).retired);
+		for(const stats_shard_t *shard = (*counters).shards; shard != NULL; shard = (*shard).next){
+			merge_ops((*stats).ops, (*shard).ops);
+		}
+		pthread_mutex_unlock(&(*counters).lock);
+	}
+	(*stats).has_cache = block_store_get_cache_stats(bs, &(*stats).cache);
+	(*stats).has_dedup = block_store_get_dedup_stats(bs, &(*stats).dedup);
+	(*stats).has_journal = block_store_journal_stats(bs, &(*stats).journal);
+	return free_space(bs, stats);
+}
+
+/// Upper bound of a latency histogram bucket
+/// \param bucket Index into block_store_op_stats_t's latency
+/// \return The slowest latency the bucket holds in nanoseconds, UINT64_MAX for the last bucket (or past it)
+//
+uint64_t block_store_stats_bucket_limit(const size_t bucket){
+	if(bucket < BS_STATS_SUB_BUCKETS){
+		return bucket;
+	}
+	if(bucket >= BS_STATS_BUCKETS - 1){
+		return UINT64_MAX;
+	}
+	const unsigned octave = (unsigned)(bucket / BS_STATS_SUB_BUCKETS) + 2;
+	const uint64_t sub = bucket % BS_STATS_SUB_BUCKETS;
+	return ((BS_STATS_SUB_BUCKETS + sub + 1) << (octave - 3)) - 1;
+}
+
+/// Estimates a latency percentile from an operation's histogram, never past the slowest call
+/// \param op The operation's counters
+/// \param percentile Between 0 and 100, 99 for p99
+/// \return The latency in nanoseconds that many percent of the calls took at most, 0 without any calls
+//
+uint64_t block_store_stats_percentile(const block_store_op_stats_t *const op, const double percentile){
+	if(op == NULL){
+		return 0;
+	}
+	uint64_t total = 0;
+	for(size_t b = 0; b < BS_STATS_BUCKETS; ++b){
+		total += (*op).latency[b];
+	}
+	if(total == 0){
+		return 0;
+	}
+	const double clamped = percentile < 0 ? 0 : (percentile > 100 ? 100 : percentile);
+	const double position = clamped / 100 * (double)total;
+	uint64_t rank = (uint64_t)position; // The call that many percent are at or below, counting from 1
+	rank += (double)rank < position || rank == 0;
+	rank = rank > total ? total : rank;
+	uint64_t seen = 0;
+	for(size_t b = 0; b < BS_STATS_BUCKETS; ++b){
+		seen += (*op).latency[b];
+		if(seen >= rank){
+			const uint64_t limit = block_store_stats_bucket_limit(b);
+			return limit < (*op).max_ns ? limit : (*op).max_ns;
+		}
+	}
+	return (*op).max_ns;
+}
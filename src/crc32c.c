@@ -0,0 +1,137 @@
+#define _DEFAULT_SOURCE // getauxval
+#include<string.h>
+#include<pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Reflected
+
+// Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_update)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_update_portable(uint32_t crc, const uint8_t *data, size_t len){
+	while(len > 0 && ((uintptr_t)data & 7)){
+		crc = crc_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		--len;
+	}
+	for(; len >= 8; data += 8, len -= 8){
+		uint32_t low, high;
+		memcpy(&low, data, 4);
+		memcpy(&high, data + 4, 4);
+		low ^= crc; // Little endian, like the rest of the on-disk formats
+		crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^ crc_table[5][(low >> 16) & 0xFF] ^ crc_table[4][low >> 24]
+			^ crc_table[3][high & 0xFF] ^ crc_table[2][(high >> 8) & 0xFF] ^ crc_table[1][(high >> 16) & 0xFF] ^ crc_table[0][high >> 24];
+	}
+	while(len-- > 0){
+		crc = crc_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_sse42(uint32_t crc, const uint8_t *data, size_t len){
+	while(len > 0 && ((uintptr_t)data & 7)){
+		crc = _mm_crc32_u8(crc, *data++);
+		--len;
+	}
+	uint64_t wide = crc;
+	for(; len >= 8; data += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, data, 8);
+		wide = _mm_crc32_u64(wide, word);
+	}
+	crc = (uint32_t)wide;
+	while(len-- > 0){
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t crc_update_armv8(uint32_t crc, const uint8_t *data, size_t len){
+	while(len > 0 && ((uintptr_t)data & 7)){
+		crc = __crc32cb(crc, *data++);
+		--len;
+	}
+	for(; len >= 8; data += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc = __crc32cd(crc, word);
+	}
+	while(len-- > 0){
+		crc = __crc32cb(crc, *data++);
+	}
+	return crc;
+}
+#endif
+
+static void crc_init(void){
+	for(uint32_t i = 0; i < 256; ++i){
+		uint32_t crc = i;
+		for(int bit = 0; bit < 8; ++bit){
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+		}
+		crc_table[0][i] = crc;
+	}
+	for(int k = 1; k < 8; ++k){
+		for(int i = 0; i < 256; ++i){
+			crc_table[k][i] = crc_table[0][crc_table[k - 1][i] & 0xFF] ^ (crc_table[k - 1][i] >> 8);
+		}
+	}
+	crc_update = crc_update_portable;
+#ifdef CRC32C_X86
+	if(__builtin_cpu_supports("sse4.2")){
+		crc_update = crc_update_sse42;
+	}
+#endif
+#ifdef CRC32C_ARM
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32){
+		crc_update = crc_update_armv8;
+	}
+#endif
+}
+
+// Checksums a buffer
+// \param data The bytes
+// \param len Number of bytes
+// \return The CRC-32C of the bytes
+//
+uint32_t crc32c(const void *const data, const size_t len){
+	pthread_once(&crc_once, crc_init);
+	return ~crc_update(UINT32_MAX, data, len);
+}
+
+// Same checksum without the hardware, whatever the CPU supports
+// \param data The bytes
+// \param len Number of bytes
+// \return The CRC-32C of the bytes
+//
+uint32_t crc32c_portable(const void *const data, const size_t len){
+	pthread_once(&crc_once, crc_init);
+	return ~crc_update_portable(UINT32_MAX, data, len);
+}
+
+// Tells whether crc32c uses a CPU instruction
+// \return boolean indicating it does
+//
+bool crc32c_hardware(void){
+	pthread_once(&crc_once, crc_init);
+	return crc_update != crc_update_portable;
+}
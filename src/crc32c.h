@@ -0,0 +1,34 @@
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+// CRC-32C (Castagnoli), the checksum of the block checksum table and the journal
+// Uses the CPU's instruction for it where there is one (SSE4.2 crc32 on x86-64, the ARMv8 CRC extension),
+// picked the first time it's called, and slicing-by-8 tables everywhere else.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+///
+/// Checksums a buffer
+/// \param data The bytes
+/// \param len Number of bytes
+/// \return The CRC-32C of the bytes
+///
+uint32_t crc32c(const void *const data, const size_t len);
+
+///
+/// Same checksum without the hardware, whatever the CPU supports
+/// \param data The bytes
+/// \param len Number of bytes
+/// \return The CRC-32C of the bytes
+///
+uint32_t crc32c_portable(const void *const data, const size_t len);
+
+///
+/// Tells whether crc32c uses a CPU instruction
+/// \return boolean indicating it does
+///
+bool crc32c_hardware(void);
+
+#endif
@@ -0,0 +1,175 @@
+#include<string.h>
+
+#include "lz4.h"
+
+// A sequence is a token (literal count in the high nibble, match length - 4 in the low one), extra length bytes
+//  for either nibble at 15, the literals, a 16-bit little endian offset back to the match and its extra length bytes.
+//  The last sequence is literals only, and matches keep away from the end the way the format asks.
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // The last 5 bytes are always literals
+#define LZ4_MATCH_LIMIT 12 // and no match starts in the last 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12 // 16 KiB of table on the stack
+
+static inline uint32_t read32(const uint8_t *const p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz4_hash(const uint32_t sequence){
+	return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG); // Knuth's multiplicative hash
+}
+
+// Room for a length field's extra bytes
+static inline size_t length_bytes(const size_t length){
+	return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static inline uint8_t *put_length(uint8_t *op, size_t length){
+	if(length >= 15){
+		for(length -= 15; length >= 255; length -= 255){
+			*op++ = 255;
+		}
+		*op++ = (uint8_t)length;
+	}
+	return op;
+}
+
+// Room lz4_compress may need for input of the given size, when nothing in it repeats
+size_t lz4_bound(const size_t len){
+	return len + len / 255 + 16;
+}
+
+// Compresses a buffer
+// \param src The bytes
+// \param len Number of bytes
+// \param dst Where to put the compressed bytes
+// \param capacity Room in dst
+// \return Number of compressed bytes, 0 if they didn't fit
+//
+size_t lz4_compress(const void *const src, const size_t len, void *const dst, const size_t capacity){
+	if((src == NULL && len > 0) || dst == NULL || len > UINT32_MAX){ // Positions have to fit the table
+		return 0;
+	}
+	const uint8_t *const base = src, *const end = base + len;
+	const uint8_t *ip = base, *anchor = base;
+	uint8_t *op = dst;
+	const uint8_t *const oend = op + capacity;
+	if(len > LZ4_MATCH_LIMIT){
+		uint32_t table[1u << LZ4_HASH_LOG];
+		memset(table, 0, sizeof(table)); // Everything points at the start, checked before it's used like any other entry
+		const uint8_t *const last_start = end - LZ4_MATCH_LIMIT, *const match_end = end - LZ4_LAST_LITERALS;
+		while(ip <= last_start){
+			const uint32_t sequence = read32(ip), h = lz4_hash(sequence);
+			const uint8_t *match = base + table[h];
+			table[h] = (uint32_t)(ip - base);
+			if(match >= ip || ip - match > LZ4_MAX_OFFSET || read32(match) != sequence){
+				++ip;
+				continue;
+			}
+			while(ip > anchor && match > base && ip[-1] == match[-1]){ // The match may well have started earlier
+				--ip;
+				--match;
+			}
+			const uint8_t *p = ip + LZ4_MIN_MATCH, *q = match + LZ4_MIN_MATCH;
+			while(p < match_end && *p == *q){
+				++p;
+				++q;
+			}
+			const size_t literals = (size_t)(ip - anchor), match_length = (size_t)(p - ip) - LZ4_MIN_MATCH;
+			if((size_t)(oend - op) < 1 + length_bytes(literals) + literals + 2 + length_bytes(match_length)){
+				return 0;
+			}
+			*op++ = (uint8_t)((literals < 15 ? literals : 15) << 4 | (match_length < 15 ? match_length : 15));
+			op = put_length(op, literals);
+			memcpy(op, anchor, literals);
+			op += literals;
+			const size_t offset = (size_t)(ip - match);
+			*op++ = (uint8_t)offset;
+			*op++ = (uint8_t)(offset >> 8);
+			op = put_length(op, match_length);
+			ip = anchor = p;
+		}
+	}
+	const size_t literals = (size_t)(end - anchor);
+	if((size_t)(oend - op) < 1 + length_bytes(literals) + literals){
+		return 0;
+	}
+	*op++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+	op = put_length(op, literals);
+	if(literals > 0){
+		memcpy(op, anchor, literals);
+		op += literals;
+	}
+	return (size_t)(op - (uint8_t *)dst);
+}
+
+// Reads the extra bytes of a length field, false if the input ends in the middle of them
+static inline bool get_length(const uint8_t **const ip, const uint8_t *const iend, size_t *const length){
+	if(*length < 15){
+		return true;
+	}
+	uint8_t extra;
+	do {
+		if(*ip >= iend){
+			return false;
+		}
+		extra = *(*ip)++;
+		*length += extra;
+	} while(extra == 255);
+	return true;
+}
+
+// Decompresses a buffer that has to come out to exactly the given size
+// \param src The compressed bytes
+// \param len Number of compressed bytes
+// \param dst Where to put the bytes
+// \param out_len Number of bytes it decompresses to
+// \return boolean indicating success, false if the input is corrupt or doesn't come out to out_len
+//
+bool lz4_decompress(const void *const src, const size_t len, void *const dst, const size_t out_len){
+	if(src == NULL || dst == NULL){
+		return false;
+	}
+	const uint8_t *ip = src;
+	const uint8_t *const iend = ip + len;
+	uint8_t *op = dst;
+	uint8_t *const ostart = op, *const oend = op + out_len;
+	while(ip < iend){
+		const uint8_t token = *ip++;
+		size_t literals = token >> 4;
+		if(!get_length(&ip, iend, &literals) || literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)){
+			return false;
+		}
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+		if(ip == iend){
+			break; // The last sequence, literals only
+		}
+		if(iend - ip < 2){
+			return false;
+		}
+		const size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		size_t match_length = token & 15;
+		if(offset == 0 || offset > (size_t)(op - ostart) || !get_length(&ip, iend, &match_length)){
+			return false;
+		}
+		match_length += LZ4_MIN_MATCH;
+		if(match_length > (size_t)(oend - op)){
+			return false;
+		}
+		// A match closer than its length repeats itself, so it's copied in pieces that never overlap,
+		//  each as long as everything copied so far (the pattern doubles every time)
+		const uint8_t *const match = op - offset;
+		while(match_length > 0){
+			const size_t distance = (size_t)(op - match), piece = distance < match_length ? distance : match_length;
+			memcpy(op, match, piece);
+			op += piece;
+			match_length -= piece;
+		}
+	}
+	return op == oend;
+}
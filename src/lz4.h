@@ -0,0 +1,39 @@
+#ifndef LZ4_H__
+#define LZ4_H__
+
+// The LZ4 block format (no frames), the codec of the compressed image format
+// Greedy single-pass compression with a small hash table, tuned for speed over ratio,
+// and a decoder that checks every length and offset against both buffers, so a corrupt input just fails.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+///
+/// Room lz4_compress may need for input of the given size, when nothing in it repeats
+/// \param len Number of input bytes
+/// \return Worst case compressed size
+///
+size_t lz4_bound(const size_t len);
+
+///
+/// Compresses a buffer
+/// \param src The bytes
+/// \param len Number of bytes
+/// \param dst Where to put the compressed bytes
+/// \param capacity Room in dst
+/// \return Number of compressed bytes, 0 if they didn't fit
+///
+size_t lz4_compress(const void *const src, const size_t len, void *const dst, const size_t capacity);
+
+///
+/// Decompresses a buffer that has to come out to exactly the given size
+/// \param src The compressed bytes
+/// \param len Number of compressed bytes
+/// \param dst Where to put the bytes
+/// \param out_len Number of bytes it decompresses to
+/// \return boolean indicating success, false if the input is corrupt or doesn't come out to out_len
+///
+bool lz4_decompress(const void *const src, const size_t len, void *const dst, const size_t out_len);
+
+#endif
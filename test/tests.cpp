@@ -7,7 +7,24 @@
  * @Description:
  */
 #include <gtest/gtest.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <csignal>
 #include "../include/block_store.h"
+#include "../include/bitmap.h"
+#include "../include/hbitmap.h"
+#include "../include/block_store.hpp"
+extern "C" {
+#include "../src/crc32c.h"
+#include "../src/lz4.h"
+}
 
 // Helpful constants...
 #define BITMAP_SIZE_BYTES 256        // 2^8 blocks.
@@ -241,7 +258,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -269,7 +286,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -328,6 +345,1426 @@ TEST(block_store_write_read, valid_write_and_read) {
     score += 20;
 }
 
+TEST(block_store_write_read, every_block_independent) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    // Blocks share one arena now, make sure none of them bleed into their neighbours
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 1; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        memset(buffer, (int) id, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+    }
+    for (size_t id = 1; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+        for (size_t i = 0; i < BLOCK_SIZE_BYTES; ++i) {
+            ASSERT_EQ((uint8_t) id, buffer[i]);
+        }
+    }
+    ASSERT_EQ(0, block_store_read(bs, BLOCK_STORE_NUM_BLOCKS, buffer));
+    ASSERT_EQ(0, block_store_write(bs, BLOCK_STORE_NUM_BLOCKS, buffer));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, partial_write) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, '~', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 100, write_buffer));
+
+    // Patch a few bytes in the middle, the rest of the block has to survive
+    const char patch[] = "patched";
+    ASSERT_EQ(sizeof(patch), block_store_write_partial(bs, 100, 40, sizeof(patch), patch));
+    memcpy(write_buffer + 40, patch, sizeof(patch));
+
+    uint8_t read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 100, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+
+    // Ends exactly at the end of the block
+    ASSERT_EQ(16, block_store_write_partial(bs, 100, BLOCK_SIZE_BYTES - 16, 16, write_buffer));
+
+    // Out of bounds in every way we can think of
+    ASSERT_EQ(0, block_store_write_partial(bs, 100, BLOCK_SIZE_BYTES - 16, 17, write_buffer));
+    ASSERT_EQ(0, block_store_write_partial(bs, 100, BLOCK_SIZE_BYTES, 1, write_buffer));
+    ASSERT_EQ(0, block_store_write_partial(bs, 100, 1, SIZE_MAX, write_buffer));
+    ASSERT_EQ(0, block_store_write_partial(bs, 100, 0, 0, write_buffer));
+    ASSERT_EQ(0, block_store_write_partial(bs, BLOCK_STORE_NUM_BLOCKS, 0, 1, write_buffer));
+    ASSERT_EQ(0, block_store_write_partial(bs, 100, 0, 1, NULL));
+    ASSERT_EQ(0, block_store_write_partial(NULL, 100, 0, 1, write_buffer));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, peek_and_pin) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, '~', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 100, write_buffer));
+
+    const void *view = block_store_peek(bs, 100);
+    ASSERT_NE(nullptr, view);
+    ASSERT_EQ(0, memcmp(view, write_buffer, BLOCK_SIZE_BYTES));
+
+    // Peeks see later writes, they're views, not copies
+    write_buffer[0] = '!';
+    ASSERT_EQ(1, block_store_write_partial(bs, 100, 0, 1, write_buffer));
+    ASSERT_EQ(0, memcmp(block_store_peek(bs, 100), write_buffer, BLOCK_SIZE_BYTES));
+
+    const void *pinned = block_store_pin(bs, 100);
+    ASSERT_EQ(view, pinned);
+    ASSERT_EQ(pinned, block_store_pin(bs, 100));  // pins nest
+    block_store_unpin(bs, 100);
+    block_store_unpin(bs, 100);
+
+    ASSERT_EQ(nullptr, block_store_peek(NULL, 100));
+    ASSERT_EQ(nullptr, block_store_peek(bs, BLOCK_STORE_NUM_BLOCKS));
+    ASSERT_EQ(nullptr, block_store_pin(NULL, 100));
+    ASSERT_EQ(nullptr, block_store_pin(bs, BLOCK_STORE_NUM_BLOCKS));
+    block_store_unpin(NULL, 100);
+
+    block_store_destroy(bs);
+}
+
+#ifndef NDEBUG
+TEST(block_store_write_read, pin_misuse_death) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+    ASSERT_DEATH(block_store_unpin(bs, 100), "without a matching");
+    ASSERT_NE(nullptr, block_store_pin(bs, 100));
+    ASSERT_DEATH(block_store_write(bs, 100, buffer), "pinned block");
+    block_store_unpin(bs, 100);
+    block_store_destroy(bs);
+}
+#endif
+
+// Reference scan for checking the word/vector versions against
+static size_t slow_scan(const bitmap_t *bitmap, size_t start, bool want) {
+    for (size_t bit = start; bit < bitmap_get_bits(bitmap); ++bit) {
+        if (bitmap_test(bitmap, bit) == want) {
+            return bit;
+        }
+    }
+    return SIZE_MAX;
+}
+
+TEST(bitmap_scan, ffs_ffz_match_bitwise_scan) {
+    // Odd sizes on purpose so partial words and partial bytes both show up
+    const size_t sizes[] = {1, 7, 63, 64, 65, 255, 256, 1000, 4099};
+    srand(42);
+    for (size_t size : sizes) {
+        bitmap_t *bitmap = bitmap_create(size);
+        ASSERT_NE(nullptr, bitmap);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+        ASSERT_EQ(0, bitmap_ffz(bitmap));
+        bitmap_invert(bitmap);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+        ASSERT_EQ(0, bitmap_ffs(bitmap));
+        bitmap_invert(bitmap);
+
+        // Mostly-full and mostly-empty maps, which is where skipping whole words matters
+        for (int density = 0; density < 2; ++density) {
+            bitmap_format(bitmap, density ? 0xFF : 0x00);
+            for (int flips = 0; flips < 3; ++flips) {
+                bitmap_flip(bitmap, (size_t) rand() % size);
+            }
+            for (size_t start = 0; start < size; start += 1 + (size_t) rand() % 17) {
+                ASSERT_EQ(slow_scan(bitmap, start, true), bitmap_ffs_from(bitmap, start)) << size << " " << start;
+                ASSERT_EQ(slow_scan(bitmap, start, false), bitmap_ffz_from(bitmap, start)) << size << " " << start;
+            }
+            ASSERT_EQ(slow_scan(bitmap, 0, true), bitmap_ffs(bitmap));
+            ASSERT_EQ(slow_scan(bitmap, 0, false), bitmap_ffz(bitmap));
+        }
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs_from(bitmap, size));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, size));
+        bitmap_destroy(bitmap);
+    }
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs_from(NULL, 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(NULL, 0));
+}
+
+TEST(bitmap_scan, total_set_matches_bitwise_count) {
+    const size_t sizes[] = {1, 7, 63, 64, 65, 255, 256, 1000, 4099};
+    srand(7);
+    for (size_t size : sizes) {
+        bitmap_t *bitmap = bitmap_create(size);
+        ASSERT_NE(nullptr, bitmap);
+        ASSERT_EQ(0, bitmap_total_set(bitmap));
+        for (size_t i = 0; i < size / 3 + 1; ++i) {
+            bitmap_set(bitmap, (size_t) rand() % size);
+        }
+        size_t expected = 0;
+        for (size_t bit = 0; bit < size; ++bit) {
+            expected += bitmap_test(bitmap, bit);
+        }
+        ASSERT_EQ(expected, bitmap_total_set(bitmap)) << size;
+        bitmap_destroy(bitmap);
+    }
+    ASSERT_EQ(0, bitmap_total_set(NULL));
+}
+
+TEST(block_store, used_count_tracks_fbm_writes) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, 200));
+    block_store_release(bs, 1);
+    block_store_release(bs, 1);  // double release must not drop the count twice
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+
+    // Overwriting block 0 replaces the free block map wholesale, the counters have to follow
+    uint8_t fbm[BLOCK_SIZE_BYTES] = {0};
+    fbm[0] = 0x0F;  // blocks 0-3
+    fbm[31] = 0x80; // block 255
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, fbm));
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 4, block_store_get_free_blocks(bs));
+    ASSERT_EQ(4, block_store_allocate(bs));
+    ASSERT_EQ(5, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create, custom_geometry) {
+    // 4 KiB blocks, enough of them that the fbm spills over into several blocks
+    const size_t block_size = 4096, block_count = 100000;
+    const size_t meta_blocks = (block_count / 8 + block_size - 1) / block_size;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(block_size, block_store_get_block_size(bs));
+    ASSERT_EQ(block_count - meta_blocks, block_store_get_capacity(bs));
+    ASSERT_EQ(block_count - meta_blocks, block_store_get_free_blocks(bs));
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+
+    // The fbm blocks are off limits, the first thing handed out comes right after them
+    ASSERT_FALSE(block_store_request(bs, meta_blocks - 1));
+    ASSERT_EQ(meta_blocks, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, block_count - 1));
+    ASSERT_FALSE(block_store_request(bs, block_count));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+
+    std::vector<uint8_t> buffer(block_size, '~'), read_back(block_size);
+    ASSERT_EQ(block_size, block_store_write(bs, block_count - 1, buffer.data()));
+    ASSERT_EQ(block_size, block_store_read(bs, block_count - 1, read_back.data()));
+    ASSERT_EQ(buffer, read_back);
+    ASSERT_EQ(0, block_store_read(bs, block_count, read_back.data()));
+    block_store_destroy(bs);
+
+    // The classic device is just the 256x256 case
+    bs = block_store_create_ex(BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_capacity(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(nullptr, block_store_create_ex(0, 256, BS_FLAG_NONE));
+    ASSERT_EQ(nullptr, block_store_create_ex(256, 0, BS_FLAG_NONE));
+    ASSERT_EQ(nullptr, block_store_create_ex(1, 1, BS_FLAG_NONE));  // the fbm would be the only block
+    ASSERT_EQ(nullptr, block_store_create_ex(SIZE_MAX, 2, BS_FLAG_NONE));
+    ASSERT_EQ(nullptr, block_store_create_ex(256, 256, 0x80000000u));
+    ASSERT_EQ(SIZE_MAX, block_store_get_capacity(NULL));
+    ASSERT_EQ(0, block_store_get_block_size(NULL));
+}
+
+TEST(block_store_create, hugepage_and_numa_arenas) {
+    // Placement is best effort, whatever the machine has the devices have to work like any other
+    const size_t block_size = 4096, block_count = 1000;
+    for (unsigned flags : {(unsigned) BS_FLAG_HUGEPAGES, (unsigned) BS_FLAG_NUMA_INTERLEAVE, (unsigned) BS_FLAG_NUMA_PARTITION,
+                           (unsigned) (BS_FLAG_HUGEPAGES | BS_FLAG_NUMA_PARTITION | BS_FLAG_CONCURRENT),
+                           (unsigned) (BS_FLAG_HUGEPAGES | BS_FLAG_CHECKSUM)}) {
+        block_store_t *bs = block_store_create_ex(block_size, block_count, flags);
+        ASSERT_NE(nullptr, bs) << "flags " << flags;
+        const size_t first = block_store_allocate(bs);
+        ASSERT_EQ(block_count - block_store_get_capacity(bs), first);
+        ASSERT_TRUE(block_store_request(bs, block_count - 1));
+        std::vector<uint8_t> buffer(block_size, 'h'), read_back(block_size, 0xFF);
+        ASSERT_EQ(block_size, block_store_read(bs, first, read_back.data()));
+        ASSERT_EQ(std::vector<uint8_t>(block_size, 0), read_back);  // the mapping comes zeroed
+        ASSERT_EQ(block_size, block_store_write(bs, block_count - 1, buffer.data()));
+        ASSERT_EQ(block_size, block_store_read(bs, block_count - 1, read_back.data()));
+        ASSERT_EQ(buffer, read_back);
+
+        // Partitioned blocks each sit on some node, in ranges that go up with the block ids
+        const int node = block_store_get_block_node(bs, first);
+        if (flags & BS_FLAG_NUMA_PARTITION) {
+            for (size_t id = first; id < block_count; ++id) {
+                ASSERT_LE(node, block_store_get_block_node(bs, id));
+            }
+        } else {
+            ASSERT_EQ(-1, node);
+        }
+        ASSERT_EQ(-1, block_store_get_block_node(bs, block_count));
+        block_store_destroy(bs);
+    }
+
+    ASSERT_EQ(nullptr, block_store_create_ex(block_size, block_count, BS_FLAG_NUMA_INTERLEAVE | BS_FLAG_NUMA_PARTITION));
+    ASSERT_EQ(-1, block_store_get_block_node(NULL, 0));
+
+#if GRAD_TESTS
+    // Mapped and cached devices keep their blocks in the file, there's nothing to place, so the open fails
+    for (unsigned flags : {(unsigned) BS_FLAG_NUMA_INTERLEAVE, (unsigned) BS_FLAG_NUMA_PARTITION}) {
+        remove("test_numa.bs");
+        ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_numa.bs", block_size, block_count, flags));
+        ASSERT_EQ(nullptr, block_store_open_cached("test_numa.bs", block_size, block_count, 64 * block_size, flags));
+        // A journaled device lives on the heap like any other, so it does get placed
+        block_store_t *bs = block_store_open_journaled("test_numa.bs", block_size, block_count, flags);
+        ASSERT_NE(nullptr, bs);
+        const size_t first = block_count - block_store_get_capacity(bs);
+        if (flags & BS_FLAG_NUMA_PARTITION) {
+            ASSERT_LE(0, block_store_get_block_node(bs, first));
+        }
+        block_store_destroy(bs);
+    }
+    remove("test_numa.bs");
+    remove("test_numa.bs.journal");
+#endif
+}
+
+TEST(hbitmap, ffz_matches_flat_scan) {
+    // Sizes around the 64 / 64^2 / 64^3 level boundaries
+    const size_t sizes[] = {1, 64, 65, 4096, 4097, 262144, 262145 + 77};
+    srand(1234);
+    for (size_t size : sizes) {
+        bitmap_t *base = bitmap_create(size);
+        ASSERT_NE(nullptr, base);
+        hbitmap_t *hbitmap = hbitmap_create(base);
+        ASSERT_NE(nullptr, hbitmap);
+        ASSERT_EQ(base, hbitmap_get_base(hbitmap));
+        ASSERT_EQ(0, hbitmap_ffz(hbitmap));
+
+        // Fill it up in order, which is the case the summaries exist for
+        for (size_t bit = 0; bit < size; ++bit) {
+            ASSERT_EQ(bit, hbitmap_ffz(hbitmap));
+            hbitmap_set(hbitmap, bit);
+        }
+        ASSERT_EQ(SIZE_MAX, hbitmap_ffz(hbitmap));
+
+        // Knock random holes in it, then fill random bits back in
+        for (int round = 0; round < 200; ++round) {
+            const size_t bit = (size_t) rand() % size;
+            if (round & 1) {
+                hbitmap_set(hbitmap, bit);
+            } else {
+                hbitmap_reset(hbitmap, bit);
+            }
+            ASSERT_EQ(bitmap_test(base, bit), hbitmap_test(hbitmap, bit));
+            const size_t start = (size_t) rand() % size;
+            ASSERT_EQ(bitmap_ffz(base), hbitmap_ffz(hbitmap)) << size << " " << round;
+            ASSERT_EQ(bitmap_ffz_from(base, start), hbitmap_ffz_from(hbitmap, start)) << size << " " << start;
+        }
+
+        // Changes made directly to the base are picked up by a rebuild
+        bitmap_format(base, 0xFF);
+        bitmap_reset(base, size - 1);
+        hbitmap_rebuild(hbitmap);
+        ASSERT_EQ(size - 1, hbitmap_ffz(hbitmap));
+        ASSERT_EQ(SIZE_MAX, hbitmap_ffz_from(hbitmap, size));
+
+        hbitmap_destroy(hbitmap);
+        bitmap_destroy(base);
+    }
+    ASSERT_EQ(nullptr, hbitmap_create(NULL));
+    ASSERT_EQ(SIZE_MAX, hbitmap_ffz(NULL));
+    hbitmap_destroy(NULL);
+}
+
+TEST(block_store_alloc_free_req, allocate_large_device_until_full) {
+    const size_t block_count = 1 << 20;
+    block_store_t *bs = block_store_create_ex(64, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    const size_t capacity = block_store_get_capacity(bs);
+    const size_t first = block_count - capacity;
+    for (size_t i = 0; i < capacity; ++i) {
+        ASSERT_EQ(first + i, block_store_allocate(bs));
+    }
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    block_store_release(bs, block_count / 2);
+    block_store_release(bs, block_count - 1);
+    ASSERT_EQ(block_count / 2, block_store_allocate(bs));
+    ASSERT_EQ(block_count - 1, block_store_allocate(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_scan, ranges_match_bitwise_ops) {
+    const size_t size = 1000;
+    bitmap_t *bitmap = bitmap_create(size);
+    bitmap_t *expected = bitmap_create(size);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_NE(nullptr, expected);
+    srand(99);
+    for (int round = 0; round < 500; ++round) {
+        const size_t start = (size_t) rand() % size;
+        const size_t count = 1 + (size_t) rand() % (size - start);
+        const bool value = rand() & 1;
+        if (value) {
+            bitmap_set_range(bitmap, start, count);
+        } else {
+            bitmap_reset_range(bitmap, start, count);
+        }
+        for (size_t bit = start; bit < start + count; ++bit) {
+            if (value) {
+                bitmap_set(expected, bit);
+            } else {
+                bitmap_reset(expected, bit);
+            }
+        }
+        ASSERT_EQ(0, memcmp(bitmap_export(bitmap), bitmap_export(expected), bitmap_get_bytes(bitmap))) << round;
+
+        size_t in_range = 0;
+        for (size_t bit = start; bit < start + count; ++bit) {
+            in_range += bitmap_test(bitmap, bit);
+        }
+        ASSERT_EQ(in_range, bitmap_count_range(bitmap, start, count));
+
+        // Brute force the first run of zeros of a random length
+        const size_t run = 1 + (size_t) rand() % 40;
+        size_t want = SIZE_MAX;
+        for (size_t bit = start; bit + run <= size && want == SIZE_MAX; ++bit) {
+            if (bitmap_count_range(expected, bit, run) == 0) {
+                want = bit;
+            }
+        }
+        ASSERT_EQ(want, bitmap_ffz_run(bitmap, start, run)) << round;
+    }
+    // Out of range requests do nothing
+    bitmap_format(bitmap, 0x00);
+    bitmap_set_range(bitmap, size - 1, 2);
+    bitmap_set_range(bitmap, 0, 0);
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 0, size + 1));
+    ASSERT_EQ(0, bitmap_ffz_run(bitmap, 0, size));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 0, 0));
+    bitmap_destroy(bitmap);
+    bitmap_destroy(expected);
+}
+
+TEST(bitmap_scan, binary_ops_match_bitwise_ops) {
+    // Sizes around the 32 byte vector width, so the kernels' leftovers show up too
+    const size_t sizes[] = {1, 7, 64, 255, 256, 257, 1000, 4099};
+    srand(5);
+    for (size_t size : sizes) {
+        bitmap_t *a = bitmap_create(size);
+        bitmap_t *b = bitmap_create(size);
+        bitmap_t *result = bitmap_create(size);
+        ASSERT_NE(nullptr, a);
+        ASSERT_NE(nullptr, b);
+        ASSERT_NE(nullptr, result);
+        for (size_t bit = 0; bit < size; ++bit) {
+            if (rand() & 1) {
+                bitmap_set(a, bit);
+            }
+            if (rand() & 1) {
+                bitmap_set(b, bit);
+            }
+        }
+        bool (*const ops[])(bitmap_t *const, const bitmap_t *const) = {bitmap_and, bitmap_or, bitmap_xor, bitmap_andnot};
+        for (int op = 0; op < 4; ++op) {
+            memcpy((void *) bitmap_export(result), bitmap_export(a), bitmap_get_bytes(a));
+            ASSERT_TRUE(ops[op](result, b));
+            for (size_t bit = 0; bit < size; ++bit) {
+                const bool x = bitmap_test(a, bit), y = bitmap_test(b, bit);
+                const bool want = op == 0 ? x && y : op == 1 ? x || y : op == 2 ? x != y : x && !y;
+                ASSERT_EQ(want, bitmap_test(result, bit)) << size << " " << op << " " << bit;
+            }
+        }
+        bitmap_destroy(a);
+        bitmap_destroy(b);
+        bitmap_destroy(result);
+    }
+    bitmap_t *small = bitmap_create(100);
+    bitmap_t *large = bitmap_create(101);
+    ASSERT_FALSE(bitmap_or(small, large));
+    ASSERT_FALSE(bitmap_and(small, NULL));
+    bitmap_destroy(small);
+    bitmap_destroy(large);
+}
+
+TEST(bitmap_scan, storage_stays_byte_compatible) {
+    // Bit n is bit n % 8 of byte n / 8, whatever the words look like inside
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(13, bitmap_get_bytes(bitmap));
+    ASSERT_EQ(0, (uintptr_t) bitmap_export(bitmap) % 64);
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 9);
+    bitmap_set_range(bitmap, 64, 4);
+    const uint8_t *bytes = bitmap_export(bitmap);
+    ASSERT_EQ(0x01, bytes[0]);
+    ASSERT_EQ(0x02, bytes[1]);
+    ASSERT_EQ(0x0F, bytes[8]);
+    // Whole-bitmap operations leave the bits past the end clear
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(0x0F, bytes[12]);
+    ASSERT_EQ(100, bitmap_total_set(bitmap));
+    bitmap_format(bitmap, 0x00);
+    bitmap_invert(bitmap);
+    ASSERT_EQ(0x0F, bytes[12]);
+
+    // An overlay of 13 bytes never reaches past them, even though its last word is cut short
+    alignas(8) uint8_t buffer[16];
+    memset(buffer, 0xAA, sizeof(buffer));
+    bitmap_t *overlay = bitmap_overlay(100, buffer);
+    ASSERT_NE(nullptr, overlay);
+    ASSERT_EQ(50, bitmap_total_set(overlay));
+    ASSERT_TRUE(bitmap_or(overlay, bitmap));
+    ASSERT_EQ(100, bitmap_total_set(overlay));
+    ASSERT_EQ(0x0F, buffer[12]);
+    bitmap_reset_range(overlay, 90, 10);
+    ASSERT_EQ(90, bitmap_count_range(overlay, 0, 100));
+    ASSERT_EQ(90, bitmap_ffz(overlay));
+    for (size_t i = 13; i < sizeof(buffer); ++i) {
+        ASSERT_EQ(0xAA, buffer[i]) << i;
+    }
+    bitmap_t *copy = bitmap_import(100, buffer);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(0, memcmp(buffer, bitmap_export(copy), 13));
+    bitmap_destroy(copy);
+
+    // Memory off a word boundary overlays just the same, only slower
+    alignas(8) uint8_t shifted[40];
+    memset(shifted, 0xAA, sizeof(shifted));
+    memcpy(shifted + 1, buffer, 13);
+    bitmap_t *unaligned = bitmap_overlay(200, shifted + 1);
+    ASSERT_NE(nullptr, unaligned);
+    bitmap_reset_range(unaligned, 100, 100);
+    ASSERT_EQ(90, bitmap_total_set(unaligned));
+    ASSERT_EQ(90, bitmap_ffz(unaligned));
+    bitmap_set_range(unaligned, 100, 100);
+    ASSERT_EQ(190, bitmap_count_range(unaligned, 0, 200));
+    bitmap_invert(unaligned);
+    ASSERT_EQ(10, bitmap_total_set(unaligned));
+    ASSERT_EQ(90, bitmap_ffs(unaligned));
+    ASSERT_EQ(0x00, shifted[1]);
+    ASSERT_EQ(0xAA, shifted[0]);
+    for (size_t i = 26; i < sizeof(shifted); ++i) {
+        ASSERT_EQ(0xAA, shifted[i]) << i;
+    }
+    bitmap_destroy(unaligned);
+    bitmap_destroy(overlay);
+    bitmap_destroy(bitmap);
+}
+
+static void collect_bit(size_t bit, void *arg) {
+    ((std::vector<size_t> *) arg)->push_back(bit);
+}
+
+TEST(bitmap_scan, iterator_visits_set_bits_in_order) {
+    const size_t sizes[] = {1, 63, 64, 65, 1000, 4099};
+    srand(11);
+    for (size_t size : sizes) {
+        bitmap_t *bitmap = bitmap_create(size);
+        ASSERT_NE(nullptr, bitmap);
+        for (int density : {0, 1, 50, 100}) {
+            bitmap_format(bitmap, density == 100 ? 0xFF : 0x00);  // all ones sets the bits past the end too
+            for (size_t bit = 0; density > 0 && density < 100 && bit < size; ++bit) {
+                if (rand() % 100 < density) {
+                    bitmap_set(bitmap, bit);
+                }
+            }
+            for (size_t start : {(size_t) 0, size / 3, size - 1, size}) {
+                std::vector<size_t> want;
+                for (size_t bit = start; bit < size; ++bit) {
+                    if (bitmap_test(bitmap, bit)) {
+                        want.push_back(bit);
+                    }
+                }
+                std::vector<size_t> got;
+                bitmap_iter_t iter;
+                bitmap_iter_init(&iter, bitmap, start);
+                for (size_t bit = bitmap_iter_next(&iter); bit != SIZE_MAX; bit = bitmap_iter_next(&iter)) {
+                    got.push_back(bit);
+                }
+                ASSERT_EQ(want, got) << size << " " << density << " " << start;
+                ASSERT_EQ(SIZE_MAX, bitmap_iter_next(&iter));  // and it stays done
+            }
+            std::vector<size_t> visited;
+            bitmap_for_each(bitmap, collect_bit, &visited);
+            ASSERT_EQ(bitmap_total_set(bitmap), visited.size());
+        }
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(hbitmap, ranges_keep_summaries_in_sync) {
+    const size_t size = 64 * 64 * 3 + 5;
+    bitmap_t *base = bitmap_create(size);
+    hbitmap_t *hbitmap = hbitmap_create(base);
+    ASSERT_NE(nullptr, hbitmap);
+    hbitmap_set_range(hbitmap, 0, size - 100);
+    ASSERT_EQ(size - 100, hbitmap_ffz(hbitmap));
+    ASSERT_EQ(size - 100, hbitmap_ffz_run(hbitmap, 0, 100));
+    ASSERT_EQ(SIZE_MAX, hbitmap_ffz_run(hbitmap, 0, 101));
+    hbitmap_reset_range(hbitmap, 70, 200);
+    ASSERT_EQ(70, hbitmap_ffz(hbitmap));
+    ASSERT_EQ(70, hbitmap_ffz_run(hbitmap, 0, 200));
+    ASSERT_EQ(SIZE_MAX, hbitmap_ffz_run(hbitmap, 0, 201));
+    ASSERT_EQ(size - 100, hbitmap_ffz_run(hbitmap, 171, 100));  // 171-269 is one short
+    hbitmap_set_range(hbitmap, 70, 200);
+    ASSERT_EQ(size - 100, hbitmap_ffz(hbitmap));
+    hbitmap_destroy(hbitmap);
+    bitmap_destroy(base);
+}
+
+TEST(block_store_alloc_free_req, allocate_range) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    size_t first = 0;
+    ASSERT_TRUE(block_store_allocate_range(bs, 10, &first));
+    ASSERT_EQ(1, first);
+    ASSERT_TRUE(block_store_request(bs, 20));
+    // 11-19 is only 9 long, so the next extent has to go after block 20
+    ASSERT_TRUE(block_store_allocate_range(bs, 10, &first));
+    ASSERT_EQ(21, first);
+    ASSERT_EQ(21, block_store_get_used_blocks(bs));
+    ASSERT_TRUE(block_store_allocate_range(bs, 9, &first));
+    ASSERT_EQ(11, first);
+
+    // Partially free extent, only the blocks that were in use count
+    block_store_release(bs, 25);
+    block_store_release_range(bs, 21, 10);
+    ASSERT_EQ(20, block_store_get_used_blocks(bs));
+    ASSERT_EQ(21, block_store_allocate(bs));
+
+    ASSERT_FALSE(block_store_allocate_range(bs, BLOCK_STORE_AVAIL_BLOCKS, &first));
+    ASSERT_FALSE(block_store_allocate_range(bs, 0, &first));
+    ASSERT_FALSE(block_store_allocate_range(bs, 1, NULL));
+    ASSERT_FALSE(block_store_allocate_range(NULL, 1, &first));
+    block_store_release_range(bs, 0, 5);   // fbm block, ignored
+    block_store_release_range(bs, 250, 10); // runs off the end, ignored
+    block_store_release_range(NULL, 1, 1);
+    ASSERT_EQ(21, block_store_get_used_blocks(bs));
+
+    block_store_release_range(bs, 1, BLOCK_STORE_AVAIL_BLOCKS);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_TRUE(block_store_allocate_range(bs, BLOCK_STORE_AVAIL_BLOCKS, &first));
+    ASSERT_EQ(1, first);
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, allocation_policies) {
+    for (unsigned flags : {(unsigned) BS_FLAG_NONE, (unsigned) BS_FLAG_CONCURRENT}) {
+        block_store_t *bs = block_store_create_ex(256, 256, flags);
+        ASSERT_NE(nullptr, bs);
+        // Free extents 1-9, 11-29, 31-32 and 34-255
+        ASSERT_TRUE(block_store_request(bs, 10));
+        ASSERT_TRUE(block_store_request(bs, 30));
+        ASSERT_TRUE(block_store_request(bs, 33));
+        size_t first = 0;
+        ASSERT_TRUE(block_store_set_policy(bs, BS_POLICY_BEST_FIT));
+        ASSERT_TRUE(block_store_allocate_range(bs, 2, &first));
+        ASSERT_EQ(31, first);
+        ASSERT_TRUE(block_store_allocate_range(bs, 5, &first));
+        ASSERT_EQ(1, first);
+        ASSERT_TRUE(block_store_allocate_range(bs, 15, &first));
+        ASSERT_EQ(11, first);
+        ASSERT_TRUE(block_store_allocate_range(bs, 100, &first));
+        ASSERT_EQ(34, first);
+        ASSERT_FALSE(block_store_allocate_range(bs, 200, &first));
+        block_store_release_range(bs, 34, 100);
+
+        // Free: 6-9, 26-29 and 34-255, next fit starts at the front and keeps going from the last allocation
+        ASSERT_TRUE(block_store_set_policy(bs, BS_POLICY_NEXT_FIT));
+        ASSERT_EQ(6, block_store_allocate(bs));
+        ASSERT_EQ(7, block_store_allocate(bs));
+        block_store_release(bs, 7);
+        ASSERT_EQ(8, block_store_allocate(bs));
+        ASSERT_TRUE(block_store_allocate_range(bs, 3, &first));
+        ASSERT_EQ(26, first);
+        ASSERT_EQ(29, block_store_allocate(bs));
+        ASSERT_EQ(34, block_store_allocate(bs));
+
+        // Hints, wrapping around past the end
+        ASSERT_EQ(200, block_store_allocate_near(bs, 200));
+        ASSERT_EQ(255, block_store_allocate_near(bs, 255));
+        ASSERT_EQ(7, block_store_allocate_near(bs, 255));
+        ASSERT_EQ(9, block_store_allocate_near(bs, 0));
+        ASSERT_TRUE(block_store_allocate_range_near(bs, 3, 199, &first));
+        ASSERT_EQ(201, first);
+        ASSERT_TRUE(block_store_allocate_range_near(bs, 2, 204, &first));  // growing that extent in place
+        ASSERT_EQ(204, first);
+        ASSERT_FALSE(block_store_allocate_range_near(bs, 300, 1, &first));
+        ASSERT_FALSE(block_store_allocate_range_near(bs, 0, 1, &first));
+
+        // Every block still goes out exactly once
+        ASSERT_TRUE(block_store_set_policy(bs, BS_POLICY_FIRST_FIT));
+        while (block_store_allocate_near(bs, 100) != SIZE_MAX) {
+        }
+        ASSERT_EQ(0, block_store_get_free_blocks(bs));
+        ASSERT_EQ(255, block_store_get_used_blocks(bs));
+        ASSERT_FALSE(block_store_set_policy(bs, 3));
+        block_store_destroy(bs);
+    }
+    ASSERT_FALSE(block_store_set_policy(NULL, BS_POLICY_NEXT_FIT));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(NULL, 1));
+}
+
+// Where every block allocated at the start of block_store_defragment tests is now, by its original id
+struct defrag_map {
+    std::vector<size_t> where, owner;  // owner[block] is the original id of what's in it
+    size_t veto;  // Original block to keep in place
+};
+
+bool defrag_remap(void *const context, const size_t from, const size_t to) {
+    defrag_map &map = *static_cast<defrag_map *>(context);
+    const size_t original = map.owner[from];
+    if (original == map.veto) {
+        return false;
+    }
+    map.where[original] = to;
+    map.owner[to] = original;
+    map.owner[from] = SIZE_MAX;
+    return true;
+}
+
+bool defrag_refuse(void *const context, const size_t, const size_t) {
+    ++*static_cast<size_t *>(context);
+    return false;
+}
+
+// Tries to write the block being moved from another thread, which has to wait until the move is over
+struct defrag_writer {
+    block_store_t *bs;
+    std::thread thread;
+    std::atomic<bool> written;
+};
+
+bool defrag_race(void *const context, const size_t from, const size_t) {
+    defrag_writer &writer = *static_cast<defrag_writer *>(context);
+    writer.thread = std::thread([&writer, from] {
+        std::vector<uint8_t> buffer(block_store_get_block_size(writer.bs), 0xEE);
+        block_store_write(writer.bs, from, buffer.data());
+        writer.written = true;
+    });
+    usleep(20000);
+    return !writer.written;
+}
+
+TEST(block_store_defragment, slides_blocks_down_in_order) {
+    const size_t block_size = 512, block_count = 256;
+    for (unsigned flags : {(unsigned) BS_FLAG_NONE, (unsigned) (BS_FLAG_CONCURRENT | BS_FLAG_CHECKSUM)}) {
+        block_store_t *bs = block_store_create_ex(block_size, block_count, flags);
+        ASSERT_NE(nullptr, bs);
+        const size_t meta = block_count - block_store_get_capacity(bs);
+        defrag_map map = {std::vector<size_t>(block_count, SIZE_MAX), std::vector<size_t>(block_count, SIZE_MAX), 152};
+        std::vector<uint8_t> buffer(block_size);
+        for (size_t id = meta; id < 200; ++id) {
+            ASSERT_EQ(id, block_store_allocate(bs));
+            memset(buffer.data(), (int) id, block_size);
+            ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+        }
+        for (size_t id = meta; id < 200; id += 3) {
+            block_store_release(bs, id);
+        }
+        block_store_release_range(bs, 100, 20);
+        for (size_t id = meta; id < 200; ++id) {
+            if (block_store_request(bs, id)) {
+                block_store_release(bs, id);  // free, not part of the test
+            } else {
+                map.where[id] = id;
+                map.owner[id] = id;
+            }
+        }
+        const size_t used = block_store_get_used_blocks(bs);
+        ASSERT_EQ(map.veto, map.where[map.veto]);
+
+        size_t steps = 0;
+        bool done = false;
+        while (!done) {
+            ASSERT_LE(block_store_defragment(bs, 7, defrag_remap, &map, &done), 7);
+            ASSERT_LT(++steps, block_count);
+        }
+        ASSERT_GT(steps, 1);
+        ASSERT_EQ(used, block_store_get_used_blocks(bs));
+        // Everything before the vetoed block is packed at the front in its old order, it and those after it follow
+        size_t next = meta;
+        for (size_t id = meta; id < 200; ++id) {
+            if (map.where[id] == SIZE_MAX) {
+                continue;
+            }
+            if (id == map.veto) {
+                ASSERT_EQ(map.veto, map.where[id]);
+                next = map.veto + 1;
+                continue;
+            }
+            ASSERT_EQ(next, map.where[id]) << "block " << id;
+            ++next;
+            ASSERT_EQ(block_size, block_store_read(bs, map.where[id], buffer.data()));
+            ASSERT_EQ(std::vector<uint8_t>(block_size, (uint8_t) id), buffer);
+        }
+        std::vector<block_store_stats_t> stats(1);
+        ASSERT_TRUE(block_store_get_stats(bs, &stats[0]));
+        ASSERT_EQ(2, stats[0].free_extents);  // the gap left in front of the vetoed block, and the end of the device
+        ASSERT_EQ(block_count - next, stats[0].largest_free_extent);
+        // Nothing left to do, bar copying the vetoed block once more to hear it turned down again
+        ASSERT_EQ(1, block_store_defragment(bs, 7, defrag_remap, &map, &done));
+        ASSERT_TRUE(done);
+        ASSERT_EQ(0, block_store_defragment(bs, 0, defrag_remap, &map, &done));
+        ASSERT_FALSE(done);  // no budget isn't the same as no work
+
+        // Turned down moves were still copies, a step makes no more of them than it's allowed
+        block_store_release(bs, meta);
+        size_t refused = 0;
+        ASSERT_EQ(1, block_store_defragment(bs, 1, defrag_refuse, &refused, &done));  // the block after the new hole
+        ASSERT_FALSE(done);
+        ASSERT_EQ(1, block_store_defragment(bs, 1, defrag_refuse, &refused, &done));  // the vetoed one
+        ASSERT_FALSE(done);
+        ASSERT_EQ(0, block_store_defragment(bs, 1, defrag_refuse, &refused, &done));  // and a pass that moved nothing is the end
+        ASSERT_TRUE(done);
+        ASSERT_EQ(2, refused);
+        ASSERT_EQ(used - 1, block_store_get_used_blocks(bs));
+        if (flags & BS_FLAG_CHECKSUM) {
+            ASSERT_EQ(0, block_store_scrub(bs, 1, NULL, 0));
+        }
+        ASSERT_EQ(SIZE_MAX, block_store_defragment(bs, 7, NULL, &map, &done));
+        block_store_destroy(bs);
+    }
+
+    // On a concurrent device the block being moved stays locked until it's freed
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CONCURRENT);
+    const size_t meta = block_count - block_store_get_capacity(bs);
+    ASSERT_TRUE(block_store_request(bs, meta + 1));
+    defrag_writer writer{bs, std::thread(), {false}};
+    ASSERT_EQ(1, block_store_defragment(bs, 1, defrag_race, &writer, NULL));
+    writer.thread.join();
+    ASSERT_TRUE(writer.written);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, meta));
+    ASSERT_TRUE(block_store_request(bs, meta + 1));  // turned down if the write got in, the late write went to a free block
+    block_store_destroy(bs);
+
+    bs = block_store_create_ex(512, 256, BS_FLAG_THREAD_CACHE);
+    ASSERT_EQ(SIZE_MAX, block_store_defragment(bs, 1, defrag_remap, NULL, NULL));
+    block_store_destroy(bs);
+    ASSERT_EQ(SIZE_MAX, block_store_defragment(NULL, 1, defrag_remap, NULL, NULL));
+}
+
+TEST(block_store_write_read, vectored_write_and_read) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    // Big enough that the sort has to go to the heap, shuffled so it actually has to sort
+    const size_t n = 200;
+    std::vector<std::vector<uint8_t>> data(n, std::vector<uint8_t>(BLOCK_SIZE_BYTES));
+    std::vector<block_store_iovec_t> iov(n);
+    for (size_t i = 0; i < n; ++i) {
+        iov[i].block_id = 1 + (i * 37) % BLOCK_STORE_AVAIL_BLOCKS;
+        memset(data[i].data(), (int) iov[i].block_id, BLOCK_SIZE_BYTES);
+        iov[i].buffer = data[i].data();
+    }
+    ASSERT_EQ(n * BLOCK_SIZE_BYTES, block_store_writev(bs, iov.data(), n));
+
+    std::vector<std::vector<uint8_t>> read_back(n, std::vector<uint8_t>(BLOCK_SIZE_BYTES));
+    for (size_t i = 0; i < n; ++i) {
+        iov[i].buffer = read_back[i].data();
+    }
+    ASSERT_EQ(n * BLOCK_SIZE_BYTES, block_store_readv(bs, iov.data(), n));
+    ASSERT_EQ(data, read_back);
+
+    // Duplicates: the later entry wins
+    uint8_t first[BLOCK_SIZE_BYTES], second[BLOCK_SIZE_BYTES], out[BLOCK_SIZE_BYTES];
+    memset(first, 'a', BLOCK_SIZE_BYTES);
+    memset(second, 'b', BLOCK_SIZE_BYTES);
+    block_store_iovec_t dupes[3] = {{50, second}, {5, first}, {5, second}};
+    ASSERT_EQ(3 * BLOCK_SIZE_BYTES, block_store_writev(bs, dupes, 3));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, out));
+    ASSERT_EQ(0, memcmp(out, second, BLOCK_SIZE_BYTES));
+
+    // One bad entry fails the whole batch and nothing gets written
+    block_store_iovec_t bad[2] = {{6, first}, {BLOCK_STORE_NUM_BLOCKS, first}};
+    ASSERT_EQ(0, block_store_writev(bs, bad, 2));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 6, out));
+    ASSERT_NE(0, memcmp(out, first, BLOCK_SIZE_BYTES));
+    bad[1].block_id = 7;
+    bad[1].buffer = NULL;
+    ASSERT_EQ(0, block_store_writev(bs, bad, 2));
+    ASSERT_EQ(0, block_store_readv(bs, bad, 2));
+    ASSERT_EQ(0, block_store_readv(bs, iov.data(), 0));
+    ASSERT_EQ(0, block_store_readv(NULL, iov.data(), 1));
+    ASSERT_EQ(0, block_store_writev(bs, NULL, 1));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_concurrent, parallel_allocate_write_release) {
+    ASSERT_EQ(nullptr, block_store_create_ex(100, 1024, BS_FLAG_CONCURRENT)) << "Concurrent devices need 8 byte multiples\n";
+    const size_t block_size = 64, block_count = 4096 + 37; // ragged last fbm word
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CONCURRENT);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    const size_t capacity = block_store_get_capacity(bs);
+    const unsigned thread_count = 8;
+
+    // Everyone allocates until the device is full, no block can be handed out twice
+    std::vector<std::vector<size_t>> owned(thread_count);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<uint8_t> data(block_size, (uint8_t) t);
+            for (;;) {
+                size_t first = 0;
+                if (owned[t].size() % 3 == 0 && block_store_allocate_range(bs, 3, &first)) {
+                    for (size_t i = 0; i < 3; ++i) {
+                        owned[t].push_back(first + i);
+                    }
+                    continue;
+                }
+                const size_t id = block_store_allocate(bs);
+                if (id == SIZE_MAX) {
+                    break;
+                }
+                owned[t].push_back(id);
+            }
+            for (size_t id : owned[t]) {
+                block_store_write(bs, id, data.data());
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    std::vector<size_t> all;
+    for (const auto &ids : owned) {
+        all.insert(all.end(), ids.begin(), ids.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(capacity, all.size());
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "A block was allocated twice\n";
+    ASSERT_EQ(capacity, block_store_get_used_blocks(bs));
+    ASSERT_EQ(block_count - 1, all.back());
+
+    // Nobody stepped on anyone else's blocks
+    std::vector<uint8_t> out(block_size);
+    for (unsigned t = 0; t < thread_count; ++t) {
+        for (size_t id : owned[t]) {
+            ASSERT_EQ(block_size, block_store_read(bs, id, out.data()));
+            ASSERT_EQ(std::vector<uint8_t>(block_size, (uint8_t) t), out);
+        }
+    }
+
+    // Churn: half the threads give their blocks back and grab them again while the rest read theirs
+    for (unsigned t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<uint8_t> buffer(block_size);
+            for (int round = 0; round < 20; ++round) {
+                if (t % 2) {
+                    for (size_t &id : owned[t]) {
+                        block_store_release(bs, id);
+                        id = block_store_allocate(bs);
+                    }
+                } else {
+                    for (size_t id : owned[t]) {
+                        block_store_read(bs, id, buffer.data());
+                    }
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    all.clear();
+    for (const auto &ids : owned) {
+        all.insert(all.end(), ids.begin(), ids.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.end(), std::find(all.begin(), all.end(), SIZE_MAX));
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "A block was allocated twice\n";
+    ASSERT_EQ(capacity, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+
+    // The fbm itself has to agree with all of that
+    const size_t meta_blocks = block_count - capacity;
+    block_store_release_range(bs, meta_blocks, capacity);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(meta_blocks, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, block_count - 1));
+    ASSERT_FALSE(block_store_request(bs, block_count - 1));
+    ASSERT_FALSE(block_store_request(bs, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_concurrent, thread_cache_hands_out_everything) {
+    const size_t block_size = 64, block_count = 8192;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_THREAD_CACHE);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    const size_t capacity = block_store_get_capacity(bs);
+    const unsigned thread_count = 8;
+
+    // Threads race until the device is full, blocks cached by one thread have to reach the others eventually
+    std::vector<std::vector<size_t>> owned(thread_count);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            size_t allocations = 0;
+            for (size_t id; (id = block_store_allocate(bs)) != SIZE_MAX;) {
+                owned[t].push_back(id);
+                if (++allocations % 5 == 0) { // some churn through the magazine
+                    block_store_release(bs, owned[t].back());
+                    owned[t].pop_back();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    std::vector<size_t> all;
+    for (const auto &ids : owned) {
+        all.insert(all.end(), ids.begin(), ids.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(capacity, all.size());
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "A block was allocated twice\n";
+    ASSERT_EQ(capacity, block_store_get_used_blocks(bs));
+
+    // Everyone gives everything back, and their magazines empty into the free map when they exit
+    for (unsigned t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t id : owned[t]) {
+                block_store_release(bs, id);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(capacity, block_store_get_free_blocks(bs));
+
+    // A block in this thread's magazine can still be requested by id
+    const size_t id = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, id);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_TRUE(block_store_request(bs, id + 1));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    block_store_release(bs, id);
+    block_store_release(bs, id + 1);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+
+    // Releasing a block twice, from this thread or another, caches it once, so it can't get two owners
+    const size_t twice = block_store_allocate(bs);
+    block_store_release(bs, twice);
+    block_store_release(bs, twice);
+    std::thread([&] { block_store_release(bs, twice); }).join();
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(twice, block_store_allocate(bs));
+    ASSERT_NE(twice, block_store_allocate(bs));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(crc32c, known_answers) {
+    const char *check = "123456789";
+    ASSERT_EQ(0xE3069283u, crc32c(check, 9));
+    ASSERT_EQ(0xE3069283u, crc32c_portable(check, 9));
+    ASSERT_EQ(0u, crc32c(check, 0));
+    // Every length and alignment, so the hardware path's head and tail handling gets the same answers
+    std::vector<uint8_t> data(4096 + 16);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 131 + (i >> 7));
+    }
+    for (size_t start = 0; start < 8; ++start) {
+        for (size_t len : {1, 7, 8, 9, 63, 255, 256, 4096}) {
+            ASSERT_EQ(crc32c_portable(&data[start], len), crc32c(&data[start], len)) << start << " " << len;
+        }
+    }
+}
+
+TEST(block_store_checksum, writes_keep_checksums) {
+    const size_t block_size = 512, block_count = 1024;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    // The fbm takes one block, the table of 1024 checksums eight more
+    ASSERT_EQ(block_count - 9, block_store_get_capacity(bs));
+    ASSERT_EQ(9, block_store_allocate(bs));
+    std::vector<uint8_t> buffer(block_size, 0x5A);
+    ASSERT_EQ(0, block_store_scrub(bs, 1, NULL, 0));  // fresh blocks are all zeros, and checksummed as such
+    ASSERT_EQ(block_size, block_store_write(bs, 9, buffer.data()));
+    ASSERT_EQ(5, block_store_write_partial(bs, 10, 100, 5, "hello"));
+    std::vector<uint8_t> other(block_size, 0x11), third(block_size, 0x22);
+    block_store_iovec_t iov[] = {{400, other.data()}, {300, third.data()}};
+    ASSERT_EQ(2 * block_size, block_store_writev(bs, iov, 2));
+    ASSERT_EQ(block_size, block_store_read(bs, 10, buffer.data()));
+    ASSERT_EQ(0, memcmp(buffer.data() + 100, "hello", 5));
+    ASSERT_EQ(2 * block_size, block_store_readv(bs, iov, 2));
+    ASSERT_EQ(0, block_store_scrub(bs, 4, NULL, 0));
+    block_store_destroy(bs);
+
+    // Without the flag there's nothing to scrub
+    bs = block_store_create();
+    ASSERT_EQ(SIZE_MAX, block_store_scrub(bs, 1, NULL, 0));
+    block_store_destroy(bs);
+    ASSERT_EQ(SIZE_MAX, block_store_scrub(NULL, 1, NULL, 0));
+    ASSERT_EQ(nullptr, block_store_create_ex(4, 4, BS_FLAG_CHECKSUM));  // the table wouldn't leave any room
+}
+
+TEST(block_store_snapshot, copy_on_write) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 1; id <= 10; ++id) {
+        memset(buffer, (int) id, BLOCK_SIZE_BYTES);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+    }
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_EQ(nullptr, block_store_snapshot(snapshot));
+    const void *shared = block_store_peek(snapshot, 4);  // the snapshot's own copy from here on
+    ASSERT_NE(block_store_peek(bs, 4), shared);
+
+    // The device carries on, the snapshot keeps what it had
+    memset(buffer, 0xEE, BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 2, buffer));
+    ASSERT_EQ(3, block_store_write_partial(bs, 3, 0, 3, "new"));
+    block_store_iovec_t iov[] = {{5, buffer}, {4, buffer}};
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_writev(bs, iov, 2));
+    ASSERT_TRUE(block_store_request(bs, 11));
+    block_store_release(bs, 1);
+    block_store_t *later = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, later);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 6, buffer));
+
+    ASSERT_EQ(10, block_store_get_used_blocks(snapshot));
+    ASSERT_EQ(10, block_store_get_used_blocks(later));
+    for (size_t id = 1; id <= 10; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snapshot, id, buffer));
+        ASSERT_EQ(id, buffer[BLOCK_SIZE_BYTES - 1]) << id;
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(later, id, buffer));
+        ASSERT_EQ(id >= 2 && id <= 5 && id != 3 ? 0xEE : id, buffer[BLOCK_SIZE_BYTES - 1]) << id;
+    }
+    ASSERT_EQ(0, memcmp("new", block_store_peek(later, 3), 3));
+    ASSERT_EQ(0x04, *(const uint8_t *) shared);
+
+    // Read-only
+    ASSERT_EQ(0, block_store_write(snapshot, 7, buffer));
+    ASSERT_EQ(0, block_store_write_partial(snapshot, 7, 0, 1, buffer));
+    ASSERT_EQ(0, block_store_writev(snapshot, iov, 2));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snapshot));
+    ASSERT_FALSE(block_store_request(snapshot, 100));
+    block_store_release(snapshot, 7);
+    ASSERT_EQ(10, block_store_get_used_blocks(snapshot));
+
+    // Snapshots outlive the device
+    block_store_destroy(later);
+    block_store_destroy(bs);
+    for (size_t id = 1; id <= 10; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snapshot, id, buffer));
+        ASSERT_EQ(id, buffer[0]) << id;
+    }
+    block_store_destroy(snapshot);
+    ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+}
+
+TEST(block_store_snapshot, taken_under_writers) {
+    // Writers keep every block uniform, a snapshot must never see half of a write
+    const size_t block_size = 1024, block_count = 1024, threads = 4;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CONCURRENT | BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    const size_t meta = block_count - block_store_get_capacity(bs);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < threads; ++t) {
+        writers.emplace_back([&, t] {
+            std::vector<uint8_t> data(block_size);
+            for (unsigned round = 0; !stop; ++round) {
+                for (size_t id = meta + t; id < block_count; id += threads) {
+                    memset(data.data(), (int) (round + id), block_size);
+                    block_store_write(bs, id, data.data());
+                }
+            }
+        });
+    }
+    std::vector<uint8_t> first(block_size), again(block_size);
+    for (int s = 0; s < 5; ++s) {
+        block_store_t *snapshot = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snapshot);
+        for (size_t id = meta; id < block_count; ++id) {
+            ASSERT_EQ(block_size, block_store_read(snapshot, id, first.data()));
+            ASSERT_EQ(block_size, (size_t) std::count(first.begin(), first.end(), first[0])) << id;
+            ASSERT_EQ(block_size, block_store_read(snapshot, id, again.data()));
+            ASSERT_EQ(first, again) << id;
+        }
+        ASSERT_EQ(0, block_store_scrub(snapshot, 2, NULL, 0));
+        block_store_destroy(snapshot);
+    }
+    stop = true;
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store_dedup, identical_blocks_are_shared) {
+    const size_t block_size = 512, block_count = 256;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_DEDUP | BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    const size_t meta = block_count - block_store_get_capacity(bs);
+    block_store_dedup_stats_t stats;
+    ASSERT_TRUE(block_store_get_dedup_stats(bs, &stats));
+    ASSERT_EQ(block_count - meta, stats.zero_blocks);  // nothing stored for a fresh device
+    ASSERT_EQ(0, stats.stored_blocks);
+
+    std::vector<uint8_t> buffer(block_size, 0xAB), other(block_size, 0);
+    for (size_t id = meta; id < meta + 100; ++id) {
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+    }
+    ASSERT_TRUE(block_store_get_dedup_stats(bs, &stats));
+    ASSERT_EQ(1, stats.stored_blocks);
+    ASSERT_EQ(block_count - meta - 100, stats.zero_blocks);
+    // A partial write gives the block contents of its own, the rest still share theirs
+    ASSERT_EQ(5, block_store_write_partial(bs, meta, 10, 5, "hello"));
+    ASSERT_TRUE(block_store_get_dedup_stats(bs, &stats));
+    ASSERT_EQ(2, stats.stored_blocks);
+    ASSERT_EQ(block_size, block_store_read(bs, meta, other.data()));
+    ASSERT_EQ(0, memcmp(other.data() + 10, "hello", 5));
+    ASSERT_EQ(0xAB, other[9]);
+    ASSERT_EQ(0, memcmp(buffer.data(), block_store_peek(bs, meta + 1), block_size));
+    // Zeroing blocks takes them out of the store, and the last one out frees the contents
+    std::fill(other.begin(), other.end(), 0);
+    for (size_t id = meta + 1; id < meta + 100; ++id) {
+        ASSERT_EQ(block_size, block_store_write(bs, id, other.data()));
+    }
+    ASSERT_TRUE(block_store_get_dedup_stats(bs, &stats));
+    ASSERT_EQ(1, stats.stored_blocks);
+    ASSERT_EQ(block_count - meta - 1, stats.zero_blocks);
+    ASSERT_EQ(block_size, block_store_read(bs, meta + 50, buffer.data()));
+    ASSERT_EQ(other, buffer);
+    ASSERT_EQ(0, block_store_scrub(bs, 2, NULL, 0));
+    block_store_destroy(bs);
+
+    bs = block_store_create();
+    ASSERT_FALSE(block_store_get_dedup_stats(bs, &stats));
+    block_store_destroy(bs);
+    ASSERT_FALSE(block_store_get_dedup_stats(NULL, &stats));
+}
+
+TEST(block_store_stats, counts_and_fragmentation) {
+    const size_t block_size = 512, block_count = 256;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_STATS);
+    ASSERT_NE(nullptr, bs);
+    const size_t meta = block_count - block_store_get_capacity(bs);
+    std::vector<block_store_stats_t> stats(1);
+    ASSERT_TRUE(block_store_get_stats(bs, &stats[0]));
+    ASSERT_EQ(0, stats[0].ops[BS_OP_ALLOCATE].calls);
+    ASSERT_EQ(block_count - meta, stats[0].free_blocks);
+    ASSERT_EQ(1, stats[0].free_extents);
+    ASSERT_EQ(block_count - meta, stats[0].largest_free_extent);
+    ASSERT_FALSE(stats[0].has_cache || stats[0].has_dedup || stats[0].has_journal);
+
+    // Every other block of the first 100 allocated leaves 50 holes of one, and the rest in one piece
+    for (size_t i = 0; i < 100; ++i) {
+        ASSERT_EQ(meta + i, block_store_allocate(bs));
+    }
+    for (size_t i = 0; i < 100; i += 2) {
+        block_store_release(bs, meta + i);
+    }
+    block_store_release(bs, 0);  // a meta block, fails
+    ASSERT_FALSE(block_store_request(bs, meta + 1));
+    std::vector<uint8_t> buffer(block_size, 7);
+    ASSERT_EQ(block_size, block_store_write(bs, meta + 1, buffer.data()));
+    ASSERT_EQ(3, block_store_write_partial(bs, meta + 1, 0, 3, "abc"));
+    ASSERT_EQ(block_size, block_store_read(bs, meta + 1, buffer.data()));
+    ASSERT_EQ(0, block_store_read(bs, block_count, buffer.data()));
+    ASSERT_TRUE(block_store_get_stats(bs, &stats[0]));
+    const block_store_op_stats_t &allocate = stats[0].ops[BS_OP_ALLOCATE], &release = stats[0].ops[BS_OP_RELEASE];
+    ASSERT_EQ(100, allocate.calls);
+    ASSERT_EQ(0, allocate.failures);
+    ASSERT_EQ(51, release.calls);
+    ASSERT_EQ(1, release.failures);
+    ASSERT_EQ(1, stats[0].ops[BS_OP_REQUEST].failures);
+    ASSERT_EQ(2, stats[0].ops[BS_OP_WRITE].calls);
+    ASSERT_EQ(block_size + 3, stats[0].ops[BS_OP_WRITE].bytes);
+    ASSERT_EQ(2, stats[0].ops[BS_OP_READ].calls);
+    ASSERT_EQ(1, stats[0].ops[BS_OP_READ].failures);
+    ASSERT_EQ(block_count - meta - 50, stats[0].free_blocks);
+    ASSERT_EQ(51, stats[0].free_extents);
+    ASSERT_EQ(block_count - meta - 100, stats[0].largest_free_extent);
+    uint64_t counted = 0;
+    for (size_t b = 0; b < BS_STATS_BUCKETS; ++b) {
+        counted += allocate.latency[b];
+    }
+    ASSERT_EQ(allocate.calls, counted);
+    ASSERT_GE(allocate.total_ns, allocate.max_ns);
+    ASSERT_LE(block_store_stats_percentile(&allocate, 50), block_store_stats_percentile(&allocate, 99));
+    ASSERT_EQ(allocate.max_ns, block_store_stats_percentile(&allocate, 100));
+    ASSERT_EQ(0, block_store_stats_percentile(&stats[0].ops[BS_OP_SERIALIZE], 50));
+
+    // Buckets are exact up to 8 ns, then 8 to every power of two, and they tile the whole range
+    ASSERT_EQ(0, block_store_stats_bucket_limit(0));
+    ASSERT_EQ(7, block_store_stats_bucket_limit(7));
+    ASSERT_EQ(8, block_store_stats_bucket_limit(8));
+    ASSERT_EQ(17, block_store_stats_bucket_limit(16));
+    for (size_t b = 1; b + 1 < BS_STATS_BUCKETS; ++b) {
+        ASSERT_LT(block_store_stats_bucket_limit(b - 1), block_store_stats_bucket_limit(b));
+    }
+    ASSERT_EQ((UINT64_C(1) << 41) - (UINT64_C(1) << 37) - 1, block_store_stats_bucket_limit(BS_STATS_BUCKETS - 2));
+    ASSERT_EQ(UINT64_MAX, block_store_stats_bucket_limit(BS_STATS_BUCKETS - 1));
+    block_store_destroy(bs);
+
+    // Without the flag there are no operation counters, the rest is still there
+    bs = block_store_create_ex(block_size, block_count, BS_FLAG_DEDUP);
+    ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_get_stats(bs, &stats[0]));
+    ASSERT_EQ(0, stats[0].ops[BS_OP_ALLOCATE].calls);
+    ASSERT_TRUE(stats[0].has_dedup);
+    ASSERT_EQ(block_count - meta - 1, stats[0].free_blocks);
+    block_store_destroy(bs);
+    ASSERT_FALSE(block_store_get_stats(NULL, &stats[0]));
+}
+
+TEST(block_store_stats, threads_add_up) {
+    // Threads count into shards of their own, including the ones that are gone by the time anybody reads
+    const size_t threads = 4, rounds = 2000;
+    block_store_t *bs = block_store_create_ex(512, 1 << 14, BS_FLAG_THREAD_CACHE | BS_FLAG_STATS);
+    ASSERT_NE(nullptr, bs);
+    std::atomic<bool> done(false);
+    std::thread reader([&] {
+        std::vector<block_store_stats_t> stats(1);
+        while (!done) {
+            block_store_get_stats(bs, &stats[0]);
+        }
+    });
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            for (size_t round = 0; round < rounds; ++round) {
+                block_store_release(bs, block_store_allocate(bs));
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    done = true;
+    reader.join();
+    ASSERT_NE(SIZE_MAX, block_store_allocate(bs));  // this thread's shard is still live
+    std::vector<block_store_stats_t> stats(1);
+    ASSERT_TRUE(block_store_get_stats(bs, &stats[0]));
+    ASSERT_EQ(threads * rounds + 1, stats[0].ops[BS_OP_ALLOCATE].calls);
+    ASSERT_EQ(threads * rounds, stats[0].ops[BS_OP_RELEASE].calls);
+    ASSERT_EQ(0, stats[0].ops[BS_OP_RELEASE].failures);
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snapshot));
+    ASSERT_TRUE(block_store_get_stats(snapshot, &stats[0]));
+    ASSERT_EQ(1, stats[0].ops[BS_OP_ALLOCATE].failures);
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+}
+
+TEST(lz4, round_trips) {
+    std::vector<std::vector<uint8_t>> inputs;
+    inputs.push_back({});
+    inputs.push_back({'x'});
+    inputs.push_back(std::vector<uint8_t>(65536, 0));
+    std::vector<uint8_t> text;
+    for (int i = 0; i < 2000; ++i) {
+        const char *const word = i % 3 ? "block store " : "free block map ";
+        text.insert(text.end(), word, word + strlen(word));
+        text.push_back((uint8_t) ('0' + i % 10));
+    }
+    inputs.push_back(text);
+    std::vector<uint8_t> noise(5000);
+    uint32_t state = 12345;
+    for (uint8_t &byte : noise) {
+        state = state * 1103515245u + 12345u;
+        byte = (uint8_t) (state >> 24);
+    }
+    inputs.push_back(noise);
+    std::vector<uint8_t> runs;  // long matches right behind themselves, and literal runs over 15
+    for (int i = 0; i < 100; ++i) {
+        runs.insert(runs.end(), (size_t) (i * 7 % 300), (uint8_t) i);
+        runs.insert(runs.end(), noise.begin(), noise.begin() + i % 40);
+    }
+    inputs.push_back(runs);
+    for (const std::vector<uint8_t> &input : inputs) {
+        std::vector<uint8_t> packed(lz4_bound(input.size())), output(input.size() + 1);
+        const size_t length = lz4_compress(input.data(), input.size(), packed.data(), packed.size());
+        ASSERT_NE(0, length);
+        ASSERT_LE(length, input == inputs[2] ? 300 : packed.size());  // 64 KiB of zeros is a few runs of 255s
+        ASSERT_TRUE(lz4_decompress(packed.data(), length, output.data(), input.size())) << input.size();
+        ASSERT_EQ(0, memcmp(input.data(), output.data(), input.size()));
+        ASSERT_FALSE(lz4_decompress(packed.data(), length, output.data(), input.size() + 1));  // has to come out exact
+        if (input.size() > 1) {
+            ASSERT_FALSE(lz4_decompress(packed.data(), length - 1, output.data(), input.size()));
+        }
+    }
+    std::vector<uint8_t> small(100);
+    ASSERT_EQ(0, lz4_compress(noise.data(), noise.size(), small.data(), small.size()));  // doesn't fit
+    const uint8_t bad_offset[] = {0x04, 'a', 0x05, 0x00, 0x10, 'b'};  // a match reaching back before the start
+    ASSERT_FALSE(lz4_decompress(bad_offset, sizeof(bad_offset), small.data(), 10));
+}
+
+TEST(block_store_cpp, compile_time_geometry) {
+    typedef bs::BlockStore<512, 1024> Store;
+    static_assert(Store::block_size() == 512 && Store::block_count() == 1024, "geometry is a constant");
+    static_assert(Store::bytes() == 512 * 1024 && Store::offset(3) == 1536 && Store::fbm_bytes() == 128, "so is everything from it");
+    static_assert(!std::is_copy_constructible<Store>::value && std::is_move_constructible<Store>::value, "move-only");
+    static_assert(sizeof(Store::ConstBlock) == sizeof(void *), "a fixed size view is just the pointer");
+
+    Store store(BS_FLAG_CHECKSUM);
+    ASSERT_TRUE(store);
+    const size_t meta = Store::block_count() - store.capacity();
+    std::array<uint8_t, 512> block;
+    block.fill(0x5A);
+    const size_t id = store.allocate();
+    ASSERT_EQ(meta, id);
+    ASSERT_TRUE(store.write(id, block));
+    const uint8_t patch[3] = {1, 2, 3};
+    ASSERT_TRUE(store.write(id, 509, patch));
+    ASSERT_FALSE(store.write(id, 510, patch));  // runs off the end of the block
+    ASSERT_FALSE(store.write(Store::block_count(), block));
+    Store::ConstBlock view = store.view(id);
+    ASSERT_NE(nullptr, view.data());
+    ASSERT_EQ(0x5A, view[508]);
+    ASSERT_EQ(3, view[511]);
+    ASSERT_EQ(nullptr, store.view(Store::block_count()).data());
+
+    // Ownership moves along, the device is destroyed once
+    Store moved(std::move(store));
+    ASSERT_FALSE(store);
+    ASSERT_TRUE(moved);
+    std::array<uint8_t, 512> out;
+    ASSERT_TRUE(moved.read(id, out));
+    ASSERT_EQ(0, memcmp(view.data(), out.data(), out.size()));
+    ASSERT_FALSE(store.read(id, out));
+    store = std::move(moved);
+    ASSERT_EQ(1, store.used_blocks());
+    store.release(id);
+    ASSERT_EQ(0, store.used_blocks());
+    block_store_t *raw = store.detach();
+    ASSERT_FALSE(store);
+    block_store_destroy(raw);
+}
+
+TEST(block_store_cpp, runtime_geometry) {
+    bs::BlockStore<> store(128, 300);
+    ASSERT_TRUE(store);
+    ASSERT_EQ(128, store.block_size());
+    ASSERT_EQ(300, store.block_count());
+    ASSERT_EQ(300 * 128, store.bytes());
+    ASSERT_EQ(38, store.fbm_bytes());
+    std::vector<uint8_t> block(128, 0x11), small(64);
+    size_t first = SIZE_MAX;
+    ASSERT_TRUE(store.allocate_range(4, &first));
+    ASSERT_TRUE(store.write(first + 3, block));
+    ASSERT_FALSE(store.read(first + 3, small));  // not a whole block
+    bs::BlockStore<>::ConstBlock view = store.view(first + 3);
+    ASSERT_EQ(128, view.size());
+    ASSERT_EQ(0x11, view[127]);
+    ASSERT_EQ(0, store.view(300).size());
+    store.release_range(first, 4);
+    ASSERT_EQ(0, store.used_blocks());
+    ASSERT_FALSE(bs::BlockStore<>(128, 0));
+}
 
 #if GRAD_TESTS
 
@@ -428,6 +1865,885 @@ TEST(block_store_deserialize, valid_deserialize) {
 }
 
 
+TEST(block_store_deserialize, custom_geometry_round_trip) {
+    const size_t block_size = 512, block_count = 5000;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t i = 0; i < 10; ++i) {
+        const size_t id = block_store_allocate(bs);
+        ASSERT_NE(SIZE_MAX, id);
+        memset(buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+    }
+    ASSERT_EQ(block_size * block_count, block_store_serialize(bs, "test_geometry.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize_ex("test_geometry.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(10, block_store_get_used_blocks(bs));
+    ASSERT_EQ(block_count - 2 - 10, block_store_get_free_blocks(bs));  // 625 byte fbm, two blocks
+    ASSERT_EQ(12, block_store_allocate(bs));
+    std::vector<uint8_t> read_back(block_size);
+    ASSERT_EQ(block_size, block_store_read(bs, 5, read_back.data()));
+    memset(buffer.data(), 5, block_size);
+    ASSERT_EQ(buffer, read_back);
+    block_store_destroy(bs);
+    remove("test_geometry.bs");
+}
+
+TEST(block_store_open_mmap, round_trip) {
+    remove("test_mmap.bs");
+    block_store_t *bs = block_store_open_mmap("test_mmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_free_blocks(bs));
+    ASSERT_TRUE(block_store_request(bs, 10));
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, '~', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, write_buffer));
+    ASSERT_TRUE(block_store_sync(bs, true));
+    ASSERT_TRUE(block_store_sync(bs, false));
+    ASSERT_EQ(0, block_store_flush(bs, "test_mmap.bs"));  // its own file, that's just an msync
+    block_store_destroy(bs);
+
+    // Same image, mapped again and loaded the old way
+    bs = block_store_open_mmap("test_mmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 10));
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, memcmp(write_buffer, block_store_peek(bs, 10), BLOCK_SIZE_BYTES));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_mmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, memcmp(write_buffer, block_store_peek(bs, 10), BLOCK_SIZE_BYTES));
+    ASSERT_FALSE(block_store_sync(bs, false));  // heap device, nothing to sync to
+    block_store_destroy(bs);
+
+    // Wrong geometry for the existing image
+    ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_mmap.bs", 512, 256, BS_FLAG_NONE));
+    ASSERT_EQ(nullptr, block_store_open_mmap(NULL));
+    ASSERT_FALSE(block_store_sync(NULL, false));
+    remove("test_mmap.bs");
+}
+
+TEST(block_store_aio, submit_and_poll) {
+    // Every engine: the ring with everything registered, worker threads, and the heap device's inline path
+    const size_t depth = 16, blocks = 200;
+    std::vector<uint8_t> region(depth * BLOCK_SIZE_BYTES);
+    block_store_aio_options_t ring = {depth, BS_AIO_FIXED_FILE, 0, region.data(), region.size()};
+    block_store_aio_options_t pool = {depth, BS_AIO_THREAD_POOL, 3, NULL, 0};
+    for (int engine = 0; engine < 3; ++engine) {
+        remove("test_aio.bs");
+        block_store_t *bs = engine < 2 ? block_store_open_mmap_ex("test_aio.bs", BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_STATS)
+                                       : block_store_create_ex(BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_STATS);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_TRUE(block_store_aio_setup(bs, engine == 1 ? &pool : &ring));
+
+        // Keep the queue full, each block gets its own id as data
+        std::vector<block_store_completion_t> done(depth);
+        size_t submitted = 0, completed = 0;
+        while (completed < blocks) {
+            for (; submitted < blocks && submitted < completed + depth; ++submitted) {
+                uint8_t *buffer = &region[(submitted % depth) * BLOCK_SIZE_BYTES];
+                memset(buffer, (int) submitted, BLOCK_SIZE_BYTES);
+                ASSERT_TRUE(block_store_submit_write(bs, 1 + submitted, buffer, submitted));
+            }
+            const size_t n = block_store_poll_completions(bs, done.data(), depth, 1);
+            ASSERT_NE(SIZE_MAX, n);
+            ASSERT_LT(0, n);
+            for (size_t i = 0; i < n; ++i) {
+                ASSERT_EQ(0, done[i].error);
+                ASSERT_EQ(BLOCK_SIZE_BYTES, done[i].bytes);
+                ASSERT_EQ(1 + done[i].user_data, done[i].block_id);
+            }
+            completed += n;
+            // Buffers are reused in submission order, so wait for a whole round before moving on
+            while (completed < submitted) {
+                const size_t more = block_store_poll_completions(bs, done.data(), depth, submitted - completed);
+                ASSERT_NE(SIZE_MAX, more);
+                completed += more;
+            }
+        }
+        ASSERT_EQ(0, block_store_poll_completions(bs, done.data(), depth, 1));  // nothing in flight, doesn't wait
+        for (size_t i = 0; i < blocks; ++i) {
+            ASSERT_EQ((uint8_t) i, ((const uint8_t *) block_store_peek(bs, 1 + i))[BLOCK_SIZE_BYTES - 1]) << "engine " << engine;
+        }
+
+        // And back, through buffers outside the registered region
+        std::vector<uint8_t> out(depth * BLOCK_SIZE_BYTES);
+        for (size_t i = 0; i < depth; ++i) {
+            ASSERT_TRUE(block_store_submit_read(bs, 100 + i, &out[i * BLOCK_SIZE_BYTES], i));
+        }
+        ASSERT_FALSE(block_store_submit_read(bs, 1, &out[0], 0));  // queue_depth reached
+        ASSERT_FALSE(block_store_aio_setup(bs, NULL));  // can't redo it with requests in flight
+        ASSERT_EQ(depth, block_store_poll_completions(bs, done.data(), depth, depth));
+        for (size_t i = 0; i < depth; ++i) {
+            ASSERT_EQ(0, done[i].error);
+            ASSERT_EQ(std::vector<uint8_t>(BLOCK_SIZE_BYTES, (uint8_t) (99 + done[i].user_data)),
+                      std::vector<uint8_t>(&out[done[i].user_data * BLOCK_SIZE_BYTES], &out[(done[i].user_data + 1) * BLOCK_SIZE_BYTES]));
+        }
+        // Every request shows up in the stats once, whichever engine ran it
+        block_store_stats_t stats;
+        ASSERT_TRUE(block_store_get_stats(bs, &stats));
+        ASSERT_EQ(blocks, stats.ops[BS_OP_WRITE].calls) << "engine " << engine;
+        ASSERT_EQ(blocks * BLOCK_SIZE_BYTES, stats.ops[BS_OP_WRITE].bytes);
+        ASSERT_EQ(depth, stats.ops[BS_OP_READ].calls);
+        ASSERT_EQ(0, stats.ops[BS_OP_READ].failures);
+
+        ASSERT_FALSE(block_store_submit_read(bs, BLOCK_STORE_NUM_BLOCKS, &out[0], 0));
+        ASSERT_FALSE(block_store_submit_write(bs, 1, NULL, 0));
+        ASSERT_EQ(SIZE_MAX, block_store_poll_completions(bs, NULL, 1, 0));
+        // Left in flight on purpose, destroy has to wait for it
+        ASSERT_TRUE(block_store_submit_write(bs, 5, &region[0], 0));
+        block_store_destroy(bs);
+    }
+    ASSERT_FALSE(block_store_submit_read(NULL, 1, &region[0], 0));
+    ASSERT_EQ(SIZE_MAX, block_store_poll_completions(NULL, NULL, 0, 0));
+    remove("test_aio.bs");
+}
+
+TEST(block_store_open_cached, bigger_than_the_cache) {
+    // 2 MiB device through a 32 KiB cache
+    const size_t block_size = 512, block_count = 4096, frames = 64;
+    remove("test_cached.bs");
+    block_store_t *bs = block_store_open_cached("test_cached.bs", block_size, block_count, frames * block_size, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    const size_t first = block_count - block_store_get_free_blocks(bs);  // past the meta blocks
+    std::vector<uint8_t> buffer(block_size), expected(block_size);
+    for (size_t i = first; i < block_count; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+        memset(buffer.data(), (int) (i * 7), block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, i, buffer.data()));
+    }
+    ASSERT_EQ(8, block_store_write_partial(bs, first, 100, 8, "partial!"));  // the first block was evicted long ago
+    block_store_cache_stats_t stats;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_LT(block_count - first - frames - 1, stats.evictions);
+    ASSERT_LT(block_count - first - frames - 1, stats.writebacks);
+    for (size_t i = first; i < block_count; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, i, buffer.data()));
+        memset(expected.data(), (int) (i * 7), block_size);
+        if (i == first) {
+            memcpy(&expected[100], "partial!", 8);
+        }
+        ASSERT_EQ(expected, buffer) << "block " << i;
+    }
+
+    // Blocks used over and over outlast a scan through everything else
+    const size_t hot = 16;
+    for (int round = 0; round < 4; ++round) {
+        for (size_t i = 0; i < 2 * hot; ++i) {
+            ASSERT_EQ(block_size, block_store_read(bs, first + i % hot, buffer.data()));
+        }
+        for (size_t i = first + hot; i < block_count; i += 3) {
+            ASSERT_EQ(block_size, block_store_read(bs, i, buffer.data()));
+        }
+    }
+    block_store_cache_stats_t before, after;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &before));
+    for (size_t i = 0; i < hot; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, first + i, buffer.data()));
+    }
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &after));
+    ASSERT_EQ(before.hits + hot, after.hits);
+    ASSERT_EQ(before.misses, after.misses);
+
+    // A pinned block keeps its frame while everything else cycles through
+    const uint8_t *pinned = (const uint8_t *) block_store_pin(bs, block_count - 1);
+    ASSERT_NE(nullptr, pinned);
+    for (size_t i = first; i < block_count - 1; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, i, buffer.data()));
+    }
+    ASSERT_EQ((uint8_t) ((block_count - 1) * 7), pinned[block_size - 1]);
+    block_store_unpin(bs, block_count - 1);
+
+    // Copies leave the cache alone and pick up blocks that haven't been written back
+    memset(buffer.data(), 0xAB, block_size);
+    ASSERT_EQ(block_size, block_store_write(bs, first + 1, buffer.data()));
+    ASSERT_EQ(block_size * block_count, block_store_serialize(bs, "test_cached_copy.bs"));
+    block_store_t *copy = block_store_deserialize_ex("test_cached_copy.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(copy));
+    ASSERT_EQ(0xAB, ((const uint8_t *) block_store_peek(copy, first + 1))[0]);
+    ASSERT_EQ(0, memcmp((const uint8_t *) block_store_peek(copy, first) + 100, "partial!", 8));
+    block_store_destroy(copy);
+
+    block_store_release(bs, first + 2);
+    ASSERT_TRUE(block_store_sync(bs, false));
+    ASSERT_FALSE(block_store_get_cache_stats(NULL, &stats));
+    block_store_destroy(bs);
+
+    // The image on disk is a plain one, and opens again cached or mapped
+    ASSERT_EQ(nullptr, block_store_open_cached("test_cached.bs", block_size, block_count / 2, frames * block_size, BS_FLAG_NONE));
+    bs = block_store_open_mmap_ex("test_cached.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_count - first - 1, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(0xAB, ((const uint8_t *) block_store_peek(bs, first + 1))[block_size - 1]);
+    block_store_destroy(bs);
+    bs = block_store_open_cached("test_cached.bs", block_size, block_count, 0, BS_FLAG_NONE);  // one frame
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_count - first - 1, block_store_get_used_blocks(bs));
+    for (size_t i = block_count - 10; i < block_count; ++i) {
+        ASSERT_EQ((uint8_t) (i * 7), ((const uint8_t *) block_store_peek(bs, i))[0]);
+    }
+    block_store_destroy(bs);
+    remove("test_cached.bs");
+    remove("test_cached_copy.bs");
+}
+
+TEST(block_store_open_cached, sequential_readahead) {
+    const size_t block_size = 256, block_count = 8192, frames = 256;
+    remove("test_readahead.bs");
+    block_store_t *bs = block_store_open_cached("test_readahead.bs", block_size, block_count, frames * block_size, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    const size_t first = block_count - block_store_get_free_blocks(bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t i = first; i < block_count; ++i) {
+        memset(buffer.data(), (int) i, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, i, buffer.data()));
+    }
+    block_store_destroy(bs);
+
+    // A scan in block order mostly finds its blocks already loaded
+    bs = block_store_open_cached("test_readahead.bs", block_size, block_count, frames * block_size, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    for (size_t i = first; i < block_count; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, i, buffer.data()));
+        ASSERT_EQ(std::vector<uint8_t>(block_size, (uint8_t) i), buffer) << "block " << i;
+    }
+    block_store_cache_stats_t stats;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_GT((block_count - first) / 20, stats.misses);
+    ASSERT_LT(block_count - first - stats.misses - 1, stats.readahead_hits);
+    ASSERT_GE(stats.readahead, stats.readahead_hits);
+
+    // Jumping around sets nothing off
+    const uint64_t readahead = stats.readahead;
+    for (size_t i = 0; i < 500; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, first + (i * 1237) % (block_count - first), buffer.data()));
+    }
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(readahead, stats.readahead);
+    block_store_destroy(bs);
+
+    // Mapped devices only get advice, the data has to come out the same
+    bs = block_store_open_mmap_ex("test_readahead.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    for (size_t i = first; i < block_count; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, i, buffer.data()));
+        ASSERT_EQ((uint8_t) i, buffer[block_size - 1]);
+    }
+    block_store_destroy(bs);
+    remove("test_readahead.bs");
+}
+
+// Size of a file, -1 if it isn't there
+static long file_size(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+TEST(block_store_journal, commit_survives_a_crash) {
+    remove("test_journal.bs");
+    remove("test_journal.bs.journal");
+    block_store_t *bs = block_store_open_journaled("test_journal.bs", BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, file_size("test_journal.bs"));  // created right away
+    const long empty_journal = file_size("test_journal.bs.journal");
+    ASSERT_LT(0, empty_journal);
+    block_store_destroy(bs);
+
+    // The child commits and dies without a checkpoint, only the journal has its changes
+    const pid_t child = fork();
+    ASSERT_NE(-1, child);
+    if (child == 0) {
+        bs = block_store_open_journaled("test_journal.bs", BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_NONE);
+        uint8_t data[BLOCK_SIZE_BYTES];
+        bool ok = bs != NULL;
+        for (size_t i = 0; ok && i < 10; ++i) {
+            memset(data, (int) (0x40 + i), sizeof(data));
+            const size_t id = block_store_allocate(bs);
+            ok = id == 1 + i && block_store_write(bs, id, data) == BLOCK_SIZE_BYTES;
+        }
+        block_store_release(bs, 3);
+        ok = ok && block_store_write_partial(bs, 5, 10, 5, "hello") == 5 && block_store_commit(bs);
+        block_store_write(bs, 6, data);  // never committed, may or may not make it
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+    ASSERT_LT(empty_journal, file_size("test_journal.bs.journal"));
+
+    // A torn record at the end is where replay stops
+    FILE *journal = fopen("test_journal.bs.journal", "ab");
+    ASSERT_NE(nullptr, journal);
+    fputs("half a record", journal);
+    fclose(journal);
+
+    bs = block_store_deserialize("test_journal.bs");  // replays and folds the journal, without taking it over
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(9, block_store_get_used_blocks(bs));
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, buffer));
+    ASSERT_EQ(0x49, buffer[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, buffer));
+    ASSERT_EQ(0, memcmp(buffer + 10, "hello", 5));
+    ASSERT_EQ(0x44, buffer[9]);
+    ASSERT_FALSE(block_store_commit(bs));  // not journaled
+    ASSERT_EQ(empty_journal, file_size("test_journal.bs.journal"));
+    // So writing the device back over its image sticks, the old records don't come back on the next load
+    memset(buffer, 0x77, sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 7, buffer));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_journal.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0x77, ((const uint8_t *) block_store_peek(bs, 7))[0]);
+    block_store_destroy(bs);
+
+    // Opening it again folds the journal into the image
+    bs = block_store_open_journaled("test_journal.bs", BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(empty_journal, file_size("test_journal.bs.journal"));
+    ASSERT_EQ(9, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+    remove("test_journal.bs.journal");
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(9, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, memcmp((const uint8_t *) block_store_peek(bs, 5) + 10, "hello", 5));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(nullptr, block_store_open_journaled("test_journal.bs", BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS / 2, BS_FLAG_NONE));
+    ASSERT_EQ(nullptr, block_store_open_journaled(NULL, BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, BS_FLAG_NONE));
+    ASSERT_FALSE(block_store_commit(NULL));
+    ASSERT_FALSE(block_store_checkpoint(NULL));
+    remove("test_journal.bs");
+    remove("test_journal.bs.journal");
+}
+
+TEST(block_store_journal, group_commit) {
+    // Writers on a concurrent device committing all at once, then checkpoints while they're at it
+    remove("test_journal.bs");
+    remove("test_journal.bs.journal");
+    const size_t threads = 4, rounds = 600, block_size = 4096, block_count = 4096;  // enough to wake the checkpointer
+    block_store_t *bs = block_store_open_journaled("test_journal.bs", block_size, block_count, BS_FLAG_CONCURRENT);
+    ASSERT_NE(nullptr, bs);
+    std::vector<std::thread> workers;
+    std::vector<int> failures(threads);
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::vector<uint8_t> data(block_size);
+            for (size_t round = 0; round < rounds; ++round) {
+                const size_t id = block_store_allocate(bs);
+                memset(data.data(), (int) (t * rounds + round), block_size);
+                failures[t] += id == SIZE_MAX || block_store_write(bs, id, data.data()) != block_size || !block_store_commit(bs);
+                if (round % 3 == 0) {
+                    block_store_release(bs, id);
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(block_store_checkpoint(bs));
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    for (size_t t = 0; t < threads; ++t) {
+        ASSERT_EQ(0, failures[t]);
+    }
+    std::vector<block_store_stats_t> stats(1);
+    ASSERT_TRUE(block_store_get_stats(bs, &stats[0]));
+    ASSERT_TRUE(stats[0].has_journal);
+    ASSERT_EQ(stats[0].journal.appended_bytes, stats[0].journal.durable_bytes);  // every commit went through
+    ASSERT_GT(stats[0].journal.syncs, 0);
+    ASSERT_LE(stats[0].journal.syncs, threads * rounds);  // group commits share theirs
+    ASSERT_GE(stats[0].journal.checkpoints, 3);
+    const size_t used = block_store_get_used_blocks(bs);
+    ASSERT_EQ(threads * (rounds - (rounds + 2) / 3), used);
+    std::vector<uint8_t> expected(block_count * block_size);
+    for (size_t i = 0; i < block_count; ++i) {
+        ASSERT_EQ(block_size, block_store_read(bs, i, &expected[i * block_size]));
+    }
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize_ex("test_journal.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    for (size_t i = 0; i < block_count; ++i) {
+        ASSERT_EQ(0, memcmp(block_store_peek(bs, i), &expected[i * block_size], block_size)) << "block " << i;
+    }
+    block_store_destroy(bs);
+    remove("test_journal.bs");
+    remove("test_journal.bs.journal");
+}
+
+TEST(block_store_checksum, corruption_is_caught) {
+    remove("test_checksum.bs");
+    const size_t block_size = 512, block_count = 1024, meta = 9;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CHECKSUM | BS_FLAG_CONCURRENT);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t i = meta; i < block_count; ++i) {
+        memset(buffer.data(), (int) i, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, i, buffer.data()));
+    }
+    ASSERT_EQ(block_size * block_count, block_store_serialize(bs, "test_checksum.bs"));
+    block_store_destroy(bs);
+
+    // Flip a byte in a few blocks behind the device's back
+    const size_t corrupt[] = {meta, 100, 517, block_count - 1};
+    FILE *file = fopen("test_checksum.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    for (size_t id : corrupt) {
+        ASSERT_EQ(0, fseek(file, (long) (id * block_size + 7), SEEK_SET));
+        fputc((int) (~id & 0xFF), file);
+    }
+    fclose(file);
+
+    bs = block_store_deserialize_ex("test_checksum.bs", block_size, block_count, BS_FLAG_CHECKSUM | BS_FLAG_CONCURRENT);
+    ASSERT_NE(nullptr, bs);
+    errno = 0;
+    ASSERT_EQ(0, block_store_read(bs, 100, buffer.data()));
+    ASSERT_EQ(EBADMSG, errno);
+    ASSERT_EQ(block_size, block_store_read(bs, 101, buffer.data()));
+    block_store_iovec_t iov[] = {{101, buffer.data()}, {517, buffer.data()}};
+    ASSERT_EQ(0, block_store_readv(bs, iov, 2));
+    for (unsigned threads : {1, 3, 8, 0}) {
+        size_t bad[8];
+        ASSERT_EQ(4, block_store_scrub(bs, threads, bad, 8)) << threads;
+        ASSERT_TRUE(std::equal(corrupt, corrupt + 4, bad)) << threads;
+        ASSERT_EQ(4, block_store_scrub(bs, threads, bad, 2));
+        ASSERT_EQ(meta, bad[0]);
+        ASSERT_EQ(100, bad[1]);
+    }
+    // Writing the block over fixes it
+    ASSERT_EQ(block_size, block_store_write(bs, 100, buffer.data()));
+    ASSERT_EQ(3, block_store_scrub(bs, 2, NULL, 0));
+    block_store_destroy(bs);
+
+    // Cached devices check what comes through the cache, and scrub past it
+    bs = block_store_open_cached("test_checksum.bs", block_size, block_count, 16 * block_size, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_read(bs, 517, buffer.data()));
+    ASSERT_EQ(block_size, block_store_read(bs, 518, buffer.data()));
+    ASSERT_EQ(4, block_store_write_partial(bs, 518, 0, 4, "abcd"));
+    ASSERT_EQ(block_size, block_store_read(bs, 518, buffer.data()));
+    ASSERT_EQ(4, block_store_scrub(bs, 2, NULL, 0));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap_ex("test_checksum.bs", block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_size, block_store_read(bs, 518, buffer.data()));
+    ASSERT_EQ(0, memcmp("abcd", buffer.data(), 4));
+    ASSERT_EQ(4, block_store_scrub(bs, 2, NULL, 0));
+    // Asynchronous writes get their checksum with the data, a read before the completion is polled sees both
+    std::vector<uint8_t> async(block_size, 'q');
+    ASSERT_TRUE(block_store_submit_write(bs, 519, async.data(), 519));
+    ASSERT_EQ(block_size, block_store_read(bs, 519, buffer.data()));
+    ASSERT_EQ(async, buffer);
+    ASSERT_TRUE(block_store_submit_read(bs, 519, buffer.data(), 0));
+    block_store_completion_t completions[2];
+    ASSERT_EQ(2, block_store_poll_completions(bs, completions, 2, 2));
+    ASSERT_EQ(0, completions[0].error);
+    ASSERT_EQ(0, completions[1].error);
+    ASSERT_EQ(async, buffer);
+    ASSERT_EQ(4, block_store_scrub(bs, 2, NULL, 0));
+    block_store_destroy(bs);
+    remove("test_checksum.bs");
+
+    // Journaled checksums come back with the writes they belong to
+    remove("test_checksum.bs.journal");
+    bs = block_store_open_journaled("test_checksum.bs", block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_size, block_store_write(bs, 600, buffer.data()));
+    ASSERT_EQ(3, block_store_write_partial(bs, 601, 9, 3, "xyz"));
+    ASSERT_TRUE(block_store_commit(bs));
+    ASSERT_TRUE(block_store_checkpoint(bs));
+    ASSERT_EQ(block_size, block_store_write(bs, 602, buffer.data()));
+    ASSERT_EQ(2, block_store_write_partial(bs, 603, 0, 2, "hi"));
+    ASSERT_TRUE(block_store_commit(bs));
+    block_store_t *replayed = block_store_deserialize_ex("test_checksum.bs", block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, replayed);  // 600 and 601 come from the image, 602 and 603 from the journal
+    ASSERT_EQ(0, block_store_scrub(replayed, 2, NULL, 0));
+    ASSERT_EQ(block_size, block_store_read(replayed, 603, buffer.data()));
+    block_store_destroy(replayed);
+    block_store_destroy(bs);
+    bs = block_store_deserialize_ex("test_checksum.bs", block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_scrub(bs, 2, NULL, 0));
+    ASSERT_EQ(block_size, block_store_read(bs, 601, buffer.data()));
+    ASSERT_EQ(0, memcmp("xyz", buffer.data() + 9, 3));
+    block_store_destroy(bs);
+    remove("test_checksum.bs");
+    remove("test_checksum.bs.journal");
+}
+
+TEST(block_store_snapshot, backup_of_a_mapped_device) {
+    remove("test_snapshot.bs");
+    remove("test_snapshot_backup.bs");
+    const size_t block_size = 512, block_count = 512;
+    block_store_t *bs = block_store_open_mmap_ex("test_snapshot.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t id = 1; id < block_count; ++id) {
+        memset(buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+    }
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    memset(buffer.data(), 0, block_size);
+    ASSERT_EQ(block_size, block_store_write(bs, 7, buffer.data()));
+    ASSERT_TRUE(block_store_submit_write(bs, 8, buffer.data(), 8));
+    block_store_completion_t completion;
+    ASSERT_EQ(1, block_store_poll_completions(bs, &completion, 1, 1));
+    ASSERT_EQ(block_size, completion.bytes);
+
+    ASSERT_EQ(block_size * block_count, block_store_serialize(snapshot, "test_snapshot_backup.bs"));
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+    bs = block_store_deserialize_ex("test_snapshot_backup.bs", block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    for (size_t id = 1; id < block_count; ++id) {
+        ASSERT_EQ(block_size, block_store_read(bs, id, buffer.data()));
+        ASSERT_EQ((uint8_t) id, buffer[0]) << id;
+    }
+    block_store_destroy(bs);
+    remove("test_snapshot.bs");
+    remove("test_snapshot_backup.bs");
+}
+
+TEST(block_store_dedup, image_round_trip) {
+    remove("test_dedup.bs");
+    const size_t block_size = 4096, block_count = 1024;
+    ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_dedup.bs", block_size, block_count, BS_FLAG_DEDUP));
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_DEDUP);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t id = 1; id < 32; ++id) {
+        memset(buffer.data(), (int) (id % 4) + 1, block_size);
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+    }
+    ASSERT_EQ(block_size * block_count, block_store_serialize(bs, "test_dedup.bs"));
+    block_store_destroy(bs);
+    // The zero blocks never made it to the file, they're holes in it
+    struct stat st;
+    ASSERT_EQ(0, stat("test_dedup.bs", &st));
+    ASSERT_EQ(block_size * block_count, (size_t) st.st_size);
+    ASSERT_LT((size_t) st.st_blocks * 512, block_size * block_count / 2);
+
+    bs = block_store_deserialize_ex("test_dedup.bs", block_size, block_count, BS_FLAG_DEDUP);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(31, block_store_get_used_blocks(bs));
+    block_store_dedup_stats_t stats;
+    ASSERT_TRUE(block_store_get_dedup_stats(bs, &stats));
+    ASSERT_EQ(4, stats.stored_blocks);
+    ASSERT_EQ(block_count - 32, stats.zero_blocks);
+    for (size_t id = 1; id < 32; ++id) {
+        ASSERT_EQ(block_size, block_store_read(bs, id, buffer.data()));
+        ASSERT_EQ((uint8_t) ((id % 4) + 1), buffer[block_size - 1]) << id;
+    }
+    block_store_destroy(bs);
+    remove("test_dedup.bs");
+}
+
+TEST(block_store_serialize, compressed_image) {
+    remove("test_compressed.bs");
+    const size_t block_size = 1024, block_count = 2048;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CONCURRENT);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t id = 1; id < block_count; id += 3) {
+        for (size_t i = 0; i < block_size; ++i) {
+            buffer[i] = (uint8_t) (id * 31 + i / 16);
+        }
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+    }
+    const size_t used = block_store_get_used_blocks(bs);
+    const size_t size = block_store_serialize_ex(bs, "test_compressed.bs", BS_SERIALIZE_COMPRESS | BS_SERIALIZE_ATOMIC);
+    ASSERT_NE(0, size);
+    ASSERT_LT(size, block_size * block_count / 4);
+    struct stat st;
+    ASSERT_EQ(0, stat("test_compressed.bs", &st));
+    ASSERT_EQ(size, (size_t) st.st_size);
+    std::vector<uint8_t> expected(block_size * block_count);
+    for (size_t id = 0; id < block_count; ++id) {
+        ASSERT_EQ(block_size, block_store_read(bs, id, &expected[id * block_size]));
+    }
+    block_store_destroy(bs);
+
+    // Plain and deduplicated devices load it the same, a different geometry doesn't
+    for (unsigned flags : {(unsigned) BS_FLAG_NONE, (unsigned) BS_FLAG_DEDUP}) {
+        bs = block_store_deserialize_ex("test_compressed.bs", block_size, block_count, flags);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_EQ(used, block_store_get_used_blocks(bs));
+        for (size_t id = 0; id < block_count; ++id) {
+            ASSERT_EQ(block_size, block_store_read(bs, id, buffer.data()));
+            ASSERT_EQ(0, memcmp(buffer.data(), &expected[id * block_size], block_size)) << "block " << id;
+        }
+        block_store_destroy(bs);
+    }
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("test_compressed.bs", block_size, block_count / 2, BS_FLAG_NONE));
+    ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_compressed.bs", block_size, block_count, BS_FLAG_NONE));
+
+    // A flipped byte in an extent fails the load
+    FILE *file = fopen("test_compressed.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(0, fseek(file, (long) size - 100, SEEK_SET));
+    const int byte = fgetc(file);
+    ASSERT_EQ(0, fseek(file, (long) size - 100, SEEK_SET));
+    fputc(byte ^ 0x40, file);
+    fclose(file);
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("test_compressed.bs", block_size, block_count, BS_FLAG_NONE));
+    ASSERT_EQ(0, block_store_serialize_ex(NULL, "test_compressed.bs", BS_SERIALIZE_COMPRESS));
+    remove("test_compressed.bs");
+}
+
+TEST(block_store_serialize, sparse_image) {
+    remove("test_sparse.bs");
+    const size_t block_size = 4096, block_count = 1024;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_NONE);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t id = 1; id < block_count; ++id) {  // every block has something, about 30% of them is in use
+        memset(buffer.data(), (int) (id % 250) + 1, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+        if (id % 10 < 3) {
+            ASSERT_TRUE(block_store_request(bs, id));
+        }
+    }
+    const size_t used = block_store_get_used_blocks(bs);
+    ASSERT_EQ(block_size * block_count, block_store_serialize_ex(bs, "test_sparse.bs", BS_SERIALIZE_SPARSE));
+    block_store_destroy(bs);
+    struct stat st;
+    ASSERT_EQ(0, stat("test_sparse.bs", &st));
+    ASSERT_EQ(block_size * block_count, (size_t) st.st_size);
+    ASSERT_LT((size_t) st.st_blocks * 512, block_size * (used + 10));
+
+    for (unsigned flags : {(unsigned) BS_FLAG_NONE, (unsigned) BS_FLAG_DEDUP}) {
+        bs = block_store_deserialize_ex("test_sparse.bs", block_size, block_count, flags);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_EQ(used, block_store_get_used_blocks(bs));
+        for (size_t id = 1; id < block_count; ++id) {
+            ASSERT_EQ(block_size, block_store_read(bs, id, buffer.data()));
+            ASSERT_EQ(id % 10 < 3 ? (uint8_t) ((id % 250) + 1) : 0, buffer[block_size / 2]) << id;
+        }
+        if (flags == BS_FLAG_NONE) {  // and the same again compressed
+            ASSERT_NE(0, block_store_serialize_ex(bs, "test_sparse.bs", BS_SERIALIZE_SPARSE | BS_SERIALIZE_COMPRESS));
+        }
+        block_store_destroy(bs);
+    }
+    remove("test_sparse.bs");
+}
+
+TEST(block_store_serialize, sparse_image_checksums) {
+    // Free blocks go out as holes, their checksums have to go out as the checksum of zeros
+    remove("test_sparse.bs");
+    const size_t block_size = 512, block_count = 2048;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    const size_t meta = block_count - block_store_get_capacity(bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t id = meta; id < block_count; ++id) {
+        memset(buffer.data(), (int) (id % 250) + 1, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+        if (id % 4 == 0) {
+            ASSERT_TRUE(block_store_request(bs, id));
+        }
+    }
+    for (unsigned options : {(unsigned) BS_SERIALIZE_SPARSE, (unsigned) (BS_SERIALIZE_SPARSE | BS_SERIALIZE_COMPRESS)}) {
+        ASSERT_NE(0, block_store_serialize_ex(bs, "test_sparse.bs", options)) << options;
+        block_store_t *loaded = block_store_deserialize_ex("test_sparse.bs", block_size, block_count, BS_FLAG_CHECKSUM);
+        ASSERT_NE(nullptr, loaded) << options;
+        ASSERT_EQ(0, block_store_scrub(loaded, 2, NULL, 0)) << options;
+        for (size_t id = meta; id < block_count; ++id) {
+            ASSERT_EQ(block_size, block_store_read(loaded, id, buffer.data())) << id;
+            ASSERT_EQ(id % 4 == 0 ? (uint8_t) ((id % 250) + 1) : 0, buffer[block_size - 1]) << id;
+        }
+        block_store_destroy(loaded);
+    }
+    // The device itself keeps what its free blocks hold
+    ASSERT_EQ(block_size, block_store_read(bs, meta + 1, buffer.data()));
+    ASSERT_EQ((uint8_t) (((meta + 1) % 250) + 1), buffer[0]);
+    block_store_destroy(bs);
+    remove("test_sparse.bs");
+}
+
+TEST(block_store_deserialize, parallel_load) {
+    remove("test_parallel.bs");
+    const size_t block_size = 512, block_count = 8192;
+    block_store_t *bs = block_store_create_ex(block_size, block_count, BS_FLAG_CHECKSUM);
+    ASSERT_NE(nullptr, bs);
+    const size_t meta = block_count - block_store_get_capacity(bs);
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t id = meta; id < block_count; ++id) {
+        memset(buffer.data(), (int) (id * 7), block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+        if (id % 5 != 0) {
+            ASSERT_TRUE(block_store_request(bs, id));
+        }
+    }
+    const size_t used = block_store_get_used_blocks(bs);
+    ASSERT_EQ(block_size * block_count, block_store_serialize_ex(bs, "test_parallel.bs", BS_SERIALIZE_SPARSE));
+    block_store_destroy(bs);
+    // Two allocated blocks go bad in the file, they still load
+    FILE *file = fopen("test_parallel.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    for (size_t id : {meta + 1, block_count - 2}) {
+        ASSERT_EQ(0, fseek(file, (long) (id * block_size + 10), SEEK_SET));
+        fputc(~(id * 7) & 0xFF, file);
+    }
+    fclose(file);
+
+    for (unsigned threads : {1u, 3u, 8u, 0u}) {
+        size_t bad = SIZE_MAX;
+        bs = block_store_deserialize_parallel("test_parallel.bs", block_size, block_count, BS_FLAG_CHECKSUM, threads, &bad);
+        ASSERT_NE(nullptr, bs) << threads;
+        ASSERT_EQ(2, bad) << threads;
+        ASSERT_EQ(used, block_store_get_used_blocks(bs));
+        for (size_t id = meta + 2; id < block_count - 2; ++id) {
+            ASSERT_EQ(block_size, block_store_read(bs, id, buffer.data()));
+            ASSERT_EQ(id % 5 != 0 ? (uint8_t) (id * 7) : 0, buffer[block_size - 1]) << id;
+        }
+        errno = 0;
+        ASSERT_EQ(0, block_store_read(bs, meta + 1, buffer.data()));
+        ASSERT_EQ(EBADMSG, errno);
+        block_store_destroy(bs);
+    }
+    // An image cut short doesn't load, whichever range runs into the end
+    ASSERT_EQ(0, truncate("test_parallel.bs", (off_t) (block_size * block_count - block_size / 2)));
+    for (unsigned threads : {1u, 3u, 8u}) {
+        ASSERT_EQ(nullptr, block_store_deserialize_parallel("test_parallel.bs", block_size, block_count, BS_FLAG_CHECKSUM, threads, NULL)) << threads;
+    }
+    ASSERT_EQ(nullptr, block_store_deserialize_parallel("no_such_file.bs", block_size, block_count, BS_FLAG_CHECKSUM, 3, NULL));
+    ASSERT_EQ(nullptr, block_store_deserialize_parallel(NULL, block_size, block_count, BS_FLAG_NONE, 2, NULL));
+    remove("test_parallel.bs");
+}
+
+TEST(block_store_cpp, images_match_the_c_api) {
+    bs::BlockStore<256, 256> store;
+    ASSERT_TRUE(store);
+    std::array<uint8_t, 256> block;
+    for (size_t id = 1; id < 20; ++id) {
+        block.fill((uint8_t) id);
+        ASSERT_TRUE(store.request(id));
+        ASSERT_TRUE(store.write(id, block));
+    }
+    const size_t written = store.serialize("test_cpp.bs", BS_SERIALIZE_COMPRESS);
+    ASSERT_LT(0, written);
+    ASSERT_GT(store.bytes(), written);  // the compressed file's size
+    // The C API reads what the wrapper wrote, and the other way round
+    block_store_t *c = block_store_deserialize("test_cpp.bs");
+    ASSERT_NE(nullptr, c);
+    ASSERT_EQ(19, block_store_get_used_blocks(c));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(c, "test_cpp.bs"));
+    block_store_destroy(c);
+    bs::BlockStore<256, 256> loaded = bs::BlockStore<256, 256>::deserialize("test_cpp.bs");
+    ASSERT_TRUE(loaded);
+    ASSERT_EQ(19, loaded.used_blocks());
+    ASSERT_EQ(7, loaded.view(7)[255]);
+    bs::BlockStore<> dynamic = bs::BlockStore<>::deserialize("test_cpp.bs", 256, 256);
+    ASSERT_TRUE(dynamic);
+    ASSERT_TRUE(dynamic.read(19, block));
+    ASSERT_EQ(19, block[0]);
+    ASSERT_FALSE(bs::BlockStore<>::deserialize("no_such_file.bs", 256, 256));
+    remove("test_cpp.bs");
+}
+
+TEST(block_store_serialize, atomic_and_incremental_flush) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 'a', BLOCK_SIZE_BYTES);
+    for (size_t id = 1; id <= 20; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+    }
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize_ex(bs, "test_flush.bs", BS_SERIALIZE_ATOMIC | BS_SERIALIZE_FSYNC));
+    ASSERT_EQ(0, block_store_serialize_ex(bs, "test_flush.bs", 0x80));
+
+    // Never flushed, so the first flush is the whole device, after that only what changed
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(bs, "test_flush.bs"));
+    ASSERT_EQ(0, block_store_flush(bs, "test_flush.bs"));
+    memset(buffer, 'b', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 6, buffer));
+    ASSERT_EQ(7, block_store_write_partial(bs, 100, 0, 7, "partial"));
+    ASSERT_EQ(3 * BLOCK_SIZE_BYTES, block_store_flush(bs, "test_flush.bs"));
+    // Allocation only touches the fbm, which lives in block 0
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_flush(bs, "test_flush.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_flush.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(21, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, memcmp(buffer, block_store_peek(bs, 6), BLOCK_SIZE_BYTES));
+    ASSERT_EQ(0, memcmp("partial", block_store_peek(bs, 100), 7));
+    memset(buffer, 'a', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(0, memcmp(buffer, block_store_peek(bs, 7), BLOCK_SIZE_BYTES));
+    // Freshly loaded devices are clean with respect to their own image
+    ASSERT_EQ(0, block_store_flush(bs, "test_flush.bs"));
+    // ...but not with respect to anything else
+    remove("test_flush_copy.bs");
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(bs, "test_flush_copy.bs"));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(SIZE_MAX, block_store_flush(NULL, "test_flush.bs"));
+    remove("test_flush.bs");
+    remove("test_flush_copy.bs");
+}
+
+// Files in the current directory whose names start with prefix
+static size_t files_starting_with(const char *const prefix) {
+    size_t count = 0;
+    DIR *dir = opendir(".");
+    for (struct dirent *entry = dir != nullptr ? readdir(dir) : nullptr; entry != nullptr; entry = readdir(dir)) {
+        count += strncmp(entry->d_name, prefix, strlen(prefix)) == 0;
+    }
+    if (dir != nullptr) {
+        closedir(dir);
+    }
+    return count;
+}
+
+TEST(block_store_serialize, atomic_failure_leaves_no_temp_file) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    remove("test_atomic.bs");
+    // A file size limit below the image makes the write itself fail, after the temporary file exists
+    struct rlimit old_limit, limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+    limit = old_limit;
+    limit.rlim_cur = BLOCK_STORE_NUM_BYTES / 4;
+    void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+    const size_t written = block_store_serialize_ex(bs, "test_atomic.bs", BS_SERIALIZE_ATOMIC);
+    const size_t synced = block_store_serialize_ex(bs, "test_atomic.bs", BS_SERIALIZE_ATOMIC | BS_SERIALIZE_FSYNC);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+    ASSERT_EQ(0, written);
+    ASSERT_EQ(0, synced);
+    ASSERT_EQ(0, files_starting_with("test_atomic.bs"));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize_ex(bs, "test_atomic.bs", BS_SERIALIZE_ATOMIC));
+    ASSERT_EQ(1, files_starting_with("test_atomic.bs"));
+    block_store_destroy(bs);
+    remove("test_atomic.bs");
+}
+
 TEST(block_store_deserialize, null_filename) {
     // Try to call deserialize...
     block_store_t *bs;